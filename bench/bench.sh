@@ -0,0 +1,231 @@
+#!/bin/sh
+################################################################################
+#                 ____      _      _   _   _   _   _____   _____               #
+#                / ___|    / \    | \ | | | | | | |_   _| | ____|              #
+#               | |       / _ \   |  \| | | | | |   | |   |  _|                #
+#               | |___   / ___ \  | |\  | | |_| |   | |   | |___               #
+#                \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|              #
+#                                                                              #
+#                          LOOPBACK BENCHMARK SUITE                            #
+#                                                                              #
+################################################################################
+#
+# Usage: bench.sh <canute binary> <benchtool binary> [<wanproxy binary>]
+#
+# Runs a sender and a receiver over loopback for each scenario and reports
+# throughput, CPU time and read/write syscall counts.  Everything is tuned with
+# environment variables (the Makefile 'bench' target passes them through):
+#
+#   BENCH_DIR        Work directory (datasets are generated once and reused)
+#   BENCH_PORT       TCP port to use on 127.0.0.1
+#   BENCH_SCENARIOS  Subset of: huge tiny deep sparse text random
+#   BENCH_RUNS       Runs per scenario, the fastest one is kept
+#   BENCH_OUT        Results file
+#   BENCH_BASELINE   Previous results file to compare against
+#   BENCH_THRESHOLD  Allowed slowdown against the baseline, in percent
+#   BENCH_VERIFY     Compare source and destination trees after each run
+#   BENCH_SEND_OPTS  Extra options for the sender (e.g. a feature under test)
+#   BENCH_RECV_OPTS  Extra options for the receiver
+#   BENCH_WAN        Run the connection through wanproxy with these options
+#                    (e.g. "-d 20 -j 2 -b 100000", see wanproxy.c), on
+#                    BENCH_PORT + 1
+#
+# Dataset sizes: BENCH_HUGE_MB, BENCH_TINY_FILES, BENCH_DEEP ("depth fanout
+# files"), BENCH_SPARSE_MB, BENCH_SPARSE_DATA_MB, BENCH_STREAM_MB.
+
+set -e
+
+CANUTE=`cd \`dirname "$1"\` && pwd`/`basename "$1"`
+TOOL=`cd \`dirname "$2"\` && pwd`/`basename "$2"`
+if [ -n "$BENCH_WAN" ]
+then
+        if [ -z "$3" ]
+        then
+                echo "BENCH_WAN needs the wanproxy binary" >&2
+                exit 1
+        fi
+        PROXY=`cd \`dirname "$3"\` && pwd`/`basename "$3"`
+fi
+
+BENCH_DIR=${BENCH_DIR:-${TMPDIR:-/tmp}/canute-bench}
+BENCH_PORT=${BENCH_PORT:-11210}
+BENCH_SCENARIOS=${BENCH_SCENARIOS:-"huge tiny deep sparse text random"}
+BENCH_RUNS=${BENCH_RUNS:-1}
+BENCH_OUT=${BENCH_OUT:-$BENCH_DIR/results.txt}
+BENCH_THRESHOLD=${BENCH_THRESHOLD:-10}
+BENCH_VERIFY=${BENCH_VERIFY:-1}
+BENCH_HUGE_MB=${BENCH_HUGE_MB:-1024}
+BENCH_TINY_FILES=${BENCH_TINY_FILES:-100000}
+BENCH_DEEP=${BENCH_DEEP:-"6 4 4"}
+BENCH_SPARSE_MB=${BENCH_SPARSE_MB:-2048}
+BENCH_SPARSE_DATA_MB=${BENCH_SPARSE_DATA_MB:-128}
+BENCH_STREAM_MB=${BENCH_STREAM_MB:-256}
+
+MB=1048576
+DATA=$BENCH_DIR/data
+DST=$BENCH_DIR/dst
+RAW=$BENCH_DIR/raw.txt
+
+
+# Generate a dataset unless an identical one (same parameters) already exists
+generate ()
+{
+        sc=$1; shift
+        params="$*"
+        if [ -f "$DATA/$sc.params" ] && [ "`cat $DATA/$sc.params`" = "$params" ]
+        then
+                return
+        fi
+
+        echo "Generating dataset '$sc'"
+        rm -rf "$DATA/$sc" "$DATA/$sc.params"
+        mkdir -p "$DATA/$sc"
+        case $sc in
+        huge)   "$TOOL" file "$DATA/$sc/huge.bin" `expr $1 \* $MB` random 1 ;;
+        tiny)   "$TOOL" tree "$DATA/$sc/tiny" 0 0 $1 512 2 ;;
+        deep)   "$TOOL" tree "$DATA/$sc/deep" $1 $2 $3 4096 3 ;;
+        sparse) "$TOOL" sparse "$DATA/$sc/sparse.img" `expr $1 \* $MB` \
+                        `expr $2 \* $MB` 4 ;;
+        text)   "$TOOL" file "$DATA/$sc/text.txt" `expr $1 \* $MB` text 5 ;;
+        random) "$TOOL" file "$DATA/$sc/random.bin" `expr $1 \* $MB` random 6 ;;
+        esac
+
+        # Apparent size and number of regular files, used for the rates
+        ( cd "$DATA/$sc" && find . -type f -exec stat -c %s {} + |
+          awk '{ b += $1; n++ } END { printf "%d %d\n", b, n }' ) \
+                > "$DATA/$sc.meta"
+        echo "$params" > "$DATA/$sc.params"
+}
+
+
+# Block until something (receiver or proxy) is listening on the given port
+wait_listen ()
+{
+        hex=`printf '%04X' $1`
+        i=0
+        while ! grep -q ":$hex [0-9A-F:]* 0A " /proc/net/tcp /proc/net/tcp6 \
+                2>/dev/null
+        do
+                i=`expr $i + 1`
+                if [ $i -gt 100 ]
+                then
+                        echo "Nothing listening on port $1" >&2
+                        exit 1
+                fi
+                sleep 0.05
+        done
+}
+
+
+# One sender/receiver round for a scenario
+run_once ()
+{
+        sc=$1
+        rm -rf "$DST" && mkdir -p "$DST"
+        : > "$RAW"
+
+        ( cd "$DST" && "$TOOL" run "$RAW" recv "$CANUTE" \
+                getserv:$BENCH_PORT $BENCH_RECV_OPTS > /dev/null ) &
+        rpid=$!
+        wait_listen $BENCH_PORT
+        port=$BENCH_PORT
+        if [ -n "$BENCH_WAN" ]
+        then
+                port=`expr $BENCH_PORT + 1`
+                "$PROXY" $BENCH_WAN $port 127.0.0.1 $BENCH_PORT 2> /dev/null &
+                ppid=$!
+                wait_listen $port
+        fi
+        ( cd "$DATA/$sc" && "$TOOL" run "$RAW" send "$CANUTE" \
+                sendto:$port $BENCH_SEND_OPTS 127.0.0.1 * > /dev/null )
+        wait $rpid
+        if [ -n "$BENCH_WAN" ]
+        then
+                wait $ppid
+        fi
+
+        if [ "$BENCH_VERIFY" = 1 ] && ! diff -r -q "$DATA/$sc" "$DST" > /dev/null
+        then
+                echo "Scenario '$sc': destination differs from source" >&2
+                exit 1
+        fi
+}
+
+
+mkdir -p "$DATA"
+for sc in $BENCH_SCENARIOS
+do
+        case $sc in
+        huge)   generate huge $BENCH_HUGE_MB ;;
+        tiny)   generate tiny $BENCH_TINY_FILES ;;
+        deep)   generate deep $BENCH_DEEP ;;
+        sparse) generate sparse $BENCH_SPARSE_MB $BENCH_SPARSE_DATA_MB ;;
+        text)   generate text $BENCH_STREAM_MB ;;
+        random) generate random $BENCH_STREAM_MB ;;
+        *)      echo "Unknown scenario '$sc'" >&2; exit 1 ;;
+        esac
+done
+
+: > "$BENCH_OUT"
+for sc in $BENCH_SCENARIOS
+do
+        best=""
+        r=0
+        while [ $r -lt $BENCH_RUNS ]
+        do
+                sync
+                run_once $sc
+                # raw.txt: label status wall user sys syscr syscw
+                line=`awk -v meta="\`cat $DATA/$sc.meta\`" '
+                        $2 != 0  { bad = 1 }
+                        /^send/  { w = $3; sc = $4 + $5; sn = $6 + $7 }
+                        /^recv/  { rc = $4 + $5; rn = $6 + $7 }
+                        END {
+                                if (bad) exit 1
+                                split(meta, m, " ")
+                                if (w <= 0) w = 0.001
+                                printf "%d %d %.3f %.2f %.1f %.3f %.3f %d %d\n",
+                                       m[1], m[2], w, m[1] / w / 1048576,
+                                       m[2] / w, sc, rc, sn, rn
+                        }' "$RAW"` || { echo "Scenario '$sc' failed" >&2; exit 1; }
+                if [ -z "$best" ] || [ `echo "$line $best" |
+                        awk '{ print ($3 < $12) }'` = 1 ]
+                then
+                        best=$line
+                fi
+                r=`expr $r + 1`
+        done
+        echo "$sc $best" >> "$BENCH_OUT"
+done
+
+# Report and, when a baseline is available, compare against it
+awk -v base="$BENCH_BASELINE" -v thr="$BENCH_THRESHOLD" '
+BEGIN {
+        if (base != "")
+                while ((getline l < base) > 0)
+                {
+                        split(l, f, " ")
+                        bmbs[f[1]] = f[5]; bfps[f[1]] = f[6]
+                }
+        printf "%-8s %10s %10s %9s %9s %10s %10s", "scenario", "MB/s",
+               "files/s", "send cpu", "recv cpu", "send sysc", "recv sysc"
+        if (base != "")
+                printf " %9s", "vs base"
+        printf "\n"
+}
+{
+        printf "%-8s %10.2f %10.1f %8.2fs %8.2fs %10d %10d", $1, $5, $6, $7,
+               $8, $9, $10
+        if ($1 in bmbs && bmbs[$1] > 0)
+        {
+                d = ($5 - bmbs[$1]) * 100 / bmbs[$1]
+                printf " %+8.1f%%", d
+                if (d < -thr)
+                {
+                        printf "  REGRESSION"
+                        fail = 1
+                }
+        }
+        printf "\n"
+}
+END { exit fail }' "$BENCH_OUT"
@@ -0,0 +1,324 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                     BENCHMARK DATASETS AND MEASUREMENT                     */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * Helper for bench.sh.  Generates reproducible synthetic datasets (the same
+ * seed always produces the same bytes, so two runs of the benchmark move
+ * exactly the same data) and measures a child process: wall time, CPU time and
+ * the number of read/write class system calls it issued.
+ *
+ * This is a Linux only tool, as the syscall counters come from /proc/<pid>/io.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define GEN_BLOCK 65536
+
+static unsigned long long rng_state;
+static char               block[GEN_BLOCK];
+
+
+/*
+ * die
+ *
+ * Report an error (with errno string) and exit.
+ */
+static void die (const char *what)
+{
+        perror(what);
+        exit(EXIT_FAILURE);
+}
+
+
+/*
+ * rng_next
+ *
+ * xorshift64* generator.  Not good for anything but fast, tiny and, above all,
+ * identical on every platform.
+ */
+static unsigned long long rng_next (void)
+{
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return rng_state * 2685821657736338717ULL;
+}
+
+
+static void rng_seed (unsigned long long seed)
+{
+        rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+}
+
+
+/*
+ * fill_block
+ *
+ * Fill count bytes of buf.  Random data does not compress at all; text data is
+ * built from a small vocabulary so it compresses roughly like source code.
+ */
+static void fill_block (char *buf, size_t count, int text)
+{
+        static const char *words[] = {
+                "static ", "int ", "return ", "struct ", "char ", "if (",
+                ") {\n", "}\n", "        ", "size", "count", "buf", " = ",
+                "NULL", ";\n", "while (", "error(\"", "\");\n", "0", "1"
+        };
+        unsigned long long r;
+        size_t             i = 0, n;
+        const char        *w;
+
+        if (!text)
+        {
+                for (;  i + 8 <= count;  i += 8)
+                {
+                        r = rng_next();
+                        memcpy(buf + i, &r, 8);
+                }
+                r = rng_next();
+                memcpy(buf + i, &r, count - i);
+                return;
+        }
+
+        while (i < count)
+        {
+                w = words[rng_next() % (sizeof(words) / sizeof(words[0]))];
+                n = strlen(w);
+                if (n > count - i)
+                        n = count - i;
+                memcpy(buf + i, w, n);
+                i += n;
+        }
+}
+
+
+/*
+ * write_file
+ *
+ * Create a file with size bytes of generated data.
+ */
+static void write_file (const char *path, long long size, int text)
+{
+        int    fd;
+        size_t b;
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+                die(path);
+
+        while (size > 0)
+        {
+                b = (size > GEN_BLOCK ? GEN_BLOCK : (size_t) size);
+                fill_block(block, b, text);
+                if (write(fd, block, b) != (ssize_t) b)
+                        die(path);
+                size -= b;
+        }
+        close(fd);
+}
+
+
+/*
+ * gen_tree
+ *
+ * Directory tree of the given depth and fanout.  Every directory holds 'files'
+ * small files of up to 'maxsize' bytes.
+ */
+static void gen_tree (const char *path, int depth, int fanout, int files,
+                      int maxsize)
+{
+        char sub[4096];
+        int  i;
+
+        if (mkdir(path, 0755) == -1 && errno != EEXIST)
+                die(path);
+
+        for (i = 0;  i < files;  i++)
+        {
+                snprintf(sub, sizeof(sub), "%s/f%05d", path, i);
+                write_file(sub, (long long) (rng_next() % (maxsize + 1)), 1);
+        }
+
+        if (depth == 0)
+                return;
+
+        for (i = 0;  i < fanout;  i++)
+        {
+                snprintf(sub, sizeof(sub), "%s/d%02d", path, i);
+                gen_tree(sub, depth - 1, fanout, files, maxsize);
+        }
+}
+
+
+/*
+ * gen_sparse
+ *
+ * Apparent size 'size' with 'data' bytes of random content spread in 1 MiB
+ * extents, the rest being holes.
+ */
+static void gen_sparse (const char *path, long long size, long long data)
+{
+        int       fd;
+        long long extents, stride, i, off;
+        int       j;
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1)
+                die(path);
+        if (ftruncate(fd, size) == -1)
+                die(path);
+
+        extents = data >> 20;
+        stride  = (extents > 0 ? size / extents : size);
+        for (i = 0;  i < extents;  i++)
+        {
+                off = (i * stride) & ~((long long) GEN_BLOCK - 1);
+                for (j = 0;  j < 16;  j++)
+                {
+                        fill_block(block, GEN_BLOCK, 0);
+                        if (pwrite(fd, block, GEN_BLOCK,
+                                   off + (long long) j * GEN_BLOCK) != GEN_BLOCK)
+                                die(path);
+                }
+        }
+        close(fd);
+}
+
+
+/*
+ * read_proc_io
+ *
+ * Extract the syscr and syscw counters of a (zombie) process.
+ */
+static void read_proc_io (pid_t pid, long long *syscr, long long *syscw)
+{
+        char  path[64], line[128];
+        FILE *f;
+
+        *syscr = *syscw = -1;
+        snprintf(path, sizeof(path), "/proc/%d/io", (int) pid);
+        f = fopen(path, "r");
+        if (f == NULL)
+                return;
+        while (fgets(line, sizeof(line), f) != NULL)
+        {
+                sscanf(line, "syscr: %lld", syscr);
+                sscanf(line, "syscw: %lld", syscw);
+        }
+        fclose(f);
+}
+
+
+/*
+ * run_measured
+ *
+ * Run a command and append one line to 'out':
+ *
+ *      <label> <exit status> <wall s> <user s> <sys s> <syscr> <syscw>
+ *
+ * The child is inspected with WNOWAIT before being reaped, otherwise its
+ * /proc entry would be gone already.
+ */
+static int run_measured (const char *out, const char *label, char **argv)
+{
+        struct timeval t0, t1;
+        struct rusage  ru;
+        siginfo_t      si;
+        pid_t          pid;
+        int            status;
+        long long      syscr, syscw;
+        FILE          *f;
+
+        gettimeofday(&t0, NULL);
+        pid = fork();
+        if (pid == -1)
+                die("fork");
+        if (pid == 0)
+        {
+                execvp(argv[0], argv);
+                die(argv[0]);
+        }
+
+        if (waitid(P_PID, pid, &si, WEXITED | WNOWAIT) == -1)
+                die("waitid");
+        gettimeofday(&t1, NULL);
+        read_proc_io(pid, &syscr, &syscw);
+        if (wait4(pid, &status, 0, &ru) == -1)
+                die("wait4");
+
+        f = fopen(out, "a");
+        if (f == NULL)
+                die(out);
+        fprintf(f, "%s %d %.3f %.3f %.3f %lld %lld\n", label,
+                WIFEXITED(status) ? WEXITSTATUS(status) : 128,
+                (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) * 1e-6,
+                ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6,
+                ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6,
+                syscr, syscw);
+        fclose(f);
+
+        return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+
+static void usage (void)
+{
+        fputs("Usage:\n"
+              "\tbenchtool file   <path> <bytes> random|text <seed>\n"
+              "\tbenchtool tree   <path> <depth> <fanout> <files> <maxsize> <seed>\n"
+              "\tbenchtool sparse <path> <bytes> <data bytes> <seed>\n"
+              "\tbenchtool run    <outfile> <label> <command> [args ...]\n",
+              stderr);
+        exit(EXIT_FAILURE);
+}
+
+
+int main (int argc, char **argv)
+{
+        if (argc < 2)
+                usage();
+
+        if (strcmp(argv[1], "file") == 0 && argc == 6)
+        {
+                rng_seed(strtoull(argv[5], NULL, 10));
+                write_file(argv[2], atoll(argv[3]),
+                           strcmp(argv[4], "text") == 0);
+        }
+        else if (strcmp(argv[1], "tree") == 0 && argc == 8)
+        {
+                rng_seed(strtoull(argv[7], NULL, 10));
+                gen_tree(argv[2], atoi(argv[3]), atoi(argv[4]), atoi(argv[5]),
+                         atoi(argv[6]));
+        }
+        else if (strcmp(argv[1], "sparse") == 0 && argc == 6)
+        {
+                rng_seed(strtoull(argv[5], NULL, 10));
+                gen_sparse(argv[2], atoll(argv[3]), atoll(argv[4]));
+        }
+        else if (strcmp(argv[1], "run") == 0 && argc >= 5)
+                return run_measured(argv[2], argv[3], argv + 4);
+        else
+                usage();
+
+        return EXIT_SUCCESS;
+}
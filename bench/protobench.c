@@ -0,0 +1,258 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                         PROTOCOL MICROBENCHMARKS                           */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * Measures the per message cost of the framing in net.c and the receiver state
+ * machine in protocol.c with no kernel network stack involved.  Both peers run
+ * in the same process, in two threads, joined by an in-memory pipe plugged in
+ * as the connection transport.
+ *
+ * The receiver side is the real receive_item() working in a scratch directory,
+ * so file and directory negotiations include their filesystem calls (a stat()
+ * per skipped file, a mkdir()+chdir() pair per directory), as they would in a
+ * real session.  The sender side drives the messages by hand.
+ */
+#include "../canute.h"
+#include <pthread.h>
+
+#define PIPE_SIZE  (4 * CANUTE_BLOCK_SIZE)
+
+
+/*
+ * One direction of the memory pipe.  A plain ring buffer guarded by a mutex;
+ * readers and writers block on the condition variables like they would on a
+ * socket.
+ */
+struct ring
+{
+        pthread_mutex_t lock;
+        pthread_cond_t  readable;
+        pthread_cond_t  writable;
+        size_t          head;      /* Next byte to read */
+        size_t          used;
+        char            data[PIPE_SIZE];
+};
+
+/* Each peer reads from one ring and writes to the other */
+struct pipe_end
+{
+        struct ring *in;
+        struct ring *out;
+};
+
+static struct ring     rings[2];
+static struct pipe_end ends[2];
+static char            scratch[PATH_MAX];
+
+
+/***************************  MEMORY PIPE TRANSPORT  **************************/
+
+static int mempipe_send (struct connection *cn, const char *buf, size_t count)
+{
+        struct ring *r = ((struct pipe_end *) cn->ctx)->out;
+        size_t       tail, n, first;
+
+        pthread_mutex_lock(&r->lock);
+        while (r->used == PIPE_SIZE)
+                pthread_cond_wait(&r->writable, &r->lock);
+
+        n     = PIPE_SIZE - r->used;
+        n     = (count < n ? count : n);
+        tail  = (r->head + r->used) % PIPE_SIZE;
+        first = PIPE_SIZE - tail;
+        if (first > n)
+                first = n;
+        memcpy(r->data + tail, buf, first);
+        memcpy(r->data, buf + first, n - first);
+        r->used += n;
+
+        pthread_cond_signal(&r->readable);
+        pthread_mutex_unlock(&r->lock);
+        return (int) n;
+}
+
+
+static int mempipe_recv (struct connection *cn, char *buf, size_t count)
+{
+        struct ring *r = ((struct pipe_end *) cn->ctx)->in;
+        size_t       n, first;
+
+        pthread_mutex_lock(&r->lock);
+        while (r->used == 0)
+                pthread_cond_wait(&r->readable, &r->lock);
+
+        n     = (count < r->used ? count : r->used);
+        first = PIPE_SIZE - r->head;
+        if (first > n)
+                first = n;
+        memcpy(buf, r->data + r->head, first);
+        memcpy(buf + first, r->data, n - first);
+        r->head  = (r->head + n) % PIPE_SIZE;
+        r->used -= n;
+
+        pthread_cond_signal(&r->writable);
+        pthread_mutex_unlock(&r->lock);
+        return (int) n;
+}
+
+
+static const struct transport mempipe_transport = {
+        mempipe_send,
+        mempipe_recv,
+        NULL
+};
+
+
+/*
+ * mempipe_open
+ *
+ * Set up both ends of the pipe: a is the sender side, b the receiver side.
+ */
+static void mempipe_open (struct connection *a, struct connection *b)
+{
+        int i;
+
+        for (i = 0;  i < 2;  i++)
+        {
+                pthread_mutex_init(&rings[i].lock, NULL);
+                pthread_cond_init(&rings[i].readable, NULL);
+                pthread_cond_init(&rings[i].writable, NULL);
+                rings[i].head = 0;
+                rings[i].used = 0;
+        }
+
+        ends[0].out = ends[1].in = &rings[0];
+        ends[0].in  = ends[1].out = &rings[1];
+
+        transport_connection(a, &mempipe_transport, &ends[0]);
+        transport_connection(b, &mempipe_transport, &ends[1]);
+}
+
+
+/*******************************  BENCHMARKS  ********************************/
+
+static double now_ns (void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * header_sink
+ *
+ * Receiver for the header benchmark: just parse count messages.
+ */
+static void *header_sink (void *arg)
+{
+        struct connection *cn = arg;
+        char               name[CANUTE_NAME_LENGTH + 1];
+        int                x, mtime;
+        long long          size;
+
+        while (receive_message(cn, &x, &mtime, &size, name) != REQUEST_END)
+                ;
+        return NULL;
+}
+
+
+/*
+ * protocol_sink
+ *
+ * Receiver for the negotiation benchmarks: the real state machine.
+ */
+static void *protocol_sink (void *arg)
+{
+        if (chdir(scratch) == -1)
+                fatal("Cannot change to dir '%s'", scratch);
+        while (!receive_item(arg))
+                ;
+        return NULL;
+}
+
+
+/*
+ * run
+ *
+ * Time 'count' iterations of one benchmark against the given receiver thread
+ * and print the cost per iteration.
+ */
+static void run (const char *label, void *(*sink) (void *), int kind,
+                 long count)
+{
+        struct connection snd, rcv;
+        pthread_t         th;
+        long              i;
+        double            t0, t1;
+
+        mempipe_open(&snd, &rcv);
+        pthread_create(&th, NULL, sink, &rcv);
+
+        t0 = now_ns();
+        for (i = 0;  i < count;  i++)
+        {
+                switch (kind)
+                {
+                case REQUEST_FILE:
+                        /* Empty file that already exists: negotiated and
+                         * skipped every time but the first */
+                        send_message(&snd, REQUEST_FILE, 0, 1, 0, "file");
+                        receive_message(&snd, NULL, NULL, NULL, NULL);
+                        break;
+
+                case REQUEST_BEGINDIR:
+                        send_message(&snd, REQUEST_BEGINDIR, 0, 0, 0, "dir");
+                        receive_message(&snd, NULL, NULL, NULL, NULL);
+                        send_message(&snd, REQUEST_ENDDIR, 0, 0, 0, NULL);
+                        break;
+
+                default:
+                        send_message(&snd, REQUEST_FILE, 0, 1, i, "header");
+                }
+        }
+        send_message(&snd, REQUEST_END, 0, 0, 0, NULL);
+        flush_connection(&snd);
+        pthread_join(th, NULL);
+        t1 = now_ns();
+        close_connection(&snd);
+        close_connection(&rcv);
+
+        fprintf(stderr, "%-24s %10.1f ns/op  (%ld ops)\n", label,
+                (t1 - t0) / count, count);
+}
+
+
+int main (int argc, char **argv)
+{
+        long count = (argc > 1 ? atol(argv[1]) : 200000);
+
+        snprintf(scratch, sizeof(scratch), "%s/canute-protobench.XXXXXX",
+                 getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp");
+        if (mkdtemp(scratch) == NULL)
+                fatal("Creating scratch directory");
+
+        /* Receiver chatter would dominate the numbers */
+        if (freopen("/dev/null", "w", stdout) == NULL)
+                fatal("Redirecting standard output");
+
+        run("header", header_sink, 0, count);
+        run("file negotiation", protocol_sink, REQUEST_FILE, count);
+        run("directory enter/leave", protocol_sink, REQUEST_BEGINDIR, count);
+
+        unlink(strcat(scratch, "/file"));
+        *strrchr(scratch, '/') = '\0';
+        rmdir(strcat(scratch, "/dir"));
+        *strrchr(scratch, '/') = '\0';
+        rmdir(scratch);
+        return EXIT_SUCCESS;
+}
@@ -0,0 +1,496 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                         WAN EMULATION PROXY                                */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * Helper for bench.sh.  Sits between a sender and a receiver on the same host
+ * and makes the connection behave like a long distance one, without root nor
+ * tc/netem: it accepts a single client on a local port, connects to the real
+ * server and forwards both ways, holding every byte back as a WAN link would.
+ *
+ * What is read from one side is cut in segments of SEGMENT bytes, each one
+ * scheduled in order:
+ *
+ *   - The bottleneck (-b) sends one segment at a time, so a segment starts
+ *     when the previous one is done and takes its length over the rate.
+ *
+ *   - Then it travels for the one way delay (-d), give or take up to the
+ *     jitter (-j), never overtaking the segment before (TCP delivers in order
+ *     anyway).
+ *
+ *   - With the probability of -l (percent) it is "lost" and only arrives a
+ *     stall (-s) later, like a retransmission after a timeout, holding back
+ *     everything behind it.
+ *
+ * Bytes stay in flight, counted against the window (-w), until they have been
+ * delivered and the acknowledgement came back, one more delay later.  So the
+ * throughput is never above window / RTT: a small window shows what small
+ * socket buffers cost on a long link.  Both directions are shaped the same,
+ * each one on its own.  The same seed (-S) gives the same jitter and stalls.
+ *
+ * This is a Linux only tool (ppoll()), like the rest of the benchmark.
+ */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define SEGMENT      1448     /* Payload of an Ethernet sized TCP segment */
+#define SEGMENTS_MAX 65536    /* In flight per direction */
+#define READ_MAX     65536    /* Most taken from a side at once */
+
+struct segment
+{
+        size_t    offset;  /* In the direction buffer */
+        size_t    length;
+        size_t    done;    /* Bytes written to the destination */
+        long long due;     /* When it reaches the other end (us) */
+        long long acked;   /* When it leaves the window, once written */
+};
+
+struct direction
+{
+        int             from, to;
+        char           *buf;        /* window bytes, circular */
+        size_t          head, fill; /* Oldest byte held and bytes held */
+        struct segment  seg[SEGMENTS_MAX];
+        size_t          first;      /* Oldest segment held */
+        size_t          count;      /* Segments held */
+        size_t          written;    /* Of them, those written whole */
+        long long       link_free;  /* Bottleneck busy until then */
+        long long       last_due;
+        int             eof;        /* Nothing more from the source */
+        int             blocked;    /* Destination full */
+        int             shut;       /* Destination shut down for writing */
+        long long       bytes, stalls;
+};
+
+static long long          delay_us  = 0;
+static long long          jitter_us = 0;
+static long long          rate      = 0;  /* Bytes per second, 0 = no limit */
+static double             loss      = 0;  /* Probability per segment */
+static long long          stall_us  = 200000;
+static size_t             window    = 4 << 20;
+static unsigned long long rng_state;
+
+static struct direction   dirs[2];  /* Client to server, server to client */
+
+
+/*
+ * die
+ *
+ * Report an error (with errno string) and exit.
+ */
+static void die (const char *what)
+{
+        perror(what);
+        exit(EXIT_FAILURE);
+}
+
+
+/*
+ * rng_next
+ *
+ * Same generator as benchtool, only reproducibility matters.
+ */
+static unsigned long long rng_next (void)
+{
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return rng_state * 2685821657736338717ULL;
+}
+
+
+/*
+ * rng_unit
+ *
+ * Uniform in [0, 1).
+ */
+static double rng_unit (void)
+{
+        return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static long long now_us (void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+/*
+ * accept_client
+ *
+ * Wait on the loopback port for a single client and return its socket.
+ */
+static int accept_client (int port)
+{
+        struct sockaddr_in sa;
+        int                lsk, sk, on = 1;
+
+        lsk = socket(AF_INET, SOCK_STREAM, 0);
+        if (lsk == -1)
+                die("socket");
+        setsockopt(lsk, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family      = AF_INET;
+        sa.sin_port        = htons(port);
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(lsk, (struct sockaddr *) &sa, sizeof(sa)) == -1
+            || listen(lsk, 1) == -1)
+                die("listen");
+        sk = accept(lsk, NULL, NULL);
+        if (sk == -1)
+                die("accept");
+        close(lsk);
+        return sk;
+}
+
+
+/*
+ * connect_server
+ *
+ * Connect to the real server.
+ */
+static int connect_server (const char *host, const char *port)
+{
+        struct addrinfo hints, *ai, *a;
+        int             sk = -1, e;
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        e = getaddrinfo(host, port, &hints, &ai);
+        if (e != 0)
+        {
+                fprintf(stderr, "%s: %s\n", host, gai_strerror(e));
+                exit(EXIT_FAILURE);
+        }
+        for (a = ai;  a != NULL;  a = a->ai_next)
+        {
+                sk = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                if (sk != -1 && connect(sk, a->ai_addr, a->ai_addrlen) == 0)
+                        break;
+                if (sk != -1)
+                        close(sk);
+                sk = -1;
+        }
+        freeaddrinfo(ai);
+        if (sk == -1)
+                die("connect");
+        return sk;
+}
+
+
+/*
+ * schedule
+ *
+ * A segment of length bytes at offset in the buffer was just read, work out
+ * when it arrives.
+ */
+static void schedule (struct direction *d, size_t offset, size_t length,
+                      long long now)
+{
+        struct segment *s = &d->seg[(d->first + d->count) % SEGMENTS_MAX];
+        long long       due;
+
+        if (d->link_free < now)
+                d->link_free = now;
+        if (rate > 0)
+                d->link_free += (long long) length * 1000000 / rate;
+
+        due = d->link_free + delay_us;
+        if (jitter_us > 0)
+                due += (long long) ((rng_unit() * 2 - 1) * jitter_us);
+        if (due < d->link_free)
+                due = d->link_free;
+        if (loss > 0 && rng_unit() < loss)
+        {
+                due += stall_us;
+                d->stalls++;
+        }
+        if (due < d->last_due)
+                due = d->last_due;
+        d->last_due = due;
+
+        s->offset = offset;
+        s->length = length;
+        s->done   = 0;
+        s->due    = due;
+        s->acked  = 0;
+        d->count++;
+}
+
+
+/*
+ * take_input
+ *
+ * Read what the source has, as far as the window allows, and schedule it.
+ */
+static void take_input (struct direction *d, long long now)
+{
+        size_t  tail, room, n;
+        ssize_t r;
+
+        tail = (d->head + d->fill) % window;
+        room = window - d->fill;
+        if (room > window - tail)
+                room = window - tail;  /* Segments never wrap */
+        if (room > READ_MAX)
+                room = READ_MAX;
+        if (room > (SEGMENTS_MAX - d->count) * SEGMENT)
+                room = (SEGMENTS_MAX - d->count) * SEGMENT;
+        if (room == 0)
+                return;
+
+        r = read(d->from, d->buf + tail, room);
+        if (r == -1 && (errno == EAGAIN || errno == EINTR))
+                return;
+        if (r <= 0)
+        {
+                d->eof = 1;
+                return;
+        }
+
+        d->fill  += r;
+        d->bytes += r;
+        for (n = 0;  n < (size_t) r;  n += SEGMENT)
+                schedule(d, tail + n, ((size_t) r - n > SEGMENT
+                                       ? SEGMENT : (size_t) r - n), now);
+}
+
+
+/*
+ * give_output
+ *
+ * Write the segments that have arrived, and let go of those acknowledged.
+ */
+static void give_output (struct direction *d, long long now)
+{
+        struct segment *s;
+        ssize_t         r;
+
+        d->blocked = 0;
+        while (d->written < d->count)
+        {
+                s = &d->seg[(d->first + d->written) % SEGMENTS_MAX];
+                if (s->due > now)
+                        break;
+                r = write(d->to, d->buf + s->offset + s->done,
+                          s->length - s->done);
+                if (r == -1 && errno == EINTR)
+                        continue;
+                if (r == -1 && errno == EAGAIN)
+                {
+                        d->blocked = 1;
+                        break;
+                }
+                if (r == -1)
+                {
+                        /* The destination is gone, so is the rest */
+                        d->eof   = 1;
+                        d->shut  = 1;
+                        d->count = d->written = d->fill = 0;
+                        return;
+                }
+                s->done += r;
+                if (s->done < s->length)
+                        continue;
+                s->acked = now + delay_us;
+                d->written++;
+        }
+
+        while (d->written > 0 && d->seg[d->first].acked <= now)
+        {
+                s         = &d->seg[d->first];
+                d->head   = (d->head + s->length) % window;
+                d->fill  -= s->length;
+                d->first  = (d->first + 1) % SEGMENTS_MAX;
+                d->count--;
+                d->written--;
+        }
+
+        if (d->eof && d->written == d->count && !d->shut)
+        {
+                shutdown(d->to, SHUT_WR);
+                d->shut = 1;
+        }
+}
+
+
+/*
+ * next_event
+ *
+ * Earliest time something is due in the direction, or -1 if nothing is.
+ */
+static long long next_event (const struct direction *d)
+{
+        long long t = -1;
+
+        if (d->written < d->count && !d->blocked)
+                t = d->seg[(d->first + d->written) % SEGMENTS_MAX].due;
+        if (d->written > 0 && (t == -1 || d->seg[d->first].acked < t))
+                t = d->seg[d->first].acked;
+        return t;
+}
+
+
+/*
+ * forward
+ *
+ * Move data between the client and the server until both directions end.
+ */
+static void forward (int client, int server)
+{
+        struct pollfd   pfd[2];
+        struct timespec ts;
+        long long       now, t, next;
+        int             i;
+
+        dirs[0].from = dirs[1].to = client;
+        dirs[0].to = dirs[1].from = server;
+        for (i = 0;  i < 2;  i++)
+        {
+                dirs[i].buf = malloc(window);
+                if (dirs[i].buf == NULL)
+                        die("malloc");
+                fcntl(dirs[i].to, F_SETFL, O_NONBLOCK);
+        }
+
+        while (!dirs[0].shut || !dirs[1].shut)
+        {
+                now  = now_us();
+                next = -1;
+                for (i = 0;  i < 2;  i++)
+                {
+                        give_output(&dirs[i], now);
+                        t = next_event(&dirs[i]);
+                        if (t != -1 && (next == -1 || t < next))
+                                next = t;
+                }
+
+                /* Socket i is the source of direction i and the destination
+                 * of the other one */
+                for (i = 0;  i < 2;  i++)
+                {
+                        pfd[i].fd     = dirs[i].from;
+                        pfd[i].events = 0;
+                        if (!dirs[i].eof && dirs[i].fill < window
+                            && dirs[i].count < SEGMENTS_MAX)
+                                pfd[i].events |= POLLIN;
+                        if (dirs[1 - i].blocked)
+                                pfd[i].events |= POLLOUT;
+                        if (pfd[i].events == 0)
+                                pfd[i].fd = -1;  /* Or a hangup would spin */
+                }
+
+                if (next != -1)
+                {
+                        t = (next > now ? next - now : 0);
+                        ts.tv_sec  = t / 1000000;
+                        ts.tv_nsec = (t % 1000000) * 1000;
+                }
+                if (ppoll(pfd, 2, (next != -1 ? &ts : NULL), NULL) == -1
+                    && errno != EINTR)
+                        die("ppoll");
+
+                now = now_us();
+                for (i = 0;  i < 2;  i++)
+                        if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                                take_input(&dirs[i], now);
+        }
+}
+
+
+/*
+ * parse_size
+ *
+ * Number of bytes with an optional k or m suffix.
+ */
+static size_t parse_size (const char *s)
+{
+        char  *end;
+        size_t n = (size_t) strtoull(s, &end, 10);
+
+        if (*end == 'k' || *end == 'K')
+                n <<= 10;
+        else if (*end == 'm' || *end == 'M')
+                n <<= 20;
+        return n;
+}
+
+
+static void usage (void)
+{
+        fputs("Usage:\n"
+              "\twanproxy [options] <listen port> <host> <port>\n"
+              "\nOptions (each direction):\n"
+              "\t-d <ms>      One way delay\n"
+              "\t-j <ms>      Jitter, the delay varies up to that much\n"
+              "\t-b <kbit/s>  Bandwidth cap\n"
+              "\t-l <percent> Segments lost (stalled)\n"
+              "\t-s <ms>      Stall of a lost segment (200)\n"
+              "\t-w <bytes>   Window, most bytes in flight (4m)\n"
+              "\t-S <seed>    Seed for jitter and losses\n",
+              stderr);
+        exit(EXIT_FAILURE);
+}
+
+
+int main (int argc, char **argv)
+{
+        unsigned long long seed = 1;
+        int                c, client, server, on = 1;
+
+        while ((c = getopt(argc, argv, "d:j:b:l:s:w:S:")) != -1)
+        {
+                switch (c)
+                {
+                case 'd': delay_us  = atof(optarg) * 1000;         break;
+                case 'j': jitter_us = atof(optarg) * 1000;         break;
+                case 'b': rate      = atof(optarg) * 1000 / 8;     break;
+                case 'l': loss      = atof(optarg) / 100;          break;
+                case 's': stall_us  = atof(optarg) * 1000;         break;
+                case 'w': window    = parse_size(optarg);          break;
+                case 'S': seed      = strtoull(optarg, NULL, 10);  break;
+                default:  usage();
+                }
+        }
+        if (argc - optind != 3 || window < SEGMENT)
+                usage();
+        rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+        signal(SIGPIPE, SIG_IGN);
+
+        client = accept_client(atoi(argv[optind]));
+        server = connect_server(argv[optind + 1], argv[optind + 2]);
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        forward(client, server);
+        fprintf(stderr, "wanproxy: %lld bytes up, %lld down, %lld stalls\n",
+                dirs[0].bytes, dirs[1].bytes, dirs[0].stalls + dirs[1].stalls);
+        return EXIT_SUCCESS;
+}
@@ -11,8 +11,196 @@
 
 #include "canute.h"
 
-/* Working directory */
-static char cwd_buf[PATH_MAX];
+
+/*
+ * parse_options
+ *
+ * Options go right after the sub-command.  Consume them starting at argv[*arg]
+ * and leave *arg pointing to the first argument that is not an option.
+ */
+static void parse_options (int argc, char **argv, int *arg)
+{
+        char *o;
+
+        memset(&opt, 0, sizeof(opt));
+
+        for (;  *arg < argc && argv[*arg][0] == '-';  (*arg)++)
+        {
+                o = argv[*arg];
+                if (strcmp(o, "--") == 0)
+                {
+                        (*arg)++;
+                        break;
+                }
+                if (o[1] == '\0' || o[2] != '\0')
+                        help(argv[0]);
+
+                switch (o[1])
+                {
+                case 'a':
+                        opt.confirmed = 1;
+                        break;
+
+                case 'C':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        opt.hash_cache = argv[*arg];
+                        break;
+
+                case 'd':
+                        opt.dedup = 1;
+                        break;
+
+                case 'f':
+                        opt.follow = 1;
+                        break;
+
+                case 'i':
+                        opt.incremental = 1;
+                        break;
+
+                case 'k':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        cipher_key(argv[*arg]);
+                        break;
+
+                case 'l':
+                        opt.hard_links = 1;
+                        break;
+
+                case 'r':
+                        opt.peer_rules = 1;
+                        break;
+
+                case 'R':
+                        opt.resume = 1;
+                        break;
+
+                case 'w':
+                        opt.watch = 1;
+                        break;
+
+                case 'x':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        filter_add(argv[*arg]);
+                        break;
+
+                case 'X':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        filter_load(argv[*arg]);
+                        break;
+
+                case 'H':
+                        opt.index_hashes = 1;
+                        break;
+
+                case 'I':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        opt.index = argv[*arg];
+                        break;
+
+                case 'm':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        multipath_add(argv[*arg]);
+                        break;
+
+                case 'p':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        opt.pack_source = argv[*arg];
+                        break;
+
+                case 'P':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        opt.pack = argv[*arg];
+                        break;
+
+                case 't':
+                case 'T':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        opt.record     = argv[*arg];
+                        opt.record_all = (o[1] == 'T');
+                        break;
+
+                case 'y':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        opt.durability = durable_policy(argv[*arg]);
+                        if (opt.durability == -1)
+                                help(argv[0]);
+                        break;
+
+                case 'z':
+                        opt.sparse = 1;
+                        break;
+
+                case 's':
+                        opt.interleave = 1;
+                        break;
+
+                case 'S':
+                        if (++(*arg) == argc)
+                                help(argv[0]);
+                        opt.chunk_store = argv[*arg];
+                        break;
+
+                default:
+                        help(argv[0]);
+                }
+        }
+}
+
+
+/*
+ * open_server
+ *
+ * Wait for the client, on the Unix socket at local if there is one (a port
+ * given as "unix:<path>"), otherwise on the TCP port.
+ */
+static SOCKET open_server (unsigned short port, const char *local)
+{
+        if (local != NULL)
+                return open_local_server(local);
+        return open_connection_server(port);
+}
+
+
+/*
+ * receive_session
+ *
+ * Be the receiver of a session until the sender is done, over a connection
+ * just set up (or a tape, see replay.c).
+ */
+static void receive_session (struct connection *cn)
+{
+        int last;
+
+        if (opt.record != NULL)
+                replay_record(cn, opt.record, opt.record_all);
+        if (opt.chunk_store != NULL)
+                store_open(opt.chunk_store);
+        if (opt.index != NULL)
+                index_load(opt.index);
+        if (opt.pack != NULL)
+                pack_create(opt.pack);
+
+        do {
+                last = receive_item(cn);
+        } while (!last);
+
+        pack_finish();
+        index_save();
+        store_close();
+        durable_session_end(".");
+        confirm_end(cn);
+}
 
 
 /*
@@ -28,10 +216,12 @@ static char cwd_buf[PATH_MAX];
  */
 int main (int argc, char **argv)
 {
-        SOCKET         sk = -1; /* Quest for a warning free compilation */
-        char          *port_str, *cwd;
-        unsigned short port;
-        int            i, err, last, arg = 0;
+        SOCKET            sk = -1; /* Quest for a warning free compilation */
+        struct connection cn;
+        char             *port_str, *local = NULL;
+        unsigned short    port;
+        int               i, arg = 0;
+        int               status = EXIT_SUCCESS;
 #ifdef HASEFROCH
         WSADATA ws;
 
@@ -51,9 +241,59 @@ int main (int argc, char **argv)
                 *port_str = '\0';
                 port_str++;
                 port = (unsigned short) atoi(port_str);
+                if (strncmp(port_str, "unix:", 5) == 0)
+                        local = port_str + 5;
         }
 
-        if (strncmp(argv[1], "send", 4) == 0)
+        arg = 2;
+        parse_options(argc, argv, &arg);
+        if (opt.resume && multipath_enabled())
+                help(argv[0]);
+
+        if (strcmp(argv[1], "lspack") == 0 || strcmp(argv[1], "unpack") == 0)
+        {
+                /*************************/
+                /***  LOCAL PACK MODE  ***/
+                /*************************/
+
+                /* No connection, just the pack and maybe a directory */
+                if (argv[1][0] == 'l' && argc == arg + 1)
+                        pack_list(argv[arg]);
+                else if (argv[1][0] == 'u' && argc == arg + 1)
+                        pack_extract(argv[arg], ".");
+                else if (argv[1][0] == 'u' && argc == arg + 2)
+                        pack_extract(argv[arg], argv[arg + 1]);
+                else
+                        help(argv[0]);
+                return status;
+        }
+        else if (strcmp(argv[1], "sendstream") == 0
+            || strcmp(argv[1], "getstream") == 0)
+        {
+                /*********************/
+                /***  STREAM MODE  ***/
+                /*********************/
+
+                /* With a host we are the client, otherwise the server */
+                if (argc == arg + 1)
+                        sk = open_connection_client(argv[arg], port);
+                else if (argc == arg)
+                        sk = open_server(port, local);
+                else
+                        help(argv[0]);
+                socket_connection(&cn, sk);
+
+                /* Standard output belongs to the stream, no messages there */
+                feedback_setup(1, NULL, NULL);
+                if (cipher_enabled())
+                        cipher_setup(&cn, argc == arg);
+
+                if (argv[1][0] == 's')
+                        send_stream(&cn);
+                else
+                        receive_stream(&cn);
+        }
+        else if (strncmp(argv[1], "send", 4) == 0)
         {
                 /*********************/
                 /***  SENDER MODE  ***/
@@ -62,47 +302,61 @@ int main (int argc, char **argv)
                 /* Open connection */
                 if (strcmp(argv[1], "send") == 0)
                 {
-                        if (argc < 3)
+                        if (argc < arg + (opt.pack_source == NULL))
                                 help(argv[0]);
-                        sk  = open_connection_server(port);
-                        arg = 2;
+                        sk = open_server(port, local);
                 }
                 else if (strcmp(argv[1], "sendto") == 0)
                 {
-                        if (argc < 4)
+                        if (argc < arg + 1 + (opt.pack_source == NULL))
                                 help(argv[0]);
-                        sk  = open_connection_client(argv[2], port);
-                        arg = 3;
+                        sk = open_connection_client(argv[arg], port);
+                        arg++;
                 }
                 else
                         help(argv[0]);
 
-                /* Save current working directory */
-                cwd = getcwd(cwd_buf, PATH_MAX);
-                if (cwd == NULL)
-                        error("Could not retrieve working directory."
-                              " This may produce some path errors.\n");
-
                 /* Adjust send buffer */
                 i = CANUTE_BLOCK_SIZE;
                 setsockopt(sk, SOL_SOCKET, SO_SNDBUF, CCP_CAST &i, sizeof(i));
+                socket_connection(&cn, sk);
+                if (multipath_enabled())
+                        multipath_setup(&cn, argv[1][4] == '\0', port);
+                if (opt.resume)
+                        resume_setup(&cn, argv[1][4] == '\0', port);
+                if (cipher_enabled())
+                        cipher_setup(&cn, argv[1][4] == '\0');
+
+                if (opt.hash_cache != NULL)
+                        hashcache_open(opt.hash_cache);
+                if (opt.incremental)
+                        fetch_index(&cn);
+                if (opt.peer_rules)
+                        fetch_rules(&cn);
+                if ((opt.watch || opt.follow) && opt.pack_source != NULL)
+                        help(argv[0]);
+                if (opt.watch && opt.follow)
+                        help(argv[0]);
+                if (opt.watch)
+                        watch_start(argv + arg, argc - arg);
 
                 /* Now we have the transmission channel open, so let's send
                  * everything we're supposed to send */
-                for (i = arg;  i < argc;  i++)
-                {
-                        send_item(sk, argv[i]);
-                        /* Return to original working directory.  This fixes a
-                         * potential bug when giving multiple arguments with
-                         * different path prefixes. */
-                        err = chdir(cwd);
-                        if (err == -1)
-                                error("Could not change working directory."
-                                      " This may produce some path errors.\n");
-                }
+                if (opt.pack_source != NULL)
+                        send_pack(&cn, opt.pack_source, argv + arg, argc - arg);
+                for (i = arg;  opt.pack_source == NULL && i < argc;  i++)
+                        if (!opt.follow || !follow_item(&cn, argv[i]))
+                                send_item(&cn, argv[i]);
+                send_slices(&cn);
+                if (opt.watch)
+                        watch_run(&cn);
+                if (opt.follow)
+                        follow_run(&cn);
 
                 /* It's over. Notify the receiver to finish as well, please */
-                send_message(sk, REQUEST_END, 0, 0, 0, NULL);
+                prefetch_stop();
+                send_end(&cn);
+                hashcache_save();
         }
         else if (strncmp(argv[1], "get", 3) == 0)
         {
@@ -113,27 +367,83 @@ int main (int argc, char **argv)
                 /* Open connection */
                 if (strcmp(argv[1], "get") == 0)
                 {
-                        if (argc < 3)
+                        if (argc < arg + 1)
                                 help(argv[0]);
-                        sk = open_connection_client(argv[2], port);
+                        sk = open_connection_client(argv[arg], port);
                 }
                 else if (strcmp(argv[1], "getserv") == 0)
-                        sk = open_connection_server(port);
+                        sk = open_server(port, local);
                 else
                         help(argv[0]);
 
                 /* Adjust receive buffer */
                 i = CANUTE_BLOCK_SIZE;
                 setsockopt(sk, SOL_SOCKET, SO_RCVBUF, CCP_CAST &i, sizeof(i));
+                socket_connection(&cn, sk);
+                if (multipath_enabled())
+                        multipath_setup(&cn, argv[1][3] != '\0', port);
+                if (opt.resume)
+                        resume_setup(&cn, argv[1][3] != '\0', port);
+                if (cipher_enabled())
+                        cipher_setup(&cn, argv[1][3] != '\0');
+
+                receive_session(&cn);
+        }
+        else if (strcmp(argv[1], "replay") == 0)
+        {
+                /*********************/
+                /***  REPLAY MODE  ***/
+                /*********************/
+
+                /* A session recorded with -T or -t, no sender involved */
+                if (argc != arg + 1 || opt.record != NULL)
+                        help(argv[0]);
+                replay_open(&cn, argv[arg]);
+                receive_session(&cn);
+        }
+        else if (strncmp(argv[1], "verify", 6) == 0)
+        {
+                /*********************/
+                /***  VERIFY MODE  ***/
+                /*********************/
+
+                /* Open connection.  The client drives the comparison */
+                if (strcmp(argv[1], "verify") == 0)
+                {
+                        if (argc != arg + 1)
+                                help(argv[0]);
+                        sk = open_server(port, local);
+                }
+                else if (strcmp(argv[1], "verifyto") == 0)
+                {
+                        if (argc != arg + 2)
+                                help(argv[0]);
+                        sk = open_connection_client(argv[arg], port);
+                        arg++;
+                }
+                else
+                        help(argv[0]);
+                socket_connection(&cn, sk);
+                if (cipher_enabled())
+                        cipher_setup(&cn, argv[1][6] == '\0');
+
+                if (opt.hash_cache != NULL)
+                        hashcache_open(opt.hash_cache);
+
+                if (strcmp(argv[1], "verifyto") == 0)
+                {
+                        if (verify_compare(&cn, argv[arg]) > 0)
+                                status = EXIT_FAILURE;
+                }
+                else
+                        verify_answer(&cn, argv[arg]);
 
-                do {
-                        last = receive_item(sk);
-                } while (!last);
+                hashcache_save();
         }
         else
                 help(argv[0]);
 
-        closesocket(sk);
-        return EXIT_SUCCESS;
+        close_connection(&cn);
+        return status;
 }
 
@@ -10,7 +10,7 @@
 /******************************************************************************/
 
 /* Constants */
-#define CANUTE_VERSION_STR   "v1.4"
+#define CANUTE_VERSION_STR   "v1.5"
 #define CANUTE_DEFAULT_PORT  1121
 #define CANUTE_NAME_LENGTH   239  /* Don't touch this */
 #define CANUTE_ENHANCED      43   /* Enhanced packet marker [plus sign '+'] */
@@ -23,27 +23,72 @@
 #define REQUEST_END          4
 #define REPLY_ACCEPT         5
 #define REPLY_SKIP           6
+#define REQUEST_CHUNKS       7
+#define REQUEST_DATA         8
+#define REQUEST_HOLE         9
+#define REQUEST_INDEX        10
+#define REQUEST_TREE         11
+#define REQUEST_STREAM       12
+#define REQUEST_LINK         13
+#define REQUEST_RULES        14
+#define REQUEST_FOLLOW       15
+#define REQUEST_APPEND       16
+#define REQUEST_PATHS        17
+#define REQUEST_SLICE        18
+#define REQUEST_RESUME       19
+#define REQUEST_CRYPT        20
+#define REQUEST_TYPE_MASK    0xFF
+#define FLAG_DEDUP           0x100  /* REQUEST_FILE: data goes as chunks */
+#define FLAG_SPARSE          0x200  /* REQUEST_FILE: data goes as segments */
+#define FLAG_DESCRIPTOR      0x400  /* REQUEST_FILE: the file itself is passed */
+#define FLAG_REPLACE         0x800  /* REQUEST_FILE: changed, do not resume */
+#define FLAG_INTERLEAVE      0x1000 /* REQUEST_FILE: may go as a stream */
+#define FLAG_SLICES          0x2000 /* REQUEST_FILE: slices may come first */
+#define DEDUP_BATCH          256    /* Maximum chunks per REQUEST_CHUNKS */
+#define HASH_SIZE            32
+#define CHUNK_RECORD         (HASH_SIZE + 4)  /* Chunk table entry on the wire */
+#define PREFETCH_FILES       16     /* Upcoming files the sender reads ahead */
+#define NET_BUFFER           (4 * CANUTE_BLOCK_SIZE)  /* Each way, see net.c */
+#define DURABLE_NONE         0
+#define DURABLE_FILE         1
+#define DURABLE_DIR          2
+#define DURABLE_SESSION      3
 
 /* Large File Support */
 #define _FILE_OFFSET_BITS    64
 #define _LARGEFILE_SOURCE
 #define _LARGEFILE64_SOURCE
 
+/* Linux extensions (SEEK_DATA and friends), harmless elsewhere */
+#define _GNU_SOURCE
+
 /* Common headers */
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <dirent.h>
 #include <errno.h>
+#include <setjmp.h>
+
+/* Error codes, progress callbacks and the buffer size are shared with users
+ * of the library */
+#include "libcanute.h"
+
+/* Module state is per thread, so library sessions can run concurrently */
+#if defined(__GNUC__) || defined(__SUNPRO_C)
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
 
 #if defined(__WIN32__) || defined(WIN32)
 
 /* Definitions and headers (Hasefroch) */
 #include <sys/utime.h>
-#include <stdint.h>
 #include <windows.h>
 #include <winsock.h>
 #define  HASEFROCH
@@ -111,29 +156,292 @@ struct header
 };
 
 
+/*
+ * Command line options.  See help() for their meaning.
+ */
+struct options
+{
+        int   dedup;        /* Sender: send files as deduplicated chunks */
+        int   sparse;       /* Sender: elide holes and zero blocks */
+        int   incremental;  /* Sender: skip what the receiver index has */
+        char *chunk_store;  /* Receiver: chunk store directory */
+        char *index;        /* Receiver: file index */
+        int   index_hashes; /* Receiver: record content hashes in the index */
+        char *hash_cache;   /* Sender: content hash cache file */
+        char *pack_source;  /* Sender: send the contents of this pack */
+        char *pack;         /* Receiver: store everything in this pack */
+        int   durability;   /* Receiver: DURABLE_* sync policy */
+        int   confirmed;    /* Sender: fail unless the end is confirmed */
+        int   hard_links;   /* Sender: send hard linked files only once */
+        int   peer_rules;   /* Sender: leave out what the receiver excludes */
+        int   watch;        /* Sender: keep sending what changes */
+        int   follow;       /* Sender: keep sending what files grow */
+        int   interleave;   /* Sender: big files go along with the rest */
+        int   resume;       /* Both: reconnect and resume a lost session */
+        char *record;       /* Receiver: record the session to this tape */
+        int   record_all;   /* Receiver: file contents on the tape too */
+};
+
+extern THREAD_LOCAL struct options opt;
+
+/*
+ * A file or directory stored in a pack (see pack.c).
+ */
+struct pack_entry
+{
+        char     *path;
+        long long offset;
+        long long size;
+        int       mtime;
+        int       mode;
+};
+
+/*
+ * SHA-256 running state.
+ */
+struct sha256
+{
+        uint32_t      state[8];
+        uint64_t      length;
+        unsigned char buf[64];
+        size_t        used;
+};
+
+/*
+ * Transport operations.  Everything above net.c talks to a connection, and the
+ * connection moves its bytes through one of these.  Both calls behave like
+ * send() and recv(): they return how many bytes were moved (maybe less than
+ * requested), zero at the end of the stream and SOCKET_ERROR on failure.
+ * close, if there is one, ends the transport when the connection is closed.
+ */
+struct connection;
+struct cipher;
+struct tape;
+
+struct transport
+{
+        int  (*send)  (struct connection *cn, const char *buf, size_t count);
+        int  (*recv)  (struct connection *cn, char *buf, size_t count);
+        void (*close) (struct connection *cn);  /* May be NULL */
+};
+
+/*
+ * An established connection.  For the socket transport sk is all there is;
+ * other transports keep their state behind ctx.  The rest is buffering, see
+ * net.c.
+ */
+struct connection
+{
+        SOCKET                  sk;
+        const struct transport *tr;
+        void                   *ctx;
+        char                   *out;       /* Pending output */
+        size_t                  out_fill;
+        char                   *in;        /* Input read ahead */
+        size_t                  in_pos, in_fill;
+        int                     corked;    /* Last send was MSG_MORE */
+        int                     own_buffers;
+        int                     passed_fd; /* Received, not taken, or -1 */
+        struct cipher          *cipher;    /* Or NULL, see cipher.c */
+        struct tape            *tape;      /* Recording or replay, see replay.c */
+};
+
+/*
+ * Where fail() goes instead of exiting, while a library call runs (see
+ * util.c).
+ */
+struct failure
+{
+        jmp_buf env;
+        int     code;          /* CANUTE_E*, 0 while nothing failed */
+        int     sys_errno;
+        int     warnings;      /* Non fatal errors meanwhile */
+        char    message[160];
+        char    warning[160];  /* The last of them */
+};
+
+
 /***************************  FUNCTION PROTOTYPES  ***************************/
 
+/* cipher.c */
+void cipher_key      (const char *file);
+int  cipher_enabled  (void);
+void cipher_setup    (struct connection *cn, int server);
+void cipher_send     (struct connection *cn, const char *buf, size_t count);
+int  cipher_recv     (struct connection *cn, char *buf, size_t count);
+int  cipher_buffered (struct connection *cn);
+void cipher_free     (struct connection *cn);
+
+/* dedup.c */
+size_t chunk_cut    (const unsigned char *buf, size_t count);
+void   store_open   (char *dir);
+void   store_close  (void);
+int    store_lookup (const unsigned char *hash);
+int    store_read   (const unsigned char *hash, char *buf);
+void   store_add    (const unsigned char *hash, const char *buf, int length);
+
+/* durable.c */
+int  durable_policy      (const char *name);
+void durable_file        (FILE *file, const char *path);
+void durable_link        (const char *path);
+void durable_dir_end     (const char *dir);
+void durable_session_end (const char *dir);
+
 /* feedback.c */
+void feedback_setup  (int quiet, canute_progress callback, void *arg);
+void inform          (char *msg, ...);
 void setup_progress  (char *name, long long size, long long offset);
 void update_progress (size_t increment);
 void finish_progress (void);
 
+/* filter.c */
+void   filter_add        (const char *rule);
+void   filter_load       (const char *file);
+void   filter_add_remote (char *text);
+size_t filter_text       (char **text);
+int    filter_enabled    (void);
+int    filter_dirs       (void);
+int    filter_excluded   (const char *path, int is_dir);
+void   filter_reset      (void);
+
+/* follow.c */
+int  follow_item (struct connection *cn, char *path);
+void follow_run  (struct connection *cn);
+
+/* hash.c */
+void sha256_init   (struct sha256 *ctx);
+void sha256_update (struct sha256 *ctx, const void *data, size_t count);
+void sha256_final  (struct sha256 *ctx, unsigned char *digest);
+void sha256        (const void *data, size_t count, unsigned char *digest);
+
+/* hashcache.c */
+void           hashcache_open          (char *file);
+void           hashcache_save          (void);
+int            hashcache_enabled       (void);
+int            hashcache_file_hash     (const struct stat_info *st, unsigned char *digest);
+void           hashcache_set_file_hash (const struct stat_info *st, const unsigned char *digest);
+unsigned char *hashcache_chunks        (const struct stat_info *st, size_t *count);
+void           hashcache_set_chunks    (const struct stat_info *st, const unsigned char *records, size_t count);
+
+/* index.c */
+void   index_load        (char *file);
+void   index_save        (void);
+int    index_enabled     (void);
+int    index_unchanged   (const char *path, long long size, int mtime);
+void   index_update      (const char *path, long long size, int mtime, const unsigned char *hash);
+size_t index_summary     (unsigned char **buf);
+void   index_set_summary (unsigned char *buf, size_t count);
+int    index_in_summary  (const char *path, long long size, int mtime);
+
+/* links.c */
+const char *links_find  (const struct stat_info *st);
+void        links_add   (const struct stat_info *st, const char *path);
+void        links_reset (void);
+
+/* multipath.c */
+void multipath_add     (char *addr);
+int  multipath_enabled (void);
+void multipath_setup   (struct connection *cn, int server, unsigned short port);
+
 /* net.c */
 SOCKET open_connection_server (unsigned short port);
 SOCKET open_connection_client (char *host, unsigned short port);
-void   send_data              (SOCKET sk, char *buf, size_t count);
-void   receive_data           (SOCKET sk, char *buf, size_t count);
-void   send_message           (SOCKET sk, int type, int is_executable, int mtime, long long size, char *name);
-int    receive_message        (SOCKET sk, int *is_executable, int *mtime, long long *size, char *name);
+SOCKET open_local_server      (const char *path);
+void   transport_connection   (struct connection *cn, const struct transport *tr, void *ctx);
+void   socket_connection      (struct connection *cn, SOCKET sk);
+void   connection_buffers     (struct connection *cn, char *out, char *in);
+void   release_connection     (struct connection *cn);
+void   close_connection       (struct connection *cn);
+SOCKET connection_socket      (struct connection *cn);
+int    connection_local       (struct connection *cn);
+void   send_descriptor        (struct connection *cn, int fd);
+int    receive_descriptor     (struct connection *cn);
+void   flush_connection       (struct connection *cn);
+void   push_connection        (struct connection *cn);
+size_t buffered_input         (struct connection *cn);
+int    connection_ready       (struct connection *cn);
+void   send_data              (struct connection *cn, char *buf, size_t count);
+void   receive_data           (struct connection *cn, char *buf, size_t count);
+void   receive_contents       (struct connection *cn, char *buf, size_t count);
+void   send_message           (struct connection *cn, int type, int is_executable, int mtime, long long size, char *name);
+int    receive_message        (struct connection *cn, int *is_executable, int *mtime, long long *size, char *name);
+int    receive_final          (struct connection *cn);
+
+/* pack.c */
+void  pack_create    (char *file);
+void  pack_finish    (void);
+void  pack_abort     (void);
+void  pack_file_done (void);
+int   pack_enabled   (void);
+int   pack_has       (const char *path, long long size, int mtime);
+FILE *pack_add_file  (const char *path, long long size, int mtime, int is_executable, long long *base);
+void  pack_add_dir   (const char *path);
+FILE *pack_load      (char *file, struct pack_entry **list, size_t *count);
+int   pack_is_dir    (const struct pack_entry *e);
+void  pack_list      (char *file);
+void  pack_extract   (char *file, char *dir);
+
+/* prefetch.c */
+int  prefetch_add  (DIR *dir, const char *name);
+void prefetch_stop (void);
 
 /* protocol.c */
-void send_item    (SOCKET sk, char *name);
-int  receive_item (SOCKET sk);
+void      protocol_setup (const char *dir, char *buffer);
+void      protocol_reset (void);
+void      send_pack      (struct connection *cn, char *pack, char **items, int count);
+void      send_end       (struct connection *cn);
+void      confirm_end    (struct connection *cn);
+void      fetch_index    (struct connection *cn);
+void      fetch_rules    (struct connection *cn);
+void      send_item      (struct connection *cn, char *name);
+void      send_changed   (struct connection *cn, const char *item, const char *sub);
+void      end_changes    (struct connection *cn);
+long long send_follow    (struct connection *cn, char *sname, long long size, int mtime, int is_executable);
+long long send_appended  (struct connection *cn, char *sname, FILE *file, long long offset, long long size, int mtime);
+void      send_slices    (struct connection *cn);
+int       receive_item   (struct connection *cn);
+
+/* replay.c */
+void replay_record    (struct connection *cn, const char *file, int contents);
+void replay_bytes     (struct connection *cn, const char *buf, size_t count, int is_contents);
+void replay_sent      (struct connection *cn, const char *buf, size_t count);
+int  replay_recording (struct connection *cn);
+int  replay_playing   (struct connection *cn);
+void replay_stop      (struct connection *cn);
+void replay_open      (struct connection *cn, const char *file);
+
+/* resume.c */
+void resume_setup (struct connection *cn, int server, unsigned short port);
+
+/* sparse.c */
+int  is_zero   (const char *buf, size_t count);
+void next_data (FILE *file, long long offset, long long size, long long *start, long long *end);
+
+/* verify.c */
+int  verify_compare (struct connection *cn, char *dir);
+void verify_answer  (struct connection *cn, char *dir);
+
+/* stream.c */
+void send_stream    (struct connection *cn);
+void receive_stream (struct connection *cn);
+
+/* watch.c */
+void watch_start (char **items, int count);
+void watch_run   (struct connection *cn);
+
+/* writeback.c */
+void writeback_setup   (FILE *file);
+void writeback_begin   (FILE *file, long long offset, long long end, int prealloc);
+void writeback_written (size_t count);
+void writeback_end     (void);
 
 /* util.c */
 char *safename  (char *path);
+int   safepath  (char *out, const char *item, const char *sub);
 void  error     (char *msg, ...);
 void  fatal     (char *msg, ...);
+void  fail      (int code, char *msg, ...);
+void  fail_trap (struct failure *f);
 void  help      (char *argv0);
 /* fseeko() also implemented, but only in HASEFROCH */
 
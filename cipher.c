@@ -0,0 +1,1122 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                         CONNECTION ENCRYPTION                              */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * With -k on both ends, everything the connection carries is encrypted and
+ * authenticated with a pre-shared key: the SHA-256 of the key file contents.
+ * It sits in net.c, between the buffering and the transport, so it works the
+ * same over TCP, multipath and resumable sessions.
+ *
+ * SETTING UP
+ *
+ * Right after connecting, the client sends a REQUEST_CRYPT with a random salt
+ * (in hex) in the name, and in the size the ciphers it runs fast.  The server
+ * answers another one with its own salt and the cipher chosen:
+ *
+ *   - AES-256-GCM, if both ends have AES-NI and PCLMULQDQ.
+ *   - ChaCha20-Poly1305 otherwise, plain C and fast everywhere.
+ *
+ * Each direction has its own key, HMAC-SHA256 of the pre-shared key and both
+ * salts, so no session, nor direction, ever uses the same key and nonce twice.
+ * A peer with another key is found out by the first record it sends.
+ *
+ * RECORDS
+ *
+ * From then on the bytes go in records of CIPHER_RECORD bytes at most: the
+ * length (32 bits, also authenticated), the ciphertext and a 16 byte tag.  The
+ * nonce is the number of records sent before in that direction, so records
+ * cannot be dropped, repeated nor reordered unnoticed.  Large records keep the
+ * cost per byte near that of a copy: the output buffer and large sends are
+ * sealed a block at a time, and a record that fits where the caller wants it
+ * is opened right there, without going through a buffer.
+ */
+#include "canute.h"
+
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+#define CIPHER_AESNI
+#define AESNI __attribute__((target("aes,pclmul,sse4.1")))
+#endif
+
+#define CIPHER_AESGCM  1      /* Suites, as bits of the client offer */
+#define CIPHER_CHACHA  2
+#define CIPHER_RECORD  CANUTE_BLOCK_SIZE  /* Most plaintext per record */
+#define CIPHER_HEADER  4      /* Record header: plaintext length */
+#define CIPHER_TAG     16
+#define CIPHER_SALT    16
+#define CIPHER_RAW     NET_BUFFER         /* Records read ahead */
+#define CIPHER_KEY_MAX 4096   /* Longest key file */
+#define CIPHER_WAIT    5      /* s the server waits for the client offer */
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+        a += b;  d ^= a;  d = ROTL32(d, 16); \
+        c += d;  b ^= c;  b = ROTL32(b, 12); \
+        a += b;  d ^= a;  d = ROTL32(d, 8);  \
+        c += d;  b ^= c;  b = ROTL32(b, 7)
+
+/*
+ * Keys and nonce of one direction.
+ */
+struct sealing
+{
+        unsigned char key[32];        /* ChaCha20 */
+        unsigned char rk[15 * 16];    /* AES-256 round keys */
+        unsigned char hp[4][16];      /* GHASH: H to H^4, byte swapped */
+        uint64_t      seq;            /* Records so far, the nonce */
+};
+
+struct cipher
+{
+        int            suite;
+        struct sealing out, in;
+        char          *rec;           /* Record being sent */
+        char          *raw;           /* Records received, CIPHER_RAW */
+        size_t         raw_pos, raw_fill;
+        char          *plain;         /* A record bigger than asked for */
+        size_t         plain_pos, plain_fill;
+};
+
+/*
+ * Poly1305 running state, 26 bit limbs.
+ */
+struct poly1305
+{
+        uint32_t      r[5], h[5], pad[4];
+        unsigned char buf[16];
+        size_t        used;
+};
+
+
+/*************************  PRIVATE DATA (Both ends)  *************************/
+
+static THREAD_LOCAL unsigned char master[HASH_SIZE];
+static THREAD_LOCAL int           keyed = 0;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * get_le32
+ *
+ * A little endian 32 bit number.
+ */
+static uint32_t get_le32 (const unsigned char *p)
+{
+        return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16
+               | (uint32_t) p[3] << 24;
+}
+
+
+/*
+ * put_le32
+ *
+ * Store a 32 bit number, little endian.
+ */
+static void put_le32 (unsigned char *p, uint32_t v)
+{
+        p[0] = (unsigned char) v;
+        p[1] = (unsigned char) (v >> 8);
+        p[2] = (unsigned char) (v >> 16);
+        p[3] = (unsigned char) (v >> 24);
+}
+
+
+/*
+ * chacha_block
+ *
+ * The ChaCha20 key stream block number counter for a key and nonce.
+ */
+static void chacha_block (const unsigned char *key, const unsigned char *nonce,
+                          uint32_t counter, unsigned char *out)
+{
+        uint32_t s[16], x[16];
+        int      i;
+
+        s[0] = 0x61707865;
+        s[1] = 0x3320646e;
+        s[2] = 0x79622d32;
+        s[3] = 0x6b206574;
+        for (i = 0;  i < 8;  i++)
+                s[4 + i] = get_le32(key + 4 * i);
+        s[12] = counter;
+        s[13] = get_le32(nonce);
+        s[14] = get_le32(nonce + 4);
+        s[15] = get_le32(nonce + 8);
+
+        memcpy(x, s, sizeof(x));
+        for (i = 0;  i < 10;  i++)
+        {
+                QUARTER(x[0], x[4], x[8],  x[12]);
+                QUARTER(x[1], x[5], x[9],  x[13]);
+                QUARTER(x[2], x[6], x[10], x[14]);
+                QUARTER(x[3], x[7], x[11], x[15]);
+                QUARTER(x[0], x[5], x[10], x[15]);
+                QUARTER(x[1], x[6], x[11], x[12]);
+                QUARTER(x[2], x[7], x[8],  x[13]);
+                QUARTER(x[3], x[4], x[9],  x[14]);
+        }
+        for (i = 0;  i < 16;  i++)
+                put_le32(out + 4 * i, x[i] + s[i]);
+}
+
+
+/*
+ * chacha_xor
+ *
+ * XOR count bytes with the ChaCha20 key stream from block 1 on.
+ */
+static void chacha_xor (const unsigned char *key, const unsigned char *nonce,
+                        unsigned char *out, const unsigned char *in,
+                        size_t count)
+{
+        unsigned char ks[64];
+        uint32_t      counter = 1;
+        uint64_t      a, b;
+        size_t        i, n;
+
+        while (count > 0)
+        {
+                chacha_block(key, nonce, counter++, ks);
+                n = (count < 64 ? count : 64);
+                if (n == 64)
+                        for (i = 0;  i < 64;  i += 8)
+                        {
+                                memcpy(&a, in + i, 8);
+                                memcpy(&b, ks + i, 8);
+                                a ^= b;
+                                memcpy(out + i, &a, 8);
+                        }
+                else
+                        for (i = 0;  i < n;  i++)
+                                out[i] = in[i] ^ ks[i];
+                in    += n;
+                out   += n;
+                count -= n;
+        }
+}
+
+
+/*
+ * poly_init
+ *
+ * Start a Poly1305 MAC with a one time key.
+ */
+static void poly_init (struct poly1305 *p, const unsigned char *key)
+{
+        int i;
+
+        p->r[0] = get_le32(key) & 0x3ffffff;
+        p->r[1] = (get_le32(key + 3) >> 2) & 0x3ffff03;
+        p->r[2] = (get_le32(key + 6) >> 4) & 0x3ffc0ff;
+        p->r[3] = (get_le32(key + 9) >> 6) & 0x3f03fff;
+        p->r[4] = (get_le32(key + 12) >> 8) & 0x00fffff;
+        for (i = 0;  i < 5;  i++)
+                p->h[i] = 0;
+        for (i = 0;  i < 4;  i++)
+                p->pad[i] = get_le32(key + 16 + 4 * i);
+        p->used = 0;
+}
+
+
+/*
+ * poly_blocks
+ *
+ * Take whole 16 byte blocks.  hibit is 1 << 24, but for a last short block
+ * already padded.
+ */
+static void poly_blocks (struct poly1305 *p, const unsigned char *m,
+                         size_t count, uint32_t hibit)
+{
+        uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3];
+        uint32_t r4 = p->r[4], s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5;
+        uint32_t s4 = r4 * 5, c;
+        uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3];
+        uint32_t h4 = p->h[4];
+        uint64_t d0, d1, d2, d3, d4;
+
+        for (;  count >= 16;  m += 16, count -= 16)
+        {
+                h0 += get_le32(m) & 0x3ffffff;
+                h1 += (get_le32(m + 3) >> 2) & 0x3ffffff;
+                h2 += (get_le32(m + 6) >> 4) & 0x3ffffff;
+                h3 += (get_le32(m + 9) >> 6) & 0x3ffffff;
+                h4 += (get_le32(m + 12) >> 8) | hibit;
+
+                d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4
+                     + (uint64_t) h2 * s3 + (uint64_t) h3 * s2
+                     + (uint64_t) h4 * s1;
+                d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0
+                     + (uint64_t) h2 * s4 + (uint64_t) h3 * s3
+                     + (uint64_t) h4 * s2;
+                d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1
+                     + (uint64_t) h2 * r0 + (uint64_t) h3 * s4
+                     + (uint64_t) h4 * s3;
+                d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2
+                     + (uint64_t) h2 * r1 + (uint64_t) h3 * r0
+                     + (uint64_t) h4 * s4;
+                d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3
+                     + (uint64_t) h2 * r2 + (uint64_t) h3 * r1
+                     + (uint64_t) h4 * r0;
+
+                c  = (uint32_t) (d0 >> 26);  h0 = (uint32_t) d0 & 0x3ffffff;
+                d1 += c;
+                c  = (uint32_t) (d1 >> 26);  h1 = (uint32_t) d1 & 0x3ffffff;
+                d2 += c;
+                c  = (uint32_t) (d2 >> 26);  h2 = (uint32_t) d2 & 0x3ffffff;
+                d3 += c;
+                c  = (uint32_t) (d3 >> 26);  h3 = (uint32_t) d3 & 0x3ffffff;
+                d4 += c;
+                c  = (uint32_t) (d4 >> 26);  h4 = (uint32_t) d4 & 0x3ffffff;
+                h0 += c * 5;
+                c  = h0 >> 26;  h0 &= 0x3ffffff;
+                h1 += c;
+        }
+        p->h[0] = h0;
+        p->h[1] = h1;
+        p->h[2] = h2;
+        p->h[3] = h3;
+        p->h[4] = h4;
+}
+
+
+/*
+ * poly_update
+ *
+ * Take count more bytes of the message.
+ */
+static void poly_update (struct poly1305 *p, const unsigned char *m,
+                         size_t count)
+{
+        size_t n;
+
+        if (p->used > 0)
+        {
+                n = 16 - p->used;
+                n = (n < count ? n : count);
+                memcpy(p->buf + p->used, m, n);
+                p->used += n;
+                m       += n;
+                count   -= n;
+                if (p->used < 16)
+                        return;
+                poly_blocks(p, p->buf, 16, 1 << 24);
+                p->used = 0;
+        }
+        n = count & ~(size_t) 15;
+        poly_blocks(p, m, n, 1 << 24);
+        memcpy(p->buf, m + n, count - n);
+        p->used = count - n;
+}
+
+
+/*
+ * poly_pad
+ *
+ * Zeros up to the next 16 byte boundary, as ChaCha20-Poly1305 does.
+ */
+static void poly_pad (struct poly1305 *p)
+{
+        if (p->used == 0)
+                return;
+        memset(p->buf + p->used, 0, 16 - p->used);
+        poly_blocks(p, p->buf, 16, 1 << 24);
+        p->used = 0;
+}
+
+
+/*
+ * poly_finish
+ *
+ * The MAC of the message taken, a multiple of 16 bytes long here.
+ */
+static void poly_finish (struct poly1305 *p, unsigned char *mac)
+{
+        uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3];
+        uint32_t h4 = p->h[4], g0, g1, g2, g3, g4, c, mask;
+        uint64_t f;
+
+        c = h1 >> 26;  h1 &= 0x3ffffff;
+        h2 += c;  c = h2 >> 26;  h2 &= 0x3ffffff;
+        h3 += c;  c = h3 >> 26;  h3 &= 0x3ffffff;
+        h4 += c;  c = h4 >> 26;  h4 &= 0x3ffffff;
+        h0 += c * 5;  c = h0 >> 26;  h0 &= 0x3ffffff;
+        h1 += c;
+
+        /* h - p, taken if h is not below p */
+        g0 = h0 + 5;  c = g0 >> 26;  g0 &= 0x3ffffff;
+        g1 = h1 + c;  c = g1 >> 26;  g1 &= 0x3ffffff;
+        g2 = h2 + c;  c = g2 >> 26;  g2 &= 0x3ffffff;
+        g3 = h3 + c;  c = g3 >> 26;  g3 &= 0x3ffffff;
+        g4 = h4 + c - (1UL << 26);
+        mask = (g4 >> 31) - 1;
+        h0 = (h0 & ~mask) | (g0 & mask);
+        h1 = (h1 & ~mask) | (g1 & mask);
+        h2 = (h2 & ~mask) | (g2 & mask);
+        h3 = (h3 & ~mask) | (g3 & mask);
+        h4 = (h4 & ~mask) | (g4 & mask);
+
+        h0 = h0 | (h1 << 26);
+        h1 = (h1 >> 6) | (h2 << 20);
+        h2 = (h2 >> 12) | (h3 << 14);
+        h3 = (h3 >> 18) | (h4 << 8);
+
+        f = (uint64_t) h0 + p->pad[0];
+        put_le32(mac, (uint32_t) f);
+        f = (uint64_t) h1 + p->pad[1] + (f >> 32);
+        put_le32(mac + 4, (uint32_t) f);
+        f = (uint64_t) h2 + p->pad[2] + (f >> 32);
+        put_le32(mac + 8, (uint32_t) f);
+        f = (uint64_t) h3 + p->pad[3] + (f >> 32);
+        put_le32(mac + 12, (uint32_t) f);
+}
+
+
+/*
+ * chacha_aead
+ *
+ * ChaCha20-Poly1305 (RFC 8439) of count bytes, in place or not, with the
+ * record header as additional data.  Fill tag, the one computed when opening.
+ */
+static void chacha_aead (const struct sealing *s, const unsigned char *nonce,
+                         const unsigned char *aad, unsigned char *out,
+                         const unsigned char *in, size_t count,
+                         unsigned char *tag, int sealing)
+{
+        struct poly1305 p;
+        unsigned char   block[64];
+
+        chacha_block(s->key, nonce, 0, block);
+        poly_init(&p, block);
+        poly_update(&p, aad, CIPHER_HEADER);
+        poly_pad(&p);
+        if (!sealing)
+                poly_update(&p, in, count);
+        chacha_xor(s->key, nonce, out, in, count);
+        if (sealing)
+                poly_update(&p, out, count);
+        poly_pad(&p);
+
+        memset(block, 0, 16);
+        put_le32(block, CIPHER_HEADER);
+        put_le32(block + 8, (uint32_t) count);
+        poly_update(&p, block, 16);
+        poly_finish(&p, tag);
+}
+
+
+#ifdef CIPHER_AESNI
+#define BSWAP128 _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, \
+                              14, 15)
+
+/*
+ * aesni_available
+ *
+ * True if the CPU has the instructions AES-256-GCM needs here.
+ */
+static int aesni_available (void)
+{
+        unsigned int a, b, c, d;
+
+        if (!__get_cpuid(1, &a, &b, &c, &d))
+                return 0;
+        return (c & bit_AES) && (c & bit_PCLMUL) && (c & bit_SSE4_1);
+}
+
+
+/*
+ * gfmul
+ *
+ * Product in GF(2^128) of two GHASH values, byte swapped (see Intel's
+ * "Carry-Less Multiplication and Its Usage for Computing the GCM Mode").
+ */
+static AESNI __m128i gfmul (__m128i a, __m128i b)
+{
+        __m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+        t3 = _mm_clmulepi64_si128(a, b, 0x00);
+        t4 = _mm_clmulepi64_si128(a, b, 0x10);
+        t5 = _mm_clmulepi64_si128(a, b, 0x01);
+        t6 = _mm_clmulepi64_si128(a, b, 0x11);
+        t4 = _mm_xor_si128(t4, t5);
+        t5 = _mm_slli_si128(t4, 8);
+        t4 = _mm_srli_si128(t4, 8);
+        t3 = _mm_xor_si128(t3, t5);
+        t6 = _mm_xor_si128(t6, t4);
+
+        /* The product is bit reflected, shift it left one bit */
+        t7 = _mm_srli_epi32(t3, 31);
+        t8 = _mm_srli_epi32(t6, 31);
+        t3 = _mm_slli_epi32(t3, 1);
+        t6 = _mm_slli_epi32(t6, 1);
+        t9 = _mm_srli_si128(t7, 12);
+        t8 = _mm_slli_si128(t8, 4);
+        t7 = _mm_slli_si128(t7, 4);
+        t3 = _mm_or_si128(t3, t7);
+        t6 = _mm_or_si128(t6, t8);
+        t6 = _mm_or_si128(t6, t9);
+
+        /* Reduce modulo x^128 + x^7 + x^2 + x + 1 */
+        t7 = _mm_slli_epi32(t3, 31);
+        t8 = _mm_slli_epi32(t3, 30);
+        t9 = _mm_slli_epi32(t3, 25);
+        t7 = _mm_xor_si128(t7, t8);
+        t7 = _mm_xor_si128(t7, t9);
+        t8 = _mm_srli_si128(t7, 4);
+        t7 = _mm_slli_si128(t7, 12);
+        t3 = _mm_xor_si128(t3, t7);
+        t2 = _mm_srli_epi32(t3, 1);
+        t4 = _mm_srli_epi32(t3, 2);
+        t5 = _mm_srli_epi32(t3, 7);
+        t2 = _mm_xor_si128(t2, t4);
+        t2 = _mm_xor_si128(t2, t5);
+        t2 = _mm_xor_si128(t2, t8);
+        t3 = _mm_xor_si128(t3, t2);
+        return _mm_xor_si128(t6, t3);
+}
+
+
+/*
+ * expand_assist
+ *
+ * One step of the AES-256 key expansion, t being the key generation assist
+ * result already spread over the four words.
+ */
+static AESNI __m128i expand_assist (__m128i k, __m128i t)
+{
+        k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+        k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+        k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+        return _mm_xor_si128(k, t);
+}
+
+#define EXPAND_PAIR(i, rcon) \
+        a = expand_assist(a, _mm_shuffle_epi32( \
+                _mm_aeskeygenassist_si128(b, rcon), 0xff)); \
+        _mm_storeu_si128((__m128i *) (s->rk + 16 * (i)), a); \
+        if ((i) < 14) \
+        { \
+                b = expand_assist(b, _mm_shuffle_epi32( \
+                        _mm_aeskeygenassist_si128(a, 0), 0xaa)); \
+                _mm_storeu_si128((__m128i *) (s->rk + 16 * ((i) + 1)), b); \
+        }
+
+/*
+ * aes_encrypt
+ *
+ * A single block, with the round keys loaded.
+ */
+static AESNI __m128i aes_encrypt (const __m128i *k, __m128i x)
+{
+        int i;
+
+        x = _mm_xor_si128(x, k[0]);
+        for (i = 1;  i < 14;  i++)
+                x = _mm_aesenc_si128(x, k[i]);
+        return _mm_aesenclast_si128(x, k[14]);
+}
+
+
+/*
+ * gcm_key
+ *
+ * Expand an AES-256 key, and work out the powers of H GHASH uses.
+ */
+static AESNI void gcm_key (struct sealing *s, const unsigned char *key)
+{
+        __m128i a, b, k[15], h, p;
+        int     i;
+
+        a = _mm_loadu_si128((const __m128i *) key);
+        b = _mm_loadu_si128((const __m128i *) (key + 16));
+        _mm_storeu_si128((__m128i *) s->rk, a);
+        _mm_storeu_si128((__m128i *) (s->rk + 16), b);
+        EXPAND_PAIR(2, 0x01);
+        EXPAND_PAIR(4, 0x02);
+        EXPAND_PAIR(6, 0x04);
+        EXPAND_PAIR(8, 0x08);
+        EXPAND_PAIR(10, 0x10);
+        EXPAND_PAIR(12, 0x20);
+        EXPAND_PAIR(14, 0x40);
+
+        for (i = 0;  i < 15;  i++)
+                k[i] = _mm_loadu_si128((const __m128i *) (s->rk + 16 * i));
+        h = _mm_shuffle_epi8(aes_encrypt(k, _mm_setzero_si128()), BSWAP128);
+        p = h;
+        for (i = 0;  i < 4;  i++)
+        {
+                _mm_storeu_si128((__m128i *) s->hp[i], p);
+                p = gfmul(p, h);
+        }
+}
+
+
+/*
+ * gcm_aead
+ *
+ * AES-256-GCM of count bytes, in place or not, with the record header as
+ * additional data.  Fill tag, the one computed when opening.  Four blocks go
+ * at a time, so the AES and GHASH instructions overlap.
+ */
+static AESNI void gcm_aead (const struct sealing *s,
+                            const unsigned char *nonce,
+                            const unsigned char *aad, unsigned char *out,
+                            const unsigned char *in, size_t count,
+                            unsigned char *tag, int sealing)
+{
+        const __m128i bswap = BSWAP128;
+        __m128i       k[15], h1, h2, h3, h4, x, base, j0, c[4], d[4];
+        unsigned char last[16];
+        uint32_t      n = 2;
+        size_t        i, left, total = count;
+        int           r;
+
+        for (i = 0;  i < 15;  i++)
+                k[i] = _mm_loadu_si128((const __m128i *) (s->rk + 16 * i));
+        h1 = _mm_loadu_si128((const __m128i *) s->hp[0]);
+        h2 = _mm_loadu_si128((const __m128i *) s->hp[1]);
+        h3 = _mm_loadu_si128((const __m128i *) s->hp[2]);
+        h4 = _mm_loadu_si128((const __m128i *) s->hp[3]);
+
+        memset(last, 0, 16);
+        memcpy(last, nonce, 12);
+        base = _mm_loadu_si128((const __m128i *) last);
+        j0   = _mm_insert_epi32(base, (int) __builtin_bswap32(1), 3);
+
+        memset(last, 0, 16);
+        memcpy(last, aad, CIPHER_HEADER);
+        x = gfmul(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) last),
+                                   bswap), h1);
+
+        for (;  count >= 64;  count -= 64, in += 64, out += 64)
+        {
+                for (i = 0;  i < 4;  i++)
+                {
+                        c[i] = _mm_insert_epi32(base,
+                                                (int) __builtin_bswap32(n++),
+                                                3);
+                        c[i] = _mm_xor_si128(c[i], k[0]);
+                        d[i] = _mm_loadu_si128((const __m128i *) in + i);
+                }
+                for (r = 1;  r < 14;  r++)
+                {
+                        c[0] = _mm_aesenc_si128(c[0], k[r]);
+                        c[1] = _mm_aesenc_si128(c[1], k[r]);
+                        c[2] = _mm_aesenc_si128(c[2], k[r]);
+                        c[3] = _mm_aesenc_si128(c[3], k[r]);
+                }
+                for (i = 0;  i < 4;  i++)
+                {
+                        c[i] = _mm_xor_si128(_mm_aesenclast_si128(c[i], k[14]),
+                                             d[i]);
+                        _mm_storeu_si128((__m128i *) out + i, c[i]);
+                        if (sealing)
+                                d[i] = c[i];
+                        d[i] = _mm_shuffle_epi8(d[i], bswap);
+                }
+                x = _mm_xor_si128(gfmul(_mm_xor_si128(x, d[0]), h4),
+                                  gfmul(d[1], h3));
+                x = _mm_xor_si128(x, gfmul(d[2], h2));
+                x = _mm_xor_si128(x, gfmul(d[3], h1));
+        }
+
+        for (;  count > 0;  count -= left, in += left, out += left)
+        {
+                left = (count < 16 ? count : 16);
+                memset(last, 0, 16);
+                memcpy(last, in, left);
+                d[0] = _mm_loadu_si128((const __m128i *) last);
+                c[0] = _mm_insert_epi32(base, (int) __builtin_bswap32(n++), 3);
+                c[0] = _mm_xor_si128(aes_encrypt(k, c[0]), d[0]);
+                _mm_storeu_si128((__m128i *) last, c[0]);
+                memcpy(out, last, left);
+                if (sealing)
+                {
+                        memset(last + left, 0, 16 - left);
+                        d[0] = _mm_loadu_si128((const __m128i *) last);
+                }
+                x = gfmul(_mm_xor_si128(x, _mm_shuffle_epi8(d[0], bswap)), h1);
+        }
+
+        /* Lengths in bits, additional data first (swapped, so last) */
+        d[0] = _mm_set_epi64x((long long) CIPHER_HEADER * 8,
+                              (long long) total * 8);
+        x    = gfmul(_mm_xor_si128(x, d[0]), h1);
+        x = _mm_xor_si128(_mm_shuffle_epi8(x, bswap), aes_encrypt(k, j0));
+        _mm_storeu_si128((__m128i *) tag, x);
+}
+#endif /* CIPHER_AESNI */
+
+
+/*
+ * seal
+ *
+ * Make a record of count bytes (CIPHER_RECORD at most) in rec.  Return its
+ * size.
+ */
+static size_t seal (struct cipher *c, char *rec, const char *data,
+                    size_t count)
+{
+        unsigned char  nonce[12], *r = (unsigned char *) rec;
+        struct sealing *s = &c->out;
+
+        r[0] = (unsigned char) (count >> 24);
+        r[1] = (unsigned char) (count >> 16);
+        r[2] = (unsigned char) (count >> 8);
+        r[3] = (unsigned char) count;
+        memset(nonce, 0, 4);
+        put_le32(nonce + 4, (uint32_t) s->seq);
+        put_le32(nonce + 8, (uint32_t) (s->seq >> 32));
+        s->seq++;
+#ifdef CIPHER_AESNI
+        if (c->suite == CIPHER_AESGCM)
+                gcm_aead(s, nonce, r, r + CIPHER_HEADER,
+                         (const unsigned char *) data, count,
+                         r + CIPHER_HEADER + count, 1);
+        else
+#endif
+                chacha_aead(s, nonce, r, r + CIPHER_HEADER,
+                            (const unsigned char *) data, count,
+                            r + CIPHER_HEADER + count, 1);
+        return CIPHER_HEADER + count + CIPHER_TAG;
+}
+
+
+/*
+ * open_record
+ *
+ * Decrypt the record at rec, count bytes of data, into out.  Fail if it is not
+ * authentic.
+ */
+static void open_record (struct cipher *c, char *out, const char *rec,
+                         size_t count)
+{
+        unsigned char   nonce[12], tag[CIPHER_TAG], diff = 0;
+        const unsigned char *r = (const unsigned char *) rec;
+        struct sealing *s = &c->in;
+        int             i;
+
+        memset(nonce, 0, 4);
+        put_le32(nonce + 4, (uint32_t) s->seq);
+        put_le32(nonce + 8, (uint32_t) (s->seq >> 32));
+        s->seq++;
+#ifdef CIPHER_AESNI
+        if (c->suite == CIPHER_AESGCM)
+                gcm_aead(s, nonce, r, (unsigned char *) out,
+                         r + CIPHER_HEADER, count, tag, 0);
+        else
+#endif
+                chacha_aead(s, nonce, r, (unsigned char *) out,
+                            r + CIPHER_HEADER, count, tag, 0);
+
+        for (i = 0;  i < CIPHER_TAG;  i++)
+                diff |= tag[i] ^ r[CIPHER_HEADER + count + i];
+        if (diff != 0)
+        {
+                errno = 0;
+                fail(CANUTE_EPROTO, "Data not authentic (wrong key?)");
+        }
+}
+
+
+/*
+ * hmac
+ *
+ * HMAC-SHA256 of count bytes, with a key of HASH_SIZE bytes.
+ */
+static void hmac (const unsigned char *key, const unsigned char *msg,
+                  size_t count, unsigned char *out)
+{
+        struct sha256 ctx;
+        unsigned char pad[64], inner[HASH_SIZE];
+        int           i;
+
+        memset(pad, 0, sizeof(pad));
+        memcpy(pad, key, HASH_SIZE);
+        for (i = 0;  i < 64;  i++)
+                pad[i] ^= 0x36;
+        sha256_init(&ctx);
+        sha256_update(&ctx, pad, 64);
+        sha256_update(&ctx, msg, count);
+        sha256_final(&ctx, inner);
+
+        for (i = 0;  i < 64;  i++)
+                pad[i] ^= 0x36 ^ 0x5c;
+        sha256_init(&ctx);
+        sha256_update(&ctx, pad, 64);
+        sha256_update(&ctx, inner, HASH_SIZE);
+        sha256_final(&ctx, out);
+}
+
+
+/*
+ * set_key
+ *
+ * Derive the key of a direction ("client" or "server", the end sending) from
+ * the pre-shared one and both salts, and set the suite up with it.
+ */
+static void set_key (struct cipher *c, struct sealing *s, const char *end,
+                     const unsigned char *salts)
+{
+        unsigned char msg[2 * CIPHER_SALT + 16], key[HASH_SIZE];
+
+        memcpy(msg, salts, 2 * CIPHER_SALT);
+        snprintf((char *) msg + 2 * CIPHER_SALT, 16, "%s %d", end, c->suite);
+        hmac(master, msg, 2 * CIPHER_SALT + strlen(end) + 2, key);
+        memcpy(s->key, key, sizeof(key));
+#ifdef CIPHER_AESNI
+        if (c->suite == CIPHER_AESGCM)
+                gcm_key(s, key);
+#endif
+        s->seq = 0;
+}
+
+
+/*
+ * random_salt
+ *
+ * CIPHER_SALT bytes nobody can guess, as hex text in hex.
+ */
+static void random_salt (unsigned char *salt, char *hex)
+{
+        struct sha256 ctx;
+        unsigned char digest[HASH_SIZE];
+        time_t        now;
+        clock_t       ticks;
+        FILE         *f;
+        int           i;
+
+        f = fopen("/dev/urandom", "rb");
+        if (f == NULL || fread(salt, 1, CIPHER_SALT, f) != CIPHER_SALT)
+        {
+                /* Unique at least, which is what the keys need */
+                now   = time(NULL);
+                ticks = clock();
+                sha256_init(&ctx);
+                sha256_update(&ctx, &now, sizeof(now));
+                sha256_update(&ctx, &ticks, sizeof(ticks));
+                sha256_update(&ctx, &f, sizeof(f));
+                sha256_update(&ctx, &ctx, sizeof(ctx));
+                sha256_final(&ctx, digest);
+                memcpy(salt, digest, CIPHER_SALT);
+        }
+        if (f != NULL)
+                fclose(f);
+        for (i = 0;  i < CIPHER_SALT;  i++)
+                sprintf(hex + 2 * i, "%02x", salt[i]);
+}
+
+
+/*
+ * parse_salt
+ *
+ * The salt in hex text.  Return false if it is not one.
+ */
+static int parse_salt (const char *hex, unsigned char *salt)
+{
+        unsigned int b;
+        int          i;
+
+        if (strlen(hex) != 2 * CIPHER_SALT)
+                return 0;
+        for (i = 0;  i < CIPHER_SALT;  i++)
+        {
+                if (sscanf(hex + 2 * i, "%2x", &b) != 1)
+                        return 0;
+                salt[i] = (unsigned char) b;
+        }
+        return 1;
+}
+
+
+/*
+ * offer_waiting
+ *
+ * Server side: wait up to CIPHER_WAIT seconds for the client offer.  Other
+ * transports than sockets cannot tell, and it is read right away.
+ */
+static int offer_waiting (struct connection *cn)
+{
+        SOCKET         sk = connection_socket(cn);
+        fd_set         set;
+        struct timeval tv;
+
+        if (buffered_input(cn) > 0 || sk == INVALID_SOCKET)
+                return 1;
+        FD_ZERO(&set);
+        FD_SET(sk, &set);
+        tv.tv_sec  = CIPHER_WAIT;
+        tv.tv_usec = 0;
+        return select((int) sk + 1, &set, NULL, NULL, &tv) == 1;
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * cipher_key
+ *
+ * Take the pre-shared key from a file (-k).
+ */
+void cipher_key (const char *file)
+{
+        struct sha256 ctx;
+        unsigned char buf[CIPHER_KEY_MAX];
+        size_t        n;
+        FILE         *f;
+
+        f = fopen(file, "rb");
+        if (f == NULL)
+                fatal("Cannot open key file '%s'", file);
+        n = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        if (n < 16)
+        {
+                errno = 0;
+                fatal("Key file '%s' too short (16 bytes at least)", file);
+        }
+        sha256_init(&ctx);
+        sha256_update(&ctx, buf, n);
+        sha256_final(&ctx, master);
+        memset(buf, 0, sizeof(buf));
+        keyed = 1;
+}
+
+
+/*
+ * cipher_enabled
+ *
+ * True if there is a pre-shared key.
+ */
+int cipher_enabled (void)
+{
+        return keyed;
+}
+
+
+/*
+ * cipher_setup
+ *
+ * Agree on salts and cipher with the peer, as the server or as the client, and
+ * encrypt the connection from then on.  Both ends must do so.
+ */
+void cipher_setup (struct connection *cn, int server)
+{
+        struct cipher *c;
+        unsigned char  salts[2 * CIPHER_SALT];
+        char           hex[CANUTE_NAME_LENGTH + 1];
+        long long      size;
+        int            fast = CIPHER_CHACHA;
+        size_t         n;
+
+#ifdef CIPHER_AESNI
+        if (aesni_available())
+                fast |= CIPHER_AESGCM;
+#endif
+        c = calloc(1, sizeof(struct cipher));
+        if (c == NULL || (c->rec = malloc(CIPHER_HEADER + CIPHER_RECORD
+                                          + CIPHER_TAG)) == NULL
+            || (c->raw = malloc(CIPHER_RAW)) == NULL
+            || (c->plain = malloc(CIPHER_RECORD)) == NULL)
+                fail(CANUTE_ENOMEM, "Allocating cipher buffers");
+
+        if (server)
+        {
+                /* A client without -k may be waiting as well */
+                if (!offer_waiting(cn)
+                    || receive_message(cn, NULL, NULL, &size, hex)
+                       != REQUEST_CRYPT
+                    || !parse_salt(hex, salts))
+                {
+                        errno = 0;
+                        fail(CANUTE_EPROTO, "The peer does not encrypt");
+                }
+                c->suite = ((size & fast & CIPHER_AESGCM) ? CIPHER_AESGCM
+                                                          : CIPHER_CHACHA);
+                random_salt(salts + CIPHER_SALT, hex);
+                send_message(cn, REQUEST_CRYPT, 0, 0, c->suite, hex);
+                push_connection(cn);
+                set_key(c, &c->out, "server", salts);
+                set_key(c, &c->in, "client", salts);
+        }
+        else
+        {
+                random_salt(salts, hex);
+                send_message(cn, REQUEST_CRYPT, 0, 0, fast, hex);
+                push_connection(cn);
+                if (receive_message(cn, NULL, NULL, &size, hex)
+                    != REQUEST_CRYPT || !(size & fast)
+                    || !parse_salt(hex, salts + CIPHER_SALT))
+                {
+                        errno = 0;
+                        fail(CANUTE_EPROTO, "The peer does not encrypt");
+                }
+                c->suite = (int) size;
+                set_key(c, &c->out, "client", salts);
+                set_key(c, &c->in, "server", salts);
+        }
+        inform("--- Encrypted with %s\n", (c->suite == CIPHER_AESGCM
+                                           ? "AES-256-GCM"
+                                           : "ChaCha20-Poly1305"));
+
+        /* Records the peer sent already may have been read ahead */
+        n = buffered_input(cn);
+        memcpy(c->raw, cn->in + cn->in_pos, n);
+        c->raw_fill = n;
+        cn->in_pos  = cn->in_fill = 0;
+        cn->cipher  = c;
+}
+
+
+/*
+ * cipher_send
+ *
+ * Send count bytes through the transport, in records.  On error aborts.
+ */
+void cipher_send (struct connection *cn, const char *buf, size_t count)
+{
+        struct cipher *c = cn->cipher;
+        size_t         n, len;
+        int            s;
+
+        while (count > 0)
+        {
+                n   = (count < CIPHER_RECORD ? count : CIPHER_RECORD);
+                len = seal(c, c->rec, buf, n);
+                buf   += n;
+                count -= n;
+                for (n = 0;  n < len;  n += s)
+                {
+                        s = cn->tr->send(cn, c->rec + n, len - n);
+                        if (s == SOCKET_ERROR)
+                                fail(CANUTE_ENET, "Sending data");
+                }
+        }
+}
+
+
+/*
+ * cipher_recv
+ *
+ * Like the transport receive: up to count bytes of the next records, waiting
+ * for one if none was read yet.  Zero at the end of the stream.
+ */
+int cipher_recv (struct connection *cn, char *buf, size_t count)
+{
+        struct cipher *c = cn->cipher;
+        unsigned char *r;
+        size_t         len;
+        int            got;
+
+        for (;;)
+        {
+                if (c->plain_pos < c->plain_fill)
+                {
+                        len = c->plain_fill - c->plain_pos;
+                        len = (len < count ? len : count);
+                        memcpy(buf, c->plain + c->plain_pos, len);
+                        c->plain_pos += len;
+                        return (int) len;
+                }
+
+                /* A whole record read?  Right to the caller if it fits */
+                r = (unsigned char *) c->raw + c->raw_pos;
+                if (c->raw_fill - c->raw_pos >= CIPHER_HEADER)
+                {
+                        len = (size_t) r[0] << 24 | (size_t) r[1] << 16
+                              | (size_t) r[2] << 8 | r[3];
+                        if (len > CIPHER_RECORD)
+                        {
+                                errno = 0;
+                                fail(CANUTE_EPROTO, "Record too long");
+                        }
+                        if (c->raw_fill - c->raw_pos
+                            >= CIPHER_HEADER + len + CIPHER_TAG)
+                        {
+                                c->raw_pos += CIPHER_HEADER + len + CIPHER_TAG;
+                                if (len <= count)
+                                {
+                                        open_record(c, buf, (char *) r, len);
+                                        if (len > 0)
+                                                return (int) len;
+                                        continue;
+                                }
+                                open_record(c, c->plain, (char *) r, len);
+                                c->plain_pos  = 0;
+                                c->plain_fill = len;
+                                continue;
+                        }
+                }
+
+                /* Read more, after what is left of the last record */
+                if (c->raw_pos > 0)
+                {
+                        memmove(c->raw, c->raw + c->raw_pos,
+                                c->raw_fill - c->raw_pos);
+                        c->raw_fill -= c->raw_pos;
+                        c->raw_pos   = 0;
+                }
+                got = cn->tr->recv(cn, c->raw + c->raw_fill,
+                                   CIPHER_RAW - c->raw_fill);
+                if (got <= 0)
+                        return got;
+                c->raw_fill += got;
+        }
+}
+
+
+/*
+ * cipher_buffered
+ *
+ * True if there is something to take without waiting for the transport: data
+ * left of a record, or a whole record read ahead.
+ */
+int cipher_buffered (struct connection *cn)
+{
+        struct cipher *c = cn->cipher;
+        unsigned char *r = (unsigned char *) c->raw + c->raw_pos;
+        size_t         len;
+
+        if (c->plain_pos < c->plain_fill)
+                return 1;
+        if (c->raw_fill - c->raw_pos < CIPHER_HEADER)
+                return 0;
+        len = (size_t) r[0] << 24 | (size_t) r[1] << 16 | (size_t) r[2] << 8
+              | r[3];
+        return c->raw_fill - c->raw_pos >= CIPHER_HEADER + len + CIPHER_TAG;
+}
+
+
+/*
+ * cipher_free
+ *
+ * Forget the keys of a connection, and free its buffers.
+ */
+void cipher_free (struct connection *cn)
+{
+        struct cipher *c = cn->cipher;
+
+        if (c == NULL)
+                return;
+        memset(&c->out, 0, sizeof(c->out));
+        memset(&c->in, 0, sizeof(c->in));
+        free(c->rec);
+        free(c->raw);
+        free(c->plain);
+        free(c);
+        cn->cipher = NULL;
+}
@@ -0,0 +1,312 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                  CONTENT DEFINED CHUNKING AND CHUNK STORE                  */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * In deduplication mode the sender cuts files into chunks whose boundaries
+ * depend on the content (a rolling "gear" hash over the last bytes), so an
+ * insertion or deletion only changes the chunks around it instead of shifting
+ * every fixed size block after it.  Each chunk is identified by its SHA-256.
+ *
+ * The receiver keeps the chunks it has seen in a store that survives between
+ * sessions: a data file where chunks are appended and an index file with one
+ * record per chunk (hash, offset and length).  The index is loaded in memory
+ * when the store is opened and appended to as new chunks arrive.  Data is
+ * always written before its index record, so a crash can only lose the tail of
+ * the data file, never make the index point to garbage.
+ *
+ * Chunk boundaries are not aligned to filesystem blocks, so rebuilding a file
+ * from the store copies the data instead of reflinking it.
+ */
+#include "canute.h"
+
+#define CHUNK_MIN_SIZE   2048
+#define CHUNK_MAX_SIZE   CANUTE_BLOCK_SIZE
+#define CHUNK_MASK       0x1FFF        /* Average chunk size ~8 KiB */
+#define INDEX_RECORD     (HASH_SIZE + 12)
+
+/* In-memory index entry */
+struct chunk_entry
+{
+        unsigned char hash[HASH_SIZE];
+        long long     offset;          /* -1 for a free slot */
+        int           length;
+};
+
+
+/****************  PRIVATE DATA (Gear table and chunk store)  ****************/
+
+static THREAD_LOCAL uint64_t            gear[256];
+static THREAD_LOCAL int                 gear_ready = 0;
+static THREAD_LOCAL FILE               *store_data  = NULL;
+static THREAD_LOCAL FILE               *store_index = NULL;
+static THREAD_LOCAL long long           store_size;
+static THREAD_LOCAL struct chunk_entry *table       = NULL;
+static THREAD_LOCAL size_t              table_slots = 0;
+static THREAD_LOCAL size_t              table_used  = 0;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * init_gear
+ *
+ * The gear table must be identical on every host and every version, otherwise
+ * boundaries would move and nothing would deduplicate.  So it is generated from
+ * a fixed seed instead of relying on any platform random number generator.
+ */
+static void init_gear (void)
+{
+        uint64_t x = 0x2545F4914F6CDD1DULL;
+        int      i;
+
+        for (i = 0;  i < 256;  i++)
+        {
+                x ^= x >> 12;
+                x ^= x << 25;
+                x ^= x >> 27;
+                gear[i] = x * 2685821657736338717ULL;
+        }
+        gear_ready = 1;
+}
+
+
+/*
+ * find_slot
+ *
+ * Open addressing lookup.  Return the slot holding hash or, if not present, the
+ * free slot where it should be inserted.
+ */
+static struct chunk_entry *find_slot (const unsigned char *hash)
+{
+        size_t i;
+
+        memcpy(&i, hash, sizeof(i));  /* Already uniformly distributed */
+        i &= table_slots - 1;
+        while (table[i].offset != -1
+               && memcmp(table[i].hash, hash, HASH_SIZE) != 0)
+                i = (i + 1) & (table_slots - 1);
+        return &table[i];
+}
+
+
+/*
+ * insert_entry
+ *
+ * Add a chunk to the in-memory index, growing it to keep the load under 50%.
+ */
+static void insert_entry (const unsigned char *hash, long long offset,
+                          int length)
+{
+        struct chunk_entry *old = table, *e;
+        size_t              i, old_slots = table_slots;
+
+        if ((table_used + 1) * 2 > table_slots)
+        {
+                table_slots = (table_slots == 0 ? 4096 : table_slots * 2);
+                table       = malloc(table_slots * sizeof(struct chunk_entry));
+                if (table == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating chunk index");
+                for (i = 0;  i < table_slots;  i++)
+                        table[i].offset = -1;
+                for (i = 0;  i < old_slots;  i++)
+                        if (old[i].offset != -1)
+                                *find_slot(old[i].hash) = old[i];
+                free(old);
+        }
+
+        e = find_slot(hash);
+        if (e->offset != -1)
+                return;
+        memcpy(e->hash, hash, HASH_SIZE);
+        e->offset = offset;
+        e->length = length;
+        table_used++;
+}
+
+
+/*
+ * load_index
+ *
+ * Read every index record into memory.  Records pointing beyond the end of the
+ * data file (interrupted session) are ignored.
+ */
+static void load_index (FILE *f)
+{
+        unsigned char rec[INDEX_RECORD];
+        long long     offset;
+        int           i, length;
+
+        while (fread(rec, 1, INDEX_RECORD, f) == INDEX_RECORD)
+        {
+                offset = 0;
+                for (i = 0;  i < 8;  i++)
+                        offset = (offset << 8) | rec[HASH_SIZE + i];
+                length = (rec[HASH_SIZE + 8]  << 24) | (rec[HASH_SIZE + 9] << 16)
+                       | (rec[HASH_SIZE + 10] << 8)  |  rec[HASH_SIZE + 11];
+                if (length <= 0 || length > CHUNK_MAX_SIZE
+                    || offset + length > store_size)
+                        continue;
+                insert_entry(rec, offset, length);
+        }
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * chunk_cut
+ *
+ * Return the length of the chunk starting at buf, at most count bytes.  The
+ * caller must provide at least CHUNK_MAX_SIZE bytes unless the data ends
+ * earlier, otherwise the boundary would depend on how the file was read.
+ */
+size_t chunk_cut (const unsigned char *buf, size_t count)
+{
+        uint64_t h = 0;
+        size_t   i;
+
+        if (!gear_ready)
+                init_gear();
+
+        if (count <= CHUNK_MIN_SIZE)
+                return count;
+        if (count > CHUNK_MAX_SIZE)
+                count = CHUNK_MAX_SIZE;
+
+        /* The hash only "remembers" the last 64 bytes, so there is no need to
+         * roll it over the whole minimum size */
+        for (i = CHUNK_MIN_SIZE - 64;  i < count;  i++)
+        {
+                h = (h << 1) + gear[buf[i]];
+                if (i >= CHUNK_MIN_SIZE && (h & CHUNK_MASK) == 0)
+                        return i + 1;
+        }
+        return count;
+}
+
+
+/*
+ * store_open
+ *
+ * Open (creating it if needed) the chunk store in directory dir.
+ */
+void store_open (char *dir)
+{
+        char             path[PATH_MAX];
+        struct stat_info st;
+
+        mkdir(dir);
+
+        snprintf(path, PATH_MAX, "%s/data", dir);
+        store_data = fopen(path, "a+b");
+        if (store_data == NULL)
+                fatal("Cannot open chunk store '%s'", path);
+        store_size = (stat(path, &st) == 0 ? (long long) st.st_size : 0);
+
+        snprintf(path, PATH_MAX, "%s/index", dir);
+        store_index = fopen(path, "a+b");
+        if (store_index == NULL)
+                fatal("Cannot open chunk store '%s'", path);
+        if (fseeko(store_index, 0, SEEK_SET) == 0)
+                load_index(store_index);
+}
+
+
+/*
+ * store_close
+ *
+ * Flush and close the chunk store, if any, and forget its index.
+ */
+void store_close (void)
+{
+        if (store_data == NULL)
+                return;
+        fclose(store_data);
+        fclose(store_index);
+        store_data = store_index = NULL;
+        free(table);
+        table       = NULL;
+        table_slots = 0;
+        table_used  = 0;
+}
+
+
+/*
+ * store_lookup
+ *
+ * True if the chunk store holds the chunk with the given hash.
+ */
+int store_lookup (const unsigned char *hash)
+{
+        return table_used > 0 && find_slot(hash)->offset != -1;
+}
+
+
+/*
+ * store_read
+ *
+ * Copy a stored chunk into buf and return its length.  The chunk must be there:
+ * looked up, or added earlier in the same batch.
+ */
+int store_read (const unsigned char *hash, char *buf)
+{
+        struct chunk_entry *e;
+
+        if (!store_lookup(hash))
+        {
+                /* Its store_add() failed, and nobody else sent it */
+                errno = 0;
+                fail(CANUTE_EFILE, "Chunk missing from the chunk store");
+        }
+        e = find_slot(hash);
+        if (fseeko(store_data, (off_t) e->offset, SEEK_SET) == -1
+            || fread(buf, 1, e->length, store_data) != (size_t) e->length)
+                fatal("Reading chunk store");
+        return e->length;
+}
+
+
+/*
+ * store_add
+ *
+ * Append a new chunk to the store.  Does nothing if there is no store open or
+ * it already holds the chunk.
+ */
+void store_add (const unsigned char *hash, const char *buf, int length)
+{
+        unsigned char rec[INDEX_RECORD];
+        int           i;
+
+        if (store_data == NULL || store_lookup(hash))
+                return;
+
+        /* "a+b" mode: writes always go to the end of file.  Still, C wants a
+         * seek between reading (store_read) and writing the same stream */
+        if (fseeko(store_data, 0, SEEK_END) == -1
+            || fwrite(buf, 1, length, store_data) != (size_t) length)
+        {
+                error("Writing chunk store");
+                return;
+        }
+
+        memcpy(rec, hash, HASH_SIZE);
+        for (i = 0;  i < 8;  i++)
+                rec[HASH_SIZE + i] = (unsigned char) (store_size >> (56 - i * 8));
+        for (i = 0;  i < 4;  i++)
+                rec[HASH_SIZE + 8 + i] = (unsigned char) (length >> (24 - i * 8));
+        fflush(store_data);
+        fwrite(rec, 1, INDEX_RECORD, store_index);
+
+        insert_entry(hash, store_size, length);
+        store_size += length;
+}
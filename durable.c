@@ -0,0 +1,290 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                          RECEIVER DURABILITY POLICY                        */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * How much of what the receiver wrote must be on stable storage, and when:
+ *
+ *      none     Whatever the operating system decides (the classic behaviour)
+ *      file     Every file, and its name, before the next item is accepted
+ *      dir      Everything inside a directory before leaving it
+ *      session  Everything, once, before acknowledging the end of the session
+ *
+ * Per file syncing is the safest and the slowest with many small files.  The
+ * other two delay the wait: files are only handed to writeback when closed
+ * (sync_file_range() on Linux) and the actual syncs happen later, so the disk
+ * works while more data arrives.  With "dir", closed files stay open in a
+ * small pending list until their directory ends or the list is full.  With
+ * "session" a single syncfs() covers the whole filesystem.
+ *
+ * The receiver acknowledges REQUEST_END only after the guarantee is met, so a
+ * sender that exits successfully knows its data is safe.  A sync that fails
+ * fails the session, and the end is never acknowledged.
+ */
+#include "canute.h"
+
+#ifdef HASEFROCH
+#include <io.h>
+#else
+#include <fcntl.h>
+#endif
+
+#define DURABLE_PENDING 64  /* Files waiting for their directory to end */
+
+static const char *policy_names[] = { "none", "file", "dir", "session", NULL };
+
+static THREAD_LOCAL int pending[DURABLE_PENDING];
+static THREAD_LOCAL int pending_count = 0;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * fd_synced
+ *
+ * Data and metadata of the open file descriptor fd to stable storage.  False
+ * if that failed.
+ */
+static int fd_synced (int fd)
+{
+#ifdef HASEFROCH
+        return _commit(fd) == 0;
+#else
+        return fsync(fd) == 0 || errno == EINVAL;
+#endif
+}
+
+
+/*
+ * sync_fd
+ *
+ * Like fd_synced(), failing if the guarantee cannot be met: the end of the
+ * session must not be acknowledged then.
+ */
+static void sync_fd (int fd, const char *what)
+{
+        if (!fd_synced(fd))
+                fail(CANUTE_EFILE, "Syncing %s", what);
+}
+
+
+/*
+ * sync_dir
+ *
+ * A directory, so the names created in it survive a crash.  Not possible (nor
+ * needed, says the documentation) in Hasefroch.
+ */
+static void sync_dir (const char *dir)
+{
+#ifndef HASEFROCH
+        int fd, e;
+
+        fd = open(dir, O_RDONLY);
+        if (fd == -1)
+                fail(CANUTE_EFILE, "Opening directory '%s' to sync it", dir);
+        if (!fd_synced(fd))
+        {
+                e = errno;
+                close(fd);
+                errno = e;
+                fail(CANUTE_EFILE, "Syncing directory '%s'", dir);
+        }
+        close(fd);
+#endif
+}
+
+
+/*
+ * sync_parent
+ *
+ * The directory holding path.
+ */
+static void sync_parent (const char *path)
+{
+        char  dir[PATH_MAX];
+        char *sep;
+
+        snprintf(dir, PATH_MAX, "%s", path);
+        sep = strrchr(dir, '/');
+        if (sep == NULL)
+                strcpy(dir, ".");
+        else if (sep == dir)
+                sep[1] = '\0';
+        else
+                *sep = '\0';
+        sync_dir(dir);
+}
+
+
+/*
+ * write_behind
+ *
+ * Start writeback of a whole file without waiting for it.
+ */
+static void write_behind (int fd)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+
+/*
+ * flush_pending
+ *
+ * Sync and close every file in the pending list.  All of them are closed
+ * even if one fails to sync.
+ */
+static void flush_pending (void)
+{
+        int e = 0;
+
+        while (pending_count > 0)
+        {
+                pending_count--;
+                if (!fd_synced(pending[pending_count]) && e == 0)
+                        e = errno;
+                close(pending[pending_count]);
+        }
+        if (e != 0)
+        {
+                errno = e;
+                fail(CANUTE_EFILE, "Syncing file");
+        }
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * durable_policy
+ *
+ * Translate a policy name into a DURABLE_* value, -1 if unknown.
+ */
+int durable_policy (const char *name)
+{
+        int i;
+
+        for (i = 0;  policy_names[i] != NULL;  i++)
+                if (strcmp(name, policy_names[i]) == 0)
+                        return i;
+        return -1;
+}
+
+
+/*
+ * durable_file
+ *
+ * A file the receiver finished writing (at path) is about to be closed,
+ * already flushed.  Sync it now or schedule it, depending on the policy.
+ */
+void durable_file (FILE *file, const char *path)
+{
+        int fd;
+
+        fd = fileno(file);
+        switch (opt.durability)
+        {
+        case DURABLE_FILE:
+                sync_fd(fd, "file");
+                sync_parent(path);
+                break;
+
+        case DURABLE_DIR:
+                write_behind(fd);
+#ifdef HASEFROCH
+                sync_fd(fd, "file");
+#else
+                if (pending_count == DURABLE_PENDING)
+                        flush_pending();
+                fd = dup(fd);
+                if (fd == -1)
+                        sync_fd(fileno(file), "file");
+                else
+                        pending[pending_count++] = fd;
+#endif
+                break;
+
+        case DURABLE_SESSION:
+                write_behind(fd);
+                break;
+        }
+}
+
+
+/*
+ * durable_link
+ *
+ * The receiver made a hard link at path to a file already received, whose
+ * contents are as safe as the policy says.  Only the name is new.
+ */
+void durable_link (const char *path)
+{
+        if (opt.durability == DURABLE_FILE)
+                sync_parent(path);
+}
+
+
+/*
+ * durable_dir_end
+ *
+ * The receiver is about to leave directory dir.
+ */
+void durable_dir_end (const char *dir)
+{
+        if (opt.durability != DURABLE_DIR)
+                return;
+        flush_pending();
+        sync_dir(dir);
+}
+
+
+/*
+ * durable_session_end
+ *
+ * Meet the guarantee for everything received in the session (into dir),
+ * before the end is acknowledged.
+ */
+void durable_session_end (const char *dir)
+{
+#if defined(__linux__)
+        int fd, e;
+#endif
+
+        switch (opt.durability)
+        {
+        case DURABLE_DIR:
+                durable_dir_end(dir);
+                break;
+
+        case DURABLE_SESSION:
+#if defined(__linux__)
+                /* Unlike sync(), syncfs() tells when it fails */
+                fd = open(dir, O_RDONLY);
+                if (fd == -1)
+                        fail(CANUTE_EFILE, "Opening directory '%s' to sync it",
+                             dir);
+                if (syncfs(fd) == -1)
+                {
+                        e = errno;
+                        close(fd);
+                        errno = e;
+                        fail(CANUTE_EFILE, "Syncing the filesystem of '%s'",
+                             dir);
+                }
+                close(fd);
+#elif !defined(HASEFROCH)
+                sync();
+#endif
+                break;
+        }
+}
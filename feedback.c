@@ -19,15 +19,21 @@
 
 /****************  PRIVATE DATA (Progress state information)  ****************/
 
-static long long      total_size;
-static long long      completed_size;
-static long long      initial_offset;
-static int            delta_index;
-static int            delta_bytes[8];
-static int            delta_msecs[8];
-static char           bar[512];       /* A reasonable unreachable value */
-static struct timeval init_time;
-static struct timeval last_time;
+static THREAD_LOCAL long long       total_size;
+static THREAD_LOCAL long long       completed_size;
+static THREAD_LOCAL long long       initial_offset;
+static THREAD_LOCAL int             delta_index;
+static THREAD_LOCAL int             delta_bytes[8];
+static THREAD_LOCAL int             delta_msecs[8];
+static THREAD_LOCAL char            bar[512];  /* A reasonable unreachable value */
+static THREAD_LOCAL struct timeval  init_time;
+static THREAD_LOCAL struct timeval  last_time;
+static THREAD_LOCAL char           *item_name;
+
+/* Library calls do not print, they may report to a callback instead */
+static THREAD_LOCAL int             quiet    = 0;
+static THREAD_LOCAL canute_progress progress = NULL;
+static THREAD_LOCAL void           *progress_arg;
 
 
 /****************************  PRIVATE FUNCTIONS  ****************************/
@@ -103,9 +109,9 @@ static void gettimeofday (struct timeval *time, void *dummy)
  */
 static char *pretty_number (long long num)
 {
-        static char str[16];
-        char        ugly[12];
-        int         i, j;
+        static THREAD_LOCAL char str[16];
+        char                     ugly[12];
+        int                      i, j;
 
 #ifdef HASEFROCH
         i = snprintf(ugly, 12, "%I64d", num);
@@ -133,8 +139,8 @@ static char *pretty_number (long long num)
  */
 static char *pretty_time (int secs)
 {
-        static char str[12];
-        int         hour, min, sec;
+        static THREAD_LOCAL char str[12];
+        int                      hour, min, sec;
 
         min  = secs / 60;
         sec  = secs % 60;
@@ -160,8 +166,8 @@ static char *pretty_time (int secs)
  */
 static char *pretty_speed (float rate)
 {
-        static char str[16];
-        char       *metric;
+        static THREAD_LOCAL char str[16];
+        char                    *metric;
 
         if (rate > 1024.0 * 1024.0 * 1024.0)
         {
@@ -251,6 +257,37 @@ static void draw_bar (void)
 
 /*****************************  PUBLIC FUNCTIONS  *****************************/
 
+/*
+ * feedback_setup
+ *
+ * Print progress and messages (the default) or keep quiet, and report progress
+ * to callback (may be NULL) with arg.  For the calling thread only.
+ */
+void feedback_setup (int be_quiet, canute_progress callback, void *arg)
+{
+        quiet        = be_quiet;
+        progress     = callback;
+        progress_arg = arg;
+}
+
+
+/*
+ * inform
+ *
+ * Informational message a la printf(), unless quiet.
+ */
+void inform (char *msg, ...)
+{
+        va_list pars;
+
+        if (quiet)
+                return;
+        va_start(pars, msg);
+        vprintf(msg, pars);
+        va_end(pars);
+}
+
+
 /*
  * setup_progress
  *
@@ -274,8 +311,13 @@ void setup_progress (char *name, long long size, long long offset)
         total_size     = size;
         initial_offset = offset;
         completed_size = offset;
+        item_name      = name;
 
-        printf("*** Transferring '%s' (%s bytes)\n", name, pretty_number(size));
+        if (progress != NULL)
+                progress(name, offset, size, progress_arg);
+        if (!quiet)
+                printf("*** Transferring '%s' (%s bytes)\n", name,
+                       pretty_number(size));
 
         /* We watch the clock before and after the whole transfer to estimate an
          * average speed to be shown at the end. */
@@ -308,7 +350,11 @@ void update_progress (size_t increment)
                 delta_index &= 0x07;     /* delta_index %= 8; */
                 last_time    = now;
 
-                draw_bar();
+                if (progress != NULL)
+                        progress(item_name, completed_size, total_size,
+                                 progress_arg);
+                if (!quiet)
+                        draw_bar();
 
                 delta_bytes[delta_index] = 0;
         }
@@ -325,6 +371,10 @@ void finish_progress (void)
         struct timeval now;
         float          total_elapsed, av_rate;
 
+        if (progress != NULL)
+                progress(item_name, total_size, total_size, progress_arg);
+        if (quiet)
+                return;
         if (total_size == 0)
         {
                 printf("\n");
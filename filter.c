@@ -0,0 +1,453 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                         INCLUDE AND EXCLUDE RULES                          */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * Rules decide which entries of the trees being sent are left out.  Each one
+ * is a line:
+ *
+ *      - <glob>     Exclude what matches
+ *      + <glob>     Include what matches
+ *      -r <regex>   Exclude what matches the POSIX extended regular expression
+ *      +r <regex>   Include what matches it
+ *
+ * Empty lines and lines starting with '#' are ignored.  The first rule that
+ * matches decides, and what no rule matches is included.  Leaving out a
+ * directory leaves out everything inside it.  A pattern ending in '/' only
+ * matches directories, as with rsync: '- build/' leaves out the build
+ * directories but not a file named build.
+ *
+ * Globs know '*' (anything but '/'), '**' (anything), '?' and '[...]' classes.
+ * A glob without '/' is matched against the entry name, wherever it is, and
+ * one with '/' against the path from the session start (a leading '/' only
+ * anchors it there).  Regular expressions always get that path, and are not
+ * available in Hasefroch.  Names are matched as sent, that is, with unsafe
+ * characters already replaced (see safename()).
+ *
+ * Rules are compiled once: literal names and '*.ext' suffixes are compared
+ * directly, expressions are regcomp()ed.  The sender applies them while
+ * listing a directory, so left out entries are never opened, prefetched nor
+ * offered, and not even stat()ed unless some rule is for directories only.
+ * A receiver with rules of its own refuses what they exclude and, when asked
+ * with a REQUEST_RULES, sends them to the sender (see protocol.c), which then
+ * leaves that out too.  Both sets apply there independently: something is
+ * sent only if neither excludes it.
+ */
+#include "canute.h"
+
+#ifndef HASEFROCH
+#include <regex.h>
+#endif
+
+#define RULE_LINE    (PATH_MAX + 8)
+#define RULES_REMOTE 1  /* Second set, from the receiver */
+
+#define MATCH_LITERAL 0  /* Whole name or path */
+#define MATCH_SUFFIX  1  /* "*" and a literal end */
+#define MATCH_GLOB    2
+#define MATCH_REGEX   3
+
+struct rule
+{
+        int      include;
+        int      kind;      /* MATCH_* */
+        int      on_path;   /* Against the path rather than the name */
+        int      dir_only;  /* Pattern ended in '/' */
+        char    *pattern;   /* What is compared, after the prefix */
+        size_t   length;
+        char    *text;      /* The whole line, for the peer */
+#ifndef HASEFROCH
+        regex_t  re;
+#endif
+};
+
+struct rule_set
+{
+        struct rule *rules;
+        size_t       count;
+        size_t       alloc;
+};
+
+
+/*******************************  PRIVATE DATA  ******************************/
+
+static THREAD_LOCAL struct rule_set sets[2];  /* Local, RULES_REMOTE */
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * glob_match
+ *
+ * True if str matches the glob pattern.
+ */
+static int glob_match (const char *pattern, const char *str)
+{
+        const char *p;
+        int         negate, found;
+
+        for (;  *pattern != '\0';  pattern++, str++)
+        {
+                switch (*pattern)
+                {
+                case '*':
+                        if (pattern[1] == '*')
+                        {
+                                /* Anything, slashes too */
+                                for (pattern += 2;  ;  str++)
+                                {
+                                        if (glob_match(pattern, str))
+                                                return 1;
+                                        if (*str == '\0')
+                                                return 0;
+                                }
+                        }
+                        for (pattern++;  ;  str++)
+                        {
+                                if (glob_match(pattern, str))
+                                        return 1;
+                                if (*str == '\0' || *str == '/')
+                                        return 0;
+                        }
+
+                case '?':
+                        if (*str == '\0' || *str == '/')
+                                return 0;
+                        break;
+
+                case '[':
+                        if (*str == '\0' || *str == '/')
+                                return 0;
+                        p      = pattern + 1;
+                        negate = (*p == '!' || *p == '^');
+                        p     += negate;
+                        found  = 0;
+                        do
+                        {
+                                if (p[1] == '-' && p[2] != ']' && p[2] != '\0')
+                                {
+                                        found |= (*str >= p[0] && *str <= p[2]);
+                                        p     += 3;
+                                }
+                                else
+                                        found |= (*str == *p++);
+                        }
+                        while (*p != ']' && *p != '\0');
+                        if (*p == '\0' || found == negate)
+                                return 0;
+                        pattern = p;
+                        break;
+
+                default:
+                        if (*pattern != *str)
+                                return 0;
+                }
+        }
+        return *str == '\0';
+}
+
+
+/*
+ * rule_matches
+ *
+ * True if the rule matches the entry at path, whose name is name.
+ */
+static int rule_matches (const struct rule *r, const char *path,
+                         const char *name, int is_dir)
+{
+        const char *s = (r->on_path ? path : name);
+        size_t      len;
+
+        if (r->dir_only && !is_dir)
+                return 0;
+        switch (r->kind)
+        {
+        case MATCH_LITERAL:
+                return strcmp(s, r->pattern) == 0;
+
+        case MATCH_SUFFIX:
+                len = strlen(s);
+                return (len >= r->length
+                        && strcmp(s + len - r->length, r->pattern) == 0);
+
+        case MATCH_GLOB:
+                return glob_match(r->pattern, s);
+
+#ifndef HASEFROCH
+        case MATCH_REGEX:
+                return regexec(&r->re, s, 0, NULL, 0) == 0;
+#endif
+        }
+        return 0;
+}
+
+
+/*
+ * set_excludes
+ *
+ * True if the first rule of the set matching path (or its name) excludes it.
+ */
+static int set_excludes (const struct rule_set *set, const char *path,
+                         int is_dir)
+{
+        const char *name = strrchr(path, '/');
+        size_t      i;
+
+        name = (name != NULL ? name + 1 : path);
+        for (i = 0;  i < set->count;  i++)
+                if (rule_matches(&set->rules[i], path, name, is_dir))
+                        return !set->rules[i].include;
+        return 0;
+}
+
+
+/*
+ * add_rule
+ *
+ * Compile a rule line into the given set.
+ */
+static void add_rule (struct rule_set *set, const char *line)
+{
+        struct rule *r;
+        const char  *p = line;
+        int          regex;
+
+        if (*p != '-' && *p != '+')
+                fail(CANUTE_EINVAL, "Invalid filter rule '%s'", line);
+        regex = (p[1] == 'r');
+        p    += 1 + regex;
+        if (*p != ' ' || p[1] == '\0')
+                fail(CANUTE_EINVAL, "Invalid filter rule '%s'", line);
+        p++;
+        if (*p == '/' && !regex)
+                p++;
+
+        if (set->count == set->alloc)
+        {
+                set->alloc = (set->alloc == 0 ? 16 : set->alloc * 2);
+                set->rules = realloc(set->rules,
+                                     set->alloc * sizeof(struct rule));
+                if (set->rules == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating filter rules");
+        }
+        r = &set->rules[set->count];
+        if (regex)
+        {
+#ifdef HASEFROCH
+                fail(CANUTE_EINVAL, "Regular expressions not supported: '%s'",
+                     line);
+#else
+                if (regcomp(&r->re, p, REG_EXTENDED | REG_NOSUB) != 0)
+                        fail(CANUTE_EINVAL, "Invalid regular expression '%s'",
+                             p);
+#endif
+        }
+
+        r->include  = (line[0] == '+');
+        r->text     = strdup(line);
+        r->pattern  = strdup(p);
+        r->length   = strlen(p);
+        if (r->text == NULL || r->pattern == NULL)
+                fail(CANUTE_ENOMEM, "Allocating filter rules");
+
+        /* A trailing '/' is not part of the name, "dir/" is like "dir" */
+        r->dir_only = (!regex && r->length > 1
+                       && r->pattern[r->length - 1] == '/');
+        if (r->dir_only)
+                r->pattern[--r->length] = '\0';
+        r->on_path  = (regex || p != line + 2
+                       || strchr(r->pattern, '/') != NULL);
+
+        if (regex)
+                r->kind = MATCH_REGEX;
+        else if (strpbrk(r->pattern, "*?[") == NULL)
+                r->kind = MATCH_LITERAL;
+        else if (r->pattern[0] == '*' && strpbrk(r->pattern + 1, "*?[") == NULL
+                 && !r->on_path)
+        {
+                r->kind = MATCH_SUFFIX;
+                memmove(r->pattern, r->pattern + 1, r->length--);
+        }
+        else
+                r->kind = MATCH_GLOB;
+        set->count++;
+}
+
+
+/*
+ * add_rules
+ *
+ * Add every rule in text, one per line, to the set.
+ */
+static void add_rules (struct rule_set *set, char *text)
+{
+        char *line, *next;
+
+        for (line = text;  line != NULL;  line = next)
+        {
+                next = strchr(line, '\n');
+                if (next != NULL)
+                        *next++ = '\0';
+                line[strcspn(line, "\r")] = '\0';
+                if (line[0] != '\0' && line[0] != '#')
+                        add_rule(set, line);
+        }
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * filter_add
+ *
+ * Add a rule of our own.  A bare glob, without '-' nor '+', excludes.
+ */
+void filter_add (const char *rule)
+{
+        char line[RULE_LINE];
+
+        if (rule[0] == '-' || rule[0] == '+')
+                add_rule(&sets[0], rule);
+        else
+        {
+                snprintf(line, RULE_LINE, "- %s", rule);
+                add_rule(&sets[0], line);
+        }
+}
+
+
+/*
+ * filter_load
+ *
+ * Add the rules of a rules file.
+ */
+void filter_load (const char *file)
+{
+        char  line[RULE_LINE];
+        FILE *f;
+
+        f = fopen(file, "r");
+        if (f == NULL)
+                fail(CANUTE_EFILE, "Cannot open rules file '%s'", file);
+        while (fgets(line, RULE_LINE, f) != NULL)
+                add_rules(&sets[0], line);
+        fclose(f);
+}
+
+
+/*
+ * filter_add_remote
+ *
+ * Sender: add the rules the receiver sent, as filter_text() made them.  The
+ * text is modified.
+ */
+void filter_add_remote (char *text)
+{
+        add_rules(&sets[RULES_REMOTE], text);
+}
+
+
+/*
+ * filter_text
+ *
+ * Receiver: our rules as text for the sender, one per line, in a malloc()ed
+ * buffer.  Return its length, 0 (and no buffer) if there are no rules.
+ */
+size_t filter_text (char **text)
+{
+        size_t len = 0, i;
+        char  *p;
+
+        if (sets[0].count == 0)
+                return 0;
+        for (i = 0;  i < sets[0].count;  i++)
+                len += strlen(sets[0].rules[i].text) + 1;
+        *text = malloc(len + 1);
+        if (*text == NULL)
+                fail(CANUTE_ENOMEM, "Allocating filter rules");
+        p = *text;
+        for (i = 0;  i < sets[0].count;  i++)
+                p += sprintf(p, "%s\n", sets[0].rules[i].text);
+        return len;
+}
+
+
+/*
+ * filter_enabled
+ *
+ * True if there is any rule at all.
+ */
+int filter_enabled (void)
+{
+        return sets[0].count > 0 || sets[RULES_REMOTE].count > 0;
+}
+
+
+/*
+ * filter_dirs
+ *
+ * True if some rule only matches directories, so filter_excluded() needs to
+ * be told whether the entry is one.
+ */
+int filter_dirs (void)
+{
+        int    s;
+        size_t i;
+
+        for (s = 0;  s < 2;  s++)
+                for (i = 0;  i < sets[s].count;  i++)
+                        if (sets[s].rules[i].dir_only)
+                                return 1;
+        return 0;
+}
+
+
+/*
+ * filter_excluded
+ *
+ * True if the entry at path (relative to the session start), a directory if
+ * is_dir, must be left out.
+ */
+int filter_excluded (const char *path, int is_dir)
+{
+        return (set_excludes(&sets[0], path, is_dir)
+                || set_excludes(&sets[RULES_REMOTE], path, is_dir));
+}
+
+
+/*
+ * filter_reset
+ *
+ * Forget every rule.
+ */
+void filter_reset (void)
+{
+        struct rule *r;
+        int          s;
+        size_t       i;
+
+        for (s = 0;  s < 2;  s++)
+        {
+                for (i = 0;  i < sets[s].count;  i++)
+                {
+                        r = &sets[s].rules[i];
+#ifndef HASEFROCH
+                        if (r->kind == MATCH_REGEX)
+                                regfree(&r->re);
+#endif
+                        free(r->text);
+                        free(r->pattern);
+                }
+                free(sets[s].rules);
+                memset(&sets[s], 0, sizeof(struct rule_set));
+        }
+}
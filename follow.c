@@ -0,0 +1,355 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                          SENDER FOLLOW MODE                                */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * With -f the files given as items are followed, like "tail -f" does: they are
+ * kept open on both sides and whatever they grow is sent as it appears, with
+ * no new session nor negotiation (see FOLLOW MODE in protocol.c).  Items that
+ * are directories are sent once, as usual.
+ *
+ * On Linux inotify tells when a followed file, or the directory holding it,
+ * changes.  After the first event the sender waits FOLLOW_BATCH ms, so a file
+ * written line by line costs a handful of checks and sends a second at most.
+ * Elsewhere, or if inotify fails, the files are checked every FOLLOW_POLL ms,
+ * which is also how long an inotify wait lasts at most.
+ *
+ * A check compares the open file with what was sent of it, and its path with
+ * the open file:
+ *
+ *   - Longer: the new data is sent.
+ *   - Shorter (truncated, like "logrotate copytruncate" does): it is sent again
+ *     from the start, the receiver cuts its copy.
+ *   - Another file at the path (rotated, moved away and created again): what
+ *     the old one still had is sent, then the new one from the start.  The
+ *     copy follows the path, as "tail -F" does.  Rotation is noticed by inode
+ *     number, so not on Hasefroch, where only truncation is.
+ *
+ * A file deleted and not created again goes on being followed as it was.
+ * SIGINT and SIGTERM end the session cleanly, after a last check.
+ */
+#include "canute.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define FOLLOW_INOTIFY
+#endif
+#ifndef HASEFROCH
+#include <poll.h>
+#endif
+#include <signal.h>
+
+#define FOLLOW_BATCH 200   /* ms gathering changes after the first event */
+#define FOLLOW_POLL  1000  /* ms between checks without events */
+#ifdef FOLLOW_INOTIFY
+#define FOLLOW_MASK  (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define FOLLOW_DIR   (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+#endif
+
+struct followed_file
+{
+        char                  *path;
+        char                   sname[CANUTE_NAME_LENGTH + 1];
+        FILE                  *file;
+        long long              sent;    /* Offset the copy has reached */
+        int                    wd;      /* Watch of the file, or -1 */
+        struct followed_file  *next;
+};
+
+
+/*************************  PRIVATE DATA (Sender)  ***************************/
+
+static struct followed_file *files = NULL;
+static int                   ifd   = -1;
+static volatile sig_atomic_t stop  = 0;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * watch_file
+ *
+ * Watch the file at f->path and the directory holding it, if inotify works.
+ */
+static void watch_file (struct followed_file *f)
+{
+#ifdef FOLLOW_INOTIFY
+        char *c;
+
+        if (ifd == -1)
+                return;
+        if (f->wd != -1)
+                inotify_rm_watch(ifd, f->wd);
+        f->wd = inotify_add_watch(ifd, f->path, FOLLOW_MASK);
+
+        /* The directory, for a file created again at the path */
+        c = strrchr(f->path, '/');
+        if (c == NULL)
+                inotify_add_watch(ifd, ".", FOLLOW_DIR);
+        else
+        {
+                *c = '\0';
+                inotify_add_watch(ifd, (c == f->path ? "/" : f->path),
+                                  FOLLOW_DIR);
+                *c = '/';
+        }
+#endif
+}
+
+
+/*
+ * open_followed
+ *
+ * Open a followed file unbuffered: stdio would serve a file truncated and
+ * written again from what it buffered before.
+ */
+static FILE *open_followed (const char *path)
+{
+        FILE *file = fopen(path, "rb");
+
+        if (file != NULL)
+                setvbuf(file, NULL, _IONBF, 0);
+        return file;
+}
+
+
+/*
+ * send_grown
+ *
+ * Send what the open file has beyond what was sent of it, or all of it again
+ * if it shrank.  Its modification time is in st.
+ */
+static void send_grown (struct connection      *cn,
+                        struct followed_file   *f,
+                        const struct stat_info *st)
+{
+        long long size = (long long) st->st_size, from = f->sent;
+
+        if (size < f->sent)
+        {
+                inform("--- File '%s' truncated, following it again\n",
+                       f->sname);
+                from = 0;
+        }
+        else if (size == f->sent)
+                return;
+
+        f->sent = send_appended(cn, f->sname, f->file, from, size,
+                                (int) st->st_mtime);
+        if (f->sent > from)
+                inform("--- Sent %lld bytes of '%s'\n", f->sent - from,
+                       f->sname);
+}
+
+
+/*
+ * check_file
+ *
+ * Send what changed in a followed file since the last check.
+ */
+static void check_file (struct connection *cn, struct followed_file *f)
+{
+        struct stat_info st, now;
+        FILE            *file;
+
+        if (fstat(fileno(f->file), &st) == -1)
+                fatal("Cannot stat file '%s'", f->path);
+        send_grown(cn, f, &st);
+
+        /* Still the same file at the path?  Missing is not another */
+        if (stat(f->path, &now) == -1 || !S_ISREG(now.st_mode)
+            || (now.st_dev == st.st_dev && now.st_ino == st.st_ino))
+                return;
+        file = open_followed(f->path);
+        if (file == NULL || fstat(fileno(file), &now) == -1)
+        {
+                if (file != NULL)
+                        fclose(file);
+                return;  /* Try again next time */
+        }
+
+        /* Anything written to the old one until now goes too */
+        if (fstat(fileno(f->file), &st) == 0)
+                send_grown(cn, f, &st);
+        fclose(f->file);
+        f->file = file;
+        watch_file(f);
+
+        inform("--- File '%s' replaced, following the new one\n", f->sname);
+        f->sent = send_appended(cn, f->sname, f->file, 0,
+                                (long long) now.st_size, (int) now.st_mtime);
+}
+
+
+/*
+ * wait_changes
+ *
+ * Wait until something may have changed: an inotify event and the batch time
+ * after it, or the poll time.
+ */
+static void wait_changes (void)
+{
+#ifdef FOLLOW_INOTIFY
+        struct pollfd pfd;
+        char          buf[4096];
+
+        if (ifd != -1)
+        {
+                pfd.fd     = ifd;
+                pfd.events = POLLIN;
+                if (poll(&pfd, 1, FOLLOW_POLL) <= 0 || stop)
+                        return;
+                poll(NULL, 0, FOLLOW_BATCH);
+
+                /* The events only woke us up, drop them */
+                while (read(ifd, buf, sizeof(buf)) > 0)
+                        ;
+                return;
+        }
+#endif
+#ifdef HASEFROCH
+        Sleep(FOLLOW_POLL);
+#else
+        poll(NULL, 0, FOLLOW_POLL);
+#endif
+}
+
+
+/*
+ * stop_following
+ *
+ * Signal handler, the session ends after the current check.
+ */
+static void stop_following (int sig)
+{
+        stop = 1;
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * follow_item
+ *
+ * If the item is a regular file, start following it: offer it to the receiver
+ * and send what its copy lacks.  Return false if it is not one, to be sent as
+ * usual.
+ */
+int follow_item (struct connection *cn, char *path)
+{
+        struct followed_file *f;
+        struct stat_info      st;
+        long long             received;
+        char                  name[PATH_MAX];
+        int                   x_bit = 0;
+
+        if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+                return 0;
+
+        f = calloc(1, sizeof(struct followed_file));
+        if (f == NULL)
+                fatal("Allocating followed file");
+        f->path = strdup(path);
+        if (f->path == NULL)
+                fatal("Allocating followed file");
+        snprintf(name, PATH_MAX, "%s", path);
+        strncpy(f->sname, safename(name), CANUTE_NAME_LENGTH);
+        f->wd = -1;
+
+        f->file = open_followed(path);
+        if (f->file == NULL || fstat(fileno(f->file), &st) == -1)
+        {
+                error("Cannot open file '%s'", path);
+                if (f->file != NULL)
+                        fclose(f->file);
+                free(f->path);
+                free(f);
+                return 1;
+        }
+#ifndef HASEFROCH
+        x_bit = st.st_mode & S_IXUSR;
+#endif
+        received = send_follow(cn, f->sname, (long long) st.st_size,
+                               (int) st.st_mtime, x_bit);
+        if (received == -1)
+        {
+                fclose(f->file);
+                free(f->path);
+                free(f);
+                return 1;
+        }
+
+        /* A copy longer than the file is not of it, send it all again */
+        if (received > (long long) st.st_size)
+                f->sent = send_appended(cn, f->sname, f->file, 0,
+                                        (long long) st.st_size,
+                                        (int) st.st_mtime);
+        else
+        {
+                f->sent = received;
+                send_grown(cn, f, &st);
+        }
+        f->next = files;
+        files   = f;
+
+#ifdef FOLLOW_INOTIFY
+        if (ifd == -1)
+                ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (ifd == -1)
+                error("Cannot watch '%s', checking it periodically", path);
+#endif
+        watch_file(f);
+        return 1;
+}
+
+
+/*
+ * follow_run
+ *
+ * Send what the followed files grow, until interrupted.  Then close them.
+ */
+void follow_run (struct connection *cn)
+{
+        struct followed_file *f;
+        void                (*old_int) (int);
+        void                (*old_term) (int);
+
+        /* poll() is not restarted after a handler, whatever signal() sets */
+        old_int  = signal(SIGINT, stop_following);
+        old_term = signal(SIGTERM, stop_following);
+
+        if (files != NULL)
+                inform("--- Following files\n");
+        while (files != NULL && !stop)
+        {
+                push_connection(cn);
+                wait_changes();
+                for (f = files;  f != NULL;  f = f->next)
+                        check_file(cn, f);
+        }
+
+        signal(SIGINT, old_int);
+        signal(SIGTERM, old_term);
+        while (files != NULL)
+        {
+                f     = files;
+                files = f->next;
+                fclose(f->file);
+                free(f->path);
+                free(f);
+        }
+#ifdef FOLLOW_INOTIFY
+        if (ifd != -1)
+                close(ifd);
+        ifd = -1;
+#endif
+}
@@ -0,0 +1,158 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                            CONTENT HASHING (SHA-256)                       */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * Plain FIPS 180-4 SHA-256.  Content hashes identify data across hosts and
+ * across sessions, so a strong hash is a must; depending on an external crypto
+ * library for a single function is not worth it.
+ */
+#include "canute.h"
+
+#define ROR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+static const uint32_t k256[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+        0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+        0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+        0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+        0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * sha256_block
+ *
+ * Process one 64 byte block of input.
+ */
+static void sha256_block (struct sha256 *ctx, const unsigned char *p)
+{
+        uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+        int      i;
+
+        for (i = 0;  i < 16;  i++)
+                w[i] = ((uint32_t) p[i * 4]     << 24)
+                     | ((uint32_t) p[i * 4 + 1] << 16)
+                     | ((uint32_t) p[i * 4 + 2] << 8)
+                     |  (uint32_t) p[i * 4 + 3];
+        for (;  i < 64;  i++)
+                w[i] = w[i - 16] + w[i - 7]
+                     + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3))
+                     + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+        a = ctx->state[0];  b = ctx->state[1];
+        c = ctx->state[2];  d = ctx->state[3];
+        e = ctx->state[4];  f = ctx->state[5];
+        g = ctx->state[6];  h = ctx->state[7];
+
+        for (i = 0;  i < 64;  i++)
+        {
+                t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25))
+                       + ((e & f) ^ (~e & g)) + k256[i] + w[i];
+                t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22))
+                   + ((a & b) ^ (a & c) ^ (b & c));
+                h = g;  g = f;  f = e;  e = d + t1;
+                d = c;  c = b;  b = a;  a = t1 + t2;
+        }
+
+        ctx->state[0] += a;  ctx->state[1] += b;
+        ctx->state[2] += c;  ctx->state[3] += d;
+        ctx->state[4] += e;  ctx->state[5] += f;
+        ctx->state[6] += g;  ctx->state[7] += h;
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+void sha256_init (struct sha256 *ctx)
+{
+        ctx->state[0] = 0x6a09e667;  ctx->state[1] = 0xbb67ae85;
+        ctx->state[2] = 0x3c6ef372;  ctx->state[3] = 0xa54ff53a;
+        ctx->state[4] = 0x510e527f;  ctx->state[5] = 0x9b05688c;
+        ctx->state[6] = 0x1f83d9ab;  ctx->state[7] = 0x5be0cd19;
+        ctx->length   = 0;
+        ctx->used     = 0;
+}
+
+
+void sha256_update (struct sha256 *ctx, const void *data, size_t count)
+{
+        const unsigned char *p = data;
+        size_t               n;
+
+        ctx->length += count;
+
+        if (ctx->used > 0)
+        {
+                n = 64 - ctx->used;
+                if (n > count)
+                        n = count;
+                memcpy(ctx->buf + ctx->used, p, n);
+                ctx->used += n;
+                p         += n;
+                count     -= n;
+                if (ctx->used < 64)
+                        return;
+                sha256_block(ctx, ctx->buf);
+                ctx->used = 0;
+        }
+
+        for (;  count >= 64;  count -= 64, p += 64)
+                sha256_block(ctx, p);
+
+        memcpy(ctx->buf, p, count);
+        ctx->used = count;
+}
+
+
+void sha256_final (struct sha256 *ctx, unsigned char *digest)
+{
+        uint64_t bits = ctx->length << 3;
+        int      i;
+
+        ctx->buf[ctx->used++] = 0x80;
+        if (ctx->used > 56)
+        {
+                memset(ctx->buf + ctx->used, 0, 64 - ctx->used);
+                sha256_block(ctx, ctx->buf);
+                ctx->used = 0;
+        }
+        memset(ctx->buf + ctx->used, 0, 56 - ctx->used);
+        for (i = 0;  i < 8;  i++)
+                ctx->buf[56 + i] = (unsigned char) (bits >> (56 - i * 8));
+        sha256_block(ctx, ctx->buf);
+
+        for (i = 0;  i < 32;  i++)
+                digest[i] = (unsigned char) (ctx->state[i >> 2]
+                                             >> (24 - (i & 3) * 8));
+}
+
+
+/*
+ * sha256
+ *
+ * One shot hashing of a memory buffer.
+ */
+void sha256 (const void *data, size_t count, unsigned char *digest)
+{
+        struct sha256 ctx;
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, data, count);
+        sha256_final(&ctx, digest);
+}
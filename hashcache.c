@@ -0,0 +1,582 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                         SENDER CONTENT HASH CACHE                          */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * Hashing a multi-terabyte tree on every session is as expensive as sending
+ * it.  The hash cache remembers, for every file hashed before, the SHA-256 of
+ * its contents and its list of deduplication chunks, keyed by device, inode,
+ * size and modification time (in nanoseconds where the platform has them).
+ * Any change of those invalidates the entry.  Entries are filled lazily, only
+ * when some feature actually needs a hash.
+ *
+ * The cache file is meant to be mapped in memory as is, so it is in host byte
+ * order and not portable between architectures:
+ *
+ *      header     magic, entry count, chunk record count
+ *      entries    struct hc_entry, sorted by device and inode
+ *      chunks     chunk records (SHA-256 + big endian length, exactly as
+ *                 they travel in a REQUEST_CHUNKS table)
+ *
+ * Entries added or refreshed during the session live in memory and are merged
+ * when the cache is saved.  Entries unused for HC_MAX_AGE saves are dropped,
+ * so files deleted long ago do not stay around forever.
+ */
+#include "canute.h"
+
+#ifndef HASEFROCH
+#include <sys/mman.h>
+#endif
+
+#define HC_MAGIC     "CANUTEHC"
+#define HC_MAX_AGE   16
+#define HC_FILE_HASH 1
+#define HC_CHUNKS    2
+
+struct hc_header
+{
+        char     magic[8];
+        uint64_t entries;
+        uint64_t chunks;
+};
+
+struct hc_entry
+{
+        uint64_t      dev;
+        uint64_t      ino;
+        uint64_t      size;
+        uint64_t      mtime_ns;
+        uint64_t      first_chunk;     /* In chunk records */
+        uint32_t      chunk_count;
+        uint32_t      flags;
+        uint32_t      age;             /* Saves since it was last used */
+        uint32_t      pad;
+        unsigned char hash[HASH_SIZE];
+};
+
+
+/**********************  PRIVATE DATA (Cache contents)  **********************/
+
+static THREAD_LOCAL char            *cache_file        = NULL;
+static THREAD_LOCAL unsigned char   *map               = NULL;  /* Whole file */
+static THREAD_LOCAL size_t           map_size          = 0;
+static THREAD_LOCAL struct hc_entry *old               = NULL;  /* Inside map */
+static THREAD_LOCAL size_t           old_count         = 0;
+static THREAD_LOCAL unsigned char   *old_chunks        = NULL;  /* Inside map */
+static THREAD_LOCAL unsigned char   *old_state         = NULL;  /* OLD_USED, OLD_REPLACED */
+static THREAD_LOCAL struct hc_entry *fresh             = NULL;  /* Added this session */
+static THREAD_LOCAL size_t           fresh_count       = 0;
+static THREAD_LOCAL size_t           fresh_alloc       = 0;
+static THREAD_LOCAL size_t          *fresh_slots       = NULL;  /* entry number + 1 */
+static THREAD_LOCAL size_t           fresh_slot_count  = 0;
+static THREAD_LOCAL unsigned char   *fresh_chunks      = NULL;
+static THREAD_LOCAL size_t           fresh_chunk_count = 0;
+static THREAD_LOCAL size_t           fresh_chunk_alloc = 0;
+
+#define OLD_USED     1
+#define OLD_REPLACED 2
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * mtime_ns
+ *
+ * Modification time with the best resolution available.
+ */
+static uint64_t mtime_ns (const struct stat_info *st)
+{
+#if defined(__linux__) || defined(__sun)
+        return (uint64_t) st->st_mtim.tv_sec * 1000000000ULL
+               + (uint64_t) st->st_mtim.tv_nsec;
+#else
+        return (uint64_t) st->st_mtime * 1000000000ULL;
+#endif
+}
+
+
+static int compare_entries (const void *a, const void *b)
+{
+        const struct hc_entry *x = a, *y = b;
+
+        if (x->dev != y->dev)
+                return (x->dev < y->dev ? -1 : 1);
+        if (x->ino != y->ino)
+                return (x->ino < y->ino ? -1 : 1);
+        return 0;
+}
+
+
+/*
+ * find_fresh
+ *
+ * Return the slot of the fresh entries table for the file identified by key:
+ * either the one holding it or the free one where it would go.
+ */
+static size_t *find_fresh (const struct hc_entry *key)
+{
+        size_t i;
+
+        i = (size_t) ((key->ino * 0x9E3779B97F4A7C15ULL) ^ key->dev)
+            & (fresh_slot_count - 1);
+        while (fresh_slots[i] != 0
+               && compare_entries(&fresh[fresh_slots[i] - 1], key) != 0)
+                i = (i + 1) & (fresh_slot_count - 1);
+        return &fresh_slots[i];
+}
+
+
+/*
+ * append_chunks
+ *
+ * Copy chunk records to the in-memory area and return the number of the first
+ * one.
+ */
+static uint64_t append_chunks (const unsigned char *records, size_t count)
+{
+        uint64_t first = fresh_chunk_count;
+
+        if (fresh_chunk_count + count > fresh_chunk_alloc)
+        {
+                while (fresh_chunk_count + count > fresh_chunk_alloc)
+                        fresh_chunk_alloc = (fresh_chunk_alloc == 0 ? 65536
+                                             : fresh_chunk_alloc * 2);
+                fresh_chunks = realloc(fresh_chunks,
+                                       fresh_chunk_alloc * CHUNK_RECORD);
+                if (fresh_chunks == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating hash cache");
+        }
+        memcpy(fresh_chunks + fresh_chunk_count * CHUNK_RECORD, records,
+               count * CHUNK_RECORD);
+        fresh_chunk_count += count;
+        return first;
+}
+
+
+/*
+ * lookup
+ *
+ * Find the entry for a file, fresh ones first, and return it if it is still
+ * valid for the given stat information.
+ */
+static struct hc_entry *lookup (const struct stat_info *st)
+{
+        struct hc_entry key, *e = NULL;
+        size_t          i;
+
+        key.dev = (uint64_t) st->st_dev;
+        key.ino = (uint64_t) st->st_ino;
+
+        if (fresh_count > 0)
+        {
+                i = *find_fresh(&key);
+                if (i != 0)
+                        e = &fresh[i - 1];
+        }
+
+        if (e == NULL && old_count > 0)
+        {
+                e = bsearch(&key, old, old_count, sizeof(struct hc_entry),
+                            compare_entries);
+                if (e != NULL && (old_state[e - old] & OLD_REPLACED))
+                        e = NULL;
+        }
+
+        if (e == NULL || e->size != (uint64_t) st->st_size
+            || e->mtime_ns != mtime_ns(st))
+                return NULL;
+
+        if (e >= old && e < old + old_count)
+                old_state[e - old] |= OLD_USED;
+        return e;
+}
+
+
+/*
+ * entry_chunks
+ *
+ * Chunk records of an entry, wherever they live.
+ */
+static unsigned char *entry_chunks (const struct hc_entry *e)
+{
+        if (e >= old && e < old + old_count)
+                return old_chunks + e->first_chunk * CHUNK_RECORD;
+        return fresh_chunks + e->first_chunk * CHUNK_RECORD;
+}
+
+
+/*
+ * fresh_entry
+ *
+ * Return a writable entry for a file, copying the old one (if still valid) so
+ * that what was known about the file is kept.
+ */
+static struct hc_entry *fresh_entry (const struct stat_info *st)
+{
+        struct hc_entry *e = lookup(st), *f, key;
+        size_t          *slot, i;
+
+        if (e != NULL && e >= fresh && e < fresh + fresh_count)
+                return e;
+
+        key.dev = (uint64_t) st->st_dev;
+        key.ino = (uint64_t) st->st_ino;
+
+        if ((fresh_count + 1) * 2 > fresh_slot_count)
+        {
+                free(fresh_slots);
+                fresh_slot_count = (fresh_slot_count == 0 ? 1024
+                                    : fresh_slot_count * 2);
+                fresh_slots      = calloc(fresh_slot_count, sizeof(size_t));
+                if (fresh_slots == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating hash cache");
+                for (i = 0;  i < fresh_count;  i++)
+                        *find_fresh(&fresh[i]) = i + 1;
+        }
+
+        slot = find_fresh(&key);
+        if (*slot != 0)
+        {
+                /* Known this session, but the file changed since */
+                f = &fresh[*slot - 1];
+        }
+        else
+        {
+                if (fresh_count == fresh_alloc)
+                {
+                        fresh_alloc = (fresh_alloc == 0 ? 256
+                                       : fresh_alloc * 2);
+                        fresh       = realloc(fresh, fresh_alloc
+                                              * sizeof(struct hc_entry));
+                        if (fresh == NULL)
+                                fail(CANUTE_ENOMEM, "Allocating hash cache");
+                }
+                f     = &fresh[fresh_count++];
+                *slot = fresh_count;
+        }
+
+        if (e != NULL)
+        {
+                /* Still valid in the map: keep what is known */
+                *f = *e;
+                if (f->flags & HC_CHUNKS)
+                        f->first_chunk = append_chunks(entry_chunks(e),
+                                                       e->chunk_count);
+        }
+        else
+        {
+                memset(f, 0, sizeof(struct hc_entry));
+                f->dev      = key.dev;
+                f->ino      = key.ino;
+                f->size     = (uint64_t) st->st_size;
+                f->mtime_ns = mtime_ns(st);
+                e = (old_count > 0 ? bsearch(&key, old, old_count,
+                                             sizeof(struct hc_entry),
+                                             compare_entries) : NULL);
+        }
+        if (e != NULL)
+                old_state[e - old] |= OLD_REPLACED;
+        return f;
+}
+
+
+/*
+ * write_cache
+ *
+ * Merge old and fresh entries and write the cache back (aside, then renamed
+ * over the old one, which may still be mapped).
+ */
+static void write_cache (void)
+{
+        char              tmp[PATH_MAX];
+        struct hc_header  h;
+        struct hc_entry  *all, out;
+        size_t            i, n = 0;
+        uint64_t          next = 0;
+        FILE             *f;
+
+        /* pad tells where the chunk records of each entry are: 0 in the map,
+         * 1 in memory */
+        all = malloc((old_count + fresh_count + 1) * sizeof(struct hc_entry));
+        if (all == NULL)
+                fail(CANUTE_ENOMEM, "Allocating hash cache");
+        for (i = 0;  i < old_count;  i++)
+        {
+                if (old_state[i] & OLD_REPLACED)
+                        continue;
+                all[n]     = old[i];
+                all[n].age = (old_state[i] & OLD_USED ? 0 : old[i].age + 1);
+                all[n].pad = 0;
+                if (all[n].age <= HC_MAX_AGE)
+                        n++;
+        }
+        for (i = 0;  i < fresh_count;  i++)
+        {
+                all[n]     = fresh[i];
+                all[n].age = 0;
+                all[n].pad = 1;
+                n++;
+        }
+        qsort(all, n, sizeof(struct hc_entry), compare_entries);
+
+        snprintf(tmp, PATH_MAX, "%s.tmp", cache_file);
+        f = fopen(tmp, "wb");
+        if (f == NULL)
+        {
+                error("Cannot write hash cache '%s'", tmp);
+                free(all);
+                return;
+        }
+
+        memcpy(h.magic, HC_MAGIC, 8);
+        h.entries = n;
+        h.chunks  = 0;
+        for (i = 0;  i < n;  i++)
+                if (all[i].flags & HC_CHUNKS)
+                        h.chunks += all[i].chunk_count;
+        fwrite(&h, sizeof(h), 1, f);
+
+        /* Entries with their chunk offsets renumbered, then the chunk records
+         * in the same order */
+        for (i = 0;  i < n;  i++)
+        {
+                out     = all[i];
+                out.pad = 0;
+                if (out.flags & HC_CHUNKS)
+                {
+                        out.first_chunk = next;
+                        next           += out.chunk_count;
+                }
+                else
+                {
+                        out.first_chunk = 0;
+                        out.chunk_count = 0;
+                }
+                fwrite(&out, sizeof(out), 1, f);
+        }
+        for (i = 0;  i < n;  i++)
+                if (all[i].flags & HC_CHUNKS)
+                        fwrite((all[i].pad ? fresh_chunks : old_chunks)
+                               + all[i].first_chunk * CHUNK_RECORD,
+                               CHUNK_RECORD, all[i].chunk_count, f);
+
+        free(all);
+        if (fclose(f) != 0)
+        {
+                error("Cannot write hash cache '%s'", tmp);
+                return;
+        }
+#ifdef HASEFROCH
+        remove(cache_file);
+#endif
+        if (rename(tmp, cache_file) == -1)
+                error("Cannot replace hash cache '%s'", cache_file);
+}
+
+
+/*
+ * forget_cache
+ *
+ * Unmap the old cache and drop the fresh entries, so another session can
+ * start afresh.
+ */
+static void forget_cache (void)
+{
+        if (map != NULL)
+#ifdef HASEFROCH
+                free(map);
+#else
+                munmap(map, map_size);
+#endif
+        free(old_state);
+        free(fresh);
+        free(fresh_slots);
+        free(fresh_chunks);
+        cache_file        = NULL;
+        map               = NULL;
+        map_size          = 0;
+        old               = NULL;
+        old_count         = 0;
+        old_chunks        = NULL;
+        old_state         = NULL;
+        fresh             = NULL;
+        fresh_count       = 0;
+        fresh_alloc       = 0;
+        fresh_slots       = NULL;
+        fresh_slot_count  = 0;
+        fresh_chunks      = NULL;
+        fresh_chunk_count = 0;
+        fresh_chunk_alloc = 0;
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * hashcache_open
+ *
+ * Map the cache file, if it exists and looks sane.
+ */
+void hashcache_open (char *file)
+{
+        struct hc_header *h;
+        struct stat_info  st;
+        FILE             *f;
+
+        cache_file = file;
+        f = fopen(file, "rb");
+        if (f == NULL)
+                return;
+        if (fstat(fileno(f), &st) == -1
+            || st.st_size < (off_t) sizeof(struct hc_header))
+        {
+                fclose(f);
+                return;
+        }
+        map_size = (size_t) st.st_size;
+
+#ifdef HASEFROCH
+        map = malloc(map_size);
+        if (map != NULL && fread(map, 1, map_size, f) != map_size)
+        {
+                free(map);
+                map = NULL;
+        }
+#else
+        map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+        if (map == MAP_FAILED)
+                map = NULL;
+#endif
+        fclose(f);
+        if (map == NULL)
+        {
+                error("Cannot read hash cache '%s'", file);
+                return;
+        }
+
+        h = (struct hc_header *) map;
+        if (memcmp(h->magic, HC_MAGIC, 8) != 0
+            || sizeof(struct hc_header) + h->entries * sizeof(struct hc_entry)
+               + h->chunks * CHUNK_RECORD != map_size)
+        {
+                error("Ignoring invalid hash cache '%s'", file);
+                return;
+        }
+
+        old        = (struct hc_entry *) (map + sizeof(struct hc_header));
+        old_count  = (size_t) h->entries;
+        old_chunks = (unsigned char *) (old + old_count);
+        old_state  = calloc(old_count + 1, 1);
+        if (old_state == NULL)
+                fail(CANUTE_ENOMEM, "Allocating hash cache");
+}
+
+
+/*
+ * hashcache_save
+ *
+ * Write the cache back and forget it.
+ */
+void hashcache_save (void)
+{
+        if (cache_file == NULL)
+                return;
+        write_cache();
+        forget_cache();
+}
+
+
+/*
+ * hashcache_enabled
+ *
+ * True if a hash cache is in use.
+ */
+int hashcache_enabled (void)
+{
+        return cache_file != NULL;
+}
+
+
+/*
+ * hashcache_file_hash
+ *
+ * Copy the cached SHA-256 of a file into digest.  Return false if unknown.
+ */
+int hashcache_file_hash (const struct stat_info *st, unsigned char *digest)
+{
+        struct hc_entry *e;
+
+        if (cache_file == NULL)
+                return 0;
+        e = lookup(st);
+        if (e == NULL || !(e->flags & HC_FILE_HASH))
+                return 0;
+        memcpy(digest, e->hash, HASH_SIZE);
+        return 1;
+}
+
+
+/*
+ * hashcache_set_file_hash
+ *
+ * Remember the SHA-256 of a file.
+ */
+void hashcache_set_file_hash (const struct stat_info *st,
+                              const unsigned char *digest)
+{
+        struct hc_entry *e;
+
+        if (cache_file == NULL)
+                return;
+        e = fresh_entry(st);
+        memcpy(e->hash, digest, HASH_SIZE);
+        e->flags |= HC_FILE_HASH;
+}
+
+
+/*
+ * hashcache_chunks
+ *
+ * Return the cached chunk records of a file (*count of them), or NULL if they
+ * are unknown.  The pointer is only valid until the cache is modified.
+ */
+unsigned char *hashcache_chunks (const struct stat_info *st, size_t *count)
+{
+        struct hc_entry *e;
+
+        if (cache_file == NULL)
+                return NULL;
+        e = lookup(st);
+        if (e == NULL || !(e->flags & HC_CHUNKS))
+                return NULL;
+        *count = e->chunk_count;
+        return entry_chunks(e);
+}
+
+
+/*
+ * hashcache_set_chunks
+ *
+ * Remember the chunk records of a whole file.
+ */
+void hashcache_set_chunks (const struct stat_info *st,
+                           const unsigned char *records, size_t count)
+{
+        struct hc_entry *e;
+
+        if (cache_file == NULL)
+                return;
+        e = fresh_entry(st);
+        e->first_chunk = append_chunks(records, count);
+        e->chunk_count = (uint32_t) count;
+        e->flags      |= HC_CHUNKS;
+}
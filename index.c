@@ -0,0 +1,392 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                       RECEIVER FILE INDEX (RE-SYNCS)                       */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * The receiver may keep an index of the files it has completely received: the
+ * path relative to where the session started, the size, the modification time
+ * and, optionally, the SHA-256 of the contents.  It is a text file with one
+ * entry per line:
+ *
+ *      <size> <mtime> <sha256 in hex, or '-'> <path>
+ *
+ * Paths are safe names (printable ASCII, see safename()), so they never contain
+ * a newline.
+ *
+ * At the beginning of a session the sender can ask for a summary of the index.
+ * The summary is just a sorted array of 8 byte fingerprints, one per entry,
+ * computed from path, size and modification time.  The sender computes the
+ * fingerprint of every file it is about to send and, when it is in the
+ * summary, skips the file without negotiating it at all.
+ */
+#include "canute.h"
+
+#define INDEX_LINE  (PATH_MAX + 128)
+
+struct index_entry
+{
+        char         *path;
+        long long     size;
+        int           mtime;
+        int           has_hash;
+        unsigned char hash[HASH_SIZE];
+};
+
+
+/********************  PRIVATE DATA (Receiver and sender)  *******************/
+
+static THREAD_LOCAL char               *index_file   = NULL;
+static THREAD_LOCAL struct index_entry *entries      = NULL;
+static THREAD_LOCAL size_t              entry_count  = 0;
+static THREAD_LOCAL size_t              entry_alloc  = 0;
+static THREAD_LOCAL size_t             *slots        = NULL;  /* entry number + 1, 0 = free */
+static THREAD_LOCAL size_t              slot_count   = 0;
+static THREAD_LOCAL unsigned char      *summary      = NULL;  /* Sender side */
+static THREAD_LOCAL size_t              summary_size = 0;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * path_hash
+ *
+ * FNV-1a, good enough for the in-memory table.
+ */
+static size_t path_hash (const char *path)
+{
+        size_t h = 2166136261U;
+
+        while (*path != '\0')
+                h = (h ^ (unsigned char) *path++) * 16777619U;
+        return h;
+}
+
+
+/*
+ * find_entry
+ *
+ * Return the slot for path: either the one holding it or the free one where it
+ * would go.
+ */
+static size_t *find_entry (const char *path)
+{
+        size_t i = path_hash(path) & (slot_count - 1);
+
+        while (slots[i] != 0 && strcmp(entries[slots[i] - 1].path, path) != 0)
+                i = (i + 1) & (slot_count - 1);
+        return &slots[i];
+}
+
+
+/*
+ * add_entry
+ *
+ * Append a new entry, growing the array and rehashing the table as needed.
+ */
+static struct index_entry *add_entry (const char *path)
+{
+        size_t i;
+
+        if (entry_count == entry_alloc)
+        {
+                entry_alloc = (entry_alloc == 0 ? 1024 : entry_alloc * 2);
+                entries     = realloc(entries,
+                                      entry_alloc * sizeof(struct index_entry));
+                if (entries == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating file index");
+        }
+
+        if ((entry_count + 1) * 2 > slot_count)
+        {
+                free(slots);
+                slot_count = (slot_count == 0 ? 2048 : slot_count * 2);
+                slots      = calloc(slot_count, sizeof(size_t));
+                if (slots == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating file index");
+                for (i = 0;  i < entry_count;  i++)
+                        *find_entry(entries[i].path) = i + 1;
+        }
+
+        entries[entry_count].path = strdup(path);
+        if (entries[entry_count].path == NULL)
+                fail(CANUTE_ENOMEM, "Allocating file index");
+        entries[entry_count].has_hash = 0;
+        *find_entry(path) = ++entry_count;
+        return &entries[entry_count - 1];
+}
+
+
+/*
+ * fingerprint
+ *
+ * Summary key of an entry: first 8 bytes of the SHA-256 of the path (with its
+ * terminator), the size and the modification time in network byte order.
+ */
+static void fingerprint (const char *path, long long size, int mtime,
+                         unsigned char *fp)
+{
+        struct sha256 ctx;
+        unsigned char buf[12], digest[HASH_SIZE];
+        int           i;
+
+        for (i = 0;  i < 8;  i++)
+                buf[i] = (unsigned char) (size >> (56 - i * 8));
+        for (i = 0;  i < 4;  i++)
+                buf[8 + i] = (unsigned char) (mtime >> (24 - i * 8));
+
+        sha256_init(&ctx);
+        sha256_update(&ctx, path, strlen(path) + 1);
+        sha256_update(&ctx, buf, sizeof(buf));
+        sha256_final(&ctx, digest);
+        memcpy(fp, digest, 8);
+}
+
+
+static int compare_fingerprints (const void *a, const void *b)
+{
+        return memcmp(a, b, 8);
+}
+
+
+/*
+ * write_index
+ *
+ * Write the index back.  Written aside and renamed, so an interrupted save
+ * never leaves a truncated index behind.
+ */
+static void write_index (void)
+{
+        char                tmp[PATH_MAX];
+        struct index_entry *e;
+        size_t              i;
+        int                 j;
+        FILE               *f;
+
+        snprintf(tmp, PATH_MAX, "%s.tmp", index_file);
+        f = fopen(tmp, "w");
+        if (f == NULL)
+        {
+                error("Cannot write index '%s'", tmp);
+                return;
+        }
+
+        for (i = 0;  i < entry_count;  i++)
+        {
+                e = &entries[i];
+                fprintf(f, "%lld %d ", e->size, e->mtime);
+                if (e->has_hash)
+                        for (j = 0;  j < HASH_SIZE;  j++)
+                                fprintf(f, "%02x", e->hash[j]);
+                else
+                        fputc('-', f);
+                fprintf(f, " %s\n", e->path);
+        }
+
+        fflush(f);
+        durable_file(f, tmp);
+        if (fclose(f) != 0)
+        {
+                error("Cannot write index '%s'", tmp);
+                return;
+        }
+#ifdef HASEFROCH
+        remove(index_file);  /* rename() does not replace there */
+#endif
+        if (rename(tmp, index_file) == -1)
+                error("Cannot replace index '%s'", index_file);
+}
+
+
+/*
+ * forget_index
+ *
+ * Drop the receiver index from memory, so another session can start afresh.
+ */
+static void forget_index (void)
+{
+        size_t i;
+
+        for (i = 0;  i < entry_count;  i++)
+                free(entries[i].path);
+        free(entries);
+        free(slots);
+        entries     = NULL;
+        slots       = NULL;
+        entry_count = 0;
+        entry_alloc = 0;
+        slot_count  = 0;
+        index_file  = NULL;
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * index_load
+ *
+ * Receiver: start using the index stored in file.  A missing file is just an
+ * empty index.
+ */
+void index_load (char *file)
+{
+        char                line[INDEX_LINE], hex[2 * HASH_SIZE + 1];
+        long long           size;
+        int                 mtime, n, i;
+        unsigned int        byte;
+        struct index_entry *e;
+        FILE               *f;
+
+        index_file = file;
+        f = fopen(file, "r");
+        if (f == NULL)
+                return;
+
+        while (fgets(line, INDEX_LINE, f) != NULL)
+        {
+                line[strcspn(line, "\n")] = '\0';
+                if (sscanf(line, "%lld %d %64s %n", &size, &mtime, hex, &n) < 3
+                    || line[n] == '\0')
+                        continue;
+                e = add_entry(line + n);
+                e->size  = size;
+                e->mtime = mtime;
+                if (strlen(hex) == 2 * HASH_SIZE)
+                {
+                        for (i = 0;  i < HASH_SIZE;  i++)
+                        {
+                                sscanf(hex + 2 * i, "%2x", &byte);
+                                e->hash[i] = (unsigned char) byte;
+                        }
+                        e->has_hash = 1;
+                }
+        }
+        fclose(f);
+}
+
+
+/*
+ * index_save
+ *
+ * Receiver: write the index back and forget it.
+ */
+void index_save (void)
+{
+        if (index_file == NULL)
+                return;
+        write_index();
+        forget_index();
+}
+
+
+/*
+ * index_enabled
+ *
+ * Receiver: true if an index is being kept.
+ */
+int index_enabled (void)
+{
+        return index_file != NULL;
+}
+
+
+/*
+ * index_unchanged
+ *
+ * Receiver: true if the index says path is already here with this exact size
+ * and modification time.
+ */
+int index_unchanged (const char *path, long long size, int mtime)
+{
+        size_t i;
+
+        if (entry_count == 0)
+                return 0;
+        i = *find_entry(path);
+        return i != 0 && entries[i - 1].size == size
+               && entries[i - 1].mtime == mtime;
+}
+
+
+/*
+ * index_update
+ *
+ * Receiver: record that path is now complete.  hash may be NULL.
+ */
+void index_update (const char *path, long long size, int mtime,
+                   const unsigned char *hash)
+{
+        struct index_entry *e;
+        size_t              i;
+
+        if (index_file == NULL)
+                return;
+
+        i = (slot_count > 0 ? *find_entry(path) : 0);
+        e = (i != 0 ? &entries[i - 1] : add_entry(path));
+        e->size     = size;
+        e->mtime    = mtime;
+        e->has_hash = (hash != NULL);
+        if (hash != NULL)
+                memcpy(e->hash, hash, HASH_SIZE);
+}
+
+
+/*
+ * index_summary
+ *
+ * Receiver: build the sorted fingerprint array.  Return the number of entries
+ * and leave the array (8 bytes per entry) in *buf, owned by the caller.
+ */
+size_t index_summary (unsigned char **buf)
+{
+        size_t i;
+
+        *buf = malloc(entry_count * 8 + 1);
+        if (*buf == NULL)
+                fail(CANUTE_ENOMEM, "Allocating index summary");
+
+        for (i = 0;  i < entry_count;  i++)
+                fingerprint(entries[i].path, entries[i].size, entries[i].mtime,
+                            *buf + i * 8);
+        qsort(*buf, entry_count, 8, compare_fingerprints);
+        return entry_count;
+}
+
+
+/*
+ * index_set_summary
+ *
+ * Sender: keep the summary received from the peer.  Takes ownership of buf.
+ */
+void index_set_summary (unsigned char *buf, size_t count)
+{
+        free(summary);
+        summary      = buf;
+        summary_size = count;
+}
+
+
+/*
+ * index_in_summary
+ *
+ * Sender: true if the receiver summary says it already has this file.
+ */
+int index_in_summary (const char *path, long long size, int mtime)
+{
+        unsigned char fp[8];
+
+        if (summary_size == 0)
+                return 0;
+        fingerprint(path, size, mtime, fp);
+        return bsearch(fp, summary, summary_size, 8, compare_fingerprints)
+               != NULL;
+}
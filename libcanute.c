@@ -0,0 +1,424 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                      LIBRARY SESSIONS (libcanute.h)                        */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * The library runs the same code as the command line, which was written to
+ * abort on any error and to keep its state in static variables.  So:
+ *
+ *   - Every call arms a trap (see fail() in util.c): an error that would make
+ *     the program exit jumps back here instead, where whatever was left open
+ *     is closed and the error code returned.  Completed files stay recorded
+ *     in the index, the pack or the hash cache, as the command line would
+ *     leave them after a clean end.  The connection is out of step after a
+ *     failure, so the session can only be freed.
+ *
+ *   - Module state is thread local (THREAD_LOCAL in canute.h) and the options
+ *     and output settings are put in place by each call, so sessions may run
+ *     concurrently in different threads.  A session is used by one thread at
+ *     a time, but not always the same one.  Nothing is printed; progress may
+ *     be reported to a callback.
+ *
+ *   - Nobody changes the working directory: items are sent from and received
+ *     into the configured directory.
+ *
+ * A session wraps a connected socket, which stays open (the caller owns it)
+ * and can carry any number of canute_send() calls, each answered by a
+ * canute_receive() on the other end.  Hasefroch programs must start WinSock
+ * themselves.
+ */
+#include "canute.h"
+
+/* Command line options, or those of the running library call */
+THREAD_LOCAL struct options opt;
+
+struct canute_session
+{
+        struct connection cn;
+        struct options    opt;
+        const char       *dir;
+        const char       *filter_file;
+        char             *buffer;        /* Caller's, or NULL */
+        canute_progress   progress;
+        void             *progress_arg;
+        struct failure    failure;       /* Of the last call */
+        int               broken;        /* A call failed, the stream is lost */
+};
+
+struct send_items
+{
+        const char *const *items;
+        int                count;
+};
+
+/* Failures outside sessions (connecting, creating them) */
+static THREAD_LOCAL struct failure thread_failure;
+
+static const char *error_names[] = {
+        "Success",
+        "Local file error",
+        "Connection error",
+        "Protocol error",
+        "Out of memory",
+        "Invalid argument",
+};
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * abandon
+ *
+ * A call failed: close and save whatever the command line would at the end
+ * of a session.
+ */
+static void abandon (struct canute_session *s)
+{
+        protocol_reset();
+        writeback_end();
+        prefetch_stop();
+        store_close();
+        index_save();
+        index_set_summary(NULL, 0);
+        durable_session_end(s->dir != NULL ? s->dir : ".");
+        pack_abort();
+        hashcache_save();
+}
+
+
+/*
+ * run
+ *
+ * Run call(s, arg) as the session wants it, trapping any failure.  Return the
+ * error code.
+ */
+static int run (struct canute_session *s,
+                void (*call) (struct canute_session *, void *),
+                void *arg)
+{
+        struct failure *f = &s->failure;
+
+        if (s->broken)
+        {
+                f->code = CANUTE_EINVAL;
+                snprintf(f->message, sizeof(f->message),
+                         "Session broken by an earlier failure");
+                return f->code;
+        }
+
+        opt = s->opt;
+        feedback_setup(1, s->progress, s->progress_arg);
+        protocol_setup(s->dir, (s->buffer != NULL ? s->buffer + 2 * NET_BUFFER
+                                                  : NULL));
+        fail_trap(f);
+        if (setjmp(f->env) == 0)
+                call(s, arg);
+        else
+        {
+                /* Failing again while abandoning, leave the rest */
+                s->broken = 1;
+                if (setjmp(f->env) == 0)
+                        abandon(s);
+        }
+        fail_trap(NULL);
+        protocol_reset();
+        feedback_setup(0, NULL, NULL);
+        memset(&opt, 0, sizeof(opt));
+        return f->code;
+}
+
+
+/*
+ * do_send / do_receive / do_push
+ *
+ * The calls run(), as the command line sender and receiver do them.
+ */
+static void do_send (struct canute_session *s, void *arg)
+{
+        struct send_items *a = arg;
+        char               name[PATH_MAX];
+        int                i;
+
+        if (opt.hash_cache != NULL)
+                hashcache_open(opt.hash_cache);
+        if (s->filter_file != NULL)
+                filter_load(s->filter_file);
+        if (opt.incremental)
+                fetch_index(&s->cn);
+        if (opt.peer_rules)
+                fetch_rules(&s->cn);
+
+        if (opt.pack_source != NULL)
+                send_pack(&s->cn, opt.pack_source, (char **) a->items,
+                          a->count);
+        for (i = 0;  opt.pack_source == NULL && i < a->count;  i++)
+        {
+                /* send_item() works on the name in place */
+                snprintf(name, PATH_MAX, "%s", a->items[i]);
+                send_item(&s->cn, name);
+        }
+
+        prefetch_stop();
+        send_end(&s->cn);
+        hashcache_save();
+        index_set_summary(NULL, 0);
+}
+
+
+static void do_receive (struct canute_session *s, void *unused)
+{
+        if (s->filter_file != NULL)
+                filter_load(s->filter_file);
+        if (opt.chunk_store != NULL)
+                store_open(opt.chunk_store);
+        if (opt.index != NULL)
+                index_load(opt.index);
+        if (opt.pack != NULL)
+                pack_create(opt.pack);
+
+        while (!receive_item(&s->cn))
+                ;
+
+        pack_finish();
+        index_save();
+        store_close();
+        durable_session_end(s->dir != NULL ? s->dir : ".");
+        confirm_end(&s->cn);
+        push_connection(&s->cn);
+}
+
+
+static void do_push (struct canute_session *s, void *unused)
+{
+        push_connection(&s->cn);
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * canute_config_init
+ *
+ * Everything off, as the command line without options.
+ */
+void canute_config_init (struct canute_config *cfg)
+{
+        memset(cfg, 0, sizeof(struct canute_config));
+}
+
+
+/*
+ * canute_connect
+ *
+ * Connect to a peer waiting with canute_accept() (or "canute getserv" or
+ * "canute send"), leaving the socket in *sk.  A host "unix:<path>" is the
+ * Unix socket of a peer on this host (see canute_accept_local()), which can
+ * take file contents without copying them through the socket.  Host names are
+ * resolved with gethostbyname(), which is not reentrant everywhere: threads
+ * connecting at the same time should give addresses.
+ */
+int canute_connect (const char *host, unsigned short port, int *sk)
+{
+        char name[PATH_MAX];
+
+        snprintf(name, PATH_MAX, "%s", host);
+        fail_trap(&thread_failure);
+        if (setjmp(thread_failure.env) == 0)
+                *sk = (int) open_connection_client(name, port);
+        fail_trap(NULL);
+        return thread_failure.code;
+}
+
+
+/*
+ * canute_accept
+ *
+ * Wait for a single peer to connect to port, leaving the socket in *sk.
+ */
+int canute_accept (unsigned short port, int *sk)
+{
+        fail_trap(&thread_failure);
+        if (setjmp(thread_failure.env) == 0)
+                *sk = (int) open_connection_server(port);
+        fail_trap(NULL);
+        return thread_failure.code;
+}
+
+
+/*
+ * canute_accept_local
+ *
+ * Like canute_accept(), for a peer on this host connecting to the Unix socket
+ * at path (as "unix:<path>").
+ */
+int canute_accept_local (const char *path, int *sk)
+{
+        fail_trap(&thread_failure);
+        if (setjmp(thread_failure.env) == 0)
+                *sk = (int) open_local_server(path);
+        fail_trap(NULL);
+        return thread_failure.code;
+}
+
+
+/*
+ * canute_session_new
+ *
+ * Start a session over the connected socket sk, with the given settings.
+ */
+int canute_session_new (int                         sk,
+                        const struct canute_config *cfg,
+                        struct canute_session     **session)
+{
+        struct canute_session *s;
+        int                    durability = 0;
+
+        /* Arming clears the last failure */
+        fail_trap(&thread_failure);
+        fail_trap(NULL);
+        *session = NULL;
+
+        if (cfg->durability != NULL)
+                durability = durable_policy(cfg->durability);
+        if (durability == -1)
+        {
+                thread_failure.code = CANUTE_EINVAL;
+                snprintf(thread_failure.message,
+                         sizeof(thread_failure.message),
+                         "Unknown durability policy '%s'", cfg->durability);
+                return thread_failure.code;
+        }
+
+        s = calloc(1, sizeof(struct canute_session));
+        if (s == NULL)
+        {
+                thread_failure.code = CANUTE_ENOMEM;
+                snprintf(thread_failure.message,
+                         sizeof(thread_failure.message), "Allocating session");
+                return thread_failure.code;
+        }
+
+        s->opt.dedup        = cfg->dedup;
+        s->opt.sparse       = cfg->sparse;
+        s->opt.incremental  = cfg->incremental;
+        s->opt.hash_cache   = (char *) cfg->hash_cache;
+        s->opt.pack_source  = (char *) cfg->pack_source;
+        s->opt.hard_links   = cfg->hard_links;
+        s->opt.peer_rules   = cfg->peer_rules;
+        s->opt.confirmed    = cfg->confirmed;
+        s->filter_file      = cfg->filter_file;
+        s->opt.chunk_store  = (char *) cfg->chunk_store;
+        s->opt.index        = (char *) cfg->index;
+        s->opt.index_hashes = cfg->index_hashes;
+        s->opt.pack         = (char *) cfg->pack;
+        s->opt.durability   = durability;
+        s->dir              = cfg->directory;
+        s->buffer           = cfg->buffer;
+        s->progress         = cfg->progress;
+        s->progress_arg     = cfg->progress_arg;
+
+        fail_trap(&thread_failure);
+        if (setjmp(thread_failure.env) == 0)
+        {
+                socket_connection(&s->cn, (SOCKET) sk);
+                if (s->buffer != NULL)
+                        connection_buffers(&s->cn, s->buffer,
+                                           s->buffer + NET_BUFFER);
+                *session = s;
+        }
+        else
+                free(s);
+        fail_trap(NULL);
+        return thread_failure.code;
+}
+
+
+/*
+ * canute_send
+ *
+ * Send count items (files or directories) to the peer, which must be in
+ * canute_receive().  With a pack source the items are paths inside it, and
+ * none means everything.
+ */
+int canute_send (struct canute_session *session, const char *const *items,
+                 int count)
+{
+        struct send_items a;
+
+        a.items = items;
+        a.count = count;
+        return run(session, do_send, &a);
+}
+
+
+/*
+ * canute_receive
+ *
+ * Receive whatever the peer sends in one canute_send() (or "canute send").
+ */
+int canute_receive (struct canute_session *session)
+{
+        return run(session, do_receive, NULL);
+}
+
+
+/*
+ * canute_error
+ *
+ * What went wrong in the last call of the session, or in the last one of this
+ * thread that had no session yet if session is NULL.
+ */
+const char *canute_error (const struct canute_session *session)
+{
+        return (session != NULL ? session->failure.message
+                                : thread_failure.message);
+}
+
+
+/*
+ * canute_warnings
+ *
+ * Number of non fatal errors (files that could not be read or written, etc.)
+ * in the last call of the session.
+ */
+int canute_warnings (const struct canute_session *session)
+{
+        return session->failure.warnings;
+}
+
+
+/*
+ * canute_session_free
+ *
+ * End the session.  The socket is left open.
+ */
+void canute_session_free (struct canute_session *session)
+{
+        if (session == NULL)
+                return;
+        run(session, do_push, NULL);
+        release_connection(&session->cn);
+        free(session);
+}
+
+
+/*
+ * canute_strerror
+ *
+ * Describe an error code.
+ */
+const char *canute_strerror (int code)
+{
+        if (code < 0 || code > CANUTE_EINVAL)
+                return "Unknown error";
+        return error_names[code];
+}
@@ -0,0 +1,95 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                           LIBRARY INTERFACE                                */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * Canute as a library (libcanute.a, libcanute.so), see libcanute.c.  This is
+ * the only header programs using it need.
+ */
+#ifndef LIBCANUTE_H
+#define LIBCANUTE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define CANUTE_API __attribute__ ((visibility ("default")))
+#else
+#define CANUTE_API
+#endif
+
+/* Error codes.  Calls return CANUTE_OK or one of the others */
+#define CANUTE_OK          0
+#define CANUTE_EFILE       1  /* Local file, directory, pack, index... */
+#define CANUTE_ENET        2  /* Connection failed or closed by the peer */
+#define CANUTE_EPROTO      3  /* The peer sent something unexpected */
+#define CANUTE_ENOMEM      4  /* Out of memory */
+#define CANUTE_EINVAL      5  /* Bad argument, or a session already broken */
+
+/* Size of the optional buffer in struct canute_config */
+#define CANUTE_BUFFER_SIZE (9 * 65536)
+
+/*
+ * Called when a file starts (done is where it resumes), about once a second
+ * while it goes, and when it is complete (done == size).
+ */
+typedef void (*canute_progress) (const char *name, long long done,
+                                 long long size, void *arg);
+
+/*
+ * Session settings.  Fill with canute_config_init() first.  Strings are not
+ * copied, they must last as long as the session.  The options have the same
+ * meaning as on the command line (see the README).
+ */
+struct canute_config
+{
+        int             dedup;         /* Sender: -d */
+        int             sparse;        /* Sender: -z */
+        int             incremental;   /* Sender: -i */
+        const char     *hash_cache;    /* Sender: -C */
+        const char     *pack_source;   /* Sender: -p */
+        int             hard_links;    /* Sender: -l */
+        int             peer_rules;    /* Sender: -r */
+        int             confirmed;     /* Sender: -a */
+        const char     *filter_file;   /* -X, NULL for no filter rules */
+        const char     *chunk_store;   /* Receiver: -S */
+        const char     *index;         /* Receiver: -I */
+        int             index_hashes;  /* Receiver: -H */
+        const char     *pack;          /* Receiver: -P */
+        const char     *durability;    /* Receiver: -y, NULL for "none" */
+        const char     *directory;     /* Items are relative to it, or
+                                        * received into it.  NULL for the
+                                        * current directory */
+        canute_progress progress;      /* May be NULL */
+        void           *progress_arg;
+        void           *buffer;        /* CANUTE_BUFFER_SIZE bytes, or NULL
+                                        * to have them allocated */
+};
+
+struct canute_session;
+
+CANUTE_API void        canute_config_init  (struct canute_config *cfg);
+CANUTE_API int         canute_connect      (const char *host, unsigned short port, int *sk);
+CANUTE_API int         canute_accept       (unsigned short port, int *sk);
+CANUTE_API int         canute_accept_local (const char *path, int *sk);
+CANUTE_API int         canute_session_new  (int sk, const struct canute_config *cfg, struct canute_session **session);
+CANUTE_API int         canute_send         (struct canute_session *session, const char *const *items, int count);
+CANUTE_API int         canute_receive      (struct canute_session *session);
+CANUTE_API const char *canute_error        (const struct canute_session *session);
+CANUTE_API int         canute_warnings     (const struct canute_session *session);
+CANUTE_API void        canute_session_free (struct canute_session *session);
+CANUTE_API const char *canute_strerror     (int code);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBCANUTE_H */
@@ -0,0 +1,150 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                         SENDER HARD LINK TRACKING                          */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * Every path is stat()ed and sent on its own, so a file with several hard
+ * links would go through the wire, and take space on the receiver, once per
+ * link.  With -l the sender remembers where the first link of every file with
+ * more than one went (its path relative to the session start, as the receiver
+ * sees it) keyed by device and inode.  The other links are offered as a
+ * REQUEST_LINK to that path instead of their contents (see protocol.c).
+ *
+ * Only files with a link count above one are remembered, so the table stays
+ * small in trees that do not use hard links.  It lives for a whole session.
+ * Hasefroch has no usable inode numbers: nothing is ever found there.
+ */
+#include "canute.h"
+
+struct link_entry
+{
+        dev_t  dev;
+        ino_t  ino;
+        char  *path;
+};
+
+
+/*************************  PRIVATE DATA (Sender)  ***************************/
+
+static THREAD_LOCAL struct link_entry *entries     = NULL;
+static THREAD_LOCAL size_t             entry_count = 0;
+static THREAD_LOCAL size_t             entry_alloc = 0;
+static THREAD_LOCAL size_t            *slots       = NULL;  /* entry number + 1, 0 = free */
+static THREAD_LOCAL size_t             slot_count  = 0;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * find_entry
+ *
+ * Return the slot for the inode: either the one holding it or the free one
+ * where it would go.
+ */
+static size_t *find_entry (dev_t dev, ino_t ino)
+{
+        size_t i;
+
+        i = ((size_t) ino * 2654435761U ^ (size_t) dev) & (slot_count - 1);
+        while (slots[i] != 0 && (entries[slots[i] - 1].ino != ino
+                                 || entries[slots[i] - 1].dev != dev))
+                i = (i + 1) & (slot_count - 1);
+        return &slots[i];
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * links_find
+ *
+ * Path where another link of the file st describes was sent, or NULL if none
+ * was.
+ */
+const char *links_find (const struct stat_info *st)
+{
+#ifdef HASEFROCH
+        return NULL;
+#else
+        size_t *slot;
+
+        if (st->st_nlink < 2 || slot_count == 0)
+                return NULL;
+        slot = find_entry(st->st_dev, st->st_ino);
+        return (*slot != 0 ? entries[*slot - 1].path : NULL);
+#endif
+}
+
+
+/*
+ * links_add
+ *
+ * The file st describes has been sent as path, remember it if it has other
+ * links.
+ */
+void links_add (const struct stat_info *st, const char *path)
+{
+#ifndef HASEFROCH
+        size_t i;
+
+        if (st->st_nlink < 2 || links_find(st) != NULL)
+                return;
+
+        if (entry_count == entry_alloc)
+        {
+                entry_alloc = (entry_alloc == 0 ? 256 : entry_alloc * 2);
+                entries     = realloc(entries,
+                                      entry_alloc * sizeof(struct link_entry));
+                if (entries == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating hard link table");
+        }
+
+        if ((entry_count + 1) * 2 > slot_count)
+        {
+                free(slots);
+                slot_count = (slot_count == 0 ? 512 : slot_count * 2);
+                slots      = calloc(slot_count, sizeof(size_t));
+                if (slots == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating hard link table");
+                for (i = 0;  i < entry_count;  i++)
+                        *find_entry(entries[i].dev, entries[i].ino) = i + 1;
+        }
+
+        entries[entry_count].dev  = st->st_dev;
+        entries[entry_count].ino  = st->st_ino;
+        entries[entry_count].path = strdup(path);
+        if (entries[entry_count].path == NULL)
+                fail(CANUTE_ENOMEM, "Allocating hard link table");
+        *find_entry(st->st_dev, st->st_ino) = ++entry_count;
+#endif
+}
+
+
+/*
+ * links_reset
+ *
+ * Forget every file sent, at the end of a session.
+ */
+void links_reset (void)
+{
+        size_t i;
+
+        for (i = 0;  i < entry_count;  i++)
+                free(entries[i].path);
+        free(entries);
+        free(slots);
+        entries     = NULL;
+        entry_count = 0;
+        entry_alloc = 0;
+        slots       = NULL;
+        slot_count  = 0;
+}
@@ -0,0 +1,1250 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                       MULTIPATH CONNECTIONS                                */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * With -m on both ends the session does not go through the first connection
+ * alone, but through several TCP connections ("paths") between pairs of
+ * addresses: the client binds each one to one of its -m addresses (or those
+ * of the interfaces named) and connects to one of the server -m addresses.
+ * Hosts with several network cards get them all working for one session.
+ *
+ * SETTING UP
+ *
+ * Right after connecting, on the first connection, the client sends a
+ * REQUEST_PATHS with how many addresses it has.  The server answers another
+ * one with a random token in the name, and its addresses ("host" or
+ * "host:port", the port defaulting to its own) as text of the size given.  The
+ * server listens on its port again meanwhile.  The client pairs the lists up,
+ * as many paths as the longer one has, connects each path and sends the token
+ * and the path number on it in a REQUEST_PATHS.  Then it tells the server which
+ * paths it opened, a bitmap in the size of a REQUEST_PATHS on the first
+ * connection, and the server replies a REPLY_ACCEPT with those it took.  A path
+ * that cannot be opened is just left out.
+ *
+ * FRAMES
+ *
+ * From then on the protocol byte stream goes through multipath_transport, cut
+ * in frames of MP_FRAME bytes at most.  A frame has a header of three 32 bit
+ * words, kind, sequence number and length, and then its data.  Every frame
+ * goes to the path that would deliver it first: among those not busy writing,
+ * the one with the least data on the way for its measured throughput, so the
+ * paths carry shares in proportion to their speed.  The first connection is
+ * one more path.  The receiving end puts frames back in order.
+ *
+ * Frames are kept until the peer says it has consumed them, in the sequence
+ * number of an ack (FRAME_ACK).  Its length is how many data bytes the path
+ * it comes through has received, which measures the throughput of the path.
+ * The peer sends one on every path when it has consumed a quarter of
+ * MP_WINDOW, and whenever it has to wait for data.  At most MP_WINDOW bytes
+ * are kept, which bounds the memory of both ends like socket buffers do.
+ *
+ * DROPPING PATHS
+ *
+ * A path that fails is closed, and the frames it had not delivered go through
+ * the others.  A path may also stall without failing (a cable pulled, a
+ * router gone): TCP keeps trying for minutes.  While an end waits it sends a
+ * FRAME_BEAT (an ack) on every path each MP_BEAT ms, so the other end knows it
+ * is reading all of them.  If the oldest frame not received yet sits on a path
+ * that has not delivered anything for MP_STALL ms while beats come through the
+ * others, that path is dropped as well.  The last path is never dropped for
+ * stalling, and the session fails when it fails.  An end closing sends a
+ * FRAME_BYE on every path first, so the other does not take it for a failure.
+ */
+#include "canute.h"
+
+#ifndef HASEFROCH
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <ifaddrs.h>
+#define MULTIPATH
+#endif
+
+#define MP_PATHS    8      /* Most paths besides the first connection */
+#define MP_ADDRS    16     /* Most -m addresses */
+#define MP_HEADER   12     /* Frame header: kind, sequence, length */
+#define MP_FRAME    CANUTE_BLOCK_SIZE
+#define MP_WINDOW   (128 * CANUTE_BLOCK_SIZE)  /* Bytes kept until consumed */
+#define MP_BEAT     500    /* ms between beats while waiting */
+#define MP_STALL    3000   /* ms a path may hold the oldest frame back */
+#define MP_CONNECT  5000   /* ms to open a path */
+#define MP_MEASURE  250    /* ms between throughput samples */
+#define MP_TEXT     4096   /* Longest address list */
+#define FRAME_DATA  1
+#define FRAME_ACK   2
+#define FRAME_BEAT  3
+#define FRAME_BYE   4
+#define FRAME_BYTES(f)   ((char *) ((f) + 1))          /* Header and data */
+#define FRAME_DATA_AT(f) (FRAME_BYTES(f) + MP_HEADER)
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+/*
+ * A frame, sent (kept until consumed) or received (kept until consumed too).
+ * The header and the data follow the structure.
+ */
+struct frame
+{
+        uint32_t      seq;
+        size_t        len;
+        int           path;      /* Carrying it, -1 for none yet */
+        int           writing;   /* Its path is writing it right now */
+        int           orphan;    /* Consumed while being written */
+        int           received;  /* Delivered by its path */
+        uint32_t      at;        /* Bytes given to its path, up to its end */
+        long long     assigned;  /* When it was given to its path */
+        struct frame *next;
+};
+
+struct path
+{
+        SOCKET        sk;        /* INVALID_SOCKET once dropped */
+        char          name[64];
+        /* Output: one frame or ack at a time */
+        struct frame *cur;
+        char          ctl[MP_HEADER];
+        const char   *wbuf;
+        size_t        wlen, wpos;
+        int           ack, beat; /* Owes the peer an ack, or a beat */
+        int           bye;       /* Has to tell the peer it is closing */
+        uint32_t      given;     /* Data bytes given to it, all along */
+        long long     inflight;  /* Bytes on the way, not received */
+        long long     carried;   /* Data bytes through it, either way */
+        long long     sample;    /* Bytes received since measured */
+        long long     measured;
+        long long     rate;      /* Bytes per second, 0 while unknown */
+        long long     progress;  /* When it delivered something last */
+        /* Input */
+        char          hdr[MP_HEADER];
+        size_t        hdr_fill;
+        struct frame *in;
+        size_t        in_fill;
+        uint32_t      got;       /* Data bytes received, all along */
+        long long     beat_heard;
+};
+
+struct multipath
+{
+        struct path   paths[MP_PATHS + 1];
+        int           count, alive;
+        int           closing;       /* Paths closed are fine from now on */
+        char         *rbuf;
+        /* Sending */
+        struct frame *queue, *tail;  /* Not consumed yet, by sequence */
+        long long     queued;
+        uint32_t      next_seq;
+        /* Receiving */
+        struct frame *store;         /* Not consumed yet, by sequence */
+        size_t        pos;           /* Consumed of the first one */
+        uint32_t      expected;
+        long long     unacked;       /* Bytes consumed since the last ack */
+        long long     beat_sent;
+};
+
+
+/*************************  PRIVATE DATA (Both ends)  *************************/
+
+static char *addrs[MP_ADDRS];
+static int   addr_count = 0;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+#ifdef MULTIPATH
+/*
+ * now_ms
+ *
+ * Milliseconds since the epoch.
+ */
+static long long now_ms (void)
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+
+/*
+ * new_frame
+ *
+ * Allocate a frame for len bytes of data, its header filled in.
+ */
+static struct frame *new_frame (int kind, uint32_t seq, size_t len)
+{
+        struct frame *f = malloc(sizeof(struct frame) + MP_HEADER + len);
+        uint32_t     *h;
+
+        if (f == NULL)
+                fail(CANUTE_ENOMEM, "Allocating frame");
+        memset(f, 0, sizeof(struct frame));
+        f->seq  = seq;
+        f->len  = len;
+        f->path = -1;
+        h       = (uint32_t *) (f + 1);
+        h[0]    = htonl(kind);
+        h[1]    = htonl(seq);
+        h[2]    = htonl((uint32_t) len);
+        return f;
+}
+
+
+/*
+ * owe_acks
+ *
+ * Have every path tell the peer what it consumed and the path delivered.
+ */
+static void owe_acks (struct multipath *mp)
+{
+        int i;
+
+        for (i = 0;  i < mp->count;  i++)
+                mp->paths[i].ack = 1;
+        mp->unacked = 0;
+}
+
+
+/*
+ * drop_path
+ *
+ * Close a path.  What it had not delivered goes through the others.
+ */
+static void drop_path (struct multipath *mp, int i, const char *why)
+{
+        struct path  *p = &mp->paths[i];
+        struct frame *f;
+
+        if (why != NULL)
+                inform("--- Path %s %s, dropped\n", p->name, why);
+        closesocket(p->sk);
+        p->sk = INVALID_SOCKET;
+        mp->alive--;
+
+        if (p->cur != NULL)
+        {
+                p->cur->writing = 0;
+                if (p->cur->orphan)
+                        free(p->cur);
+        }
+        p->cur      = NULL;
+        p->wlen     = 0;
+        p->wpos     = 0;
+        p->inflight = 0;
+        free(p->in);
+        p->in       = NULL;
+        p->hdr_fill = 0;
+        for (f = mp->queue;  f != NULL;  f = f->next)
+                if (f->path == i && !f->received)
+                        f->path = -1;
+}
+
+
+/*
+ * write_path
+ *
+ * Go on writing the current frame or ack of a path, as far as it takes.
+ */
+static void write_path (struct multipath *mp, int i)
+{
+        struct path  *p = &mp->paths[i];
+        struct frame *f;
+        ssize_t       s;
+
+        while (p->wpos < p->wlen)
+        {
+                s = send(p->sk, p->wbuf + p->wpos, p->wlen - p->wpos,
+                         SEND_FLAGS);
+                if (s == -1 && errno == EINTR)
+                        continue;
+                if (s == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return;
+                if (s <= 0)
+                {
+                        drop_path(mp, i, "failed");
+                        return;
+                }
+                p->wpos += s;
+        }
+
+        p->wlen = p->wpos = 0;
+        f       = p->cur;
+        p->cur  = NULL;
+        if (f != NULL)
+        {
+                f->writing = 0;
+                if (f->orphan)
+                        free(f);
+        }
+}
+
+
+/*
+ * start_write
+ *
+ * Have a path write count bytes of buf, which stay valid until it is done.
+ */
+static void start_write (struct multipath *mp, int i, const char *buf,
+                         size_t count)
+{
+        mp->paths[i].wbuf = buf;
+        mp->paths[i].wlen = count;
+        mp->paths[i].wpos = 0;
+        write_path(mp, i);
+}
+
+
+/*
+ * credit
+ *
+ * A frame was delivered: count it for the throughput of its path.
+ */
+static void credit (struct multipath *mp, struct frame *f, long long now)
+{
+        struct path *p;
+
+        f->received = 1;
+        if (f->path == -1)
+                return;
+        p            = &mp->paths[f->path];
+        p->inflight -= f->len;
+        p->carried  += f->len;
+        p->sample   += f->len;
+        p->progress  = now;
+}
+
+
+/*
+ * take_ack
+ *
+ * The peer consumed everything before seq, and got bytes of data through path
+ * i.  Credit the frames delivered and forget those consumed.
+ */
+static void take_ack (struct multipath *mp, int i, uint32_t seq, uint32_t got)
+{
+        struct frame *f;
+        long long     now = now_ms();
+
+        /* A path delivers in the order it was given its frames */
+        for (f = mp->queue;  f != NULL;  f = f->next)
+                if (f->path == i && !f->received && !f->writing
+                    && (int32_t) (f->at - got) <= 0)
+                        credit(mp, f, now);
+
+        while (mp->queue != NULL && (int32_t) (mp->queue->seq - seq) < 0)
+        {
+                f         = mp->queue;
+                mp->queue = f->next;
+                if (!f->received)
+                        credit(mp, f, now);
+                if (mp->queue == NULL)
+                        mp->tail = NULL;
+                mp->queued -= f->len;
+                if (f->writing)
+                        f->orphan = 1;
+                else
+                        free(f);
+        }
+}
+
+
+/*
+ * store_frame
+ *
+ * Keep a data frame received, in order, unless it is a copy of one seen.
+ */
+static void store_frame (struct multipath *mp, struct frame *f)
+{
+        struct frame **at = &mp->store;
+
+        if ((int32_t) (f->seq - mp->expected) < 0)
+        {
+                free(f);
+                return;
+        }
+        while (*at != NULL && (int32_t) ((*at)->seq - f->seq) < 0)
+                at = &(*at)->next;
+        if (*at != NULL && (*at)->seq == f->seq)
+        {
+                free(f);
+                return;
+        }
+        f->next = *at;
+        *at     = f;
+}
+
+
+/*
+ * take_input
+ *
+ * Parse count bytes read from a path.  Return false if they make no sense.
+ */
+static int take_input (struct multipath *mp, int i, const char *buf,
+                       size_t count)
+{
+        struct path *p = &mp->paths[i];
+        uint32_t     h[3];
+        size_t       n;
+        int          kind;
+
+        while (count > 0)
+        {
+                if (p->in == NULL)
+                {
+                        n = MP_HEADER - p->hdr_fill;
+                        n = (n < count ? n : count);
+                        memcpy(p->hdr + p->hdr_fill, buf, n);
+                        p->hdr_fill += n;
+                        buf         += n;
+                        count       -= n;
+                        if (p->hdr_fill < MP_HEADER)
+                                break;
+                        p->hdr_fill = 0;
+
+                        memcpy(h, p->hdr, MP_HEADER);
+                        kind = ntohl(h[0]);
+                        if (kind == FRAME_BYE)
+                        {
+                                mp->closing = 1;
+                                continue;
+                        }
+                        if (kind == FRAME_ACK || kind == FRAME_BEAT)
+                        {
+                                take_ack(mp, i, ntohl(h[1]), ntohl(h[2]));
+                                if (kind == FRAME_BEAT)
+                                        p->beat_heard = now_ms();
+                                continue;
+                        }
+                        if (kind != FRAME_DATA || ntohl(h[2]) == 0
+                            || ntohl(h[2]) > MP_FRAME)
+                                return 0;
+                        p->in      = new_frame(kind, ntohl(h[1]), ntohl(h[2]));
+                        p->in_fill = 0;
+                        continue;
+                }
+
+                n = p->in->len - p->in_fill;
+                n = (n < count ? n : count);
+                memcpy(FRAME_DATA_AT(p->in) + p->in_fill, buf, n);
+                p->in_fill += n;
+                buf        += n;
+                count      -= n;
+                if (p->in_fill == p->in->len)
+                {
+                        p->got     += (uint32_t) p->in->len;
+                        p->carried += p->in->len;
+                        store_frame(mp, p->in);
+                        p->in = NULL;
+                }
+        }
+        return 1;
+}
+
+
+/*
+ * read_path
+ *
+ * Take everything a path has ready.
+ */
+static void read_path (struct multipath *mp, int i)
+{
+        struct path *p = &mp->paths[i];
+        ssize_t      r;
+
+        for (;;)
+        {
+                r = recv(p->sk, mp->rbuf, CANUTE_BLOCK_SIZE, 0);
+                if (r == -1 && errno == EINTR)
+                        continue;
+                if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return;
+                if (r <= 0)
+                {
+                        drop_path(mp, i, (r < 0 ? "failed" : mp->closing
+                                          ? NULL : "closed"));
+                        return;
+                }
+                if (!take_input(mp, i, mp->rbuf, (size_t) r))
+                {
+                        drop_path(mp, i, "garbled");
+                        return;
+                }
+        }
+}
+
+
+/*
+ * best_path
+ *
+ * The path, among those not busy writing, that would deliver count more bytes
+ * first at its measured throughput, or -1 if all are busy.
+ */
+static int best_path (struct multipath *mp, size_t count)
+{
+        struct path *p;
+        double       score, best_score = 0, known = 0;
+        int          i, n = 0, best = -1;
+
+        /* Paths not measured yet count as average */
+        for (i = 0;  i < mp->count;  i++)
+                if (mp->paths[i].sk != INVALID_SOCKET && mp->paths[i].rate > 0)
+                {
+                        known += (double) mp->paths[i].rate;
+                        n++;
+                }
+        known = (n > 0 ? known / n : 1.0);
+
+        for (i = 0;  i < mp->count;  i++)
+        {
+                p = &mp->paths[i];
+                if (p->sk == INVALID_SOCKET || p->wlen > 0)
+                        continue;
+                score = (double) (p->inflight + (long long) count)
+                        / (p->rate > 0 ? (double) p->rate : known);
+                if (best == -1 || score < best_score)
+                {
+                        best       = i;
+                        best_score = score;
+                }
+        }
+        return best;
+}
+
+
+/*
+ * pump
+ *
+ * Give the paths not busy writing something to write: acks and beats first,
+ * then the frames nobody carries, oldest first.
+ */
+static void pump (struct multipath *mp)
+{
+        struct path  *p;
+        struct frame *f;
+        uint32_t     *h;
+        int           i;
+
+        for (i = 0;  i < mp->count;  i++)
+        {
+                p = &mp->paths[i];
+                if (p->sk == INVALID_SOCKET || p->wlen > 0
+                    || (!p->beat && !p->ack && !p->bye))
+                        continue;
+                h    = (uint32_t *) p->ctl;
+                h[0] = htonl(p->bye ? FRAME_BYE
+                             : p->beat ? FRAME_BEAT : FRAME_ACK);
+                h[1] = htonl(mp->expected);
+                h[2] = htonl(p->got);
+                p->beat = 0;
+                p->ack  = 0;
+                p->bye  = 0;
+                start_write(mp, i, p->ctl, MP_HEADER);
+        }
+
+        for (f = mp->queue;  f != NULL;  f = f->next)
+        {
+                if (f->path != -1 || f->received)
+                        continue;
+                i = best_path(mp, f->len);
+                if (i == -1)
+                        break;
+                p            = &mp->paths[i];
+                f->path      = i;
+                f->writing   = 1;
+                f->assigned  = now_ms();
+                p->cur       = f;
+                p->inflight += f->len;
+                p->given    += (uint32_t) f->len;
+                f->at        = p->given;
+                start_write(mp, i, FRAME_BYTES(f), MP_HEADER + f->len);
+        }
+}
+
+
+/*
+ * poll_paths
+ *
+ * Wait up to timeout ms for the paths, then read and write what they allow.
+ */
+static void poll_paths (struct multipath *mp, int timeout)
+{
+        struct pollfd pfd[MP_PATHS + 1];
+        int           idx[MP_PATHS + 1];
+        int           i, n = 0;
+
+        for (i = 0;  i < mp->count;  i++)
+        {
+                if (mp->paths[i].sk == INVALID_SOCKET)
+                        continue;
+                pfd[n].fd      = mp->paths[i].sk;
+                pfd[n].events  = POLLIN;
+                pfd[n].revents = 0;
+                if (mp->paths[i].wlen > 0)
+                        pfd[n].events |= POLLOUT;
+                idx[n++] = i;
+        }
+        if (n == 0 || poll(pfd, n, timeout) <= 0)
+                return;
+
+        for (i = 0;  i < n;  i++)
+        {
+                if ((pfd[i].revents & (POLLOUT | POLLERR))
+                    && mp->paths[idx[i]].sk != INVALID_SOCKET)
+                        write_path(mp, idx[i]);
+                if ((pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    && mp->paths[idx[i]].sk != INVALID_SOCKET)
+                        read_path(mp, idx[i]);
+        }
+}
+
+
+/*
+ * measure
+ *
+ * Update the throughput of the paths that were busy since the last sample.
+ */
+static void measure (struct multipath *mp)
+{
+        struct path *p;
+        long long    now = now_ms(), rate;
+        int          i;
+
+        for (i = 0;  i < mp->count;  i++)
+        {
+                p = &mp->paths[i];
+                if (now - p->measured < MP_MEASURE)
+                        continue;
+                if (p->sample > 0 || p->inflight > 0)
+                {
+                        rate    = p->sample * 1000 / (now - p->measured);
+                        p->rate = (p->rate == 0 ? rate
+                                                : (3 * p->rate + rate) / 4);
+                }
+                p->sample   = 0;
+                p->measured = now;
+        }
+}
+
+
+/*
+ * check_stall
+ *
+ * Drop the path holding back the oldest frame not received, if it delivered
+ * nothing for MP_STALL ms while the peer, beating through another path, was
+ * reading them all.
+ */
+static void check_stall (struct multipath *mp)
+{
+        struct frame *f;
+        struct path  *p;
+        long long     since, now = now_ms();
+        int           i;
+
+        if (mp->alive < 2)
+                return;
+        for (f = mp->queue;  f != NULL && f->received;  f = f->next)
+                ;
+        if (f == NULL || f->path == -1)
+                return;
+
+        p     = &mp->paths[f->path];
+        since = (f->assigned > p->progress ? f->assigned : p->progress);
+        if (now - since < MP_STALL)
+                return;
+        for (i = 0;  i < mp->count;  i++)
+                if (i != f->path && mp->paths[i].sk != INVALID_SOCKET
+                    && mp->paths[i].beat_heard > since + MP_BEAT)
+                {
+                        drop_path(mp, f->path, "stalled");
+                        return;
+                }
+}
+
+
+/*
+ * service
+ *
+ * Move data through the paths, as far as they allow without waiting.
+ */
+static void service (struct multipath *mp)
+{
+        poll_paths(mp, 0);
+        pump(mp);
+        measure(mp);
+}
+
+
+/*
+ * wait_paths
+ *
+ * The caller cannot go on until something comes: tell the peer where we are,
+ * beat, and wait a while for the paths.
+ */
+static void wait_paths (struct multipath *mp)
+{
+        long long now = now_ms();
+        int       i;
+
+        if (mp->unacked > 0)
+                owe_acks(mp);
+        if (now - mp->beat_sent >= MP_BEAT)
+        {
+                for (i = 0;  i < mp->count;  i++)
+                        mp->paths[i].beat = 1;
+                mp->beat_sent = now;
+        }
+        pump(mp);
+        poll_paths(mp, MP_BEAT);
+        check_stall(mp);
+        service(mp);
+}
+
+
+/*
+ * mp_send
+ *
+ * Transport send: queue the bytes in frames, waiting while MP_WINDOW bytes
+ * are not consumed yet.
+ */
+static int mp_send (struct connection *cn, const char *buf, size_t count)
+{
+        struct multipath *mp = cn->ctx;
+        struct frame     *f;
+        size_t            n, done;
+
+        for (done = 0;  done < count;  done += n)
+        {
+                n = count - done;
+                n = (n < MP_FRAME ? n : MP_FRAME);
+                while (mp->alive > 0 && mp->queued + (long long) n > MP_WINDOW)
+                        wait_paths(mp);
+                if (mp->alive == 0)
+                {
+                        errno = ECONNRESET;
+                        return SOCKET_ERROR;
+                }
+
+                f = new_frame(FRAME_DATA, mp->next_seq++, n);
+                memcpy(FRAME_DATA_AT(f), buf + done, n);
+                if (mp->tail != NULL)
+                        mp->tail->next = f;
+                else
+                        mp->queue = f;
+                mp->tail    = f;
+                mp->queued += n;
+                service(mp);
+        }
+        return (int) count;
+}
+
+
+/*
+ * mp_recv
+ *
+ * Transport receive: the next bytes in order, waiting for them if needed.
+ */
+static int mp_recv (struct connection *cn, char *buf, size_t count)
+{
+        struct multipath *mp = cn->ctx;
+        struct frame     *f;
+        size_t            n;
+
+        while (mp->store == NULL || mp->store->seq != mp->expected)
+        {
+                if (mp->alive == 0)
+                        return 0;
+                service(mp);
+                if (mp->store != NULL && mp->store->seq == mp->expected)
+                        break;
+                wait_paths(mp);
+        }
+
+        f = mp->store;
+        n = f->len - mp->pos;
+        n = (n < count ? n : count);
+        memcpy(buf, FRAME_DATA_AT(f) + mp->pos, n);
+        mp->pos += n;
+        if (mp->pos == f->len)
+        {
+                mp->store    = f->next;
+                mp->pos      = 0;
+                mp->unacked += f->len;
+                mp->expected++;
+                free(f);
+                if (mp->unacked >= MP_WINDOW / 4)
+                {
+                        owe_acks(mp);
+                        service(mp);
+                }
+        }
+        return (int) n;
+}
+
+
+/*
+ * mp_close
+ *
+ * Transport close: get out what is queued, then close the paths gracefully,
+ * waiting a little for the peer to close them too.
+ */
+static void mp_close (struct connection *cn)
+{
+        struct multipath *mp = cn->ctx;
+        struct frame     *f;
+        long long         end;
+        int               i, pending;
+
+        for (i = 0;  i < mp->count;  i++)
+                mp->paths[i].bye = 1;
+        do
+        {
+                pending = 0;
+                for (f = mp->queue;  f != NULL;  f = f->next)
+                        if (f->path == -1 && !f->received)
+                                pending = 1;
+                for (i = 0;  i < mp->count;  i++)
+                        if (mp->paths[i].sk != INVALID_SOCKET
+                            && (mp->paths[i].wlen > 0 || mp->paths[i].bye))
+                                pending = 1;
+                if (pending)
+                        wait_paths(mp);
+        } while (pending && mp->alive > 0);
+
+        mp->closing = 1;
+        for (i = 0;  i < mp->count;  i++)
+                if (mp->paths[i].sk != INVALID_SOCKET)
+                        shutdown(mp->paths[i].sk, SHUT_WR);
+        end = now_ms() + MP_BEAT * 2;
+        while (mp->alive > 0 && now_ms() < end)
+                poll_paths(mp, MP_BEAT);
+
+        for (i = 0;  i < mp->count;  i++)
+        {
+                if (mp->paths[i].sk != INVALID_SOCKET)
+                        drop_path(mp, i, NULL);
+                inform("--- Path %s carried %lld bytes\n", mp->paths[i].name,
+                       mp->paths[i].carried);
+        }
+        while (mp->queue != NULL)
+        {
+                f         = mp->queue;
+                mp->queue = f->next;
+                free(f);
+        }
+        while (mp->store != NULL)
+        {
+                f         = mp->store;
+                mp->store = f->next;
+                free(f);
+        }
+        free(mp->rbuf);
+        free(mp);
+        cn->ctx = NULL;
+}
+
+
+static const struct transport multipath_transport = {
+        mp_send,
+        mp_recv,
+        mp_close
+};
+
+
+/*
+ * resolve
+ *
+ * Address of an -m entry: an IPv4 address, an interface name or a host name,
+ * maybe followed by ":port" (otherwise port).  Return false if there is none.
+ */
+static int resolve (const char *entry, unsigned short port,
+                    struct sockaddr_in *sa)
+{
+        char            host[256], *c;
+        struct ifaddrs *ifs, *ifa;
+        struct hostent *he;
+
+        snprintf(host, sizeof(host), "%s", entry);
+        c = strrchr(host, ':');
+        if (c != NULL)
+        {
+                *c   = '\0';
+                port = (unsigned short) atoi(c + 1);
+        }
+        memset(sa, 0, sizeof(struct sockaddr_in));
+        sa->sin_family      = AF_INET;
+        sa->sin_port        = htons(port);
+        sa->sin_addr.s_addr = inet_addr(host);
+        if (sa->sin_addr.s_addr != INADDR_NONE)
+                return 1;
+
+        if (getifaddrs(&ifs) == 0)
+        {
+                for (ifa = ifs;  ifa != NULL;  ifa = ifa->ifa_next)
+                        if (ifa->ifa_addr != NULL
+                            && ifa->ifa_addr->sa_family == AF_INET
+                            && strcmp(ifa->ifa_name, host) == 0)
+                                break;
+                if (ifa != NULL)
+                        sa->sin_addr = ((struct sockaddr_in *)
+                                        ifa->ifa_addr)->sin_addr;
+                freeifaddrs(ifs);
+                if (ifa != NULL)
+                        return 1;
+        }
+
+        he = gethostbyname(host);
+        if (he == NULL)
+                return 0;
+        sa->sin_addr.s_addr = ((struct in_addr *) he->h_addr)->s_addr;
+        return 1;
+}
+
+
+/*
+ * wait_socket
+ *
+ * Wait up to MP_CONNECT ms for a socket to be ready for events.
+ */
+static int wait_socket (SOCKET sk, int events)
+{
+        struct pollfd pfd;
+
+        pfd.fd     = sk;
+        pfd.events = events;
+        return poll(&pfd, 1, MP_CONNECT) == 1;
+}
+
+
+/*
+ * connect_path
+ *
+ * Open a path from local to remote, or return INVALID_SOCKET.
+ */
+static SOCKET connect_path (const struct sockaddr_in *local,
+                            const struct sockaddr_in *remote)
+{
+        SOCKET    sk;
+        int       flags, e = -1;
+        socklen_t len = sizeof(e);
+
+        sk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sk == INVALID_SOCKET)
+                return INVALID_SOCKET;
+        flags = fcntl(sk, F_GETFL);
+        fcntl(sk, F_SETFL, flags | O_NONBLOCK);
+        if (bind(sk, (SOCKADDR *) local, sizeof(*local)) == 0
+            && (connect(sk, (SOCKADDR *) remote, sizeof(*remote)) == 0
+                || (errno == EINPROGRESS && wait_socket(sk, POLLOUT)
+                    && getsockopt(sk, SOL_SOCKET, SO_ERROR, &e, &len) == 0
+                    && e == 0)))
+        {
+                fcntl(sk, F_SETFL, flags);
+                return sk;
+        }
+        if (e > 0)
+                errno = e;
+        closesocket(sk);
+        return INVALID_SOCKET;
+}
+
+
+/*
+ * path_name
+ *
+ * Name a path for messages.
+ */
+static void path_name (struct path *p, const struct sockaddr_in *from,
+                       const struct sockaddr_in *to)
+{
+        char a[16];
+
+        snprintf(a, sizeof(a), "%s", inet_ntoa(from->sin_addr));
+        snprintf(p->name, sizeof(p->name), "%s > %s:%d", a,
+                 inet_ntoa(to->sin_addr), ntohs(to->sin_port));
+}
+
+
+/*
+ * add_path
+ *
+ * Take a connected socket as the next path.
+ */
+static void add_path (struct multipath *mp, SOCKET sk)
+{
+        struct path       *p = &mp->paths[mp->count++];
+        struct sockaddr_in a, b;
+        socklen_t          alen = sizeof(a), blen = sizeof(b);
+        int                e = 1;
+
+        p->sk       = sk;
+        p->measured = now_ms();
+        setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, CCP_CAST &e, sizeof(e));
+        fcntl(sk, F_SETFL, fcntl(sk, F_GETFL) | O_NONBLOCK);
+        if (getsockname(sk, (SOCKADDR *) &a, &alen) == 0
+            && getpeername(sk, (SOCKADDR *) &b, &blen) == 0)
+                path_name(p, &a, &b);
+        mp->alive++;
+}
+
+
+/*
+ * open_paths
+ *
+ * Client side of the setup: learn the server addresses, connect the paths
+ * and return the bitmap of those the server took.
+ */
+static int open_paths (struct connection *cn, SOCKET *sk)
+{
+        struct connection  pc;
+        struct sockaddr_in local, remote, peer;
+        socklen_t          plen = sizeof(peer);
+        char               token[CANUTE_NAME_LENGTH + 1], text[MP_TEXT + 1];
+        char              *remotes[MP_ADDRS], *c;
+        long long          size;
+        int                i, n, opened = 0;
+
+        send_message(cn, REQUEST_PATHS, 0, 0, addr_count, NULL);
+        push_connection(cn);
+        if (receive_message(cn, NULL, NULL, &size, token) != REQUEST_PATHS
+            || size <= 0 || size > MP_TEXT)
+                fail(CANUTE_EPROTO, "The peer does not do multipath");
+        receive_data(cn, text, (size_t) size);
+        text[size] = '\0';
+        for (n = 0, c = strtok(text, " ");  c != NULL && n < MP_ADDRS;
+             c = strtok(NULL, " "))
+                remotes[n++] = c;
+        if (n == 0 || getpeername(connection_socket(cn), (SOCKADDR *) &peer,
+                                  &plen) == -1)
+                fail(CANUTE_EPROTO, "The peer does not do multipath");
+
+        for (i = 0;  i < MP_PATHS && (i < n || i < addr_count);  i++)
+        {
+                sk[i] = INVALID_SOCKET;
+                if (!resolve(addrs[i % addr_count], 0, &local)
+                    || !resolve(remotes[i % n], ntohs(peer.sin_port),
+                                &remote))
+                {
+                        errno = 0;
+                        error("Cannot resolve path %d", i + 1);
+                        continue;
+                }
+                sk[i] = connect_path(&local, &remote);
+                if (sk[i] == INVALID_SOCKET)
+                {
+                        error("Cannot open path %d", i + 1);
+                        continue;
+                }
+                socket_connection(&pc, sk[i]);
+                send_message(&pc, REQUEST_PATHS, 0, 0, i, token);
+                push_connection(&pc);
+                release_connection(&pc);
+                opened |= 1 << i;
+        }
+
+        send_message(cn, REQUEST_PATHS, 0, 0, opened, NULL);
+        push_connection(cn);
+        if (receive_message(cn, NULL, NULL, &size, NULL) != REPLY_ACCEPT)
+                fail(CANUTE_EPROTO, "Setting up paths");
+        for (i = 0;  i < MP_PATHS;  i++)
+                if ((opened & (1 << i)) && !(size & (1 << i)))
+                {
+                        closesocket(sk[i]);
+                        sk[i] = INVALID_SOCKET;
+                }
+        return (int) size & opened;
+}
+
+
+/*
+ * accept_paths
+ *
+ * Server side of the setup: tell the client our addresses and accept the
+ * paths it opens, on our port.  Return the bitmap of those taken.
+ */
+static int accept_paths (struct connection *cn, unsigned short port,
+                         SOCKET *sk)
+{
+        struct connection  pc;
+        struct sockaddr_in sa;
+        unsigned char      noise[8];
+        char               token[CANUTE_NAME_LENGTH + 1], text[MP_TEXT + 1];
+        char               name[CANUTE_NAME_LENGTH + 1];
+        long long          size;
+        size_t             len = 0;
+        SOCKET             bsk, psk;
+        FILE              *f;
+        int                i, e = 1, opened, taken = 0;
+
+        /* A client without -m may be waiting as well */
+        if ((buffered_input(cn) == 0
+             && !wait_socket(connection_socket(cn), POLLIN))
+            || receive_message(cn, NULL, NULL, NULL, NULL) != REQUEST_PATHS)
+        {
+                errno = 0;
+                fail(CANUTE_EPROTO, "The peer does not do multipath");
+        }
+
+        /* Listen again, before the client learns it may connect */
+        bsk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family      = AF_INET;
+        sa.sin_port        = htons(port);
+        sa.sin_addr.s_addr = INADDR_ANY;
+        setsockopt(bsk, SOL_SOCKET, SO_REUSEADDR, CCP_CAST &e, sizeof(e));
+        if (bsk == INVALID_SOCKET
+            || bind(bsk, (SOCKADDR *) &sa, sizeof(sa)) == SOCKET_ERROR
+            || listen(bsk, MP_PATHS) == SOCKET_ERROR)
+                fail(CANUTE_ENET, "Could not open port %d for paths", port);
+
+        /* A token, so nobody else joins */
+        f = fopen("/dev/urandom", "rb");
+        if (f == NULL || fread(noise, 1, sizeof(noise), f) != sizeof(noise))
+                for (i = 0;  i < (int) sizeof(noise);  i++)
+                        noise[i] = (unsigned char) (now_ms() >> i ^ getpid());
+        if (f != NULL)
+                fclose(f);
+        for (i = 0;  i < (int) sizeof(noise);  i++)
+                sprintf(token + 2 * i, "%02x", noise[i]);
+
+        for (i = 0;  i < addr_count;  i++)
+        {
+                if (!resolve(addrs[i], port, &sa))
+                        fail(CANUTE_EINVAL, "Cannot resolve '%s'", addrs[i]);
+                len += snprintf(text + len, MP_TEXT + 1 - len, "%s%s:%d",
+                                (i > 0 ? " " : ""), inet_ntoa(sa.sin_addr),
+                                ntohs(sa.sin_port));
+                if (len > MP_TEXT)
+                        fail(CANUTE_EINVAL, "Too many addresses");
+        }
+        send_message(cn, REQUEST_PATHS, 0, 0, (long long) len, token);
+        send_data(cn, text, len);
+        push_connection(cn);
+
+        if (receive_message(cn, NULL, NULL, &size, NULL) != REQUEST_PATHS)
+                fail(CANUTE_EPROTO, "Setting up paths");
+        opened = (int) size;
+        for (i = 0;  i < MP_PATHS;  i++)
+                sk[i] = INVALID_SOCKET;
+
+        /* They may come in any order, and not all of them */
+        for (i = 0;  i < MP_PATHS;  i++)
+        {
+                if (!(opened & (1 << i)))
+                        continue;
+                if (!wait_socket(bsk, POLLIN))
+                        break;
+                psk = accept(bsk, NULL, NULL);
+                if (psk == INVALID_SOCKET)
+                        continue;
+                socket_connection(&pc, psk);
+                if (wait_socket(psk, POLLIN)
+                    && receive_message(&pc, NULL, NULL, &size, name)
+                       == REQUEST_PATHS
+                    && strcmp(name, token) == 0 && size >= 0
+                    && size < MP_PATHS && (opened & (1 << size))
+                    && sk[size] == INVALID_SOCKET)
+                {
+                        sk[size] = psk;
+                        taken   |= 1 << size;
+                }
+                else
+                        closesocket(psk);
+                release_connection(&pc);
+        }
+        closesocket(bsk);
+
+        send_message(cn, REPLY_ACCEPT, 0, 0, taken, NULL);
+        push_connection(cn);
+        return taken;
+}
+#endif /* MULTIPATH */
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * multipath_add
+ *
+ * Take an -m address (or interface name).
+ */
+void multipath_add (char *addr)
+{
+        if (addr_count == MP_ADDRS)
+                fatal("Too many multipath addresses");
+        addrs[addr_count++] = addr;
+}
+
+
+/*
+ * multipath_enabled
+ *
+ * True if there are -m addresses.
+ */
+int multipath_enabled (void)
+{
+        return addr_count > 0;
+}
+
+
+/*
+ * multipath_setup
+ *
+ * Open the paths of a connection just made, as the server (listening on port)
+ * or as the client, and turn it into a multipath one.  Both ends must do so.
+ */
+void multipath_setup (struct connection *cn, int server, unsigned short port)
+{
+#ifdef MULTIPATH
+        struct multipath *mp;
+        SOCKET            sk[MP_PATHS];
+        size_t            n;
+        int               i, taken;
+
+        if (connection_socket(cn) == INVALID_SOCKET || connection_local(cn))
+        {
+                errno = 0;
+                fail(CANUTE_EINVAL, "Multipath needs TCP connections");
+        }
+        if (server)
+                taken = accept_paths(cn, port, sk);
+        else
+                taken = open_paths(cn, sk);
+
+        mp = calloc(1, sizeof(struct multipath));
+        if (mp == NULL || (mp->rbuf = malloc(CANUTE_BLOCK_SIZE)) == NULL)
+                fail(CANUTE_ENOMEM, "Allocating paths");
+        add_path(mp, cn->sk);
+        snprintf(mp->paths[0].name, sizeof(mp->paths[0].name), "%s",
+                 "first connection");
+        for (i = 0;  i < MP_PATHS;  i++)
+                if (taken & (1 << i))
+                        add_path(mp, sk[i]);
+        inform("--- Transferring through %d paths\n", mp->count);
+
+        /* Frames the peer sent already may have been read ahead */
+        n = buffered_input(cn);
+        if (n > 0 && !take_input(mp, 0, cn->in + cn->in_pos, n))
+                fail(CANUTE_EPROTO, "Setting up paths");
+        cn->in_pos = cn->in_fill = 0;
+
+        cn->tr  = &multipath_transport;
+        cn->ctx = mp;
+        cn->sk  = INVALID_SOCKET;
+#else
+        errno = 0;
+        fail(CANUTE_EINVAL, "Multipath not supported");
+#endif
+}
@@ -9,8 +9,381 @@
 /*                                                                            */
 /******************************************************************************/
 
+/*
+ * EXPLANATION
+ *
+ * Connections are buffered both ways, so small messages do not cost a system
+ * call each:
+ *
+ *   - Output piles up in a NET_BUFFER sized buffer.  Whatever does not fit goes
+ *     out together with the buffer in a single sendmsg(), so a header and its
+ *     data block travel in the same call (and usually the same segment).
+ *
+ *   - Input is read in chunks as large as the peer has ready, up to NET_BUFFER,
+ *     and several headers are parsed from each.  Large reads skip the buffer.
+ *
+ *   - Pending output is sent before any receive that has to wait, otherwise
+ *     both peers could be waiting for each other.  Sockets have TCP_NODELAY,
+ *     so that last piece leaves at once instead of waiting for an ACK.  On
+ *     Linux everything but that piece is sent with MSG_MORE (TCP_CORK for a
+ *     single call) so partial segments are not sent in between.
+ *
+ * Code using the socket directly must call flush_connection() first, and mind
+ * what buffered_input() says has been read already.
+ *
+ * Once cipher_setup() is done, the buffers hold plaintext and the transport
+ * carries the records of cipher.c instead.  The socket is off limits then.
+ *
+ *
+ * LOCAL CONNECTIONS
+ *
+ * Peers on the same host may meet on a Unix socket instead, given as
+ * "unix:<path>" where a host or a port would go.  Such connections (whoever
+ * made the socket) can also pass open file descriptors: send_descriptor()
+ * sends a single byte carrying one (SCM_RIGHTS) and receive_descriptor() reads
+ * that byte and returns it.  Every read of a local connection collects the
+ * descriptors that come along in passed_fd, because the byte may have been
+ * read ahead into the buffer long before it is asked for.  The protocol only
+ * has one descriptor in flight at a time.
+ */
 #include "canute.h"
 
+#ifndef HASEFROCH
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#endif
+
+#define LOCAL_FDS 4  /* Most descriptors taken from a single read */
+
+/* A closed peer must be an error, not a signal that kills the process */
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+static int socket_send (struct connection *cn, const char *buf, size_t count)
+{
+        return send(cn->sk, CCP_CAST buf, count, SEND_FLAGS);
+}
+
+
+static int socket_recv (struct connection *cn, char *buf, size_t count)
+{
+        return recv(cn->sk, buf, count, 0);
+}
+
+
+static const struct transport socket_transport = {
+        socket_send,
+        socket_recv,
+        NULL
+};
+
+
+#ifndef HASEFROCH
+/*
+ * local_recv
+ *
+ * Like socket_recv(), keeping the descriptors passed along.
+ */
+static int local_recv (struct connection *cn, char *buf, size_t count)
+{
+        struct msghdr   msg;
+        struct iovec    iov;
+        struct cmsghdr *c;
+        ssize_t         r;
+        int            *fds;
+        size_t          n, i;
+        union
+        {
+                struct cmsghdr align;
+                char           buf[CMSG_SPACE(LOCAL_FDS * sizeof(int))];
+        } control;
+
+        iov.iov_base = buf;
+        iov.iov_len  = count;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+        r = recvmsg(cn->sk, &msg, MSG_CMSG_CLOEXEC);
+#else
+        r = recvmsg(cn->sk, &msg, 0);
+#endif
+        if (r <= 0)
+                return (int) r;
+        for (c = CMSG_FIRSTHDR(&msg);  c != NULL;  c = CMSG_NXTHDR(&msg, c))
+        {
+                if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+                        continue;
+                fds = (int *) CMSG_DATA(c);
+                n   = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (i = 0;  i < n;  i++)
+                {
+                        /* More than asked for, the peer is confused */
+                        if (cn->passed_fd != -1)
+                                close(fds[i]);
+                        else
+                                cn->passed_fd = fds[i];
+                }
+        }
+        return (int) r;
+}
+
+
+static const struct transport local_transport = {
+        socket_send,
+        local_recv,
+        NULL
+};
+
+
+/*
+ * local_address
+ *
+ * Fill a Unix socket address for path.
+ */
+static void local_address (struct sockaddr_un *addr, const char *path)
+{
+        memset(addr, 0, sizeof(struct sockaddr_un));
+        addr->sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr->sun_path))
+        {
+                errno = ENAMETOOLONG;
+                fail(CANUTE_EINVAL, "Socket path '%s'", path);
+        }
+        strcpy(addr->sun_path, path);
+}
+
+
+/*
+ * open_local_client
+ *
+ * Connect to the Unix socket at path.
+ */
+static SOCKET open_local_client (const char *path)
+{
+        struct sockaddr_un addr;
+        SOCKET             sk;
+        int                e;
+
+        local_address(&addr, path);
+        sk = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sk == INVALID_SOCKET)
+                fail(CANUTE_ENET, "Creating socket");
+        if (connect(sk, (SOCKADDR *) &addr, sizeof(addr)) == SOCKET_ERROR)
+        {
+                e = errno;
+                closesocket(sk);
+                errno = e;
+                fail(CANUTE_ENET, "Connecting to '%s'", path);
+        }
+        return sk;
+}
+#endif /* HASEFROCH */
+
+
+/*
+ * is_socket
+ *
+ * True if the connection goes straight through cn->sk.
+ */
+static int is_socket (struct connection *cn)
+{
+        if (cn->cipher != NULL)
+                return 0;
+#ifndef HASEFROCH
+        if (cn->tr == &local_transport)
+                return 1;
+#endif
+        return cn->tr == &socket_transport;
+}
+
+
+/*
+ * send_all
+ *
+ * Push count bytes through the transport, whatever it takes.
+ */
+static void send_all (struct connection *cn, const char *buf, size_t count)
+{
+        int s; /* Sent bytes in one send() call */
+
+        if (cn->cipher != NULL)
+        {
+                cipher_send(cn, buf, count);
+                return;
+        }
+        while (count > 0)
+        {
+                s = cn->tr->send(cn, buf, count);
+                if (s == SOCKET_ERROR)
+                        fail(CANUTE_ENET, "Sending data");
+                count -= s;
+                buf   += s;
+        }
+}
+
+
+/*
+ * send_pending
+ *
+ * Send the buffered output followed by count bytes of buf (maybe none), in a
+ * single call when the transport is a socket.  more tells that the peer is not
+ * being waited for yet, so the kernel may hold back a partial segment.
+ */
+static void send_pending (struct connection *cn, const char *buf, size_t count,
+                          int more)
+{
+#ifndef HASEFROCH
+        struct iovec  iov[2];
+        struct msghdr msg;
+        ssize_t       s;
+        int           flags = SEND_FLAGS;
+
+        if (is_socket(cn))
+        {
+#ifdef MSG_MORE
+                /* Only TCP holds back partial segments */
+                if (more && cn->tr == &socket_transport)
+                        flags |= MSG_MORE;
+                cn->corked = (flags & MSG_MORE) != 0;
+#endif
+                iov[0].iov_base = cn->out;
+                iov[0].iov_len  = cn->out_fill;
+                iov[1].iov_base = (char *) buf;
+                iov[1].iov_len  = count;
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_iov    = iov;
+                msg.msg_iovlen = 2;
+
+                while (iov[0].iov_len + iov[1].iov_len > 0)
+                {
+                        s = sendmsg(cn->sk, &msg, flags);
+                        if (s == -1 && errno == EINTR)
+                                continue;
+                        if (s == -1)
+                                fail(CANUTE_ENET, "Sending data");
+
+                        /* Skip what is gone */
+                        if ((size_t) s >= iov[0].iov_len)
+                        {
+                                s -= iov[0].iov_len;
+                                iov[0].iov_len  = 0;
+                                iov[1].iov_base = (char *) iov[1].iov_base + s;
+                                iov[1].iov_len -= s;
+                        }
+                        else
+                        {
+                                iov[0].iov_base = (char *) iov[0].iov_base + s;
+                                iov[0].iov_len -= s;
+                        }
+                }
+                cn->out_fill = 0;
+                return;
+        }
+#endif
+        send_all(cn, cn->out, cn->out_fill);
+        send_all(cn, buf, count);
+        cn->out_fill = 0;
+}
+
+
+/*
+ * receive_some
+ *
+ * Whatever the transport has ready, up to count bytes, decrypted if need be.
+ */
+static int receive_some (struct connection *cn, char *buf, size_t count)
+{
+        if (cn->cipher != NULL)
+                return cipher_recv(cn, buf, count);
+        return cn->tr->recv(cn, buf, count);
+}
+
+
+/*
+ * push_output
+ *
+ * About to wait for the peer: everything sent so far must reach it now.
+ */
+static void push_output (struct connection *cn)
+{
+        int e = 1;
+
+        if (cn->out_fill > 0)
+                send_pending(cn, NULL, 0, 0);
+        else if (cn->corked)
+        {
+                /* Setting TCP_NODELAY again pushes what MSG_MORE held */
+                setsockopt(cn->sk, IPPROTO_TCP, TCP_NODELAY, CCP_CAST &e,
+                           sizeof(e));
+                cn->corked = 0;
+        }
+}
+
+
+/*
+ * receive_all
+ *
+ * Receive count bytes, whatever it takes.  On error aborts.
+ */
+static void receive_all (struct connection *cn, char *buf, size_t count)
+{
+        size_t n;
+        int    r; /* Received bytes in one recv() call */
+
+        while (count > 0)
+        {
+                n = cn->in_fill - cn->in_pos;
+                if (n > 0)
+                {
+                        n = (n < count ? n : count);
+                        memcpy(buf, cn->in + cn->in_pos, n);
+                        cn->in_pos += n;
+                        count      -= n;
+                        buf        += n;
+                        continue;
+                }
+
+                /* Big reads skip the buffer, it saves a copy */
+                push_output(cn);
+                if (count >= NET_BUFFER)
+                        r = receive_some(cn, buf, count);
+                else
+                        r = receive_some(cn, cn->in, NET_BUFFER);
+                if (r == SOCKET_ERROR)
+                        fail(CANUTE_ENET, "Receiving data");
+                if (r == 0)
+                {
+                        /* Peer went away, looping would never finish */
+                        errno = ECONNRESET;
+                        fail(CANUTE_ENET, "Receiving data");
+                }
+
+                if (count >= NET_BUFFER)
+                {
+                        count -= r;
+                        buf   += r;
+                }
+                else
+                {
+                        cn->in_pos  = 0;
+                        cn->in_fill = r;
+                }
+        }
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
 
 /*
  * open_connection_server
@@ -28,7 +401,7 @@ SOCKET open_connection_server (unsigned short port)
 
         bsk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
         if (bsk == INVALID_SOCKET)
-                fatal("Could not create socket");
+                fail(CANUTE_ENET, "Could not create socket");
 
         saddr.sin_family      = AF_INET;
         saddr.sin_port        = htons(port);
@@ -39,21 +412,74 @@ SOCKET open_connection_server (unsigned short port)
         setsockopt(bsk, SOL_SOCKET, SO_REUSEADDR, CCP_CAST &e, sizeof(e));
 
         e = bind(bsk, (SOCKADDR *) &saddr, sizeof(saddr));
+        if (e != SOCKET_ERROR)
+                e = listen(bsk, 1);
         if (e == SOCKET_ERROR)
-                fatal("Could not open port %d", port);
-
-        e = listen(bsk, 1);
-        if (e == SOCKET_ERROR)
-                fatal("Could not listen on port %d", port);
+        {
+                e = errno;
+                closesocket(bsk);
+                errno = e;
+                fail(CANUTE_ENET, "Could not open port %d", port);
+        }
 
         alen = sizeof(saddr);
         sk   = accept(bsk, (SOCKADDR *) &saddr, &alen);
-        if (sk == INVALID_SOCKET)
-                fatal("Could not accept client connection");
+        e    = errno;
 
         /* Binding socket not needed anymore */
         closesocket(bsk);
+        errno = e;
+        if (sk == INVALID_SOCKET)
+                fail(CANUTE_ENET, "Could not accept client connection");
+        return sk;
+}
+
+
+/*
+ * open_local_server
+ *
+ * Like open_connection_server(), on a Unix socket at path.  A socket left
+ * there by someone else is replaced, and removed once the peer connects.
+ */
+SOCKET open_local_server (const char *path)
+{
+#ifdef HASEFROCH
+        errno = 0;
+        fail(CANUTE_EINVAL, "Unix sockets not supported");
+        return INVALID_SOCKET;
+#else
+        SOCKET             bsk, sk;
+        struct sockaddr_un addr;
+        struct stat        st;
+        int                e;
+
+        local_address(&addr, path);
+        bsk = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (bsk == INVALID_SOCKET)
+                fail(CANUTE_ENET, "Could not create socket");
+
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+                unlink(path);
+        e = bind(bsk, (SOCKADDR *) &addr, sizeof(addr));
+        if (e != SOCKET_ERROR)
+                e = listen(bsk, 1);
+        if (e == SOCKET_ERROR)
+        {
+                e = errno;
+                closesocket(bsk);
+                errno = e;
+                fail(CANUTE_ENET, "Could not listen on '%s'", path);
+        }
+
+        sk = accept(bsk, NULL, NULL);
+        e  = errno;
+        closesocket(bsk);
+        unlink(path);
+        errno = e;
+        if (sk == INVALID_SOCKET)
+                fail(CANUTE_ENET, "Could not accept client connection");
         return sk;
+#endif
 }
 
 
@@ -61,8 +487,8 @@ SOCKET open_connection_server (unsigned short port)
  * open_connection_client
  *
  * Set up a connection in client mode. Try to connect to the specified host
- * (either a hostname or an IP address) and return the connected socket ready
- * for transmission.
+ * (either a hostname or an IP address, or "unix:<path>" for a Unix socket) and
+ * return the connected socket ready for transmission.
  */
 SOCKET open_connection_client (char *host, unsigned short port)
 {
@@ -71,9 +497,13 @@ SOCKET open_connection_client (char *host, unsigned short port)
         struct hostent    *he;
         int                e;
 
+#ifndef HASEFROCH
+        if (strncmp(host, "unix:", 5) == 0)
+                return open_local_client(host + 5);
+#endif
         sk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
         if (sk == INVALID_SOCKET)
-                fatal("Creating socket");
+                fail(CANUTE_ENET, "Creating socket");
 
         saddr.sin_family      = AF_INET;
         saddr.sin_port        = htons(port);
@@ -84,11 +514,13 @@ SOCKET open_connection_client (char *host, unsigned short port)
                 he = gethostbyname(host);
                 if (he == NULL)
                 {
+                        closesocket(sk);
+                        errno = 0;
 #if defined(HASEFROCH) || defined(OMIT_HERROR)
-                        fatal("Invalid IP or hostname");
+                        fail(CANUTE_ENET, "Invalid IP or hostname");
 #else
-                        herror("FATAL ERROR: Invalid IP or hostname");
-                        exit(EXIT_FAILURE);
+                        fail(CANUTE_ENET, "Invalid IP or hostname: %s",
+                             hstrerror(h_errno));
 #endif
                 }
                 saddr.sin_addr.s_addr = ((struct in_addr *) he->h_addr)->s_addr;
@@ -97,29 +529,312 @@ SOCKET open_connection_client (char *host, unsigned short port)
         /* Now we have a destination host */
         e = connect(sk, (SOCKADDR *) &saddr, sizeof(saddr));
         if (e == SOCKET_ERROR)
-                fatal("Connecting to host '%s'", host);
+        {
+                e = errno;
+                closesocket(sk);
+                errno = e;
+                fail(CANUTE_ENET, "Connecting to host '%s'", host);
+        }
 
         return sk;
 }
 
 
+/*
+ * transport_connection
+ *
+ * Set up a connection over the given transport, with its buffers.
+ */
+void transport_connection (struct connection      *cn,
+                           const struct transport *tr,
+                           void                   *ctx)
+{
+        cn->sk          = INVALID_SOCKET;
+        cn->tr          = tr;
+        cn->ctx         = ctx;
+        cn->out         = malloc(NET_BUFFER);
+        cn->in          = malloc(NET_BUFFER);
+        cn->out_fill    = 0;
+        cn->in_pos      = 0;
+        cn->in_fill     = 0;
+        cn->corked      = 0;
+        cn->own_buffers = 1;
+        cn->passed_fd   = -1;
+        cn->cipher      = NULL;
+        cn->tape        = NULL;
+        if (cn->out == NULL || cn->in == NULL)
+        {
+                release_connection(cn);
+                fail(CANUTE_ENOMEM, "Allocating connection buffers");
+        }
+}
+
+
+/*
+ * socket_connection
+ *
+ * Wrap a connected socket so it can be used with the rest of functions.
+ */
+void socket_connection (struct connection *cn, SOCKET sk)
+{
+        int e = 1;
+#ifndef HASEFROCH
+        struct sockaddr_un addr;
+        socklen_t          alen = sizeof(addr);
+
+        if (getsockname(sk, (SOCKADDR *) &addr, &alen) == 0
+            && addr.sun_family == AF_UNIX)
+        {
+                transport_connection(cn, &local_transport, NULL);
+                cn->sk = sk;
+                return;
+        }
+#endif
+
+        transport_connection(cn, &socket_transport, NULL);
+        cn->sk = sk;
+
+        /* Buffering takes care of small segments, see above */
+        setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, CCP_CAST &e, sizeof(e));
+}
+
+
+/*
+ * connection_buffers
+ *
+ * Use the given buffers, NET_BUFFER bytes each, instead of allocating them.
+ * Only right after setting the connection up.
+ */
+void connection_buffers (struct connection *cn, char *out, char *in)
+{
+        if (cn->own_buffers)
+        {
+                free(cn->out);
+                free(cn->in);
+        }
+        cn->out         = out;
+        cn->in          = in;
+        cn->own_buffers = 0;
+}
+
+
+/*
+ * release_connection
+ *
+ * Free the buffers, leaving the socket open.  Whatever is still buffered is
+ * lost, see flush_connection().
+ */
+void release_connection (struct connection *cn)
+{
+        if (cn->own_buffers)
+        {
+                free(cn->out);
+                free(cn->in);
+        }
+        cn->out = cn->in = NULL;
+        cipher_free(cn);
+        replay_stop(cn);
+#ifndef HASEFROCH
+        if (cn->passed_fd != -1)
+                close(cn->passed_fd);
+        cn->passed_fd = -1;
+#endif
+}
+
+
+/*
+ * close_connection
+ *
+ * Send what is still buffered and close the connection.
+ */
+void close_connection (struct connection *cn)
+{
+        push_output(cn);
+        if (cn->tr->close != NULL)
+                cn->tr->close(cn);
+        if (cn->sk != INVALID_SOCKET)
+                closesocket(cn->sk);
+        release_connection(cn);
+}
+
+
+/*
+ * connection_socket
+ *
+ * The socket under a connection, for system calls that work on it directly, or
+ * INVALID_SOCKET if its bytes go through some other transport.
+ */
+SOCKET connection_socket (struct connection *cn)
+{
+        return (is_socket(cn) ? cn->sk : INVALID_SOCKET);
+}
+
+
+/*
+ * connection_local
+ *
+ * True if file descriptors can be passed over the connection.
+ */
+int connection_local (struct connection *cn)
+{
+#ifndef HASEFROCH
+        return cn->tr == &local_transport && cn->cipher == NULL;
+#else
+        return 0;
+#endif
+}
+
+
+/*
+ * send_descriptor
+ *
+ * Pass the open file descriptor fd to the peer, which must take it with
+ * receive_descriptor().  Only local connections.
+ */
+void send_descriptor (struct connection *cn, int fd)
+{
+#ifndef HASEFROCH
+        struct msghdr   msg;
+        struct iovec    iov;
+        struct cmsghdr *c;
+        ssize_t         s;
+        char            mark = 'F';
+        union
+        {
+                struct cmsghdr align;
+                char           buf[CMSG_SPACE(sizeof(int))];
+        } control;
+
+        /* The byte carrying it goes after everything before */
+        flush_connection(cn);
+
+        iov.iov_base = &mark;
+        iov.iov_len  = 1;
+        memset(&msg, 0, sizeof(msg));
+        memset(&control, 0, sizeof(control));
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        c                  = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level      = SOL_SOCKET;
+        c->cmsg_type       = SCM_RIGHTS;
+        c->cmsg_len        = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+        do
+                s = sendmsg(cn->sk, &msg, SEND_FLAGS);
+        while (s == -1 && errno == EINTR);
+        if (s != 1)
+                fail(CANUTE_ENET, "Passing file descriptor");
+#else
+        fail(CANUTE_EPROTO, "Passing file descriptors not supported");
+#endif
+}
+
+
+/*
+ * receive_descriptor
+ *
+ * Take the file descriptor the peer passed with send_descriptor().  -1 when
+ * replaying, the tape has what it gave instead (see replay.c).
+ */
+int receive_descriptor (struct connection *cn)
+{
+        char mark;
+        int  fd;
+
+        receive_data(cn, &mark, 1);
+        fd            = cn->passed_fd;
+        cn->passed_fd = -1;
+        if (fd == -1 && replay_playing(cn))
+                return -1;
+        if (fd == -1)
+        {
+                errno = 0;
+                fail(CANUTE_EPROTO, "Expected a file descriptor");
+        }
+        return fd;
+}
+
+
+/*
+ * flush_connection
+ *
+ * Send whatever is buffered, before writing to the socket directly.  More
+ * data is expected to follow.
+ */
+void flush_connection (struct connection *cn)
+{
+        if (cn->out_fill > 0)
+                send_pending(cn, NULL, 0, 1);
+}
+
+
+/*
+ * push_connection
+ *
+ * Send whatever is buffered right now, nothing else follows for a while.
+ */
+void push_connection (struct connection *cn)
+{
+        push_output(cn);
+}
+
+
+/*
+ * buffered_input
+ *
+ * Bytes already read from the socket but not consumed yet.  They must be taken
+ * with receive_data() before reading from the socket directly.
+ */
+size_t buffered_input (struct connection *cn)
+{
+        return cn->in_fill - cn->in_pos;
+}
+
+
+/*
+ * connection_ready
+ *
+ * True if something can be received without waiting.  Transports other than
+ * sockets cannot tell, and always say so.
+ */
+int connection_ready (struct connection *cn)
+{
+        fd_set         set;
+        struct timeval tv;
+
+        if (cn->in_pos < cn->in_fill || cn->sk == INVALID_SOCKET
+            || (cn->cipher != NULL && cipher_buffered(cn)))
+                return 1;
+        FD_ZERO(&set);
+        FD_SET(cn->sk, &set);
+        tv.tv_sec  = 0;
+        tv.tv_usec = 0;
+        return select((int) cn->sk + 1, &set, NULL, NULL, &tv) != 0;
+}
+
+
 /*
  * send_data
  *
- * Send count bytes over the connection. Doesn't finish until all of them are
- * sent. On error aborts.
+ * Send count bytes over the connection.  They may stay buffered until more
+ * data fills the buffer or something has to be received.  On error aborts.
  */
-void send_data (SOCKET sk, char *buf, size_t count)
+void send_data (struct connection *cn, char *buf, size_t count)
 {
-        int s; /* Sent bytes in one send() call */
+        if (cn->tape != NULL)
+                replay_sent(cn, buf, count);
+        if (cn->out_fill + count <= NET_BUFFER)
+        {
+                memcpy(cn->out + cn->out_fill, buf, count);
+                cn->out_fill += count;
+                return;
+        }
 
-        do {
-                s = send(sk, buf, count, 0);
-                if (s == SOCKET_ERROR)
-                        fatal("Sending data");
-                count -= s;
-                buf   += s;
-        } while (count > 0);
+        /* Does not fit, out with the buffer in one go */
+        send_pending(cn, buf, count, 1);
 }
 
 
@@ -129,17 +844,25 @@ void send_data (SOCKET sk, char *buf, size_t count)
  * Receive count bytes from the connection. Doesn't finish until all bytes are
  * received. On error aborts.
  */
-void receive_data (SOCKET sk, char *buf, size_t count)
+void receive_data (struct connection *cn, char *buf, size_t count)
 {
-        int r; /* Received bytes in one recv() call */
+        receive_all(cn, buf, count);
+        if (cn->tape != NULL)
+                replay_bytes(cn, buf, count, 0);
+}
 
-        do {
-                r = recv(sk, buf, count, 0);
-                if (r == SOCKET_ERROR)
-                        fatal("Receiving data");
-                count -= r;
-                buf   += r;
-        } while (count > 0);
+
+/*
+ * receive_contents
+ *
+ * Like receive_data(), for file contents: a recording may leave them out, see
+ * replay.c.
+ */
+void receive_contents (struct connection *cn, char *buf, size_t count)
+{
+        receive_all(cn, buf, count);
+        if (cn->tape != NULL)
+                replay_bytes(cn, buf, count, 1);
 }
 
 
@@ -149,12 +872,12 @@ void receive_data (SOCKET sk, char *buf, size_t count)
  * Build a header packet and send it through the connection. All the fields are
  * converted to network byte order if required.
  */
-void send_message (SOCKET    sk,
-                   int       type,
-                   int       is_executable,
-                   int       mtime,
-                   long long size,
-                   char     *name)
+void send_message (struct connection *cn,
+                   int                type,
+                   int                is_executable,
+                   int                mtime,
+                   long long          size,
+                   char              *name)
 {
         int           blocks, extra;
         struct header packet;
@@ -172,14 +895,16 @@ void send_message (SOCKET    sk,
         packet.blocks = htonl(blocks);  /* Read protocol.c for an explanation */
         packet.extra  = htonl(extra);
 
+        /* strncpy() pads with zeros, no stack garbage goes out (recorded
+         * answers are compared, see replay.c) */
         if (name != NULL)
                 strncpy(packet.name, name, CANUTE_NAME_LENGTH);
         else
-                packet.name[0] = '\0';
+                memset(packet.name, 0, CANUTE_NAME_LENGTH);
 
         /* Mark the packet as enhanced version and send it */
         packet.name[CANUTE_NAME_LENGTH] = CANUTE_ENHANCED;
-        send_data(sk, (char *) &packet, sizeof(struct header));
+        send_data(cn, (char *) &packet, sizeof(struct header));
 }
 
 
@@ -190,16 +915,16 @@ void send_message (SOCKET    sk,
  * necessary, fill the fields (if address was provided by the caller) and return
  * the message type.
  */
-int receive_message (SOCKET     sk,
-                     int       *is_executable,
-                     int       *mtime,
-                     long long *size,
-                     char      *name)
+int receive_message (struct connection *cn,
+                     int               *is_executable,
+                     int               *mtime,
+                     long long         *size,
+                     char              *name)
 {
         int           blocks, extra, pmtime = 0, is_x = 0;
         struct header packet;
 
-        receive_data(sk, (char *) &packet, sizeof(struct header));
+        receive_data(cn, (char *) &packet, sizeof(struct header));
 
         if (packet.name[CANUTE_NAME_LENGTH] == CANUTE_ENHANCED)
         {
@@ -235,3 +960,27 @@ int receive_message (SOCKET     sk,
         return ntohl(packet.type);
 }
 
+
+/*
+ * receive_final
+ *
+ * Like receive_message(), for a reply the peer may not send at all: return
+ * the message type, or -1 if the connection is closed before the first byte.
+ */
+int receive_final (struct connection *cn)
+{
+        int r;
+
+        if (cn->in_pos == cn->in_fill)
+        {
+                push_output(cn);
+                do
+                        r = receive_some(cn, cn->in, NET_BUFFER);
+                while (r == SOCKET_ERROR && errno == EINTR);
+                if (r == 0 || r == SOCKET_ERROR)
+                        return -1;
+                cn->in_pos  = 0;
+                cn->in_fill = r;
+        }
+        return receive_message(cn, NULL, NULL, NULL, NULL);
+}
@@ -0,0 +1,748 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                             PACKED FILE ARCHIVES                           */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * Creating millions of small files costs far more than writing their contents.
+ * A receiver started with -P <pack> appends every incoming file to a single
+ * pack file instead, and writes an index at the end when the session is over:
+ *
+ *      "CANUTEPK"
+ *      contents of every file, one after another
+ *      index      one record per file or directory
+ *      trailer    index offset (8 bytes), record count (8 bytes), "CANUTEPX"
+ *
+ * Each index record holds the offset and size of the contents (8 bytes each),
+ * the modification time and the mode (4 bytes each, S_IFDIR/S_IFREG and the
+ * permission bits, with POSIX values), the path length (2 bytes) and the path
+ * relative to where the session started, with '/' as separator.  Numbers are
+ * in network byte order.
+ *
+ * An existing pack is appended to: its index is loaded, new contents go after
+ * its trailer and a new index is written at the end.  A file received again
+ * replaces the record of the old copy, whose contents just become dead space,
+ * like the old index.  A receiver that dies leaves the pack without a trailer
+ * at the end, but the previous index is still in there: reading such a pack
+ * scans back for the last trailer whose index fits right before it, so a pack
+ * is only lost if its first session never finished.  Library calls (see
+ * libcanute.c) fail without dying: the file being received is dropped and the
+ * index written as usual.
+ *
+ * The lspack and unpack modes list and extract packs, and a sender started
+ * with -p sends the contents of a pack as if they were a tree on disk.
+ */
+#include "canute.h"
+
+#define PACK_MAGIC    "CANUTEPK"
+#define PACK_END      "CANUTEPX"
+#define PACK_TRAILER  24
+#define PACK_RECORD   26                /* Without the path */
+#define PACK_DIR      0040000
+#define PACK_FILE     0100000
+#define PACK_SCAN     65536             /* Bytes read at once looking back */
+
+
+/*******************  PRIVATE DATA (Receiver pack writing)  ******************/
+
+static THREAD_LOCAL char              *pack_name    = NULL;
+static THREAD_LOCAL FILE              *pack         = NULL;
+static THREAD_LOCAL struct pack_entry *entries      = NULL;
+static THREAD_LOCAL size_t             entry_count  = 0;
+static THREAD_LOCAL size_t             entry_alloc  = 0;
+static THREAD_LOCAL size_t            *slots        = NULL;  /* entry number + 1, 0 = free */
+static THREAD_LOCAL size_t             slot_count   = 0;
+static THREAD_LOCAL long long          data_end     = 0;     /* Where the next file goes */
+static THREAD_LOCAL size_t             receiving    = 0;     /* File being received, + 1 */
+static THREAD_LOCAL struct pack_entry  replaced;             /* Its previous record */
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+static void put_number (unsigned char *p, long long n, int bytes)
+{
+        int i;
+
+        for (i = 0;  i < bytes;  i++)
+                p[i] = (unsigned char) (n >> (8 * (bytes - 1 - i)));
+}
+
+
+static long long get_number (const unsigned char *p, int bytes)
+{
+        long long n = 0;
+        int       i;
+
+        for (i = 0;  i < bytes;  i++)
+                n = (n << 8) | p[i];
+        return n;
+}
+
+
+/*
+ * path_hash
+ *
+ * FNV-1a, for the in-memory table of the receiver.
+ */
+static size_t path_hash (const char *path)
+{
+        size_t h = 2166136261U;
+
+        while (*path != '\0')
+                h = (h ^ (unsigned char) *path++) * 16777619U;
+        return h;
+}
+
+
+static size_t *find_entry (const char *path)
+{
+        size_t i = path_hash(path) & (slot_count - 1);
+
+        while (slots[i] != 0 && strcmp(entries[slots[i] - 1].path, path) != 0)
+                i = (i + 1) & (slot_count - 1);
+        return &slots[i];
+}
+
+
+/*
+ * add_entry
+ *
+ * Return the record for path, a new one unless the pack already has it.
+ */
+static struct pack_entry *add_entry (const char *path)
+{
+        size_t i, *slot;
+
+        if ((entry_count + 1) * 2 > slot_count)
+        {
+                free(slots);
+                slot_count = (slot_count == 0 ? 4096 : slot_count * 2);
+                slots      = calloc(slot_count, sizeof(size_t));
+                if (slots == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating pack index");
+                for (i = 0;  i < entry_count;  i++)
+                        *find_entry(entries[i].path) = i + 1;
+        }
+
+        slot = find_entry(path);
+        if (*slot != 0)
+                return &entries[*slot - 1];
+
+        if (entry_count == entry_alloc)
+        {
+                entry_alloc = (entry_alloc == 0 ? 1024 : entry_alloc * 2);
+                entries     = realloc(entries,
+                                      entry_alloc * sizeof(struct pack_entry));
+                if (entries == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating pack index");
+        }
+        entries[entry_count].path = strdup(path);
+        if (entries[entry_count].path == NULL)
+                fail(CANUTE_ENOMEM, "Allocating pack index");
+        *slot = ++entry_count;
+        return &entries[entry_count - 1];
+}
+
+
+/*
+ * free_list
+ *
+ * Free count records read from an index, and the list.
+ */
+static void free_list (struct pack_entry *list, size_t count)
+{
+        size_t i;
+
+        for (i = 0;  i < count;  i++)
+                free(list[i].path);
+        free(list);
+}
+
+
+/*
+ * load_index
+ *
+ * Load the index whose trailer starts at offset trailer of an open pack.
+ * Return false if there is no trailer there, or its index does not end right
+ * before it.
+ */
+static int load_index (FILE *file, long long trailer, struct pack_entry **list,
+                       size_t *count)
+{
+        unsigned char      buf[PACK_TRAILER], *idx, *p, *end;
+        long long          offset, n, i;
+        size_t             len;
+        struct pack_entry *e;
+
+        if (fseeko(file, (off_t) trailer, SEEK_SET) == -1
+            || fread(buf, 1, PACK_TRAILER, file) != PACK_TRAILER
+            || memcmp(buf + 16, PACK_END, 8) != 0)
+                return 0;
+
+        offset = get_number(buf, 8);
+        n      = get_number(buf + 8, 8);
+        if (offset < 8 || offset > trailer
+            || n > (trailer - offset) / PACK_RECORD)
+                return 0;
+
+        idx = malloc((size_t) (trailer - offset) + 1);
+        if (idx == NULL)
+                fail(CANUTE_ENOMEM, "Allocating pack index");
+        if (fseeko(file, (off_t) offset, SEEK_SET) == -1
+            || fread(idx, 1, (size_t) (trailer - offset), file)
+               != (size_t) (trailer - offset))
+        {
+                free(idx);
+                return 0;
+        }
+
+        *list = malloc((size_t) (n + 1) * sizeof(struct pack_entry));
+        if (*list == NULL)
+                fail(CANUTE_ENOMEM, "Allocating pack index");
+        p   = idx;
+        end = idx + (trailer - offset);
+        for (i = 0;  i < n;  i++)
+        {
+                e = &(*list)[i];
+                if (end - p < PACK_RECORD)
+                        break;
+                len = (size_t) get_number(p + 24, 2);
+                if ((size_t) (end - p) < PACK_RECORD + len)
+                        break;
+                e->offset = get_number(p, 8);
+                e->size   = get_number(p + 8, 8);
+                e->mtime  = (int) get_number(p + 16, 4);
+                e->mode   = (int) get_number(p + 20, 4);
+                e->path   = malloc(len + 1);
+                if (e->path == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating pack index");
+                memcpy(e->path, p + PACK_RECORD, len);
+                e->path[len] = '\0';
+                p += PACK_RECORD + len;
+        }
+        free(idx);
+        if (i < n || p != end)
+        {
+                free_list(*list, (size_t) i);
+                return 0;
+        }
+
+        *count = (size_t) n;
+        return 1;
+}
+
+
+/*
+ * read_index
+ *
+ * Load the index of an open pack.  Return false if the file is not a pack or
+ * has no complete index.  On success *index_end is where the trailer ends:
+ * the end of the file, unless the session appending to it died.
+ */
+static int read_index (FILE *file, struct pack_entry **list, size_t *count,
+                       long long *index_end)
+{
+        unsigned char    buf[PACK_SCAN + 7];
+        char             magic[8];
+        long long        size, start, i;
+        size_t           len;
+        struct stat_info st;
+
+        if (fread(magic, 1, 8, file) != 8 || memcmp(magic, PACK_MAGIC, 8) != 0
+            || fstat(fileno(file), &st) == -1)
+                return 0;
+        size = (long long) st.st_size;
+        if (size >= 8 + PACK_TRAILER
+            && load_index(file, size - PACK_TRAILER, list, count))
+        {
+                *index_end = size;
+                return 1;
+        }
+
+        /* Look back for the last complete one, blocks overlapping by the
+         * magic length so none is missed */
+        for (start = size;  start > 8;  )
+        {
+                start = (start - 8 > PACK_SCAN ? start - PACK_SCAN : 8);
+                len   = (size_t) (size - start < PACK_SCAN + 7
+                                  ? size - start : PACK_SCAN + 7);
+                if (fseeko(file, (off_t) start, SEEK_SET) == -1
+                    || fread(buf, 1, len, file) != len)
+                        return 0;
+                for (i = (long long) len - 8;  i >= 0;  i--)
+                {
+                        if (memcmp(buf + i, PACK_END, 8) == 0
+                            && start + i - 16 >= 8
+                            && load_index(file, start + i - 16, list, count))
+                        {
+                                *index_end = start + i + 8;
+                                return 1;
+                        }
+                }
+        }
+        return 0;
+}
+
+
+/*
+ * compare_tree
+ *
+ * Tree order: '/' before anything else, so a directory is immediately followed
+ * by everything inside it.
+ */
+static int compare_tree (const void *a, const void *b)
+{
+        const unsigned char *x = (const unsigned char *)
+                                 ((const struct pack_entry *) a)->path;
+        const unsigned char *y = (const unsigned char *)
+                                 ((const struct pack_entry *) b)->path;
+
+        while (*x != '\0' && *x == *y)
+        {
+                x++;
+                y++;
+        }
+        if (*x == *y)
+                return 0;
+        if (*x == '\0' || *x == '/')
+                return -1;
+        if (*y == '\0' || *y == '/')
+                return 1;
+        return (int) *x - (int) *y;
+}
+
+
+/*
+ * path_inside
+ *
+ * True if a path from an index stays inside the directory it is extracted
+ * to: not absolute, without ".." components (nor drives or '\\' separators
+ * in Hasefroch).  Packs may come from anywhere.
+ */
+static int path_inside (const char *path)
+{
+        const char *c;
+
+        if (path[0] == '\0' || path[0] == '/')
+                return 0;
+#ifdef HASEFROCH
+        if (strchr(path, '\\') != NULL || strchr(path, ':') != NULL)
+                return 0;
+#endif
+        for (c = path;  c != NULL;  c = strchr(c, '/'))
+        {
+                if (*c == '/')
+                        c++;
+                if (c[0] == '.' && c[1] == '.' && (c[2] == '/' || c[2] == '\0'))
+                        return 0;
+        }
+        return 1;
+}
+
+
+/*
+ * make_parents
+ *
+ * Create every directory leading to path, like "mkdir -p" on its dirname.
+ */
+static void make_parents (char *path)
+{
+        char *c;
+
+        for (c = path;  *c != '\0';  c++)
+                if (*c == '/' && c != path)
+                {
+                        *c = '\0';
+                        mkdir(path);
+                        *c = '/';
+                }
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * pack_create
+ *
+ * Receiver: start writing into the pack file, appending if it exists.
+ */
+void pack_create (char *file)
+{
+        struct pack_entry *old, *e;
+        size_t             n, i;
+        struct stat_info   st;
+
+        pack_name = file;
+        pack      = fopen(file, "r+b");
+        if (pack != NULL)
+        {
+                writeback_setup(pack);
+                if (!read_index(pack, &old, &n, &data_end))
+                        fatal("'%s' is not a complete pack", file);
+                if (fstat(fileno(pack), &st) == 0 && st.st_size > data_end)
+                        inform("--- Pack '%s' was not finished, appending to "
+                               "its last index\n", file);
+                for (i = 0;  i < n;  i++)
+                {
+                        e = add_entry(old[i].path);
+                        e->offset = old[i].offset;
+                        e->size   = old[i].size;
+                        e->mtime  = old[i].mtime;
+                        e->mode   = old[i].mode;
+                        free(old[i].path);
+                }
+                free(old);
+        }
+        else
+        {
+                pack = fopen(file, "w+b");
+                if (pack == NULL)
+                        fatal("Cannot create pack '%s'", file);
+                writeback_setup(pack);
+                fwrite(PACK_MAGIC, 1, 8, pack);
+                data_end = 8;
+        }
+}
+
+
+/*
+ * pack_finish
+ *
+ * Receiver: write the index and the trailer, and close the pack.
+ */
+void pack_finish (void)
+{
+        unsigned char buf[PACK_RECORD + PATH_MAX];
+        size_t        i, n, len;
+        long long     end;
+        int           e;
+
+        if (pack == NULL)
+                return;
+
+        if (fseeko(pack, (off_t) data_end, SEEK_SET) == -1)
+                fatal("Seeking pack '%s'", pack_name);
+        for (i = 0;  i < entry_count;  i++)
+        {
+                if (entries[i].mode == 0)
+                        continue;
+                len = strlen(entries[i].path);
+                put_number(buf, entries[i].offset, 8);
+                put_number(buf + 8, entries[i].size, 8);
+                put_number(buf + 16, entries[i].mtime, 4);
+                put_number(buf + 20, entries[i].mode, 4);
+                put_number(buf + 24, (long long) len, 2);
+                memcpy(buf + PACK_RECORD, entries[i].path, len);
+                fwrite(buf, 1, PACK_RECORD + len, pack);
+        }
+        for (i = n = 0;  i < entry_count;  i++)
+                n += (entries[i].mode != 0);
+        put_number(buf, data_end, 8);
+        put_number(buf + 8, (long long) n, 8);
+        memcpy(buf + 16, PACK_END, 8);
+        fwrite(buf, 1, PACK_TRAILER, pack);
+
+        /* A dropped file, or what a session that died left, may follow */
+        fflush(pack);
+        end = data_end + PACK_TRAILER;
+        for (i = 0;  i < entry_count;  i++)
+                if (entries[i].mode != 0)
+                        end += PACK_RECORD + strlen(entries[i].path);
+#ifdef HASEFROCH
+        e = _chsize_s(_fileno(pack), end);
+#else
+        e = ftruncate(fileno(pack), (off_t) end);
+#endif
+        durable_file(pack, pack_name);
+        if (fclose(pack) != 0 || e != 0)
+                error("Writing pack '%s'", pack_name);
+        pack = NULL;
+
+        /* Ready for another session */
+        for (i = 0;  i < entry_count;  i++)
+                free(entries[i].path);
+        free(entries);
+        free(slots);
+        entries     = NULL;
+        slots       = NULL;
+        entry_count = 0;
+        entry_alloc = 0;
+        slot_count  = 0;
+        receiving   = 0;
+}
+
+
+/*
+ * pack_abort
+ *
+ * Receiver: the session failed.  Forget the file being received, if any, and
+ * finish the pack with what was complete.
+ */
+void pack_abort (void)
+{
+        struct pack_entry *e;
+
+        if (pack == NULL)
+                return;
+        if (receiving != 0)
+        {
+                e         = &entries[receiving - 1];
+                data_end  = e->offset;
+                e->offset = replaced.offset;
+                e->size   = replaced.size;
+                e->mtime  = replaced.mtime;
+                e->mode   = replaced.mode;  /* 0 drops it */
+                receiving = 0;
+        }
+        pack_finish();
+}
+
+
+/*
+ * pack_enabled
+ *
+ * Receiver: true if files go into a pack.
+ */
+int pack_enabled (void)
+{
+        return pack != NULL;
+}
+
+
+/*
+ * pack_has
+ *
+ * Receiver: true if the pack already holds path with this size and time.
+ */
+int pack_has (const char *path, long long size, int mtime)
+{
+        size_t i;
+
+        if (entry_count == 0)
+                return 0;
+        i = *find_entry(path);
+        return i != 0 && entries[i - 1].size == size
+               && entries[i - 1].mtime == mtime
+               && (entries[i - 1].mode & PACK_FILE);
+}
+
+
+/*
+ * pack_add_file
+ *
+ * Receiver: make room for a file and return the pack positioned where its
+ * contents go, that position in *base.  The caller must write exactly size
+ * bytes there (seeking inside them is fine), must not close the pack and must
+ * call pack_file_done() afterwards.
+ */
+FILE *pack_add_file (const char *path, long long size, int mtime,
+                     int is_executable, long long *base)
+{
+        struct pack_entry *e;
+        size_t             n = entry_count;
+
+        e = add_entry(path);
+        replaced = *e;
+        if (entry_count > n)
+                replaced.mode = 0;  /* New, there was nothing */
+        receiving = (size_t) (e - entries) + 1;
+
+        e->offset = data_end;
+        e->size   = size;
+        e->mtime  = mtime;
+        e->mode   = PACK_FILE | (is_executable ? 0755 : 0644);
+
+        if (fseeko(pack, (off_t) data_end, SEEK_SET) == -1)
+                fatal("Seeking pack '%s'", pack_name);
+        *base     = data_end;
+        data_end += size;
+        return pack;
+}
+
+
+/*
+ * pack_file_done
+ *
+ * Receiver: the file from the last pack_add_file() is complete.
+ */
+void pack_file_done (void)
+{
+        receiving = 0;
+}
+
+
+/*
+ * pack_add_dir
+ *
+ * Receiver: record a directory, so even empty ones are extracted.
+ */
+void pack_add_dir (const char *path)
+{
+        struct pack_entry *e;
+
+        e = add_entry(path);
+        e->offset = data_end;
+        e->size   = 0;
+        e->mtime  = 0;
+        e->mode   = PACK_DIR | 0755;
+}
+
+
+/*
+ * pack_load
+ *
+ * Open a pack for reading and return it, with its records sorted in tree order
+ * in *list (*count of them).
+ */
+FILE *pack_load (char *file, struct pack_entry **list, size_t *count)
+{
+        long long        end;
+        FILE            *f;
+        struct stat_info st;
+
+        f = fopen(file, "rb");
+        if (f == NULL)
+                fatal("Cannot open pack '%s'", file);
+        if (!read_index(f, list, count, &end))
+                fatal("'%s' is not a complete pack", file);
+        if (fstat(fileno(f), &st) == 0 && st.st_size > end)
+                inform("--- Pack '%s' was not finished, reading its last "
+                       "index\n", file);
+        qsort(*list, *count, sizeof(struct pack_entry), compare_tree);
+        return f;
+}
+
+
+/*
+ * pack_is_dir
+ *
+ * True if the record is a directory.
+ */
+int pack_is_dir (const struct pack_entry *e)
+{
+        return (e->mode & PACK_DIR) != 0;
+}
+
+
+/*
+ * pack_list
+ *
+ * List the contents of a pack, like "ls -l" would.
+ */
+void pack_list (char *file)
+{
+        struct pack_entry *list;
+        size_t             count, i;
+        char               date[32];
+        time_t             t;
+        FILE              *f;
+
+        f = pack_load(file, &list, &count);
+        fclose(f);
+
+        for (i = 0;  i < count;  i++)
+        {
+                t = (time_t) list[i].mtime;
+                strftime(date, sizeof(date), "%Y-%m-%d %H:%M",
+                         localtime(&t));
+                printf("%c%c%c%c %15lld %s %s%s\n",
+                       (pack_is_dir(&list[i]) ? 'd' : '-'),
+                       (list[i].mode & 0400 ? 'r' : '-'),
+                       (list[i].mode & 0200 ? 'w' : '-'),
+                       (list[i].mode & 0100 ? 'x' : '-'),
+                       list[i].size, (list[i].mtime > 0 ? date : "-"),
+                       list[i].path, (pack_is_dir(&list[i]) ? "/" : ""));
+        }
+}
+
+
+/*
+ * pack_extract
+ *
+ * Recreate the tree stored in a pack under dir.
+ */
+void pack_extract (char *file, char *dir)
+{
+        char               path[PATH_MAX], buf[CANUTE_BLOCK_SIZE];
+        struct pack_entry *list;
+        struct utime_info  ut;
+        struct stat_info   st;
+        size_t             count, i, b;
+        long long          left;
+        FILE              *f, *out;
+
+        f = pack_load(file, &list, &count);
+        mkdir(dir);
+
+        for (i = 0;  i < count;  i++)
+        {
+                if (!path_inside(list[i].path))
+                {
+                        errno = EPERM;
+                        error("Not extracting '%s', it is outside '%s'",
+                              list[i].path, dir);
+                        continue;
+                }
+                if (snprintf(path, PATH_MAX, "%s/%s", dir, list[i].path)
+                    >= PATH_MAX)
+                {
+                        errno = ENAMETOOLONG;
+                        error("Cannot extract '%s'", list[i].path);
+                        continue;
+                }
+                make_parents(path);
+                if (pack_is_dir(&list[i]))
+                {
+                        mkdir(path);
+                        continue;
+                }
+
+                out = fopen(path, "wb");
+                if (out == NULL)
+                {
+                        error("Cannot open file '%s'", path);
+                        continue;
+                }
+                inform("--- Extracting '%s'\n", list[i].path);
+                if (fseeko(f, (off_t) list[i].offset, SEEK_SET) == -1)
+                        fatal("Seeking pack '%s'", file);
+                for (left = list[i].size;  left > 0;  left -= b)
+                {
+                        b = (left > CANUTE_BLOCK_SIZE ? CANUTE_BLOCK_SIZE
+                             : (size_t) left);
+                        if (fread(buf, 1, b, f) != b)
+                                fatal("Reading pack '%s'", file);
+                        if (fwrite(buf, 1, b, out) != b)
+                                break;
+                }
+                if (fclose(out) != 0 || left > 0)
+                {
+                        error("Writing file '%s'", path);
+                        remove(path);
+                        continue;
+                }
+
+                if (list[i].mtime > 0)
+                {
+                        ut.actime  = (time_t) list[i].mtime;
+                        ut.modtime = (time_t) list[i].mtime;
+                        if (utime(path, &ut) == -1)
+                                error("Cannot set modification time on '%s'",
+                                      path);
+                }
+#ifndef HASEFROCH
+                if ((list[i].mode & 0100) && stat(path, &st) == 0
+                    && chmod(path, st.st_mode | S_IXUSR) == -1)
+                        error("Setting executable bit on '%s'", path);
+#endif
+        }
+        fclose(f);
+}
@@ -0,0 +1,226 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                         SENDER READ-AHEAD OF NEXT FILES                    */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * The sender opens a file only when the previous one is completely sent, so
+ * with cold caches, and much more on network filesystems, every file starts
+ * with the connection idle while its inode and first blocks are fetched.
+ *
+ * The directory walk knows what comes next, so it queues the next PREFETCH_FILES
+ * entries here.  A background thread looks each of them up (fstatat() on its
+ * own copy of the directory descriptor, the walk may close it meanwhile),
+ * opens the regular files without following links, and asks the kernel to
+ * read their first PREFETCH_HEAD bytes with posix_fadvise(POSIX_FADV_WILLNEED).
+ * Nothing else is opened: FIFOs, devices and the like may do something just
+ * by being opened.  So at most PREFETCH_FILES *
+ * PREFETCH_HEAD bytes per directory level are read ahead of the sender.
+ * Entries that do not fit in the queue are just not prefetched.
+ *
+ * It only warms the caches, the sender still opens and reads everything as
+ * before, so a wrong guess costs nothing but some I/O.  Systems without
+ * posix_fadvise() (and Hasefroch) do not prefetch.  Every thread sending
+ * (library sessions, see libcanute.c) has its own worker.
+ */
+#include "canute.h"
+
+#ifndef HASEFROCH
+#include <fcntl.h>
+#ifdef POSIX_FADV_WILLNEED
+#define PREFETCH
+#endif
+#endif
+
+#ifdef PREFETCH
+#include <pthread.h>
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW 0
+#endif
+
+#define PREFETCH_QUEUE (2 * PREFETCH_FILES)
+#define PREFETCH_HEAD  (16 * CANUTE_BLOCK_SIZE)
+
+struct prefetch_item
+{
+        int   dir;   /* Duplicated directory descriptor */
+        char *name;
+};
+
+struct prefetcher
+{
+        struct prefetch_item queue[PREFETCH_QUEUE];
+        size_t               queue_head, queue_count;
+        int                  stopping;
+        pthread_t            worker;
+        pthread_mutex_t      queue_lock;
+        pthread_cond_t       queue_ready;
+};
+
+static THREAD_LOCAL struct prefetcher *pf = NULL;  /* Of the sending thread */
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * warm
+ *
+ * Get the inode and, for regular files, the first blocks of a directory entry
+ * into the caches.
+ */
+static void warm (struct prefetch_item *it)
+{
+        struct stat st;
+        int         fd = -1;
+
+        /* Checked again once open, it may have been replaced meanwhile */
+        if (fstatat(it->dir, it->name, &st, AT_SYMLINK_NOFOLLOW) == 0
+            && S_ISREG(st.st_mode))
+                fd = openat(it->dir, it->name,
+                            O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_NOCTTY);
+        if (fd != -1)
+        {
+                if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+                        posix_fadvise(fd, 0, (st.st_size < PREFETCH_HEAD
+                                              ? st.st_size : PREFETCH_HEAD),
+                                      POSIX_FADV_WILLNEED);
+                close(fd);
+        }
+        close(it->dir);
+        free(it->name);
+}
+
+
+/*
+ * prefetch_worker
+ *
+ * Thread entry point.  Warm queued entries until told to stop.
+ */
+static void *prefetch_worker (void *arg)
+{
+        struct prefetcher   *p = arg;
+        struct prefetch_item it;
+        int                  drop;
+
+        for (;;)
+        {
+                pthread_mutex_lock(&p->queue_lock);
+                while (p->queue_count == 0 && !p->stopping)
+                        pthread_cond_wait(&p->queue_ready, &p->queue_lock);
+                if (p->queue_count == 0)
+                {
+                        pthread_mutex_unlock(&p->queue_lock);
+                        break;
+                }
+                it             = p->queue[p->queue_head];
+                p->queue_head  = (p->queue_head + 1) % PREFETCH_QUEUE;
+                p->queue_count--;
+                drop           = p->stopping;
+                pthread_mutex_unlock(&p->queue_lock);
+
+                /* Not worth it anymore, but the descriptors must go */
+                if (drop)
+                {
+                        close(it.dir);
+                        free(it.name);
+                        continue;
+                }
+                warm(&it);
+        }
+        return arg;
+}
+#endif /* PREFETCH */
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * prefetch_add
+ *
+ * The entry name of the open directory dir will be sent soon.  Return false
+ * if it could not be queued (full queue, no prefetching here), in which case
+ * there is no point in queueing more right now.
+ */
+int prefetch_add (DIR *dir, const char *name)
+{
+#ifdef PREFETCH
+        struct prefetch_item it;
+        int                  full;
+
+        if (pf == NULL)
+        {
+                pf = calloc(1, sizeof(struct prefetcher));
+                if (pf == NULL)
+                        return 0;
+                pthread_mutex_init(&pf->queue_lock, NULL);
+                pthread_cond_init(&pf->queue_ready, NULL);
+                if (pthread_create(&pf->worker, NULL, prefetch_worker, pf)
+                    != 0)
+                {
+                        pthread_mutex_destroy(&pf->queue_lock);
+                        pthread_cond_destroy(&pf->queue_ready);
+                        free(pf);
+                        pf = NULL;
+                        return 0;
+                }
+        }
+
+        pthread_mutex_lock(&pf->queue_lock);
+        full = (pf->queue_count == PREFETCH_QUEUE);
+        pthread_mutex_unlock(&pf->queue_lock);
+        if (full)
+                return 0;
+
+        it.dir  = dup(dirfd(dir));
+        it.name = strdup(name);
+        if (it.dir == -1 || it.name == NULL)
+        {
+                if (it.dir != -1)
+                        close(it.dir);
+                free(it.name);
+                return 0;
+        }
+
+        /* Only this thread adds, so there is still room */
+        pthread_mutex_lock(&pf->queue_lock);
+        pf->queue[(pf->queue_head + pf->queue_count) % PREFETCH_QUEUE] = it;
+        pf->queue_count++;
+        pthread_cond_signal(&pf->queue_ready);
+        pthread_mutex_unlock(&pf->queue_lock);
+        return 1;
+#else
+        return 0;
+#endif
+}
+
+
+/*
+ * prefetch_stop
+ *
+ * Drop whatever is pending and wait for the worker thread to finish.
+ */
+void prefetch_stop (void)
+{
+#ifdef PREFETCH
+        if (pf == NULL)
+                return;
+        pthread_mutex_lock(&pf->queue_lock);
+        pf->stopping = 1;
+        pthread_cond_signal(&pf->queue_ready);
+        pthread_mutex_unlock(&pf->queue_lock);
+        pthread_join(pf->worker, NULL);
+        pthread_mutex_destroy(&pf->queue_lock);
+        pthread_cond_destroy(&pf->queue_ready);
+        free(pf);
+        pf = NULL;
+#endif
+}
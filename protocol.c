@@ -44,7 +44,123 @@
  *
  * Finally, when no more items are left, a REQUEST_END is sent to notify the
  * receiver about the situation. Then both hosts close the connection and
- * exit.
+ * exit.  A REQUEST_END with size 1 asks the receiver to reply REPLY_ACCEPT
+ * first, once whatever it received is as durable as its policy requires (see
+ * durable.c).  Receivers that do not know about this simply close.
+ *
+ *
+ * DEDUPLICATION
+ *
+ * A REQUEST_FILE carrying FLAG_DEDUP is negotiated as usual, but its contents
+ * are not sent as a raw byte stream. Instead, the sender cuts the data into
+ * content defined chunks (see dedup.c) and goes in batches: a REQUEST_CHUNKS
+ * header with the number of chunks in the size field, followed by a table with
+ * the SHA-256 and length of each chunk. The receiver answers with a bitmap (one
+ * bit per chunk, no header) flagging the chunks it does not have, and the
+ * sender sends exactly those, in order. Chunks the receiver already holds are
+ * copied from its chunk store.
+ *
+ *
+ * SPARSE FILES
+ *
+ * A REQUEST_FILE carrying FLAG_SPARSE has its contents split in segments, each
+ * one starting with a header: REQUEST_DATA with the segment size, followed by
+ * that many bytes, or REQUEST_HOLE with the size of a run of zeros, followed by
+ * nothing. The receiver seeks over the holes, leaving them unallocated.
+ *
+ *
+ * LOCAL TRANSFERS
+ *
+ * Over a Unix socket (see net.c) a whole file goes as a REQUEST_FILE carrying
+ * FLAG_DESCRIPTOR, negotiated as usual, after which the sender passes its open
+ * descriptor of the file instead of the contents.  The receiver copies the
+ * missing range from it, inside the kernel (copy_file_range(), which may even
+ * share the blocks) unless it must hash the contents or the kernel cannot,
+ * then with pread() into the usual writes.  Only the header and the byte
+ * carrying the descriptor travel through the socket.
+ *
+ *
+ * INCREMENTAL SESSIONS
+ *
+ * Before sending any item, the sender may ask for the receiver file index with
+ * a REQUEST_INDEX. The receiver answers REPLY_SKIP if it keeps no index, or
+ * REPLY_ACCEPT with the number of entries in the size field followed by the
+ * index summary (see index.c). Files found in the summary are not sent nor
+ * negotiated. Both peers track the path of the current directory relative to
+ * the session start, because that is what the index is keyed by.
+ *
+ *
+ * HARD LINKS
+ *
+ * With -l, a file with several links that already went in the session (see
+ * links.c) is offered as a REQUEST_LINK instead: the name of the new link,
+ * its modification time, and the path of the first one (relative to the
+ * session start) as that many bytes following the header.  The receiver links
+ * it and replies REPLY_ACCEPT, or replies REPLY_SKIP if it cannot (packs, no
+ * hard links there, the first one did not make it...), in which case the
+ * sender goes on with a REQUEST_FILE for it as usual.
+ *
+ *
+ * FILTERS
+ *
+ * Entries left out by the filter rules (see filter.c) are simply never
+ * offered.  A receiver refuses what its own rules exclude, like anything it
+ * does not want, and a sender may ask for those rules first with a
+ * REQUEST_RULES, which is answered REPLY_SKIP if there are none, or
+ * REPLY_ACCEPT with their length in the size field followed by their text.
+ *
+ *
+ * WATCH MODE
+ *
+ * A sender watching its trees (see watch.c) keeps the session open after the
+ * items have been sent and goes on sending what changes, in batches: it opens
+ * the directories leading to each changed entry with REQUEST_BEGINDIR, sends
+ * it as usual (a directory with everything inside) and closes them again with
+ * REQUEST_ENDDIR by the end of the batch.  Files changed go with FLAG_REPLACE:
+ * the receiver skips them only if it has them with the same size and
+ * modification time, and otherwise receives them whole rather than resuming
+ * them.  Receivers that do not know the flag resume, as always.
+ *
+ *
+ * FOLLOW MODE
+ *
+ * A sender following growing files (see follow.c) offers each of them with a
+ * REQUEST_FOLLOW instead of a REQUEST_FILE.  The receiver answers REPLY_SKIP,
+ * or REPLY_ACCEPT with the size of its copy in the size field, and keeps that
+ * copy open until the session ends.  From then on whatever the file grows goes
+ * as a REQUEST_APPEND, carrying the offset the new data starts at in the size
+ * field, followed by a REQUEST_DATA segment with the data.  An offset below the
+ * size of the copy cuts the copy there first: the file was truncated or
+ * replaced, and is being sent again from the start.  An offset past it means
+ * the copy was changed behind our back, and the data is dropped.
+ *
+ *
+ * INTERLEAVED FILES
+ *
+ * A sender started with -s offers files of INTERLEAVE_MIN bytes or more with
+ * FLAG_INTERLEAVE.  A receiver taking them as streams answers REPLY_ACCEPT
+ * with the offset as usual and a stream number in the time field, and keeps
+ * the file open until it is complete.  A zero there (older receivers, packs)
+ * means the contents follow right away, as always.  The contents of a stream
+ * go as REQUEST_SLICE messages carrying the stream number in the time field
+ * and a length in the size field, followed by that many bytes.  A file request
+ * sent while there are streams carries FLAG_SLICES: slices may come between
+ * the reply and its contents, which then start with a REQUEST_DATA header.
+ *
+ * The sender takes its streams in turn, a slice each, before every entry it
+ * sends and while it waits for a reply.  So directories and small files go
+ * through while big files are on their way, behind one slice at most, and the
+ * time spent waiting for replies carries data.  Each stream gets the same
+ * share, and at most INTERLEAVE_MAX are open at once; another big file waits
+ * for one of them to end.
+ *
+ *
+ * LOCAL PATHS
+ *
+ * "Moving into" a directory is only a manner of speaking: neither peer changes
+ * its working directory, which belongs to the whole process (see libcanute.c).
+ * The sender keeps the local path of the directory it walks, the receiver puts
+ * the relative path after its session directory.
  *
  *
  * ABOUT FILE SIZES
@@ -66,55 +182,302 @@
  */
 #include "canute.h"
 
-static char databuf[CANUTE_BLOCK_SIZE];
+#ifdef __linux__
+#define COPY_RANGE
+#endif
+
+#define DEDUP_BUFFER  (64 * CANUTE_BLOCK_SIZE)
+#define SPARSE_BUFFER (16 * CANUTE_BLOCK_SIZE)  /* Largest data segment */
+#define RULES_MAX     (1 << 20)  /* Longest filter rules text accepted */
+#define INDEX_MAX     (1 << 26)  /* Most index summary entries accepted */
+#define COPY_CHUNK    (16 * CANUTE_BLOCK_SIZE)  /* Kernel copy at once */
+#define INTERLEAVE_MIN   (64 * CANUTE_BLOCK_SIZE)  /* Smallest file streamed */
+#define INTERLEAVE_SLICE (4 * CANUTE_BLOCK_SIZE)
+#define INTERLEAVE_MAX   4   /* Streams at once */
+#define INTERLEAVE_AHEAD 2   /* Most slices sent waiting for a reply */
+#define REPLACE_ALL      1   /* open_file(): the sender asked, FLAG_REPLACE */
+#define REPLACE_LONGER   2   /* Only what is not shorter, see receive_file() */
+
+/*
+ * A directory the sender is walking.  Kept in a list, so a failed library call
+ * can close them all.
+ */
+struct walk
+{
+        DIR         *dir;
+        char       **names;
+        size_t       count;
+        size_t       next;   /* First name not sent (nor freed) yet */
+        struct walk *up;
+};
+
+/*
+ * A file the receiver keeps open for a following sender.
+ */
+struct followed
+{
+        char            *name;   /* item_path() of it, the key */
+        char            *path;   /* local_path() of it */
+        FILE            *file;
+        long long        size;
+        int              mtime;
+        struct followed *next;
+};
+
+/*
+ * A file the sender is sending in slices (see INTERLEAVED FILES).
+ */
+struct outgoing
+{
+        int              id;
+        char             sname[CANUTE_NAME_LENGTH + 1];
+        FILE            *file;
+        long long        sent;
+        long long        size;
+        struct outgoing *next;
+};
+
+/*
+ * A file the receiver is receiving in slices.
+ */
+struct incoming
+{
+        int              id;
+        char            *sname;
+        char            *name;   /* item_path() of it, for the index */
+        char            *path;   /* local_path() of it */
+        FILE            *file;
+        long long        received;
+        long long        size;
+        int              mtime;
+        int              is_executable;
+        int              hashed;
+        struct sha256    ctx;
+        struct incoming *next;
+};
+
+/* Per thread, so library sessions can run concurrently */
+static THREAD_LOCAL char          *databuf = NULL;     /* CANUTE_BLOCK_SIZE */
+static THREAD_LOCAL int            own_databuf = 0;
+static THREAD_LOCAL unsigned char  chunk_table[DEDUP_BATCH * CHUNK_RECORD];
+static THREAD_LOCAL unsigned char  chunk_bitmap[DEDUP_BATCH / 8];
+static THREAD_LOCAL unsigned char *dedup_buf = NULL;
+static THREAD_LOCAL char          *chunk_kept[DEDUP_BATCH];  /* Receiver */
+static THREAD_LOCAL unsigned char *chunk_list = NULL;  /* Sender, hash cache */
+static THREAD_LOCAL size_t         chunk_list_alloc = 0;
+static THREAD_LOCAL char          *sparse_buf = NULL;
+static THREAD_LOCAL char           relpath[PATH_MAX];  /* From session start */
+static THREAD_LOCAL size_t         rellen = 0;
+static THREAD_LOCAL char           srcpath[PATH_MAX];  /* Sender, local walk */
+static THREAD_LOCAL size_t         srclen = 0;
+static THREAD_LOCAL struct walk   *walking = NULL;
+static THREAD_LOCAL const char    *session_dir = NULL; /* Receiver, or cwd */
+static THREAD_LOCAL FILE          *open_item = NULL;   /* Closed on failure */
+static THREAD_LOCAL int            passed_item = -1;   /* Same, a descriptor */
+static THREAD_LOCAL int            replacing = 0;      /* Sender, watch mode */
+static THREAD_LOCAL struct followed *following = NULL; /* Receiver */
+static THREAD_LOCAL struct outgoing *sending = NULL;   /* Sender, in turn */
+static THREAD_LOCAL struct incoming *receiving = NULL; /* Receiver */
+static THREAD_LOCAL struct sha256 *content_hash = NULL;  /* Receiver, index */
+static THREAD_LOCAL int            end_confirmation = 0; /* See confirm_end() */
 
 
 /****************************  PRIVATE FUNCTIONS  ****************************/
 
 /*
- * receive_file
+ * skip_progress
  *
- * A file request has been received from the network.  We must reply depending
- * on the local state of the file requested.
+ * Account for a range that was not transferred byte by byte (a hole), which may
+ * be larger than what update_progress() takes at once.
+ */
+static void skip_progress (long long count)
+{
+        size_t b;
+
+        while (count > 0)
+        {
+                b = (count > 0x40000000 ? 0x40000000 : (size_t) count);
+                update_progress(b);
+                count -= b;
+        }
+}
+
+
+/*
+ * enter_path / leave_path
  *
- * Having mtime > 0 means that the peer is version above 1.1, so we can set the
- * file mtime to that provided by the protocol.
+ * Keep relpath in step with the directory walk.
  */
-static void receive_file (SOCKET    sk,
-                          char     *name,
-                          long long size,
-                          int       mtime,
-                          int       is_executable)
+static void enter_path (const char *name)
 {
-        int               e;
-        FILE             *file;
-        long long         received_bytes; /* Think about it also as "offset" */
-        size_t            b;
-        struct stat_info  st;
-        struct utime_info ut;
+        rellen += snprintf(relpath + rellen, PATH_MAX - rellen, "%s%s",
+                           (rellen > 0 ? "/" : ""), name);
+        if (rellen >= PATH_MAX)
+                fatal("Path too long");
+}
 
-        e = stat(name, &st);
-        if (e == -1)
-                received_bytes = 0;  /* Most probable: errno == ENOENT */
-        else if (st.st_size >= size)
+
+static void leave_path (void)
+{
+        while (rellen > 0 && relpath[rellen - 1] != '/')
+                rellen--;
+        if (rellen > 0)
+                rellen--;
+        relpath[rellen] = '\0';
+}
+
+
+/*
+ * item_path
+ *
+ * Relative path of an item in the current directory.
+ */
+static char *item_path (const char *name)
+{
+        static THREAD_LOCAL char path[PATH_MAX];
+        int                      n;
+
+        n = snprintf(path, PATH_MAX, "%s%s%s", relpath,
+                     (rellen > 0 ? "/" : ""), name);
+        if (n < 0 || n >= PATH_MAX)
         {
-                printf("--- Skipping file '%s'\n", name);
-                send_message(sk, REPLY_SKIP, 0, 0, 0, NULL);
-                return;
+                /* Cut short, it would be the key of some other item */
+                errno = ENAMETOOLONG;
+                fail(CANUTE_EFILE, "Path of '%s'", name);
         }
-        else
-                received_bytes = (long long) st.st_size;
+        return path;
+}
 
-        file = fopen(name, (received_bytes > 0 ? "ab" : "wb"));
-        if (file == NULL)
+
+/*
+ * local_path
+ *
+ * Receiver: where an item of the current directory goes, or the directory
+ * itself if name is empty.
+ */
+static char *local_path (const char *name)
+{
+        static THREAD_LOCAL char path[PATH_MAX];
+        const char              *rel = item_path(name);
+        int                      n;
+
+        if (rel[0] == '\0' && session_dir == NULL)
+                return ".";
+        if (session_dir == NULL)
+                return strcpy(path, rel);
+        n = snprintf(path, PATH_MAX, "%s%s%s", session_dir,
+                     (rel[0] != '\0' ? "/" : ""), rel);
+        if (n < 0 || n >= PATH_MAX)
         {
-                error("Cannot open file '%s'", name);
-                send_message(sk, REPLY_SKIP, 0, 0, 0, NULL);
-                return;
+                errno = ENAMETOOLONG;
+                fail(CANUTE_EFILE, "Path of '%s'", name);
         }
+        return path;
+}
 
-        send_message(sk, REPLY_ACCEPT, 0, 0, received_bytes, NULL);
-        setup_progress(name, size, received_bytes);
+
+/*
+ * need_buffer
+ *
+ * Allocate the block buffer, unless some is there already.
+ */
+static void need_buffer (void)
+{
+        if (databuf != NULL)
+                return;
+        databuf = malloc(CANUTE_BLOCK_SIZE);
+        if (databuf == NULL)
+                fail(CANUTE_ENOMEM, "Allocating block buffer");
+        own_databuf = 1;
+}
+
+
+/*
+ * entry_is_dir
+ *
+ * Sender: true if the entry name of the directory at srcpath is a directory,
+ * as send_entry() will find it.  Only looked at when some filter rule is for
+ * directories only.
+ */
+static int entry_is_dir (const char *name)
+{
+        char             path[PATH_MAX];
+        struct stat_info st;
+        int              n;
+
+        if (!filter_dirs())
+                return 0;
+        n = snprintf(path, PATH_MAX, "%s%s%s", srcpath,
+                     (srclen > 0 ? "/" : ""), name);
+        return (n >= 0 && n < PATH_MAX && stat(path, &st) == 0
+                && S_ISDIR(st.st_mode));
+}
+
+
+/*
+ * excluded
+ *
+ * Sender: true if the filter rules leave out the entry name of the current
+ * directory, a directory if is_dir.
+ */
+static int excluded (const char *name, int is_dir)
+{
+        char safe[CANUTE_NAME_LENGTH + 1], *sname;
+
+        if (!filter_enabled())
+                return 0;
+        strncpy(safe, name, CANUTE_NAME_LENGTH);
+        safe[CANUTE_NAME_LENGTH] = '\0';
+        sname = safename(safe);
+        if (!filter_excluded(item_path(sname), is_dir))
+                return 0;
+        inform("--- Excluding '%s'\n", sname);
+        return 1;
+}
+
+
+/*
+ * refused
+ *
+ * Receiver: if our filter rules exclude the entry name of the current
+ * directory, a directory if is_dir, refuse it and return true.
+ */
+static int refused (struct connection *cn, const char *name, int is_dir)
+{
+        if (!filter_enabled() || !filter_excluded(item_path(name), is_dir))
+                return 0;
+        inform("--- Excluding '%s'\n", name);
+        send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+        return 1;
+}
+
+
+/*
+ * write_data
+ *
+ * Write received contents, hashing them on the way if requested.
+ */
+static void write_data (FILE *file, const char *buf, size_t count)
+{
+        fwrite(buf, 1, count, file);
+        writeback_written(count);
+        if (content_hash != NULL)
+                sha256_update(content_hash, buf, count);
+}
+
+
+/*
+ * receive_raw
+ *
+ * Receive the file contents as a plain byte stream, from the given offset up
+ * to size.
+ */
+static void receive_raw (struct connection *cn,
+                         FILE              *file,
+                         long long          received_bytes,
+                         long long          size)
+{
+        size_t b;
 
         while (received_bytes < size)
         {
@@ -123,224 +486,2301 @@ static void receive_file (SOCKET    sk,
                 else
                         b = (size_t) (size - received_bytes);
 
-                receive_data(sk, databuf, b);
-                fwrite(databuf, 1, b, file);
+                receive_contents(cn, databuf, b);
+                write_data(file, databuf, b);
                 update_progress(b);
                 received_bytes += b;
         }
-
-        finish_progress();
-        fflush(file);
-        fclose(file);
-
-        /* Set mtime if packet provides information */
-        if (mtime > 0)
-        {
-                ut.actime  = (time_t) mtime;
-                ut.modtime = (time_t) mtime;
-                e = utime(name, &ut);
-                if (e == -1)
-                        error("Cannot set modification time on '%s'", name);
-        }
-
-#ifndef HASEFROCH
-        if (is_executable)
-        {
-                e = stat(name, &st);
-                if (e != -1)
-                {
-                        e = chmod(name, st.st_mode | S_IXUSR);
-                        if (e == -1)
-                                error("Setting executable bit on '%s'", name);
-                }
-                else
-                        error("Cannot stat file '%s'", name);
-        }
-#endif
 }
 
 
 /*
- * send_file
+ * receive_passed
  *
- * Treat the item as a file and try to send it.
+ * Receive the file contents from the descriptor the sender passes, copying
+ * them from the given offset up to size.  They start at base in file (inside
+ * a pack).
  */
-static void send_file (SOCKET    sk,
-                       char     *name,
-                       long long size,
-                       int       mtime,
-                       int       is_executable)
+static void receive_passed (struct connection *cn,
+                            FILE              *file,
+                            long long          base,
+                            long long          received_bytes,
+                            long long          size)
 {
-        int       e, reply;
-        long long sent_bytes; /* Size reported remotely */
-        size_t    b;
-        char     *sname;
-        FILE     *file;
+        ssize_t r = -1;
+        size_t  b;
+        int     copy, recording;
+#ifdef COPY_RANGE
+        off_t   from, to;
+#endif
 
-        file  = fopen(name, "rb");
-        if (file == NULL)
+        passed_item = receive_descriptor(cn);
+        if (passed_item == -1)
         {
-                error("Cannot open file '%s'", name);
+                /* A replay: the recording kept the contents as sent raw */
+                receive_raw(cn, file, received_bytes, size);
                 return;
         }
 
-        sname = safename(name);
-        send_message(sk, REQUEST_FILE, is_executable, mtime, size, sname);
-        reply = receive_message(sk, NULL, NULL, &sent_bytes, NULL);
-        if (reply == REPLY_SKIP)
-        {
-                fclose(file);
-                printf("--- Skipping file '%s'\n", sname);
-                return;
-        }
+        /* Contents must go through databuf to reach the hash or the tape */
+        recording = replay_recording(cn);
+        copy      = (content_hash == NULL && !recording);
 
-        if (sent_bytes > 0)
+        /* Both ways below go past the stdio buffer */
+        fflush(file);
+        while (received_bytes < size)
         {
-                e = fseeko(file, (off_t) sent_bytes, SEEK_SET);
-                if (e == -1)
-                        fatal("Could not seek file '%s'", sname);
+#ifdef COPY_RANGE
+                if (copy)
+                {
+                        b = COPY_CHUNK;
+                        if ((long long) b > size - received_bytes)
+                                b = (size_t) (size - received_bytes);
+                        from = (off_t) received_bytes;
+                        to   = (off_t) (base + received_bytes);
+                        r    = copy_file_range(passed_item, &from, fileno(file),
+                                               &to, b, 0);
+                        /* Older kernels, other filesystems... just read */
+                        if (r == -1)
+                                copy = 0;
+                        else if (r > 0
+                                 && fseeko(file, to, SEEK_SET) == -1)
+                                fatal("Seeking file");
+                        else if (r > 0)
+                                writeback_written((size_t) r);
+                }
+#else
+                copy = 0;
+#endif
+                if (!copy)
+                {
+                        b = CANUTE_BLOCK_SIZE;
+                        if ((long long) b > size - received_bytes)
+                                b = (size_t) (size - received_bytes);
+                        r = pread(passed_item, databuf, b,
+                                  (off_t) received_bytes);
+                        if (r == -1 && errno == EINTR)
+                                continue;
+                        if (r == -1)
+                                fatal("Reading passed file");
+                        write_data(file, databuf, (size_t) r);
+                        if (recording)
+                                replay_bytes(cn, databuf, (size_t) r, 1);
+                }
+                if (r == 0)
+                {
+                        errno = 0;
+                        fail(CANUTE_EFILE, "Passed file shrank while sent");
+                }
+                update_progress((size_t) r);
+                received_bytes += r;
         }
 
-        setup_progress(sname, size, sent_bytes);
+        close(passed_item);
+        passed_item = -1;
+}
+
+
+/*
+ * send_raw
+ *
+ * Send the file contents as a plain byte stream, from the current position up
+ * to size.
+ */
+static void send_raw (struct connection *cn,
+                      FILE              *file,
+                      long long          sent_bytes,
+                      long long          size)
+{
+        size_t b;
 
         while (sent_bytes < size)
         {
-                b = fread(databuf, 1, CANUTE_BLOCK_SIZE, file);
-                send_data(sk, databuf, b);
+                /* Never past size, the file may be inside a pack */
+                b = CANUTE_BLOCK_SIZE;
+                if ((long long) b > size - sent_bytes)
+                        b = (size_t) (size - sent_bytes);
+                b = fread(databuf, 1, b, file);
+                if (b == 0)
+                        fatal("Reading file");
+                send_data(cn, databuf, b);
                 update_progress(b);
                 sent_bytes += b;
         }
-
-        finish_progress();
-        fclose(file);
 }
 
 
-/*****************************  PUBLIC FUNCTIONS  *****************************/
-
 /*
- * send_item
+ * receive_sparse
  *
- * Discover what kind of filesystem item 'name' represents and send it over the
- * connection.
+ * Receive data and hole segments until the file is complete.  A hole at the
+ * end of the file is materialized writing its last byte, as seeking alone does
+ * not extend the file.  The contents start at base in file (inside a pack).
  */
-void send_item (SOCKET sk, char *name)
+static void receive_sparse (struct connection *cn,
+                            FILE              *file,
+                            long long          base,
+                            long long          received_bytes,
+                            long long          size)
 {
-        int              e, reply, x_bit = 0;
-        char            *sname;
-        DIR             *dir;
-        struct dirent   *dentry;
-        struct stat_info st;
+        long long n;
+        int       type, hole = 0;
 
-        e = stat(name, &st);
-        if (e == -1)
+        while (received_bytes < size)
         {
-                error("Cannot stat item '%s'", name);
-                return;
-        }
+                type = receive_message(cn, NULL, NULL, &n, NULL);
+                if (n <= 0 || received_bytes + n > size)
+                        fail(CANUTE_EPROTO, "Invalid segment size");
 
-        if (S_ISDIR(st.st_mode))
-        {
-                dir = opendir(name);
-                if (dir == NULL)
+                if (type == REQUEST_HOLE)
                 {
-                        error("Cannot open dir '%s'", name);
-                        return;
+                        received_bytes += n;
+                        if (fseeko(file, (off_t) (base + received_bytes),
+                                   SEEK_SET) == -1)
+                                fatal("Seeking over a hole");
+                        skip_progress(n);
+                        hole = 1;
                 }
-
-                e = chdir(name);
-                if (e == -1)
+                else if (type == REQUEST_DATA)
                 {
-                        closedir(dir);
-                        error("Cannot change to dir '%s'", name);
-                        return;
+                        receive_raw(cn, file, received_bytes,
+                                    received_bytes + n);
+                        received_bytes += n;
+                        hole = 0;
                 }
+                else
+                        fail(CANUTE_EPROTO, "Unexpected segment type (%d)",
+                             type);
+        }
 
-                sname = safename(name);
-                send_message(sk, REQUEST_BEGINDIR, 0, 0, 0, sname);
-                reply = receive_message(sk, NULL, NULL, NULL, NULL);
-                if (reply == REPLY_SKIP)
-                {
-                        closedir(dir);
-                        printf("--- Skipping directory '%s'\n", sname);
-                        e = chdir("..");
-                        if (e == -1)
-                                fatal("Could not change to parent directory");
-                        return;
-                }
+        if (hole && fseeko(file, (off_t) (base + size - 1), SEEK_SET) == 0)
+                fputc(0, file);
+}
 
-                printf(">>> Entering directory '%s'\n", sname);
-                dentry = readdir(dir);
-                while (dentry != NULL)
-                {
-                        if (NOT_SELF_OR_PARENT(dentry->d_name))
-                                send_item(sk, dentry->d_name);
-                        dentry = readdir(dir);
-                }
 
-                closedir(dir);
-                e = chdir("..");
-                if (e == -1)
-                        fatal("Could not change to parent directory");
-                send_message(sk, REQUEST_ENDDIR, 0, 0, 0, NULL);
+/*
+ * flush_segment
+ *
+ * Send the pending data (from sparse_buf) or hole segment, if any.
+ */
+static void flush_segment (struct connection *cn, size_t *fill,
+                           long long *hole)
+{
+        if (*fill > 0)
+        {
+                send_message(cn, REQUEST_DATA, 0, 0, *fill, NULL);
+                send_data(cn, sparse_buf, *fill);
+                update_progress(*fill);
+                *fill = 0;
         }
-        else
+        if (*hole > 0)
         {
-#ifndef HASEFROCH
-                x_bit = st.st_mode & S_IXUSR;
-#endif
-                send_file(sk, name, st.st_size, (int) st.st_mtime, x_bit);
+                send_message(cn, REQUEST_HOLE, 0, 0, *hole, NULL);
+                skip_progress(*hole);
+                *hole = 0;
         }
 }
 
 
 /*
- * receive_item
+ * send_sparse
  *
- * Parse a header packet containing a request and act accordingly. Return true
- * if the read packet is the last one for the session (no more items to come)
- * and false otherwise (still more stuff pending).
+ * Send the file as segments.  Holes known to the filesystem are skipped
+ * without reading them, data regions are read and scanned for zero blocks.
+ * Consecutive data blocks are gathered to keep segment headers rare.  At most
+ * one kind of segment is pending at any time.
  */
-int receive_item (SOCKET sk)
+static void send_sparse (struct connection *cn,
+                         FILE              *file,
+                         long long          sent_bytes,
+                         long long          size)
 {
-        static char namebuf[CANUTE_NAME_LENGTH + 1];
-        int         e, x_bit, mtime, request;
-        long long   size;
-
-        request = receive_message(sk, &x_bit, &mtime, &size, namebuf);
+        long long pos = sent_bytes, data_start, data_end = sent_bytes;
+        long long hole = 0;   /* Pending zero bytes */
+        size_t    fill = 0;   /* Pending data bytes in sparse_buf */
+        size_t    b;
 
-        switch (request)
+        if (sparse_buf == NULL)
         {
-        case REQUEST_FILE:
-                receive_file(sk, namebuf, size, mtime, x_bit);
-                break;
+                sparse_buf = malloc(SPARSE_BUFFER);
+                if (sparse_buf == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating sparse buffer");
+        }
+
+        while (pos < size)
+        {
+                /* Past the current data region, look for the next one.  The
+                 * lseek()s underneath leave stdio out of sync, hence the
+                 * fseeko() */
+                if (pos >= data_end)
+                {
+                        next_data(file, pos, size, &data_start, &data_end);
+                        if (data_start > pos)
+                        {
+                                flush_segment(cn, &fill, &hole);
+                                hole = data_start - pos;
+                                pos  = data_start;
+                                if (pos >= size)
+                                        break;
+                        }
+                        if (fseeko(file, (off_t) pos, SEEK_SET) == -1)
+                                fatal("Could not seek file");
+                }
+
+                b = CANUTE_BLOCK_SIZE;
+                if ((long long) b > data_end - pos)
+                        b = (size_t) (data_end - pos);
+                if (fill + b > SPARSE_BUFFER)
+                        flush_segment(cn, &fill, &hole);
+
+                b = fread(sparse_buf + fill, 1, b, file);
+                if (b == 0)
+                        fatal("Reading file");
+
+                if (is_zero(sparse_buf + fill, b))
+                {
+                        if (fill > 0)
+                                flush_segment(cn, &fill, &hole);
+                        hole += b;
+                }
+                else
+                {
+                        if (hole > 0)
+                                flush_segment(cn, &fill, &hole);
+                        fill += b;
+                }
+                pos += b;
+        }
+
+        flush_segment(cn, &fill, &hole);
+}
+
+
+/*
+ * free_kept
+ *
+ * Forget the chunks receive_chunks() kept for repeating.
+ */
+static void free_kept (void)
+{
+        int i;
+
+        for (i = 0;  i < DEDUP_BATCH;  i++)
+        {
+                free(chunk_kept[i]);
+                chunk_kept[i] = NULL;
+        }
+}
+
+
+/*
+ * receive_chunks
+ *
+ * Deduplicated counterpart of the receive loop in receive_file(): get chunk
+ * tables until the file is complete, asking only for the chunks not found in
+ * the chunk store.
+ */
+static void receive_chunks (struct connection *cn,
+                            FILE              *file,
+                            long long          received_bytes,
+                            long long          size)
+{
+        unsigned char *entry;
+        char           repeated[DEDUP_BATCH]; /* Needed again later on */
+        int            first[DEDUP_BATCH];    /* Earlier copy, or -1 */
+        long long      count;
+        int            i, j, n, length;
+
+        while (received_bytes < size)
+        {
+                if (receive_message(cn, NULL, NULL, &count, NULL)
+                    != REQUEST_CHUNKS || count < 1 || count > DEDUP_BATCH)
+                        fail(CANUTE_EPROTO, "Unexpected chunk table");
+                n = (int) count;
+                receive_data(cn, (char *) chunk_table, n * CHUNK_RECORD);
+
+                /* Ask for the missing ones.  A chunk repeated within the batch
+                 * is only asked once and kept in memory for the rest, so they
+                 * do not depend on the store (nor on there being one).  The
+                 * copies are module state, a failure leaves them to
+                 * protocol_reset() */
+                memset(chunk_bitmap, 0, sizeof(chunk_bitmap));
+                memset(repeated, 0, sizeof(repeated));
+                for (i = 0;  i < n;  i++)
+                {
+                        entry    = chunk_table + i * CHUNK_RECORD;
+                        first[i] = -1;
+                        if (store_lookup(entry))
+                                continue;
+                        for (j = 0;  j < i;  j++)
+                                if ((chunk_bitmap[j >> 3] & (1 << (j & 7)))
+                                    && memcmp(chunk_table + j * CHUNK_RECORD,
+                                              entry, CHUNK_RECORD) == 0)
+                                        break;
+                        if (j == i)
+                                chunk_bitmap[i >> 3] |= 1 << (i & 7);
+                        else
+                        {
+                                first[i]    = j;
+                                repeated[j] = 1;
+                        }
+                }
+                send_data(cn, (char *) chunk_bitmap, (n + 7) / 8);
+
+                for (i = 0;  i < n;  i++)
+                {
+                        entry  = chunk_table + i * CHUNK_RECORD;
+                        length = (entry[HASH_SIZE] << 24)
+                               | (entry[HASH_SIZE + 1] << 16)
+                               | (entry[HASH_SIZE + 2] << 8)
+                               |  entry[HASH_SIZE + 3];
+                        if (length <= 0 || length > CANUTE_BLOCK_SIZE
+                            || received_bytes + length > size)
+                                fail(CANUTE_EPROTO,
+                                     "Invalid chunk length (%d)", length);
+
+                        if (chunk_bitmap[i >> 3] & (1 << (i & 7)))
+                        {
+                                receive_contents(cn, databuf, length);
+                                store_add(entry, databuf, length);
+                                if (repeated[i])
+                                {
+                                        chunk_kept[i] = malloc(length);
+                                        if (chunk_kept[i] == NULL)
+                                                fail(CANUTE_ENOMEM,
+                                                     "Allocating chunks");
+                                        memcpy(chunk_kept[i], databuf, length);
+                                }
+                        }
+                        else if (first[i] != -1)
+                                memcpy(databuf, chunk_kept[first[i]], length);
+                        else
+                                store_read(entry, databuf);
+
+                        write_data(file, databuf, length);
+                        update_progress(length);
+                        received_bytes += length;
+                }
+                free_kept();
+        }
+}
+
+
+/*
+ * offer_chunks
+ *
+ * Send a batch of n chunk records from chunk_table and return the bitmap of
+ * the chunks the receiver is missing.
+ */
+static unsigned char *offer_chunks (struct connection *cn, int n)
+{
+        send_message(cn, REQUEST_CHUNKS, 0, 0, n, NULL);
+        send_data(cn, (char *) chunk_table, n * CHUNK_RECORD);
+        receive_data(cn, (char *) chunk_bitmap, (n + 7) / 8);
+        return chunk_bitmap;
+}
+
+
+/*
+ * send_cached_chunks
+ *
+ * The hash cache already knows how the whole file is cut, so the chunk tables
+ * can be sent without reading anything.  Only the chunks the receiver is
+ * missing are read, seeking to them.
+ */
+static void send_cached_chunks (struct connection   *cn,
+                                FILE                *file,
+                                const unsigned char *records,
+                                size_t               count)
+{
+        const unsigned char *entry;
+        unsigned char       *missing;
+        long long            offset = 0;
+        size_t               done, len;
+        int                  i, n;
+
+        for (done = 0;  done < count;  done += n)
+        {
+                n = (count - done > DEDUP_BATCH ? DEDUP_BATCH
+                     : (int) (count - done));
+                memcpy(chunk_table, records + done * CHUNK_RECORD,
+                       n * CHUNK_RECORD);
+                missing = offer_chunks(cn, n);
+
+                for (i = 0;  i < n;  i++)
+                {
+                        entry = chunk_table + i * CHUNK_RECORD;
+                        len   = ((size_t) entry[HASH_SIZE] << 24)
+                              | ((size_t) entry[HASH_SIZE + 1] << 16)
+                              | ((size_t) entry[HASH_SIZE + 2] << 8)
+                              |  (size_t) entry[HASH_SIZE + 3];
+                        if (missing[i >> 3] & (1 << (i & 7)))
+                        {
+                                if (fseeko(file, (off_t) offset, SEEK_SET) == -1
+                                    || fread(databuf, 1, len, file) != len)
+                                        fatal("Reading file");
+                                send_data(cn, databuf, len);
+                        }
+                        update_progress(len);
+                        offset += len;
+                }
+        }
+}
+
+
+/*
+ * send_chunks
+ *
+ * Deduplicated counterpart of the send loop in send_file(): cut the remaining
+ * data in chunks and offer them in batches.  The buffer holds a whole batch
+ * because the missing chunks are only known after the receiver replies.  Whole
+ * files are looked up in the hash cache first, and recorded there otherwise,
+ * unless st is NULL.
+ */
+static void send_chunks (struct connection      *cn,
+                         FILE                   *file,
+                         const struct stat_info *st,
+                         long long               sent_bytes,
+                         long long               size)
+{
+        unsigned char *entry, *missing, *cached;
+        size_t         fill = 0, pos, len, b, listed = 0;
+        long long      read_bytes = sent_bytes;
+        size_t         offset[DEDUP_BATCH];
+        int            i, n, record;
+
+        record = (sent_bytes == 0 && st != NULL && hashcache_enabled());
+        if (record)
+        {
+                cached = hashcache_chunks(st, &b);
+                if (cached != NULL)
+                {
+                        send_cached_chunks(cn, file, cached, b);
+                        return;
+                }
+        }
+
+        if (dedup_buf == NULL)
+        {
+                dedup_buf = malloc(DEDUP_BUFFER);
+                if (dedup_buf == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating deduplication buffer");
+        }
+
+        while (sent_bytes < size)
+        {
+                /* Top up the buffer */
+                b = DEDUP_BUFFER - fill;
+                if ((long long) b > size - read_bytes)
+                        b = (size_t) (size - read_bytes);
+                if (b > 0)
+                {
+                        b = fread(dedup_buf + fill, 1, b, file);
+                        if (b == 0)
+                                fatal("Reading file");
+                        fill       += b;
+                        read_bytes += b;
+                }
+
+                /* Cut as many chunks as fit in a batch.  Stop short of the end
+                 * of the buffer unless the file ends there too, or the
+                 * boundary would depend on the buffer size */
+                pos = 0;
+                n   = 0;
+                while (n < DEDUP_BATCH && pos < fill
+                       && (fill - pos >= CANUTE_BLOCK_SIZE || read_bytes == size))
+                {
+                        len   = chunk_cut(dedup_buf + pos, fill - pos);
+                        entry = chunk_table + n * CHUNK_RECORD;
+                        sha256(dedup_buf + pos, len, entry);
+                        entry[HASH_SIZE]     = (unsigned char) (len >> 24);
+                        entry[HASH_SIZE + 1] = (unsigned char) (len >> 16);
+                        entry[HASH_SIZE + 2] = (unsigned char) (len >> 8);
+                        entry[HASH_SIZE + 3] = (unsigned char) len;
+                        offset[n++] = pos;
+                        pos        += len;
+                }
+                if (n == 0)
+                        continue;
+
+                if (record)
+                {
+                        if ((listed + n) * CHUNK_RECORD > chunk_list_alloc)
+                        {
+                                while ((listed + n) * CHUNK_RECORD
+                                       > chunk_list_alloc)
+                                        chunk_list_alloc = (chunk_list_alloc == 0
+                                                            ? DEDUP_BUFFER
+                                                            : chunk_list_alloc * 2);
+                                chunk_list = realloc(chunk_list,
+                                                     chunk_list_alloc);
+                                if (chunk_list == NULL)
+                                        fail(CANUTE_ENOMEM,
+                                             "Allocating chunk list");
+                        }
+                        memcpy(chunk_list + listed * CHUNK_RECORD, chunk_table,
+                               n * CHUNK_RECORD);
+                        listed += n;
+                }
+
+                missing = offer_chunks(cn, n);
+                for (i = 0;  i < n;  i++)
+                {
+                        len = (i + 1 < n ? offset[i + 1] : pos) - offset[i];
+                        if (missing[i >> 3] & (1 << (i & 7)))
+                                send_data(cn, (char *) dedup_buf + offset[i],
+                                          len);
+                        update_progress(len);
+                }
+
+                memmove(dedup_buf, dedup_buf + pos, fill - pos);
+                fill       -= pos;
+                sent_bytes += pos;
+        }
+
+        if (record)
+                hashcache_set_chunks(st, chunk_list, listed);
+}
+
+
+/*
+ * open_file
+ *
+ * Open the local file for a file request, positioned where the transfer must
+ * resume, in *received_bytes.  Return NULL, having already replied, if nothing
+ * must be received.  A file being replaced (REPLACE_*) is only complete if it
+ * has the same size and time, and is otherwise received from the start, or
+ * resumed if it is shorter and replace is REPLACE_LONGER.
+ */
+static FILE *open_file (struct connection *cn,
+                        char              *name,
+                        long long          size,
+                        int                mtime,
+                        int                replace,
+                        long long         *received_bytes)
+{
+        int              e;
+        FILE            *file;
+        char            *path = local_path(name);
+        struct stat_info st;
+
+        e = stat(path, &st);
+        if (e == -1 || (replace && (st.st_size != size
+                                    || (int) st.st_mtime != mtime)
+                        && (replace == REPLACE_ALL || st.st_size >= size)))
+                *received_bytes = 0;  /* Most probable: errno == ENOENT */
+        else if (st.st_size >= size)
+        {
+                inform("--- Skipping file '%s'\n", name);
+                send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                if (st.st_size == size && (int) st.st_mtime == mtime)
+                        index_update(item_path(name), size, mtime, NULL);
+                return NULL;
+        }
+        else
+                *received_bytes = (long long) st.st_size;
+
+        /* Resume with "r+b" rather than "ab": holes are made seeking, and
+         * append mode would ignore the seeks */
+        file = fopen(path, (*received_bytes > 0 ? "r+b" : "wb"));
+        if (file != NULL)
+                writeback_setup(file);
+        if (file != NULL && *received_bytes > 0
+            && fseeko(file, (off_t) *received_bytes, SEEK_SET) == -1)
+        {
+                fclose(file);
+                file = NULL;
+        }
+        if (file == NULL)
+        {
+                error("Cannot open file '%s'", name);
+                send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+        }
+        return file;
+}
+
+
+/*
+ * open_packed
+ *
+ * Same as open_file(), but the contents go to the pack, starting at *base.
+ * Packs are written sequentially, so files are always received whole.
+ */
+static FILE *open_packed (struct connection *cn,
+                          char              *name,
+                          long long          size,
+                          int                mtime,
+                          int                is_executable,
+                          long long         *base)
+{
+        if (pack_has(item_path(name), size, mtime))
+        {
+                inform("--- Skipping file '%s'\n", name);
+                send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                return NULL;
+        }
+        return pack_add_file(item_path(name), size, mtime, is_executable,
+                             base);
+}
+
+
+/*
+ * set_attributes
+ *
+ * Give a file received at path (name, for messages) the modification time the
+ * sender told, if any, and the executable bit.
+ */
+static void set_attributes (const char *path,
+                            const char *name,
+                            int         mtime,
+                            int         is_executable)
+{
+        int               e;
+        struct stat_info  st;
+        struct utime_info ut;
+
+        /* Set mtime if packet provides information */
+        if (mtime > 0)
+        {
+                ut.actime  = (time_t) mtime;
+                ut.modtime = (time_t) mtime;
+                e = utime(path, &ut);
+                if (e == -1)
+                        error("Cannot set modification time on '%s'", name);
+        }
+
+#ifndef HASEFROCH
+        if (is_executable)
+        {
+                e = stat(path, &st);
+                if (e != -1)
+                {
+                        e = chmod(path, st.st_mode | S_IXUSR);
+                        if (e == -1)
+                                error("Setting executable bit on '%s'", name);
+                }
+                else
+                        error("Cannot stat file '%s'", name);
+        }
+#endif
+}
+
+
+/*
+ * accept_incoming
+ *
+ * Take a file just opened as a stream, to be received in slices, and tell the
+ * sender its number.
+ */
+static void accept_incoming (struct connection *cn,
+                             FILE              *file,
+                             char              *name,
+                             long long          size,
+                             int                mtime,
+                             int                is_executable,
+                             long long          received_bytes)
+{
+        struct incoming *in;
+        int              id = 1;
+
+        /* The lowest number free */
+        in = receiving;
+        while (in != NULL)
+        {
+                if (in->id == id)
+                {
+                        id++;
+                        in = receiving;
+                }
+                else
+                        in = in->next;
+        }
+
+        in = calloc(1, sizeof(struct incoming));
+        if (in == NULL)
+        {
+                fclose(file);
+                fail(CANUTE_ENOMEM, "Allocating interleaved file");
+        }
+        in->file      = file;
+        in->next      = receiving;
+        receiving     = in;
+        in->sname     = strdup(name);
+        in->name      = strdup(item_path(name));
+        in->path      = strdup(local_path(name));
+        if (in->sname == NULL || in->name == NULL || in->path == NULL)
+                fail(CANUTE_ENOMEM, "Allocating interleaved file");
+        in->id            = id;
+        in->received      = received_bytes;
+        in->size          = size;
+        in->mtime         = mtime;
+        in->is_executable = is_executable;
+        in->hashed        = (opt.index_hashes && index_enabled()
+                             && received_bytes == 0);
+        if (in->hashed)
+                sha256_init(&in->ctx);
+
+        inform(">>> Receiving file '%s' interleaved\n", name);
+        send_message(cn, REPLY_ACCEPT, 0, id, received_bytes, NULL);
+}
+
+
+/*
+ * free_incoming
+ *
+ * Receiver: close a stream and forget it.
+ */
+static void free_incoming (struct incoming *in)
+{
+        if (in->file != NULL)
+                fclose(in->file);
+        free(in->sname);
+        free(in->name);
+        free(in->path);
+        free(in);
+}
+
+
+/*
+ * close_incoming
+ *
+ * Receiver: close the streams left, which stay as they are (to be resumed).
+ */
+static void close_incoming (void)
+{
+        struct incoming *in;
+
+        while (receiving != NULL)
+        {
+                in        = receiving;
+                receiving = in->next;
+                free_incoming(in);
+        }
+}
+
+
+/*
+ * receive_slice
+ *
+ * A slice of stream id has been received, size bytes that follow.  Write
+ * them, and finish the file if they are the last ones.
+ */
+static void receive_slice (struct connection *cn, int id, long long size)
+{
+        struct incoming **at, *in;
+        unsigned char     digest[HASH_SIZE];
+        size_t            b;
+
+        for (at = &receiving;  *at != NULL && (*at)->id != id;
+             at = &(*at)->next)
+                ;
+        in = *at;
+        if (in == NULL || size <= 0 || size > in->size - in->received)
+                fail(CANUTE_EPROTO, "Invalid slice of stream %d", id);
+
+        content_hash = (in->hashed ? &in->ctx : NULL);
+        while (size > 0)
+        {
+                b = CANUTE_BLOCK_SIZE;
+                if ((long long) b > size)
+                        b = (size_t) size;
+                receive_contents(cn, databuf, b);
+                write_data(in->file, databuf, b);
+                in->received += b;
+                size         -= b;
+        }
+        content_hash = NULL;
+        if (in->received < in->size)
+                return;
+
+        *at = in->next;
+        if (in->hashed)
+                sha256_final(&in->ctx, digest);
+        index_update(in->name, in->size, in->mtime,
+                     (in->hashed ? digest : NULL));
+        fflush(in->file);
+        durable_file(in->file, in->path);
+        inform("--- Received file '%s'\n", in->sname);
+        fclose(in->file);
+        in->file = NULL;
+        set_attributes(in->path, in->sname, in->mtime, in->is_executable);
+        free_incoming(in);
+}
+
+
+/*
+ * receive_slices
+ *
+ * Receiver: take the slices that come before the contents of a file request
+ * carrying FLAG_SLICES, up to the REQUEST_DATA header they start with.
+ */
+static void receive_slices (struct connection *cn)
+{
+        int       id, type;
+        long long size;
+
+        while ((type = receive_message(cn, NULL, &id, &size, NULL))
+               == REQUEST_SLICE)
+                receive_slice(cn, id, size);
+        if (type != REQUEST_DATA)
+                fail(CANUTE_EPROTO, "Unexpected header type (%d)", type);
+}
+
+
+/*
+ * receive_file
+ *
+ * A file request has been received from the network.  We must reply depending
+ * on the local state of the file requested.
+ *
+ * Having mtime > 0 means that the peer is version above 1.1, so we can set the
+ * file mtime to that provided by the protocol.
+ */
+static void receive_file (struct connection *cn,
+                          char              *name,
+                          long long          size,
+                          int                mtime,
+                          int                is_executable,
+                          int                flags)
+{
+        int               hashed, replace;
+        FILE             *file;
+        char             *path;
+        long long         base = 0;
+        long long         received_bytes; /* Think about it also as "offset" */
+        struct sha256     ctx;
+        unsigned char     digest[HASH_SIZE];
+
+        if (refused(cn, name, 0))
+                return;
+
+        /* Known to be complete already, no need to even look at it.  What the
+         * index does not vouch for and is not shorter is received whole: it
+         * may have changed without changing size.  Shorter copies are still
+         * resumed, they are most probably interrupted transfers */
+        if (index_unchanged(item_path(name), size, mtime))
+        {
+                inform("--- Skipping file '%s'\n", name);
+                send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                return;
+        }
+        replace = ((flags & FLAG_REPLACE) ? REPLACE_ALL
+                   : (index_enabled() ? REPLACE_LONGER : 0));
+
+        received_bytes = 0;
+        if (pack_enabled())
+                file = open_packed(cn, name, size, mtime, is_executable, &base);
+        else
+                file = open_file(cn, name, size, mtime, replace,
+                                 &received_bytes);
+        if (file == NULL)
+                return;
+        if ((flags & FLAG_INTERLEAVE) && !pack_enabled())
+        {
+                accept_incoming(cn, file, name, size, mtime, is_executable,
+                                received_bytes);
+                return;
+        }
+        if (!pack_enabled())
+                open_item = file;
+
+        send_message(cn, REPLY_ACCEPT, 0, 0, received_bytes, NULL);
+        if (flags & FLAG_SLICES)
+                receive_slices(cn);
+        setup_progress(name, size, received_bytes);
+        writeback_begin(file, base + received_bytes, base + size,
+                        !(flags & FLAG_SPARSE));
+
+        /* Contents can only be hashed when they all go through here */
+        hashed = (opt.index_hashes && index_enabled() && received_bytes == 0
+                  && !(flags & FLAG_SPARSE));
+        if (hashed)
+        {
+                sha256_init(&ctx);
+                content_hash = &ctx;
+        }
+
+        if (flags & FLAG_DEDUP)
+                receive_chunks(cn, file, received_bytes, size);
+        else if (flags & FLAG_SPARSE)
+                receive_sparse(cn, file, base, received_bytes, size);
+        else if (flags & FLAG_DESCRIPTOR)
+                receive_passed(cn, file, base, received_bytes, size);
+        else
+                receive_raw(cn, file, received_bytes, size);
+
+        finish_progress();
+        writeback_end();
+
+        if (hashed)
+        {
+                sha256_final(&ctx, digest);
+                content_hash = NULL;
+        }
+        index_update(item_path(name), size, mtime, (hashed ? digest : NULL));
+        if (pack_enabled())
+        {
+                pack_file_done();
+                return;
+        }
+        path = local_path(name);
+        fflush(file);
+        durable_file(file, path);
+        open_item = NULL;
+        fclose(file);
+        set_attributes(path, name, mtime, is_executable);
+}
+
+
+/*
+ * inside_session
+ *
+ * True if a path sent as relative to the session start stays inside it.
+ */
+static int inside_session (const char *path)
+{
+        const char *c;
+
+        if (path[0] == '\0' || IS_PATH_SEPARATOR(path[0]))
+                return 0;
+#ifdef HASEFROCH
+        if (path[1] == ':')
+                return 0;
+#endif
+        for (c = path;  c != NULL;  c = strchr(c, '/'))
+        {
+                if (*c == '/')
+                        c++;
+                if (c[0] == '.' && c[1] == '.'
+                    && (c[2] == '\0' || IS_PATH_SEPARATOR(c[2])))
+                        return 0;
+        }
+        return 1;
+}
+
+
+/*
+ * receive_link
+ *
+ * A link request has been received: name, in the current directory, must be
+ * another link of the file at the path that follows (size bytes).  If that is
+ * not possible the sender is told to send the contents instead.
+ */
+static void receive_link (struct connection *cn,
+                          char              *name,
+                          long long          size,
+                          int                mtime)
+{
+        int              e = -1;
+        char             target[PATH_MAX], path[PATH_MAX];
+        struct stat_info st, tst;
+
+        if (size <= 0 || size >= PATH_MAX)
+                fail(CANUTE_EPROTO, "Invalid link target length (%lld)", size);
+        receive_data(cn, target, (size_t) size);
+        target[size] = '\0';
+        if (refused(cn, name, 0))
+                return;
+
+#ifndef HASEFROCH
+        if (!pack_enabled() && inside_session(target))
+        {
+                snprintf(path, PATH_MAX, "%s", local_path(name));
+                e = stat(path, &st);
+                if (snprintf(path, PATH_MAX, "%s%s%s",
+                             (session_dir != NULL ? session_dir : ""),
+                             (session_dir != NULL ? "/" : ""), target)
+                    >= PATH_MAX || stat(path, &tst) == -1)
+                        e = -1;
+                else if (e != -1 && st.st_dev == tst.st_dev
+                         && st.st_ino == tst.st_ino)
+                        e = 0;  /* Linked in an earlier session */
+                else
+                {
+                        unlink(local_path(name));
+                        e = link(path, local_path(name));
+                }
+        }
+#endif
+        if (e == -1)
+        {
+                inform("--- Cannot link '%s', receiving it\n", name);
+                send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                return;
+        }
+
+        inform("--- Linked '%s' to '%s'\n", name, target);
+        send_message(cn, REPLY_ACCEPT, 0, 0, 0, NULL);
+        durable_link(local_path(name));
+        if (stat(local_path(name), &st) != -1)
+                index_update(item_path(name), (long long) st.st_size, mtime,
+                             NULL);
+}
+
+
+/*
+ * find_followed
+ *
+ * Receiver: the followed file with the given item_path(), or NULL.
+ */
+static struct followed *find_followed (const char *name)
+{
+        struct followed *f;
+
+        for (f = following;  f != NULL;  f = f->next)
+                if (strcmp(f->name, name) == 0)
+                        return f;
+        return NULL;
+}
+
+
+/*
+ * close_followed
+ *
+ * Receiver: close the followed files.  If the session is complete, make them
+ * durable and record them in the index as they are.
+ */
+static void close_followed (int complete)
+{
+        struct followed *f;
+
+        while (following != NULL)
+        {
+                f         = following;
+                following = f->next;
+                if (complete)
+                {
+                        fflush(f->file);
+                        durable_file(f->file, f->path);
+                }
+                fclose(f->file);
+                if (complete)
+                        index_update(f->name, f->size, f->mtime, NULL);
+                free(f->name);
+                free(f->path);
+                free(f);
+        }
+}
+
+
+/*
+ * receive_follow
+ *
+ * A follow request has been received: open the copy of name (creating it if
+ * needed) and keep it open for the appends to come, replying with its size.
+ */
+static void receive_follow (struct connection *cn,
+                            char              *name,
+                            int                mtime,
+                            int                is_executable)
+{
+        int              e;
+        FILE            *file;
+        struct followed *f;
+        struct stat_info st;
+
+        if (refused(cn, name, 0))
+                return;
+        if (pack_enabled())
+        {
+                inform("--- Cannot follow '%s' into a pack\n", name);
+                send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                return;
+        }
+
+        f = find_followed(item_path(name));
+        if (f == NULL)
+        {
+                /* Not "ab", a truncated copy is written from the start */
+                e    = stat(local_path(name), &st);
+                file = fopen(local_path(name), (e == 0 ? "r+b" : "wb"));
+                if (file == NULL)
+                {
+                        error("Cannot open file '%s'", name);
+                        send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                        return;
+                }
+                f = calloc(1, sizeof(struct followed));
+                if (f == NULL)
+                {
+                        fclose(file);
+                        fail(CANUTE_ENOMEM, "Allocating followed file");
+                }
+                f->file   = file;
+                f->next   = following;
+                following = f;
+                f->name   = strdup(item_path(name));
+                f->path   = strdup(local_path(name));
+                if (f->name == NULL || f->path == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating followed file");
+                f->size   = (e == 0 ? (long long) st.st_size : 0);
+                f->mtime  = mtime;
+#ifndef HASEFROCH
+                if (is_executable && fstat(fileno(file), &st) != -1
+                    && chmod(f->path, st.st_mode | S_IXUSR) == -1)
+                        error("Setting executable bit on '%s'", name);
+#endif
+        }
+
+        inform(">>> Following file '%s'\n", name);
+        send_message(cn, REPLY_ACCEPT, 0, 0, f->size, NULL);
+}
+
+
+/*
+ * receive_append
+ *
+ * An append request has been received: write the data segment that follows at
+ * offset in the copy of name, cutting the copy there first if it is longer.
+ * Data that does not fit is read and dropped.
+ */
+static void receive_append (struct connection *cn,
+                            char              *name,
+                            long long          offset,
+                            int                mtime)
+{
+        int               e, type;
+        size_t            b;
+        long long         n;
+        struct followed  *f;
+        struct utime_info ut;
+
+        type = receive_message(cn, NULL, NULL, &n, NULL);
+        if (type != REQUEST_DATA || n < 0)
+                fail(CANUTE_EPROTO, "Unexpected segment type (%d)", type);
+
+        f = find_followed(item_path(name));
+        if (f != NULL && offset < f->size)
+        {
+                inform("--- Following '%s' again from %lld\n", name, offset);
+                fflush(f->file);
+#ifdef HASEFROCH
+                e = _chsize_s(_fileno(f->file), offset);
+#else
+                e = ftruncate(fileno(f->file), (off_t) offset);
+#endif
+                if (e == 0)
+                        f->size = offset;
+        }
+        if (f == NULL || offset != f->size
+            || fseeko(f->file, (off_t) offset, SEEK_SET) == -1)
+        {
+                if (f == NULL)
+                        errno = EBADF;
+                else if (offset != f->size)
+                        errno = ESPIPE;
+                error("Cannot append to '%s'", name);
+                for (;  n > 0;  n -= b)
+                {
+                        b = (n > CANUTE_BLOCK_SIZE ? CANUTE_BLOCK_SIZE
+                                                   : (size_t) n);
+                        receive_contents(cn, databuf, b);
+                }
+                return;
+        }
+
+        for (;  n > 0;  n -= b)
+        {
+                b = (n > CANUTE_BLOCK_SIZE ? CANUTE_BLOCK_SIZE : (size_t) n);
+                receive_contents(cn, databuf, b);
+                write_data(f->file, databuf, b);
+                f->size += b;
+        }
+        fflush(f->file);  /* Readers of the copy see it now */
+
+        f->mtime = mtime;
+        if (mtime > 0)
+        {
+                ut.actime  = (time_t) mtime;
+                ut.modtime = (time_t) mtime;
+                if (utime(f->path, &ut) == -1)
+                        error("Cannot set modification time on '%s'", name);
+        }
+}
+
+
+/*
+ * send_slice
+ *
+ * Sender: send a slice of the interleaved file whose turn it is, and pass the
+ * turn on.  Return false if there are none.
+ */
+static int send_slice (struct connection *cn)
+{
+        struct outgoing  *o = sending, **last;
+        long long         n;
+        size_t            b;
+
+        if (o == NULL)
+                return 0;
+        n = o->size - o->sent;
+        if (n > INTERLEAVE_SLICE)
+                n = INTERLEAVE_SLICE;
+        send_message(cn, REQUEST_SLICE, 0, o->id, n, NULL);
+        o->sent += n;
+        while (n > 0)
+        {
+                b = CANUTE_BLOCK_SIZE;
+                if ((long long) b > n)
+                        b = (size_t) n;
+                b = fread(databuf, 1, b, o->file);
+                if (b == 0)
+                        fatal("Reading file '%s'", o->sname);
+                send_data(cn, databuf, b);
+                n -= b;
+        }
+
+        sending = o->next;
+        if (o->sent == o->size)
+        {
+                inform("--- Sent file '%s'\n", o->sname);
+                fclose(o->file);
+                free(o);
+                return 1;
+        }
+        o->next = NULL;
+        for (last = &sending;  *last != NULL;  last = &(*last)->next)
+                ;
+        *last = o;
+        return 1;
+}
+
+
+/*
+ * close_outgoing
+ *
+ * Sender: close the interleaved files left.
+ */
+static void close_outgoing (void)
+{
+        struct outgoing *o;
+
+        while (sending != NULL)
+        {
+                o       = sending;
+                sending = o->next;
+                fclose(o->file);
+                free(o);
+        }
+}
+
+
+/*
+ * count_outgoing
+ *
+ * Sender: how many files are being interleaved.
+ */
+static int count_outgoing (void)
+{
+        struct outgoing *o;
+        int              n = 0;
+
+        for (o = sending;  o != NULL;  o = o->next)
+                n++;
+        return n;
+}
+
+
+/*
+ * await_reply
+ *
+ * Sender: send slices of the interleaved files until the reply to what was
+ * just sent can be read.  Only where what follows the reply are messages,
+ * or contents marked by FLAG_SLICES.
+ */
+static void await_reply (struct connection *cn)
+{
+        int n = 0;
+
+        if (sending == NULL)
+                return;
+        push_connection(cn);
+        while (n++ < INTERLEAVE_AHEAD && !connection_ready(cn)
+               && send_slice(cn))
+                push_connection(cn);
+}
+
+
+/*
+ * send_link
+ *
+ * Offer the file sname as another link of the one already sent as target.
+ * Return false if the receiver wants the contents instead.
+ */
+static int send_link (struct connection *cn,
+                      char              *sname,
+                      const char        *target,
+                      int                mtime,
+                      int                is_executable)
+{
+        size_t len = strlen(target);
+
+        send_message(cn, REQUEST_LINK, is_executable, mtime, (long long) len,
+                     sname);
+        send_data(cn, (char *) target, len);
+        await_reply(cn);
+        if (receive_message(cn, NULL, NULL, NULL, NULL) != REPLY_ACCEPT)
+                return 0;
+        inform("--- Linked '%s' to '%s'\n", sname, target);
+        return 1;
+}
+
+
+/*
+ * send_contents
+ *
+ * Offer an open file under the (safe) name sname and send its contents, which
+ * start at base in file (inside a pack).  st is only for the hash cache and
+ * may be NULL, in which case the file is never interleaved.  Return true if
+ * it is: the file is closed once sent, not by the caller.
+ */
+static int send_contents (struct connection      *cn,
+                           FILE                   *file,
+                           long long               base,
+                           char                   *sname,
+                           long long               size,
+                           int                     mtime,
+                           int                     is_executable,
+                           const struct stat_info *st)
+{
+        int              e, reply, flags, id = 0;
+        long long        sent_bytes; /* Size reported remotely */
+        struct outgoing *o, **last;
+
+        /* Holes are found by offset, only meaningful for whole files, and
+         * a passed descriptor is read from the start too */
+        if (opt.dedup)
+                flags = FLAG_DEDUP;
+        else if (opt.sparse && base == 0)
+                flags = FLAG_SPARSE;
+        else if (connection_local(cn) && base == 0)
+                flags = FLAG_DESCRIPTOR;
+        else if (opt.interleave && st != NULL && !replacing
+                 && size >= INTERLEAVE_MIN)
+                flags = FLAG_INTERLEAVE;
+        else
+                flags = 0;
+        if (replacing)
+                flags |= FLAG_REPLACE;
+
+        /* Room for another stream, ending one if needed */
+        while ((flags & FLAG_INTERLEAVE) && count_outgoing() == INTERLEAVE_MAX)
+                send_slice(cn);
+        if (sending != NULL)
+                flags |= FLAG_SLICES;
+        send_message(cn, REQUEST_FILE | flags, is_executable, mtime, size,
+                     sname);
+        if (flags & FLAG_SLICES)
+                await_reply(cn);
+        reply = receive_message(cn, NULL, &id, &sent_bytes, NULL);
+        if (reply == REPLY_SKIP)
+        {
+                inform("--- Skipping file '%s'\n", sname);
+                return 0;
+        }
+
+        if (base + sent_bytes > 0)
+        {
+                e = fseeko(file, (off_t) (base + sent_bytes), SEEK_SET);
+                if (e == -1)
+                        fatal("Could not seek file '%s'", sname);
+        }
+
+        /* A stream: it goes in slices, after those already going */
+        if ((flags & FLAG_INTERLEAVE) && id > 0)
+        {
+                o = calloc(1, sizeof(struct outgoing));
+                if (o == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating interleaved file");
+                o->id   = id;
+                o->file = file;
+                o->sent = sent_bytes;
+                o->size = size;
+                strncpy(o->sname, sname, CANUTE_NAME_LENGTH);
+                for (last = &sending;  *last != NULL;  last = &(*last)->next)
+                        ;
+                *last = o;
+                inform("--- Interleaving file '%s'\n", sname);
+                return 1;
+        }
+
+        setup_progress(sname, size, sent_bytes);
+        if (flags & FLAG_SLICES)
+                send_message(cn, REQUEST_DATA, 0, 0, size - sent_bytes, NULL);
+
+        if (flags & FLAG_DEDUP)
+                send_chunks(cn, file, st, sent_bytes, size);
+        else if (flags & FLAG_SPARSE)
+                send_sparse(cn, file, sent_bytes, size);
+        else if (flags & FLAG_DESCRIPTOR)
+        {
+                send_descriptor(cn, fileno(file));
+                skip_progress(size - sent_bytes);
+        }
+        else
+                send_raw(cn, file, sent_bytes, size);
+
+        finish_progress();
+        return 0;
+}
+
+
+/*
+ * send_file
+ *
+ * Treat the item as a file and try to send it.  Its local path is srcpath.
+ */
+static void send_file (struct connection      *cn,
+                       char                   *name,
+                       const struct stat_info *st,
+                       int                     is_executable)
+{
+        int         mtime, kept;
+        long long   size;
+        char       *sname, safe[CANUTE_NAME_LENGTH + 1];
+        const char *target;
+        FILE       *file;
+
+        size  = (long long) st->st_size;
+        mtime = (int) st->st_mtime;
+
+        /* The receiver index says it has this one.  Test before opening,
+         * safename() works in place so use a copy */
+        strncpy(safe, name, CANUTE_NAME_LENGTH);
+        safe[CANUTE_NAME_LENGTH] = '\0';
+        sname = safename(safe);
+        if (index_in_summary(item_path(sname), size, mtime))
+        {
+                inform("--- Unchanged file '%s'\n", sname);
+                if (opt.hard_links)
+                        links_add(st, item_path(sname));
+                return;
+        }
+
+        /* Another link of it went already */
+        target = (opt.hard_links ? links_find(st) : NULL);
+        if (target != NULL && send_link(cn, sname, target, mtime,
+                                        is_executable))
+                return;
+
+        file  = fopen(srcpath, "rb");
+        if (file == NULL)
+        {
+                error("Cannot open file '%s'", name);
+                return;
+        }
+
+        open_item = file;
+        kept      = send_contents(cn, file, 0, safename(name), size, mtime,
+                                  is_executable, st);
+        open_item = NULL;
+        if (!kept)
+                fclose(file);
+        if (opt.hard_links)
+                links_add(st, item_path(sname));
+}
+
+
+/*
+ * in_selection
+ *
+ * True if path is one of items or lies inside one of them.
+ */
+static int in_selection (const char *path, char **items, int count)
+{
+        size_t len;
+        int    i;
+
+        if (count == 0)
+                return 1;
+        for (i = 0;  i < count;  i++)
+        {
+                len = strlen(items[i]);
+                while (len > 0 && items[i][len - 1] == '/')
+                        len--;
+                if (strncmp(path, items[i], len) == 0
+                    && (path[len] == '\0' || path[len] == '/'))
+                        return 1;
+        }
+        return 0;
+}
+
+
+/*
+ * path_excluded
+ *
+ * True if the filter rules leave out a path from the session start (of a
+ * pack, or a change being watched), a directory if is_dir, or any directory
+ * holding it.
+ */
+static int path_excluded (const char *path, int is_dir)
+{
+        char   prefix[PATH_MAX];
+        size_t i;
+
+        if (!filter_enabled())
+                return 0;
+        for (i = 0;  i < PATH_MAX;  i++)
+        {
+                if (path[i] == '/' || path[i] == '\0')
+                {
+                        memcpy(prefix, path, i);
+                        prefix[i] = '\0';
+                        if (filter_excluded(prefix, is_dir
+                                                    || path[i] == '/'))
+                                return 1;
+                }
+                if (path[i] == '\0')
+                        break;
+        }
+        return 0;
+}
+
+
+/*
+ * enter_dirs
+ *
+ * Open directories on the receiver until the current one is dir (a path from
+ * the session start, its names already safe).  If the receiver skips one of
+ * them, leave its path in skipped and return false.
+ */
+static int enter_dirs (struct connection *cn, const char *dir,
+                             char *skipped)
+{
+        char        name[CANUTE_NAME_LENGTH + 1];
+        const char *next;
+        size_t      len;
+        int         reply;
+
+        while (rellen < strlen(dir))
+        {
+                next = dir + (rellen > 0 ? rellen + 1 : 0);
+                len  = strcspn(next, "/");
+                if (len > CANUTE_NAME_LENGTH)
+                        fatal("Name too long in '%s'", dir);
+                memcpy(name, next, len);
+                name[len] = '\0';
+
+                send_message(cn, REQUEST_BEGINDIR, 0, 0, 0, name);
+                reply = receive_message(cn, NULL, NULL, NULL, NULL);
+                if (reply == REPLY_SKIP)
+                {
+                        inform("--- Skipping directory '%s'\n", name);
+                        strcpy(skipped, item_path(name));
+                        return 0;
+                }
+                inform(">>> Entering directory '%s'\n", name);
+                enter_path(name);
+        }
+        return 1;
+}
+
+
+/*
+ * leave_dirs
+ *
+ * Close directories on the receiver until the current one contains dir.
+ */
+static void leave_dirs (struct connection *cn, const char *dir)
+{
+        while (rellen > 0 && !(strncmp(dir, relpath, rellen) == 0
+                               && (dir[rellen] == '\0' || dir[rellen] == '/')))
+        {
+                send_message(cn, REQUEST_ENDDIR, 0, 0, 0, NULL);
+                leave_path();
+        }
+}
+
+
+/*
+ * list_dir
+ *
+ * Read all the entries of dir but "." and "..", so the walk knows what comes
+ * next.  Return them in a malloc()ed array of malloc()ed names.
+ */
+static char **list_dir (DIR *dir, size_t *count)
+{
+        struct dirent *dentry;
+        char         **names = NULL;
+        size_t         alloc = 0;
+
+        *count = 0;
+        while ((dentry = readdir(dir)) != NULL)
+        {
+                if (!NOT_SELF_OR_PARENT(dentry->d_name)
+                    || excluded(dentry->d_name, entry_is_dir(dentry->d_name)))
+                        continue;
+                if (*count == alloc)
+                {
+                        alloc = (alloc == 0 ? 64 : alloc * 2);
+                        names = realloc(names, alloc * sizeof(char *));
+                        if (names == NULL)
+                                fail(CANUTE_ENOMEM,
+                                     "Allocating directory listing");
+                }
+                names[*count] = strdup(dentry->d_name);
+                if (names[*count] == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating directory listing");
+                (*count)++;
+        }
+        return names;
+}
+
+
+/*
+ * end_walk
+ *
+ * Close the innermost directory being walked, freeing the names left.
+ */
+static void end_walk (void)
+{
+        struct walk *w = walking;
+
+        walking = w->up;
+        for (;  w->next < w->count;  w->next++)
+                free(w->names[w->next]);
+        free(w->names);
+        closedir(w->dir);
+        free(w);
+}
+
+
+/*
+ * send_entry
+ *
+ * Discover what kind of filesystem item 'name' (in the directory at srcpath)
+ * represents and send it over the connection.
+ */
+static void send_entry (struct connection *cn, char *name)
+{
+        int              e, reply, x_bit = 0;
+        char            *sname;
+        DIR             *dir;
+        size_t           queued, parent = srclen;
+        struct walk     *w;
+        struct stat_info st;
+
+        /* Interleaved files move on between entries */
+        send_slice(cn);
+
+        /* srcpath is the item itself until it is sent */
+        srclen += snprintf(srcpath + srclen, PATH_MAX - srclen, "%s%s",
+                           (srclen > 0 ? "/" : ""), name);
+        if (srclen >= PATH_MAX)
+        {
+                errno = ENAMETOOLONG;
+                error("Cannot stat item '%s'", name);
+                srcpath[srclen = parent] = '\0';
+                return;
+        }
+
+        e = stat(srcpath, &st);
+        if (e == -1)
+                error("Cannot stat item '%s'", name);
+        else if (S_ISDIR(st.st_mode))
+        {
+                dir = opendir(srcpath);
+                if (dir == NULL)
+                {
+                        error("Cannot open dir '%s'", name);
+                        srcpath[srclen = parent] = '\0';
+                        return;
+                }
+
+                sname = safename(name);
+                send_message(cn, REQUEST_BEGINDIR, 0, 0, 0, sname);
+                await_reply(cn);
+                reply = receive_message(cn, NULL, NULL, NULL, NULL);
+                if (reply == REPLY_SKIP)
+                {
+                        closedir(dir);
+                        inform("--- Skipping directory '%s'\n", sname);
+                        srcpath[srclen = parent] = '\0';
+                        return;
+                }
+
+                inform(">>> Entering directory '%s'\n", sname);
+                enter_path(sname);
+                w = calloc(1, sizeof(struct walk));
+                if (w == NULL)
+                {
+                        closedir(dir);
+                        fail(CANUTE_ENOMEM, "Allocating directory walk");
+                }
+                w->dir   = dir;
+                w->up    = walking;
+                walking  = w;
+                w->names = list_dir(dir, &w->count);
+                queued   = 0;
+                for (;  w->next < w->count;  w->next++)
+                {
+                        /* Keep the prefetcher busy with what comes next */
+                        if (queued <= w->next)
+                                queued = w->next + 1;
+                        while (queued < w->count
+                               && queued <= w->next + PREFETCH_FILES
+                               && prefetch_add(dir, w->names[queued]))
+                                queued++;
+
+                        send_entry(cn, w->names[w->next]);
+                        free(w->names[w->next]);
+                }
+                end_walk();
+
+                leave_path();
+                send_message(cn, REQUEST_ENDDIR, 0, 0, 0, NULL);
+        }
+        else
+        {
+#ifndef HASEFROCH
+                x_bit = st.st_mode & S_IXUSR;
+#endif
+                send_file(cn, name, &st, x_bit);
+        }
+        srcpath[srclen = parent] = '\0';
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * protocol_setup
+ *
+ * Library calls: items are sent from (when relative) or received into dir,
+ * NULL for the current directory, and buffer (CANUTE_BLOCK_SIZE bytes, may be
+ * NULL) is used instead of allocating one.  Both must last until
+ * protocol_reset().  The command line just goes without.
+ */
+void protocol_setup (const char *dir, char *buffer)
+{
+        protocol_reset();
+        session_dir = dir;
+        if (buffer != NULL)
+                databuf = buffer;
+}
+
+
+/*
+ * protocol_reset
+ *
+ * Forget the session of this thread, which may have been interrupted by a
+ * failure anywhere: close the file and directories being sent or received and
+ * free the buffers.
+ */
+void protocol_reset (void)
+{
+        if (open_item != NULL)
+                fclose(open_item);
+        if (passed_item != -1)
+                close(passed_item);
+        while (walking != NULL)
+                end_walk();
+        close_followed(0);
+        close_incoming();
+        close_outgoing();
+        links_reset();
+        filter_reset();
+        if (own_databuf)
+                free(databuf);
+        free(dedup_buf);
+        free(chunk_list);
+        free(sparse_buf);
+        free_kept();
+
+        open_item        = NULL;
+        passed_item      = -1;
+        replacing        = 0;
+        databuf          = NULL;
+        own_databuf      = 0;
+        dedup_buf        = NULL;
+        chunk_list       = NULL;
+        chunk_list_alloc = 0;
+        sparse_buf       = NULL;
+        relpath[0]       = '\0';
+        rellen           = 0;
+        srcpath[0]       = '\0';
+        srclen           = 0;
+        session_dir      = NULL;
+        content_hash     = NULL;
+        end_confirmation = 0;
+}
+
+
+/*
+ * send_item
+ *
+ * Discover what kind of filesystem item 'name' represents and send it over the
+ * connection.
+ */
+void send_item (struct connection *cn, char *name)
+{
+        int absolute;
+
+        need_buffer();
+#ifdef HASEFROCH
+        absolute = (IS_PATH_SEPARATOR(name[0])
+                    || (name[0] != '\0' && name[1] == ':'));
+#else
+        absolute = IS_PATH_SEPARATOR(name[0]);
+#endif
+        srclen = 0;
+        if (session_dir != NULL && !absolute)
+                srclen = snprintf(srcpath, PATH_MAX, "%s", session_dir);
+        if (srclen >= PATH_MAX)
+                fail(CANUTE_EINVAL, "Directory name too long");
+        srcpath[srclen] = '\0';
+        if (!excluded(name, entry_is_dir(name)))
+                send_entry(cn, name);
+}
+
+
+/*
+ * send_changed
+ *
+ * Watch mode: send again the entry at sub inside item (as given to
+ * send_item()), or item itself if sub is empty, opening on the receiver the
+ * directories that lead to it.  A batch of changes ends with end_changes().
+ */
+void send_changed (struct connection *cn, const char *item, const char *sub)
+{
+        char        rel[PATH_MAX], dir[PATH_MAX], skipped[PATH_MAX];
+        char        name[PATH_MAX], *c, *base;
+        const char *parent;
+        size_t      len;
+        int         absolute;
+
+        need_buffer();
+        if (!safepath(rel, item, sub))
+                return;
+
+        /* The sender goes to the directory holding it locally, as
+         * send_item() would: name is the item or a path inside it */
+        if (snprintf(name, PATH_MAX, "%s%s%s", item,
+                     (sub[0] != '\0' ? "/" : ""), sub) >= PATH_MAX)
+        {
+                errno = ENAMETOOLONG;
+                error("Cannot stat item '%s'", rel);
+                return;
+        }
+        len = strlen(name);
+        while (len > 1 && IS_PATH_SEPARATOR(name[len - 1]))
+                name[--len] = '\0';
+        absolute = IS_PATH_SEPARATOR(name[0]);
+        parent   = "";
+        base     = name;
+        c        = strrchr(name, '/');
+        if (c != NULL)
+        {
+                *c     = '\0';
+                parent = (c == name ? "/" : name);
+                base   = c + 1;
+        }
+        if (session_dir != NULL && !absolute)
+                srclen = snprintf(srcpath, PATH_MAX, "%s%s%s", session_dir,
+                                  (parent[0] != '\0' ? "/" : ""), parent);
+        else
+                srclen = snprintf(srcpath, PATH_MAX, "%s", parent);
+        if (srclen >= PATH_MAX)
+                fail(CANUTE_EINVAL, "Directory name too long");
+        if (path_excluded(rel, entry_is_dir(base)))
+                return;
+
+        /* And the receiver to the one holding it */
+        snprintf(dir, PATH_MAX, "%s", rel);
+        c = strrchr(dir, '/');
+        if (c != NULL)
+                *c = '\0';
+        else
+                dir[0] = '\0';
+        leave_dirs(cn, dir);
+        if (!enter_dirs(cn, dir, skipped))
+                return;
+
+        replacing = 1;
+        send_entry(cn, base);
+        replacing = 0;
+}
+
+
+/*
+ * end_changes
+ *
+ * Watch mode: a batch of changes is over.  Close the directories opened on the
+ * receiver and push everything to it.  The files sent are forgotten as hard
+ * link targets, they may be changed in the next batch.
+ */
+void end_changes (struct connection *cn)
+{
+        leave_dirs(cn, "");
+        push_connection(cn);
+        links_reset();
+}
+
+
+/*
+ * send_follow
+ *
+ * Follow mode: offer a file item, already open, to be followed under the
+ * (safe) name sname.  Return how much of it the receiver has, or -1 if it is
+ * not to be followed (left out or refused).
+ */
+long long send_follow (struct connection *cn,
+                       char              *sname,
+                       long long          size,
+                       int                mtime,
+                       int                is_executable)
+{
+        long long received;
+
+        need_buffer();
+        if (excluded(sname, 0))
+                return -1;
+        send_message(cn, REQUEST_FOLLOW, is_executable, mtime, size, sname);
+        if (receive_message(cn, NULL, NULL, &received, NULL) == REPLY_SKIP)
+        {
+                inform("--- Not following file '%s'\n", sname);
+                return -1;
+        }
+        return received;
+}
+
+
+/*
+ * send_appended
+ *
+ * Follow mode: send what the followed file holds from offset up to size, to be
+ * written there in the copy named sname.  Something is always sent, so with an
+ * offset of 0 the copy starts again even if the file is empty.  Return the
+ * offset reached, short of size if the file shrank meanwhile.
+ */
+long long send_appended (struct connection *cn,
+                         char              *sname,
+                         FILE              *file,
+                         long long          offset,
+                         long long          size,
+                         int                mtime)
+{
+        size_t b;
+
+        if (sparse_buf == NULL)
+        {
+                sparse_buf = malloc(SPARSE_BUFFER);
+                if (sparse_buf == NULL)
+                        fail(CANUTE_ENOMEM, "Allocating sparse buffer");
+        }
+        if (fseeko(file, (off_t) offset, SEEK_SET) == -1)
+                fatal("Could not seek file '%s'", sname);
+
+        do
+        {
+                b = SPARSE_BUFFER;
+                if ((long long) b > size - offset)
+                        b = (size_t) (size - offset);
+                b = fread(sparse_buf, 1, b, file);
+                send_message(cn, REQUEST_APPEND, 0, mtime, offset, sname);
+                send_message(cn, REQUEST_DATA, 0, 0, b, NULL);
+                send_data(cn, sparse_buf, b);
+                offset += b;
+        } while (b > 0 && offset < size);
+
+        return offset;
+}
+
+
+/*
+ * send_slices
+ *
+ * Send what is left of the interleaved files.  send_end() does, call it
+ * before anything else that is not an item.
+ */
+void send_slices (struct connection *cn)
+{
+        while (send_slice(cn))
+                ;
+}
+
+
+/*
+ * send_pack
+ *
+ * Send the contents of a pack as if they were on disk: everything, or only the
+ * given paths and what is inside them.  Items keep their place in the pack
+ * tree, directories are opened and closed on the receiver as needed.
+ */
+void send_pack (struct connection *cn, char *pack, char **items, int count)
+{
+        char               dir[PATH_MAX], skipped[PATH_MAX], *name;
+        struct pack_entry *list;
+        size_t             n, i, len;
+        FILE              *file;
+
+        need_buffer();
+        file       = pack_load(pack, &list, &n);
+        open_item  = file;
+        skipped[0] = '\0';
+        for (i = 0;  i < n;  i++)
+        {
+                if (!in_selection(list[i].path, items, count)
+                    || path_excluded(list[i].path, pack_is_dir(&list[i])))
+                        continue;
+                len = strlen(skipped);
+                if (len > 0 && strncmp(list[i].path, skipped, len) == 0
+                    && list[i].path[len] == '/')
+                        continue;
+                skipped[0] = '\0';
+
+                /* Directory the item lives in (or itself, for directories) */
+                snprintf(dir, PATH_MAX, "%s", list[i].path);
+                name = strrchr(dir, '/');
+                if (!pack_is_dir(&list[i]))
+                {
+                        if (name != NULL)
+                                *name = '\0';
+                        else
+                                dir[0] = '\0';
+                }
+
+                leave_dirs(cn, dir);
+                if (!enter_dirs(cn, dir, skipped)
+                    || pack_is_dir(&list[i]))
+                        continue;
+
+                name = strrchr(list[i].path, '/');
+                name = (name != NULL ? name + 1 : list[i].path);
+                if (index_in_summary(item_path(name), list[i].size,
+                                     list[i].mtime))
+                {
+                        inform("--- Unchanged file '%s'\n", name);
+                        continue;
+                }
+                send_contents(cn, file, list[i].offset, name, list[i].size,
+                              list[i].mtime, (list[i].mode & 0100) != 0, NULL);
+        }
+
+        leave_dirs(cn, "");
+        open_item = NULL;
+        fclose(file);
+}
+
+
+/*
+ * send_end
+ *
+ * Tell the receiver there is nothing else to send, and wait until it confirms
+ * its durability guarantee is met.  Older receivers just close the connection,
+ * but so does one that failed before meeting it: that is an error with -a,
+ * and a warning otherwise.
+ */
+void send_end (struct connection *cn)
+{
+        send_slices(cn);
+        send_message(cn, REQUEST_END, 0, 0, 1, NULL);
+        if (receive_final(cn) == REPLY_ACCEPT)
+        {
+                inform("--- Receiver confirmed the session\n");
+                return;
+        }
+        errno = ECONNRESET;
+        if (opt.confirmed)
+                fail(CANUTE_ENET, "Receiver did not confirm the session");
+        error("Receiver did not confirm the session (older than 1.5, or "
+              "failed)");
+}
+
+
+/*
+ * confirm_end
+ *
+ * Receiver: acknowledge REQUEST_END, if the sender asked for it.  Call only
+ * once everything received is as safe as the durability policy says.
+ */
+void confirm_end (struct connection *cn)
+{
+        if (end_confirmation)
+                send_message(cn, REPLY_ACCEPT, 0, 0, 0, NULL);
+}
+
+
+/*
+ * fetch_index
+ *
+ * Ask the receiver for its index summary, so unchanged files can be skipped
+ * without negotiation.  Must be called before sending any item.
+ */
+void fetch_index (struct connection *cn)
+{
+        long long      count;
+        unsigned char *summary;
+
+        send_message(cn, REQUEST_INDEX, 0, 0, 0, NULL);
+        if (receive_message(cn, NULL, NULL, &count, NULL) != REPLY_ACCEPT)
+        {
+                inform("--- Receiver keeps no index\n");
+                return;
+        }
+
+        if (count < 0 || count > INDEX_MAX
+            || (unsigned long long) count > ((size_t) -1 - 1) / 8)
+                fail(CANUTE_EPROTO, "Invalid index summary size (%lld)",
+                     count);
+        summary = malloc((size_t) count * 8 + 1);
+        if (summary == NULL)
+                fail(CANUTE_ENOMEM, "Allocating index summary");
+        receive_data(cn, (char *) summary, (size_t) count * 8);
+        index_set_summary(summary, (size_t) count);
+}
+
+
+/*
+ * fetch_rules
+ *
+ * Ask the receiver for its filter rules, so what they exclude is not even
+ * offered.  Must be called before sending any item.
+ */
+void fetch_rules (struct connection *cn)
+{
+        long long length;
+        char     *text;
+
+        send_message(cn, REQUEST_RULES, 0, 0, 0, NULL);
+        if (receive_message(cn, NULL, NULL, &length, NULL) != REPLY_ACCEPT)
+        {
+                inform("--- Receiver has no filter rules\n");
+                return;
+        }
+        if (length < 0 || length > RULES_MAX)
+                fail(CANUTE_EPROTO, "Invalid filter rules length (%lld)",
+                     length);
+
+        text = malloc((size_t) length + 1);
+        if (text == NULL)
+                fail(CANUTE_ENOMEM, "Allocating filter rules");
+        receive_data(cn, text, (size_t) length);
+        text[length] = '\0';
+        filter_add_remote(text);
+        free(text);
+}
+
+
+/*
+ * receive_item
+ *
+ * Parse a header packet containing a request and act accordingly. Return true
+ * if the read packet is the last one for the session (no more items to come)
+ * and false otherwise (still more stuff pending).
+ */
+int receive_item (struct connection *cn)
+{
+        static THREAD_LOCAL char namebuf[CANUTE_NAME_LENGTH + 1];
+        int                      e, x_bit, mtime, request;
+        long long                size;
+        size_t                   count;
+        unsigned char           *summary;
+        char                    *text;
+        struct stat_info         st;
+
+        need_buffer();
+        request = receive_message(cn, &x_bit, &mtime, &size, namebuf);
+
+        switch (request & REQUEST_TYPE_MASK)
+        {
+        case REQUEST_FILE:
+                receive_file(cn, namebuf, size, mtime, x_bit,
+                             request & ~REQUEST_TYPE_MASK);
+                break;
+
+        case REQUEST_LINK:
+                receive_link(cn, namebuf, size, mtime);
+                break;
+
+        case REQUEST_FOLLOW:
+                receive_follow(cn, namebuf, mtime, x_bit);
+                break;
+
+        case REQUEST_APPEND:
+                receive_append(cn, namebuf, size, mtime);
+                break;
+
+        case REQUEST_SLICE:
+                receive_slice(cn, mtime, size);
+                break;
 
         case REQUEST_BEGINDIR:
-                mkdir(namebuf);
-                e = chdir(namebuf);
+                if (refused(cn, namebuf, 1))
+                        break;
+                if (pack_enabled())
+                {
+                        inform(">>> Entering directory '%s'\n",  namebuf);
+                        pack_add_dir(item_path(namebuf));
+                        send_message(cn, REPLY_ACCEPT, 0, 0, 0, NULL);
+                        enter_path(namebuf);
+                        break;
+                }
+                mkdir(local_path(namebuf));
+                e = stat(local_path(namebuf), &st);
+                if (e != -1 && !S_ISDIR(st.st_mode))
+                {
+                        errno = ENOTDIR;
+                        e     = -1;
+                }
                 if (e == -1)
                 {
-                        error("Cannot change to dir '%s'", namebuf);
-                        send_message(sk, REPLY_SKIP, 0, 0, 0, NULL);
+                        error("Cannot enter dir '%s'", namebuf);
+                        send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
                 }
                 else
                 {
-                        printf(">>> Entering directory '%s'\n",  namebuf);
-                        send_message(sk, REPLY_ACCEPT, 0, 0, 0, NULL);
+                        inform(">>> Entering directory '%s'\n",  namebuf);
+                        send_message(cn, REPLY_ACCEPT, 0, 0, 0, NULL);
+                        enter_path(namebuf);
                 }
                 break;
 
         case REQUEST_ENDDIR:
-                e = chdir("..");
-                if (e == -1)
-                        fatal("Could not change to parent directory");
+                if (!pack_enabled())
+                        durable_dir_end(local_path(""));
+                leave_path();
+                break;
+
+        case REQUEST_INDEX:
+                if (!index_enabled())
+                {
+                        send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                        break;
+                }
+                count = index_summary(&summary);
+                if (count > INDEX_MAX)
+                {
+                        /* Too big for the sender, it does without */
+                        free(summary);
+                        send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                        break;
+                }
+                send_message(cn, REPLY_ACCEPT, 0, 0, count, NULL);
+                send_data(cn, (char *) summary, count * 8);
+                free(summary);
+                break;
+
+        case REQUEST_RULES:
+                count = filter_text(&text);
+                if (count == 0)
+                {
+                        send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                        break;
+                }
+                send_message(cn, REPLY_ACCEPT, 0, 0, count, NULL);
+                send_data(cn, text, count);
+                free(text);
                 break;
 
         case REQUEST_END:
+                close_followed(1);
+                close_incoming();
+                end_confirmation = (size == 1);
                 return 1;
 
         default:
-                fatal("Unexpected header type (%d)", request);
+                fail(CANUTE_EPROTO, "Unexpected header type (%d)", request);
         }
 
         return 0;
@@ -0,0 +1,393 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                      SESSION RECORDING AND REPLAY                          */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * A receiver started with -T (or -t) records everything it takes from the
+ * connection to a tape file, exactly as receive_data() hands it over: headers,
+ * chunk tables, link targets and file contents.  Its answers, as given to
+ * send_data(), go to the tape too.  "canute replay" then sets up a connection
+ * whose transport reads that tape, and runs the usual receiver on it.  No
+ * sender nor network is involved, so the same session can be written to other
+ * storage again and again.
+ *
+ * TAPE FORMAT
+ *
+ * TAPE_MAGIC, then a frame for each receive_data() and send_data() call: its
+ * length (32 bits, big endian), with TAPE_SENT set for what the receiver sent,
+ * and that many bytes.  With -t the file contents (whatever went through
+ * receive_contents()) are not kept: the frame has TAPE_MADE_UP set in the
+ * length and nothing else, and the replay makes up pseudo random bytes
+ * instead.  They do not compress nor deduplicate, which is the worst case for
+ * the storage, and the tape is just the metadata.
+ *
+ * What the sender did next depended on the receiver answers, so the replay
+ * must start from the same state the recorded session did: usually an empty
+ * directory, and the same index or chunk store.  Each answer is compared with
+ * the recorded one, and the replay stops at the first that differs (a file
+ * skipped that was received, a chunk the store already has...) rather than
+ * take the frames that followed for something they are not.  Descriptors
+ * passed on local connections are recorded as the contents they gave, which
+ * the replay takes as if they had been sent raw.
+ */
+#include "canute.h"
+
+#define TAPE_MAGIC     "canute tape 2\n" /* 1 had no answers */
+#define TAPE_MAGIC_LEN 14
+#define TAPE_MADE_UP   0x80000000u   /* Frame without its bytes */
+#define TAPE_SENT      0x40000000u   /* Frame the receiver sent */
+#define TAPE_LENGTH    0x3fffffffu
+#define TAPE_COMPARE   4096          /* Answer bytes compared at once */
+#define TAPE_BUFFER    (1024 * 1024) /* stdio buffer of the tape */
+
+/*
+ * A tape being recorded or replayed.
+ */
+struct tape
+{
+        FILE    *file;
+        char    *name;
+        int      contents;  /* Recording: keep file contents too */
+        int      replaying; /* Set up by replay_open() */
+        uint32_t left;      /* Replaying: bytes left of this frame */
+        int      made_up;   /* Replaying: they are not on the tape */
+        int      sent;      /* Replaying: they are an answer */
+        uint64_t noise;     /* Replaying: generator state */
+};
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * open_tape
+ *
+ * Open a tape file to record ("wb") or replay ("rb").
+ */
+static struct tape *open_tape (const char *file, const char *mode)
+{
+        struct tape *t;
+
+        t = calloc(1, sizeof(struct tape));
+        if (t == NULL)
+                fail(CANUTE_ENOMEM, "Allocating tape");
+        t->file = fopen(file, mode);
+        if (t->file == NULL)
+                fail(CANUTE_EFILE, "Opening tape '%s'", file);
+        setvbuf(t->file, NULL, _IOFBF, TAPE_BUFFER);
+        t->name  = (char *) file;
+        t->noise = 0x9e3779b97f4a7c15ULL;
+        return t;
+}
+
+
+/*
+ * write_frame
+ *
+ * Recording: add a frame of count bytes with the given flags.  Its bytes are
+ * not written if it is made up.
+ */
+static void write_frame (struct tape *t, const char *buf, size_t count,
+                         uint32_t flags)
+{
+        unsigned char b[4];
+        uint32_t      len = (uint32_t) count | flags;
+
+        if (count == 0)
+                return;
+        if (count > TAPE_LENGTH)
+        {
+                errno = EFBIG;
+                fail(CANUTE_EFILE, "Writing tape '%s'", t->name);
+        }
+        b[0] = (unsigned char) (len >> 24);
+        b[1] = (unsigned char) (len >> 16);
+        b[2] = (unsigned char) (len >> 8);
+        b[3] = (unsigned char) len;
+        if (fwrite(b, 1, 4, t->file) != 4
+            || (!(flags & TAPE_MADE_UP)
+                && fwrite(buf, 1, count, t->file) != count))
+                fail(CANUTE_EFILE, "Writing tape '%s'", t->name);
+}
+
+
+/*
+ * next_frame
+ *
+ * Replaying: move on to the next frame that is not empty.  False at the end of
+ * the tape.
+ */
+static int next_frame (struct tape *t)
+{
+        unsigned char b[4];
+        uint32_t      len;
+
+        while (t->left == 0)
+        {
+                if (fread(b, 1, 4, t->file) != 4)
+                {
+                        if (ferror(t->file))
+                                fail(CANUTE_EFILE, "Reading tape '%s'",
+                                     t->name);
+                        return 0;
+                }
+                len        = (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16
+                             | (uint32_t) b[2] << 8 | b[3];
+                t->made_up = (len & TAPE_MADE_UP) != 0;
+                t->sent    = (len & TAPE_SENT) != 0;
+                t->left    = len & TAPE_LENGTH;
+        }
+        return 1;
+}
+
+
+/*
+ * differs
+ *
+ * Replaying: the receiver did not answer as it did in the recording, what
+ * comes next on the tape is not for it.
+ */
+static void differs (struct tape *t)
+{
+        errno = 0;
+        fail(CANUTE_EPROTO, "Tape '%s': receiver state differs from the "
+             "recording", t->name);
+}
+
+
+/*
+ * make_up
+ *
+ * Fill count bytes with pseudo random data (xorshift64*), standing for file
+ * contents not on the tape.
+ */
+static void make_up (struct tape *t, char *buf, size_t count)
+{
+        uint64_t x = t->noise, v;
+        size_t   n;
+
+        while (count > 0)
+        {
+                x ^= x >> 12;
+                x ^= x << 25;
+                x ^= x >> 27;
+                v  = x * 0x2545f4914f6cdd1dULL;
+                n  = (count < 8 ? count : 8);
+                memcpy(buf, &v, n);
+                buf   += n;
+                count -= n;
+        }
+        t->noise = x;
+}
+
+
+/*
+ * tape_send
+ *
+ * Whatever the receiver answers goes nowhere, it was checked by
+ * replay_sent().
+ */
+static int tape_send (struct connection *cn, const char *buf, size_t count)
+{
+        return (int) count;
+}
+
+
+/*
+ * tape_recv
+ *
+ * The next bytes of the tape, up to the end of the frame.  Zero at the end of
+ * the tape.
+ */
+static int tape_recv (struct connection *cn, char *buf, size_t count)
+{
+        struct tape *t = cn->ctx;
+
+        if (!next_frame(t))
+                return 0;
+        if (t->sent)
+                differs(t);  /* The recorded receiver answered first */
+
+        if (count > t->left)
+                count = t->left;
+        if (t->made_up)
+                make_up(t, buf, count);
+        else if (fread(buf, 1, count, t->file) != count)
+        {
+                errno = 0;
+                fail(CANUTE_EPROTO, "Tape '%s' cut short", t->name);
+        }
+        t->left -= (uint32_t) count;
+        return (int) count;
+}
+
+
+/*
+ * tape_close
+ *
+ * The replay is over.
+ */
+static void tape_close (struct connection *cn)
+{
+        struct tape *t = cn->ctx;
+
+        fclose(t->file);
+        free(t);
+        cn->ctx  = NULL;
+        cn->tape = NULL;
+}
+
+
+static const struct transport tape_transport = {
+        tape_send,
+        tape_recv,
+        tape_close
+};
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * replay_record
+ *
+ * Record what the connection receives from now on to a tape file, file
+ * contents included or not.
+ */
+void replay_record (struct connection *cn, const char *file, int contents)
+{
+        struct tape *t;
+
+        t = open_tape(file, "wb");
+        t->contents = contents;
+        if (fwrite(TAPE_MAGIC, 1, TAPE_MAGIC_LEN, t->file) != TAPE_MAGIC_LEN)
+                fail(CANUTE_EFILE, "Writing tape '%s'", file);
+        cn->tape = t;
+        inform("--- Recording the session to '%s'%s\n", file,
+               (contents ? "" : " (without contents)"));
+}
+
+
+/*
+ * replay_bytes
+ *
+ * Record count bytes just received, file contents if is_contents.  Nothing to
+ * do when they come from a tape.
+ */
+void replay_bytes (struct connection *cn, const char *buf, size_t count,
+                   int is_contents)
+{
+        struct tape *t = cn->tape;
+
+        if (!t->replaying)
+                write_frame(t, buf, count,
+                            (is_contents && !t->contents ? TAPE_MADE_UP : 0));
+}
+
+
+/*
+ * replay_sent
+ *
+ * Record count bytes the receiver sends or, replaying, check that they are
+ * what it sent in the recording.
+ */
+void replay_sent (struct connection *cn, const char *buf, size_t count)
+{
+        struct tape *t = cn->tape;
+        char         recorded[TAPE_COMPARE];
+        size_t       n;
+
+        if (!t->replaying)
+        {
+                write_frame(t, buf, count, TAPE_SENT);
+                return;
+        }
+        while (count > 0)
+        {
+                if (!next_frame(t) || !t->sent)
+                        differs(t);
+                n = (count < t->left ? count : t->left);
+                n = (n < TAPE_COMPARE ? n : TAPE_COMPARE);
+                if (fread(recorded, 1, n, t->file) != n)
+                {
+                        errno = 0;
+                        fail(CANUTE_EPROTO, "Tape '%s' cut short", t->name);
+                }
+                if (memcmp(recorded, buf, n) != 0)
+                        differs(t);
+                t->left -= (uint32_t) n;
+                buf     += n;
+                count   -= n;
+        }
+}
+
+
+/*
+ * replay_recording
+ *
+ * True if what the connection receives is being recorded.
+ */
+int replay_recording (struct connection *cn)
+{
+        return cn->tape != NULL && !cn->tape->replaying;
+}
+
+
+/*
+ * replay_playing
+ *
+ * True if the connection receives from a tape.
+ */
+int replay_playing (struct connection *cn)
+{
+        return cn->tape != NULL && cn->tape->replaying;
+}
+
+
+/*
+ * replay_stop
+ *
+ * Finish the recording of a connection, if there is one.
+ */
+void replay_stop (struct connection *cn)
+{
+        struct tape *t = cn->tape;
+
+        if (t == NULL)
+                return;
+        if (fclose(t->file) != 0 && !t->replaying)
+                error("Writing tape '%s'", t->name);
+        free(t);
+        cn->tape = NULL;
+}
+
+
+/*
+ * replay_open
+ *
+ * Set up a connection that receives what the tape file recorded.
+ */
+void replay_open (struct connection *cn, const char *file)
+{
+        struct tape *t;
+        char         magic[TAPE_MAGIC_LEN];
+
+        t = open_tape(file, "rb");
+        if (fread(magic, 1, TAPE_MAGIC_LEN, t->file) != TAPE_MAGIC_LEN
+            || memcmp(magic, TAPE_MAGIC, TAPE_MAGIC_LEN) != 0)
+        {
+                errno = 0;
+                fail(CANUTE_EFILE, "'%s' is not a session tape", file);
+        }
+        t->replaying = 1;
+        transport_connection(cn, &tape_transport, t);
+        cn->tape = t;
+        inform("--- Replaying the session in '%s'\n", file);
+}
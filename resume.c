@@ -0,0 +1,836 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                          RESUMABLE SESSIONS                                */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * With -R on both ends a session survives losing its connection.  Both ends
+ * keep what they sent until the peer has consumed it.  When the connection
+ * fails the client connects again, and the server takes it.  Each end sends
+ * again what the other did not get, and the session goes on exactly where it
+ * stopped: the walk, the file on its way and its offset are still there, in
+ * both processes, so nothing is scanned nor negotiated again.
+ *
+ * SETTING UP
+ *
+ * Right after connecting, the client sends a REQUEST_RESUME with no name.  The
+ * server listens on its port again, for reconnections, and answers another
+ * one with a random session identifier in the name.
+ *
+ * FRAMES
+ *
+ * From then on the protocol byte stream goes through resume_transport, in
+ * frames with a header of three 32 bit words: a kind and a 64 bit value.
+ *
+ *   - FRAME_DATA: value bytes of data follow, RS_FRAME at most.
+ *   - FRAME_ACK: the peer has consumed the first value bytes we sent.
+ *   - FRAME_BYE: the peer is closing the session.
+ *
+ * Data sent stays in a ring of RS_WINDOW bytes until acknowledged, and the
+ * sender waits while the ring is full, so the receiving end never holds more
+ * than that either.  Acks go whenever a quarter of the window is consumed, and
+ * whenever an end is about to wait for the peer.
+ *
+ * RECONNECTING
+ *
+ * A connection is lost when a call on it fails, or when it is closed without
+ * a FRAME_BYE.  TCP notices a peer or a link gone silent: keepalives and the
+ * user timeout give up after RS_DEAD seconds.  The client then connects to the
+ * same address again and sends a REQUEST_RESUME with the session identifier
+ * and how many bytes it received all along.  The server checks the identifier
+ * and answers the same (REPLY_SKIP for a session it does not know).  Both ends
+ * send again, from their rings, what the other lacks, and go on.
+ *
+ * The client may see the failure first, so the server also takes a
+ * reconnection while it waits on a connection that still looks alive.  The
+ * client waits a second before its second attempt, twice as long before every
+ * next one (RS_BACKOFF seconds at most), and both ends give up after
+ * RS_GIVE_UP seconds.
+ */
+#include "canute.h"
+
+#ifndef HASEFROCH
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#define RESUMABLE
+#endif
+
+#define RS_HEADER   12     /* Frame header: kind, value (64 bits) */
+#define RS_FRAME    CANUTE_BLOCK_SIZE
+#define RS_WINDOW   (128 * CANUTE_BLOCK_SIZE)  /* Bytes kept until consumed */
+#define RS_DEAD     20     /* s a connection may go without answering */
+#define RS_HELLO    15000  /* ms for the peer to answer a REQUEST_RESUME */
+#define RS_BACKOFF  32     /* Most s between reconnection attempts */
+#define RS_GIVE_UP  600    /* s trying to reconnect */
+#define FRAME_DATA  1
+#define FRAME_ACK   2
+#define FRAME_BYE   3
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+struct resumable
+{
+        SOCKET             sk;         /* INVALID_SOCKET once finished */
+        SOCKET             bsk;        /* Server: listening for the client */
+        struct sockaddr_in peer;       /* Client: where to connect again */
+        char               id[CANUTE_NAME_LENGTH + 1];
+        int                closing;    /* We said FRAME_BYE */
+        int                bye;        /* The peer said it */
+        int                lost;       /* Times the connection failed */
+        /* Sending */
+        char              *out;        /* RS_WINDOW ring */
+        long long          sent;       /* Bytes, all along */
+        long long          acked;      /* Of them, consumed by the peer */
+        long long          resent;
+        /* Receiving */
+        char              *in;         /* RS_WINDOW ring */
+        long long          got;        /* Bytes, all along */
+        long long          consumed;
+        long long          acked_in;   /* Consumed as the peer was told */
+        char               hdr[RS_HEADER];
+        size_t             hdr_fill;
+        long long          data_left;  /* Of the data frame coming */
+        char              *rbuf;
+};
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+#ifdef RESUMABLE
+/*
+ * now_ms
+ *
+ * Milliseconds since the epoch.
+ */
+static long long now_ms (void)
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+
+
+/*
+ * wait_socket
+ *
+ * Wait up to timeout ms for a socket to be ready for events.
+ */
+static int wait_socket (SOCKET sk, int events, int timeout)
+{
+        struct pollfd pfd;
+        int           r;
+
+        pfd.fd     = sk;
+        pfd.events = events;
+        do
+                r = poll(&pfd, 1, timeout);
+        while (r == -1 && errno == EINTR);
+        return r == 1;
+}
+
+
+/*
+ * tune_socket
+ *
+ * Make TCP tell soon that a connection went silent, see above.
+ */
+static void tune_socket (SOCKET sk)
+{
+        int e = 1;
+
+        setsockopt(sk, IPPROTO_TCP, TCP_NODELAY, CCP_CAST &e, sizeof(e));
+        setsockopt(sk, SOL_SOCKET, SO_KEEPALIVE, CCP_CAST &e, sizeof(e));
+#ifdef TCP_KEEPIDLE
+        e = RS_DEAD / 4;
+        setsockopt(sk, IPPROTO_TCP, TCP_KEEPIDLE, CCP_CAST &e, sizeof(e));
+        setsockopt(sk, IPPROTO_TCP, TCP_KEEPINTVL, CCP_CAST &e, sizeof(e));
+        e = 3;
+        setsockopt(sk, IPPROTO_TCP, TCP_KEEPCNT, CCP_CAST &e, sizeof(e));
+#endif
+#ifdef TCP_USER_TIMEOUT
+        e = RS_DEAD * 1000;
+        setsockopt(sk, IPPROTO_TCP, TCP_USER_TIMEOUT, CCP_CAST &e, sizeof(e));
+#endif
+}
+
+
+/*
+ * new_id
+ *
+ * Make up a session identifier, so nobody else takes the session over.
+ */
+static void new_id (char *id)
+{
+        unsigned char noise[8];
+        FILE         *f;
+        int           i;
+
+        f = fopen("/dev/urandom", "rb");
+        if (f == NULL || fread(noise, 1, sizeof(noise), f) != sizeof(noise))
+                for (i = 0;  i < (int) sizeof(noise);  i++)
+                        noise[i] = (unsigned char) (now_ms() >> i ^ getpid());
+        if (f != NULL)
+                fclose(f);
+        for (i = 0;  i < (int) sizeof(noise);  i++)
+                sprintf(id + 2 * i, "%02x", noise[i]);
+}
+
+
+/*
+ * write_frame
+ *
+ * Write a frame of some kind with its value, followed by its data if it is a
+ * FRAME_DATA.  Return false if the connection failed.
+ */
+static int write_frame (SOCKET sk, int kind, long long value, const char *data)
+{
+        struct iovec  iov[2];
+        struct msghdr msg;
+        uint32_t      h[3];
+        ssize_t       s;
+
+        h[0] = htonl(kind);
+        h[1] = htonl((uint32_t) (value >> 32));
+        h[2] = htonl((uint32_t) value);
+        iov[0].iov_base = (char *) h;
+        iov[0].iov_len  = RS_HEADER;
+        iov[1].iov_base = (char *) data;
+        iov[1].iov_len  = (kind == FRAME_DATA ? (size_t) value : 0);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = 2;
+
+        while (iov[0].iov_len + iov[1].iov_len > 0)
+        {
+                s = sendmsg(sk, &msg, SEND_FLAGS);
+                if (s == -1 && errno == EINTR)
+                        continue;
+                if (s <= 0)
+                        return 0;
+
+                /* Skip what is gone */
+                if ((size_t) s >= iov[0].iov_len)
+                {
+                        s -= iov[0].iov_len;
+                        iov[0].iov_len  = 0;
+                        iov[1].iov_base = (char *) iov[1].iov_base + s;
+                        iov[1].iov_len -= s;
+                }
+                else
+                {
+                        iov[0].iov_base = (char *) iov[0].iov_base + s;
+                        iov[0].iov_len -= s;
+                }
+        }
+        return 1;
+}
+
+
+/*
+ * send_hello
+ *
+ * Send a REQUEST_RESUME (or a REPLY_SKIP) on a connection just made, telling
+ * how many bytes we got.  Return false if it failed.
+ */
+static int send_hello (SOCKET sk, int type, const char *id, long long got)
+{
+        struct header h;
+
+        memset(&h, 0, sizeof(h));
+        h.type   = htonl(type);
+        h.blocks = htonl((int) (got >> CANUTE_BLOCK_BITS));
+        h.extra  = htonl((int) (got & CANUTE_BLOCK_MASK));
+        strncpy(h.name, id, CANUTE_NAME_LENGTH);
+        h.name[CANUTE_NAME_LENGTH] = CANUTE_ENHANCED;
+        return send(sk, CCP_CAST &h, sizeof(h), SEND_FLAGS) == sizeof(h);
+}
+
+
+/*
+ * receive_hello
+ *
+ * Read the REQUEST_RESUME (or REPLY_SKIP) on a connection just made, and no
+ * more.  Return its type, or 0 if none came in time.
+ */
+static int receive_hello (SOCKET sk, char *id, long long *got)
+{
+        struct header h;
+        size_t        fill = 0;
+        ssize_t       r;
+
+        while (fill < sizeof(h))
+        {
+                if (!wait_socket(sk, POLLIN, RS_HELLO))
+                        return 0;
+                r = recv(sk, (char *) &h + fill, sizeof(h) - fill, 0);
+                if (r == -1 && errno == EINTR)
+                        continue;
+                if (r <= 0)
+                        return 0;
+                fill += r;
+        }
+        *got = ((long long) ntohl(h.blocks) << CANUTE_BLOCK_BITS)
+               + ntohl(h.extra);
+        memcpy(id, h.name, CANUTE_NAME_LENGTH);
+        id[CANUTE_NAME_LENGTH] = '\0';
+        return ntohl(h.type);
+}
+
+
+/*
+ * send_ring
+ *
+ * Send again the data kept in the ring, from the offset given on.  Return
+ * false if the connection failed.
+ */
+static int send_ring (struct resumable *rs, long long from)
+{
+        size_t at, n;
+
+        for (;  from < rs->sent;  from += n)
+        {
+                at = (size_t) (from % RS_WINDOW);
+                n  = (size_t) (rs->sent - from);
+                n  = (n < RS_FRAME ? n : RS_FRAME);
+                n  = (n < RS_WINDOW - at ? n : RS_WINDOW - at);
+                if (!write_frame(rs->sk, FRAME_DATA, n, rs->out + at))
+                        return 0;
+        }
+        return 1;
+}
+
+
+/*
+ * resume_on
+ *
+ * Go on through sk, a new connection whose peer got the first got bytes we
+ * sent.  Return false if it failed already, leaving no connection.
+ */
+static int resume_on (struct resumable *rs, SOCKET sk, long long got)
+{
+        if (got < rs->acked || got > rs->sent)
+        {
+                errno = 0;
+                fail(CANUTE_EPROTO, "The peer lost part of the session");
+        }
+        if (rs->sk != INVALID_SOCKET)
+                closesocket(rs->sk);
+        tune_socket(sk);
+        rs->sk        = sk;
+        rs->hdr_fill  = 0;
+        rs->data_left = 0;
+        rs->resent   += rs->sent - got;
+
+        /* Acks on the way may have been lost with the connection */
+        rs->acked_in = rs->consumed;
+        if (send_ring(rs, got)
+            && write_frame(sk, FRAME_ACK, rs->consumed, NULL)
+            && (!rs->closing || write_frame(sk, FRAME_BYE, 0, NULL)))
+                return 1;
+        closesocket(sk);
+        rs->sk = INVALID_SOCKET;
+        return 0;
+}
+
+
+/*
+ * connect_again
+ *
+ * Client side of a reconnection.  Return false if it did not work (yet).
+ */
+static int connect_again (struct resumable *rs)
+{
+        char      id[CANUTE_NAME_LENGTH + 1];
+        long long got;
+        SOCKET    sk;
+        int       flags, type, e = -1;
+        socklen_t len = sizeof(e);
+
+        sk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sk == INVALID_SOCKET)
+                return 0;
+        flags = fcntl(sk, F_GETFL);
+        fcntl(sk, F_SETFL, flags | O_NONBLOCK);
+        if (connect(sk, (SOCKADDR *) &rs->peer, sizeof(rs->peer)) == -1
+            && (errno != EINPROGRESS || !wait_socket(sk, POLLOUT, RS_HELLO)
+                || getsockopt(sk, SOL_SOCKET, SO_ERROR, &e, &len) == -1
+                || e != 0))
+        {
+                closesocket(sk);
+                return 0;
+        }
+        fcntl(sk, F_SETFL, flags);
+
+        type = 0;
+        if (send_hello(sk, REQUEST_RESUME, rs->id, rs->got))
+                type = receive_hello(sk, id, &got);
+        if (type == REPLY_SKIP)
+        {
+                errno = 0;
+                fail(CANUTE_EPROTO, "The peer does not know session %s",
+                     rs->id);
+        }
+        if (type != REQUEST_RESUME || strcmp(id, rs->id) != 0)
+        {
+                closesocket(sk);
+                return 0;
+        }
+        return resume_on(rs, sk, got);
+}
+
+
+/*
+ * accept_again
+ *
+ * Server side of a reconnection, waiting up to timeout ms for it.  Return
+ * false if it did not work (yet).
+ */
+static int accept_again (struct resumable *rs, int timeout)
+{
+        char      id[CANUTE_NAME_LENGTH + 1];
+        long long got;
+        SOCKET    sk;
+
+        if (!wait_socket(rs->bsk, POLLIN, timeout))
+                return 0;
+        sk = accept(rs->bsk, NULL, NULL);
+        if (sk == INVALID_SOCKET)
+                return 0;
+        if (receive_hello(sk, id, &got) != REQUEST_RESUME)
+        {
+                closesocket(sk);
+                return 0;
+        }
+        if (strcmp(id, rs->id) != 0)
+        {
+                send_hello(sk, REPLY_SKIP, id, 0);
+                closesocket(sk);
+                return 0;
+        }
+        if (!send_hello(sk, REQUEST_RESUME, rs->id, rs->got))
+        {
+                closesocket(sk);
+                return 0;
+        }
+        return resume_on(rs, sk, got);
+}
+
+
+/*
+ * lost
+ *
+ * The connection failed: get another one and go on, or fail after RS_GIVE_UP
+ * seconds.  Nothing to do if the session is over for both ends.
+ */
+static void lost (struct resumable *rs, const char *why)
+{
+        long long start = now_ms(), left;
+        int       delay = 1000, done = 0;
+
+        if (rs->sk != INVALID_SOCKET)
+                closesocket(rs->sk);
+        rs->sk = INVALID_SOCKET;
+        if (rs->bye || (rs->closing && rs->acked == rs->sent))
+                return;
+
+        rs->lost++;
+        inform("--- Connection %s, reconnecting to resume session %s\n", why,
+               rs->id);
+        while (!done)
+        {
+                left = RS_GIVE_UP * 1000LL - (now_ms() - start);
+                if (left <= 0)
+                {
+                        errno = ETIMEDOUT;
+                        fail(CANUTE_ENET, "Resuming session %s", rs->id);
+                }
+                if (rs->bsk != INVALID_SOCKET)
+                        done = accept_again(rs, (int) left);
+                else if (!(done = connect_again(rs)))
+                {
+                        poll(NULL, 0, (int) (delay < left ? delay : left));
+                        delay = (delay < RS_BACKOFF * 500 ? delay * 2
+                                                          : RS_BACKOFF * 1000);
+                }
+        }
+        inform("--- Session %s resumed\n", rs->id);
+}
+
+
+/*
+ * take_input
+ *
+ * Parse count bytes read from the connection.  Return false if they make no
+ * sense.
+ */
+static int take_input (struct resumable *rs, const char *buf, size_t count)
+{
+        uint32_t  h[3];
+        long long value;
+        size_t    at, n;
+
+        while (count > 0)
+        {
+                if (rs->data_left == 0)
+                {
+                        n = RS_HEADER - rs->hdr_fill;
+                        n = (n < count ? n : count);
+                        memcpy(rs->hdr + rs->hdr_fill, buf, n);
+                        rs->hdr_fill += n;
+                        buf          += n;
+                        count        -= n;
+                        if (rs->hdr_fill < RS_HEADER)
+                                break;
+                        rs->hdr_fill = 0;
+
+                        memcpy(h, rs->hdr, RS_HEADER);
+                        value = ((long long) ntohl(h[1]) << 32) | ntohl(h[2]);
+                        switch (ntohl(h[0]))
+                        {
+                        case FRAME_DATA:
+                                if (value <= 0 || value > RS_FRAME)
+                                        return 0;
+                                rs->data_left = value;
+                                break;
+
+                        case FRAME_ACK:
+                                if (value < rs->acked || value > rs->sent)
+                                        return 0;
+                                rs->acked = value;
+                                break;
+
+                        case FRAME_BYE:
+                                rs->bye = 1;
+                                break;
+
+                        default:
+                                return 0;
+                        }
+                        continue;
+                }
+
+                at = (size_t) (rs->got % RS_WINDOW);
+                n  = (size_t) rs->data_left;
+                n  = (n < count ? n : count);
+                n  = (n < RS_WINDOW - at ? n : RS_WINDOW - at);
+                if (rs->got + (long long) n - rs->consumed > RS_WINDOW)
+                        return 0;
+                memcpy(rs->in + at, buf, n);
+                rs->got       += n;
+                rs->data_left -= n;
+                buf           += n;
+                count         -= n;
+        }
+        return 1;
+}
+
+
+/*
+ * read_input
+ *
+ * Take what the connection has, at least a byte.
+ */
+static void read_input (struct resumable *rs)
+{
+        ssize_t r;
+
+        do
+                r = recv(rs->sk, rs->rbuf, RS_FRAME, 0);
+        while (r == -1 && errno == EINTR);
+        if (r <= 0)
+                lost(rs, (r == 0 ? "closed" : "failed"));
+        else if (!take_input(rs, rs->rbuf, (size_t) r))
+        {
+                errno = 0;
+                fail(CANUTE_EPROTO, "Garbled frames in session %s", rs->id);
+        }
+}
+
+
+/*
+ * wait_input
+ *
+ * The caller cannot go on until the peer says something.  The server takes
+ * a reconnection meanwhile, if the client comes back.
+ */
+static void wait_input (struct resumable *rs)
+{
+        struct pollfd pfd[2];
+        int           r, n = 1;
+
+        if (rs->sk == INVALID_SOCKET)
+                return;
+        pfd[0].fd      = rs->sk;
+        pfd[0].events  = POLLIN;
+        pfd[0].revents = 0;
+        if (rs->bsk != INVALID_SOCKET)
+        {
+                pfd[1].fd      = rs->bsk;
+                pfd[1].events  = POLLIN;
+                pfd[1].revents = 0;
+                n              = 2;
+        }
+        do
+                r = poll(pfd, n, -1);
+        while (r == -1 && errno == EINTR);
+
+        if (n == 2 && (pfd[1].revents & POLLIN))
+        {
+                if (accept_again(rs, 0))
+                {
+                        rs->lost++;
+                        inform("--- Session %s resumed\n", rs->id);
+                }
+                else if (rs->sk == INVALID_SOCKET)
+                        lost(rs, "failed");
+                return;
+        }
+        if (pfd[0].revents != 0)
+                read_input(rs);
+}
+
+
+/*
+ * send_ack
+ *
+ * Tell the peer what we consumed, if it does not know yet.
+ */
+static void send_ack (struct resumable *rs)
+{
+        if (rs->consumed == rs->acked_in || rs->sk == INVALID_SOCKET)
+                return;
+        rs->acked_in = rs->consumed;
+        if (!write_frame(rs->sk, FRAME_ACK, rs->consumed, NULL))
+                lost(rs, "failed");
+}
+
+
+/*
+ * rs_send
+ *
+ * Transport send: keep the bytes in the ring and send them in frames, waiting
+ * while RS_WINDOW bytes are not consumed yet.
+ */
+static int rs_send (struct connection *cn, const char *buf, size_t count)
+{
+        struct resumable *rs = cn->ctx;
+        size_t            at, n, done;
+
+        for (done = 0;  done < count;  done += n)
+        {
+                while (rs->sk != INVALID_SOCKET && !rs->bye
+                       && rs->sent - rs->acked == RS_WINDOW)
+                {
+                        send_ack(rs);
+                        wait_input(rs);
+                }
+                if (rs->sk == INVALID_SOCKET || rs->bye)
+                {
+                        errno = ECONNRESET;
+                        return SOCKET_ERROR;
+                }
+
+                at = (size_t) (rs->sent % RS_WINDOW);
+                n  = count - done;
+                n  = (n < RS_FRAME ? n : RS_FRAME);
+                n  = (n < RS_WINDOW - at ? n : RS_WINDOW - at);
+                if ((long long) n > RS_WINDOW - (rs->sent - rs->acked))
+                        n = (size_t) (RS_WINDOW - (rs->sent - rs->acked));
+                memcpy(rs->out + at, buf + done, n);
+                rs->sent += n;
+                if (!write_frame(rs->sk, FRAME_DATA, n, rs->out + at))
+                        lost(rs, "failed");
+        }
+        return (int) count;
+}
+
+
+/*
+ * rs_recv
+ *
+ * Transport receive: the next bytes the peer sent, waiting for them if
+ * needed.  Zero once the peer closed the session.
+ */
+static int rs_recv (struct connection *cn, char *buf, size_t count)
+{
+        struct resumable *rs = cn->ctx;
+        size_t            at, n;
+
+        while (rs->got == rs->consumed)
+        {
+                if (rs->bye || rs->sk == INVALID_SOCKET)
+                        return 0;
+                send_ack(rs);
+                wait_input(rs);
+        }
+
+        at = (size_t) (rs->consumed % RS_WINDOW);
+        n  = (size_t) (rs->got - rs->consumed);
+        n  = (n < count ? n : count);
+        n  = (n < RS_WINDOW - at ? n : RS_WINDOW - at);
+        memcpy(buf, rs->in + at, n);
+        rs->consumed += n;
+        if (rs->consumed - rs->acked_in >= RS_WINDOW / 4)
+                send_ack(rs);
+        return (int) n;
+}
+
+
+/*
+ * rs_close
+ *
+ * Transport close: say goodbye, and stay until the peer has consumed what we
+ * sent, reconnecting if needed.
+ */
+static void rs_close (struct connection *cn)
+{
+        struct resumable *rs = cn->ctx;
+
+        rs->closing  = 1;
+        rs->acked_in = rs->consumed;
+        if (rs->sk != INVALID_SOCKET
+            && (!write_frame(rs->sk, FRAME_ACK, rs->consumed, NULL)
+                || !write_frame(rs->sk, FRAME_BYE, 0, NULL)))
+                lost(rs, "failed");
+        while (rs->sk != INVALID_SOCKET && !rs->bye && rs->acked < rs->sent)
+                wait_input(rs);
+
+        if (rs->lost > 0)
+                inform("--- Session %s resumed %d times, %lld bytes sent "
+                       "again\n", rs->id, rs->lost, rs->resent);
+        if (rs->sk != INVALID_SOCKET)
+                closesocket(rs->sk);
+        if (rs->bsk != INVALID_SOCKET)
+                closesocket(rs->bsk);
+        free(rs->out);
+        free(rs->in);
+        free(rs->rbuf);
+        free(rs);
+        cn->ctx = NULL;
+}
+
+
+static const struct transport resume_transport = {
+        rs_send,
+        rs_recv,
+        rs_close
+};
+
+
+/*
+ * listen_again
+ *
+ * Server side of the setup: listen on our port, for the client to come back.
+ */
+static SOCKET listen_again (unsigned short port)
+{
+        struct sockaddr_in sa;
+        SOCKET             bsk;
+        int                e = 1;
+
+        bsk = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family      = AF_INET;
+        sa.sin_port        = htons(port);
+        sa.sin_addr.s_addr = INADDR_ANY;
+        setsockopt(bsk, SOL_SOCKET, SO_REUSEADDR, CCP_CAST &e, sizeof(e));
+        if (bsk == INVALID_SOCKET
+            || bind(bsk, (SOCKADDR *) &sa, sizeof(sa)) == SOCKET_ERROR
+            || listen(bsk, 4) == SOCKET_ERROR)
+                fail(CANUTE_ENET, "Could not open port %d for reconnections",
+                     port);
+        return bsk;
+}
+#endif /* RESUMABLE */
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * resume_setup
+ *
+ * Make a connection just established resumable, as the server (listening on
+ * port) or as the client.  Both ends must do so.
+ */
+void resume_setup (struct connection *cn, int server, unsigned short port)
+{
+#ifdef RESUMABLE
+        struct resumable *rs;
+        socklen_t         alen = sizeof(struct sockaddr_in);
+        size_t            n;
+
+        if (connection_socket(cn) == INVALID_SOCKET || connection_local(cn))
+        {
+                errno = 0;
+                fail(CANUTE_EINVAL, "Resumable sessions need TCP connections");
+        }
+        rs = calloc(1, sizeof(struct resumable));
+        if (rs == NULL || (rs->out = malloc(RS_WINDOW)) == NULL
+            || (rs->in = malloc(RS_WINDOW)) == NULL
+            || (rs->rbuf = malloc(RS_FRAME)) == NULL)
+                fail(CANUTE_ENOMEM, "Allocating session buffers");
+        rs->sk  = cn->sk;
+        rs->bsk = INVALID_SOCKET;
+
+        if (server)
+        {
+                /* A client without -R may be waiting as well */
+                if ((buffered_input(cn) == 0
+                     && !wait_socket(rs->sk, POLLIN, RS_HELLO))
+                    || receive_message(cn, NULL, NULL, NULL, NULL)
+                       != REQUEST_RESUME)
+                {
+                        errno = 0;
+                        fail(CANUTE_EPROTO,
+                             "The peer does not resume sessions");
+                }
+                rs->bsk = listen_again(port);
+                new_id(rs->id);
+                send_message(cn, REQUEST_RESUME, 0, 0, 0, rs->id);
+        }
+        else
+        {
+                if (getpeername(rs->sk, (SOCKADDR *) &rs->peer, &alen) == -1)
+                        fail(CANUTE_ENET, "Finding the peer address");
+                send_message(cn, REQUEST_RESUME, 0, 0, 0, NULL);
+                push_connection(cn);
+                if (receive_message(cn, NULL, NULL, NULL, rs->id)
+                    != REQUEST_RESUME || rs->id[0] == '\0')
+                {
+                        errno = 0;
+                        fail(CANUTE_EPROTO,
+                             "The peer does not resume sessions");
+                }
+        }
+        push_connection(cn);
+        tune_socket(rs->sk);
+        inform("--- Resumable session %s\n", rs->id);
+
+        /* Frames the peer sent already may have been read ahead */
+        n = buffered_input(cn);
+        if (n > 0 && !take_input(rs, cn->in + cn->in_pos, n))
+                fail(CANUTE_EPROTO, "Setting up the session");
+        cn->in_pos = cn->in_fill = 0;
+
+        cn->tr  = &resume_transport;
+        cn->ctx = rs;
+        cn->sk  = INVALID_SOCKET;
+#else
+        errno = 0;
+        fail(CANUTE_EINVAL, "Resumable sessions not supported");
+#endif
+}
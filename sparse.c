@@ -0,0 +1,185 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                      HOLE AND ZERO BLOCK DETECTION                         */
+/*                                                                            */
+/******************************************************************************/
+
+#include "canute.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ZERO_X86
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * zero_scalar
+ *
+ * Portable version, one machine word at a time.  Also used for the unaligned
+ * tails left by the vector versions.
+ */
+static int zero_scalar (const char *buf, size_t count)
+{
+        unsigned long acc = 0, w;
+        size_t        i = 0;
+
+        for (;  i + sizeof(w) <= count;  i += sizeof(w))
+        {
+                memcpy(&w, buf + i, sizeof(w));
+                acc |= w;
+        }
+        for (;  i < count;  i++)
+                acc |= (unsigned char) buf[i];
+        return acc == 0;
+}
+
+
+#ifdef ZERO_X86
+/*
+ * zero_sse2 / zero_avx2
+ *
+ * OR together 64 (resp. 128) bytes per iteration and test the accumulator only
+ * once per iteration.  Reads are unaligned, data comes from stdio buffers.
+ */
+__attribute__((target("sse2")))
+static int zero_sse2 (const char *buf, size_t count)
+{
+        __m128i acc;
+        size_t  i;
+
+        for (i = 0;  i + 64 <= count;  i += 64)
+        {
+                acc = _mm_or_si128(
+                        _mm_or_si128(_mm_loadu_si128((const __m128i *) (buf + i)),
+                                     _mm_loadu_si128((const __m128i *) (buf + i + 16))),
+                        _mm_or_si128(_mm_loadu_si128((const __m128i *) (buf + i + 32)),
+                                     _mm_loadu_si128((const __m128i *) (buf + i + 48))));
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128()))
+                    != 0xFFFF)
+                        return 0;
+        }
+        return zero_scalar(buf + i, count - i);
+}
+
+
+__attribute__((target("avx2")))
+static int zero_avx2 (const char *buf, size_t count)
+{
+        __m256i acc;
+        size_t  i;
+
+        for (i = 0;  i + 128 <= count;  i += 128)
+        {
+                acc = _mm256_or_si256(
+                        _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (buf + i)),
+                                        _mm256_loadu_si256((const __m256i *) (buf + i + 32))),
+                        _mm256_or_si256(_mm256_loadu_si256((const __m256i *) (buf + i + 64)),
+                                        _mm256_loadu_si256((const __m256i *) (buf + i + 96))));
+                if (!_mm256_testz_si256(acc, acc))
+                        return 0;
+        }
+        return zero_scalar(buf + i, count - i);
+}
+#endif /* ZERO_X86 */
+
+
+#ifdef __ARM_NEON
+static int zero_neon (const char *buf, size_t count)
+{
+        uint8x16_t acc;
+        size_t     i;
+
+        for (i = 0;  i + 64 <= count;  i += 64)
+        {
+                acc = vorrq_u8(vorrq_u8(vld1q_u8((const uint8_t *) buf + i),
+                                        vld1q_u8((const uint8_t *) buf + i + 16)),
+                               vorrq_u8(vld1q_u8((const uint8_t *) buf + i + 32),
+                                        vld1q_u8((const uint8_t *) buf + i + 48)));
+#ifdef __aarch64__
+                if (vmaxvq_u8(acc) != 0)
+                        return 0;
+#else
+                /* No across-vector reduction before AArch64: fold halves */
+                if (vget_lane_u64(vreinterpret_u64_u8(
+                        vorr_u8(vget_low_u8(acc), vget_high_u8(acc))), 0) != 0)
+                        return 0;
+#endif
+        }
+        return zero_scalar(buf + i, count - i);
+}
+#endif /* __ARM_NEON */
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * is_zero
+ *
+ * True if the buffer contains nothing but zero bytes.  The best vector version
+ * available on the running CPU is selected on the first call.
+ */
+int is_zero (const char *buf, size_t count)
+{
+        static int (*impl) (const char *, size_t) = NULL;
+
+        if (impl == NULL)
+        {
+#if defined(ZERO_X86)
+                if (__builtin_cpu_supports("avx2"))
+                        impl = zero_avx2;
+                else if (__builtin_cpu_supports("sse2"))
+                        impl = zero_sse2;
+                else
+                        impl = zero_scalar;
+#elif defined(__ARM_NEON)
+                impl = zero_neon;
+#else
+                impl = zero_scalar;
+#endif
+        }
+        return impl(buf, count);
+}
+
+
+/*
+ * next_data
+ *
+ * Find the data region of the file that contains offset, or the next one after
+ * it.  On return *start is where data begins (size if there is no more data)
+ * and *end where the following hole begins.  Without SEEK_DATA support the
+ * whole file is reported as data and zero blocks are only found by reading.
+ */
+void next_data (FILE *file, long long offset, long long size,
+                long long *start, long long *end)
+{
+#ifdef SEEK_DATA
+        off_t d, h;
+
+        d = lseek(fileno(file), (off_t) offset, SEEK_DATA);
+        if (d == -1)
+        {
+                /* ENXIO: only a hole up to the end.  Anything else: the
+                 * filesystem does not know, assume data. */
+                *start = (errno == ENXIO ? size : offset);
+                *end   = size;
+                return;
+        }
+        /* The file may have grown since it was stat()ed: nothing past size
+         * is sent */
+        h = lseek(fileno(file), d, SEEK_HOLE);
+        *start = ((long long) d > size ? size : (long long) d);
+        *end   = (h == -1 || (long long) h > size ? size : (long long) h);
+#else
+        *start = offset;
+        *end   = size;
+#endif
+}
@@ -0,0 +1,372 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                        STANDARD INPUT/OUTPUT STREAMS                       */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * Stream mode carries a single byte stream of unknown length, from the standard
+ * input of the sender to the standard output of the receiver, so Canute can sit
+ * in the middle of a pipeline.  After a REQUEST_STREAM header the data travels
+ * in frames:
+ *
+ *      length (4 bytes, network byte order), then that many bytes
+ *
+ * A frame of length zero ends the stream.  Frames are at most STREAM_FRAME
+ * bytes long, usually less: each one carries whatever the input had ready.
+ *
+ * On Linux, over a socket, the data never reaches user space.  The sender
+ * splices the input into an intermediate pipe, which tells how long the frame
+ * is, writes the frame length and splices the pipe into the socket.  The
+ * receiver does the reverse.  Inputs and outputs splice() cannot handle (a
+ * terminal, a file opened for appending) fall back to read() and write().
+ *
+ * Standard output belongs to the stream, so messages go to stderr.
+ */
+#include "canute.h"
+
+#ifdef HASEFROCH
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#define STREAM_SPLICE
+#endif
+
+#define STREAM_FRAME (16 * CANUTE_BLOCK_SIZE)
+
+static THREAD_LOCAL char *stream_buf = NULL;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * send_length / receive_length
+ *
+ * Frame header.
+ */
+static void send_length (struct connection *cn, size_t count)
+{
+        unsigned char b[4];
+
+        b[0] = (unsigned char) (count >> 24);
+        b[1] = (unsigned char) (count >> 16);
+        b[2] = (unsigned char) (count >> 8);
+        b[3] = (unsigned char) count;
+        send_data(cn, (char *) b, 4);
+}
+
+
+static size_t receive_length (struct connection *cn)
+{
+        unsigned char b[4];
+        size_t        count;
+
+        receive_data(cn, (char *) b, 4);
+        count = ((size_t) b[0] << 24) | ((size_t) b[1] << 16)
+              | ((size_t) b[2] << 8)  |  (size_t) b[3];
+        if (count > STREAM_FRAME)
+                fail(CANUTE_EPROTO, "Stream frame too long (%lu bytes)",
+                     (unsigned long) count);
+        return count;
+}
+
+
+/*
+ * write_all
+ *
+ * Write count bytes from buf to the file descriptor fd, whatever it takes.
+ */
+static void write_all (int fd, const char *buf, size_t count)
+{
+        int r;
+
+        while (count > 0)
+        {
+                r = write(fd, buf, count);
+                if (r == -1 && errno == EINTR)
+                        continue;
+                if (r <= 0)
+                        fatal("Writing stream");
+                buf   += r;
+                count -= r;
+        }
+}
+
+
+/*
+ * alloc_buffer
+ *
+ * The user space path needs a frame sized buffer.
+ */
+static void alloc_buffer (void)
+{
+        if (stream_buf != NULL)
+                return;
+        stream_buf = malloc(STREAM_FRAME);
+        if (stream_buf == NULL)
+                fail(CANUTE_ENOMEM, "Allocating stream buffer");
+}
+
+
+/*
+ * send_plain / receive_plain
+ *
+ * Portable loops through a user space buffer.  Return the bytes moved.
+ */
+static long long send_plain (struct connection *cn)
+{
+        long long total = 0;
+        int       r;
+
+        alloc_buffer();
+        for (;;)
+        {
+                r = read(fileno(stdin), stream_buf, STREAM_FRAME);
+                if (r == -1 && errno == EINTR)
+                        continue;
+                if (r == -1)
+                        fatal("Reading stream");
+                send_length(cn, r);
+                if (r == 0)
+                        break;
+                send_data(cn, stream_buf, r);
+                total += r;
+        }
+        return total;
+}
+
+
+static long long receive_plain (struct connection *cn)
+{
+        long long total = 0;
+        size_t    n;
+
+        alloc_buffer();
+        while ((n = receive_length(cn)) > 0)
+        {
+                receive_data(cn, stream_buf, n);
+                write_all(fileno(stdout), stream_buf, n);
+                total += n;
+        }
+        return total;
+}
+
+
+#ifdef STREAM_SPLICE
+/*
+ * can_splice
+ *
+ * True if splice() can move data to or from the file descriptor fd.
+ */
+static int can_splice (int fd, int output)
+{
+        struct stat st;
+        int         flags;
+
+        if (fstat(fd, &st) == -1)
+                return 0;
+        if (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))
+                return 1;
+        flags = fcntl(fd, F_GETFL);
+        return S_ISREG(st.st_mode) && !(output && (flags & O_APPEND));
+}
+
+
+/*
+ * open_pipe
+ *
+ * The intermediate pipe, as large as a frame if the system allows it.  Return
+ * false if it could not be created.
+ */
+static int open_pipe (int *fd)
+{
+        if (pipe(fd) == -1)
+                return 0;
+        fcntl(fd[1], F_SETPIPE_SZ, STREAM_FRAME);  /* Just a wish */
+        return 1;
+}
+
+
+/*
+ * splice_some
+ *
+ * Move up to count bytes from in to out, at least one.  Return how many.
+ */
+static size_t splice_some (int in, int out, size_t count)
+{
+        ssize_t r;
+
+        do
+                r = splice(in, NULL, out, NULL, count,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        while (r == -1 && errno == EINTR);
+
+        if (r == 0)
+                errno = ECONNRESET;
+        if (r <= 0)
+                fatal("Splicing stream");
+        return (size_t) r;
+}
+
+
+/*
+ * splice_all
+ *
+ * Move exactly count bytes from in to out.  Only for a pipe already holding
+ * them as input.
+ */
+static void splice_all (int in, int out, size_t count)
+{
+        while (count > 0)
+                count -= splice_some(in, out, count);
+}
+
+
+/*
+ * send_spliced
+ *
+ * Sender loop with splice().  The pipe gets whatever the input has ready, up
+ * to its capacity, and that makes a frame.  Return the bytes sent.
+ */
+static long long send_spliced (struct connection *cn, SOCKET sk, int *p)
+{
+        long long total = 0;
+        ssize_t   n;
+
+        for (;;)
+        {
+                n = splice(fileno(stdin), NULL, p[1], NULL, STREAM_FRAME,
+                           SPLICE_F_MOVE);
+                if (n == -1 && errno == EINTR)
+                        continue;
+                if (n == -1)
+                        fatal("Reading stream");
+                send_length(cn, n);
+                if (n == 0)
+                        break;
+                flush_connection(cn);
+                splice_all(p[0], sk, n);
+                total += n;
+        }
+        return total;
+}
+
+
+/*
+ * receive_spliced
+ *
+ * Receiver loop with splice().  Whatever part of a frame the socket has ready
+ * goes into the pipe and straight out of it, the pipe must be drained before
+ * asking for more or it could fill up half way.  The start of a frame may have
+ * been read along with its length already.  Return the bytes received.
+ */
+static long long receive_spliced (struct connection *cn, SOCKET sk, int *p)
+{
+        long long total = 0;
+        size_t    n, r;
+
+        alloc_buffer();
+        while ((n = receive_length(cn)) > 0)
+        {
+                total += n;
+                r      = buffered_input(cn);
+                if (r > 0)
+                {
+                        r = (r < n ? r : n);
+                        receive_data(cn, stream_buf, r);
+                        write_all(fileno(stdout), stream_buf, r);
+                        n -= r;
+                }
+                while (n > 0)
+                {
+                        r  = splice_some(sk, p[1], n);
+                        splice_all(p[0], fileno(stdout), r);
+                        n -= r;
+                }
+        }
+        return total;
+}
+#endif /* STREAM_SPLICE */
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * send_stream
+ *
+ * Send the whole standard input over the connection.
+ */
+void send_stream (struct connection *cn)
+{
+        long long total = -1;
+#ifdef STREAM_SPLICE
+        SOCKET    sk;
+        int       p[2];
+#endif
+
+#ifdef HASEFROCH
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        send_message(cn, REQUEST_STREAM, 0, 0, 0, NULL);
+
+#ifdef STREAM_SPLICE
+        sk = connection_socket(cn);
+        if (sk != INVALID_SOCKET && can_splice(fileno(stdin), 0)
+            && open_pipe(p))
+        {
+                total = send_spliced(cn, sk, p);
+                close(p[0]);
+                close(p[1]);
+        }
+#endif
+        if (total == -1)
+                total = send_plain(cn);
+
+        fprintf(stderr, "--- Stream sent (%lld bytes)\n", total);
+}
+
+
+/*
+ * receive_stream
+ *
+ * Write the stream coming from the connection to the standard output.
+ */
+void receive_stream (struct connection *cn)
+{
+        long long total = -1;
+#ifdef STREAM_SPLICE
+        SOCKET    sk;
+        int       p[2];
+#endif
+
+#ifdef HASEFROCH
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        if (receive_message(cn, NULL, NULL, NULL, NULL) != REQUEST_STREAM)
+                fail(CANUTE_EPROTO, "Peer is not sending a stream");
+
+#ifdef STREAM_SPLICE
+        sk = connection_socket(cn);
+        if (sk != INVALID_SOCKET && can_splice(fileno(stdout), 1)
+            && open_pipe(p))
+        {
+                total = receive_spliced(cn, sk, p);
+                close(p[0]);
+                close(p[1]);
+        }
+#endif
+        if (total == -1)
+                total = receive_plain(cn);
+
+        fprintf(stderr, "--- Stream received (%lld bytes)\n", total);
+}
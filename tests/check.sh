@@ -0,0 +1,210 @@
+#!/bin/sh
+################################################################################
+#                 ____      _      _   _   _   _   _____   _____               #
+#                / ___|    / \    | \ | | | | | | |_   _| | ____|              #
+#               | |       / _ \   |  \| | | | | |   | |   |  _|                #
+#               | |___   / ___ \  | |\  | | |_| |   | |   | |___               #
+#                \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|              #
+#                                                                              #
+#                          LOOPBACK REGRESSION CHECKS                          #
+#                                                                              #
+################################################################################
+#
+# Usage: check.sh <canute binary>
+#
+# Runs small sessions over loopback and checks what the receiver ends up with.
+# Each check is a function named check_<name>, listed in CHECKS.  Tuned with
+# environment variables:
+#
+#   CHECK_DIR   Work directory (emptied before each check)
+#   CHECK_PORT  TCP port to use on 127.0.0.1
+#   CHECK_ONLY  Subset of the checks, by name
+
+CANUTE=`cd \`dirname "$1"\` && pwd`/`basename "$1"`
+
+CHECK_DIR=${CHECK_DIR:-${TMPDIR:-/tmp}/canute-check}
+CHECK_PORT=${CHECK_PORT:-11220}
+CHECKS="index_same_size index_resume dedup_repeats filter_dir_slash \
+        replay_state replay_local pack_unfinished"
+CHECK_ONLY=${CHECK_ONLY:-$CHECKS}
+
+SRC=$CHECK_DIR/src
+DST=$CHECK_DIR/dst
+LOG=$CHECK_DIR/log.txt
+
+
+# Block until the receiver is listening on the port (see bench/bench.sh)
+wait_listen ()
+{
+        hex=`printf '%04X' $CHECK_PORT`
+        i=0
+        while ! grep -q ":$hex [0-9A-F:]* 0A " /proc/net/tcp /proc/net/tcp6 \
+                2>/dev/null
+        do
+                i=`expr $i + 1`
+                if [ $i -gt 100 ]
+                then
+                        echo "Nothing listening on port $CHECK_PORT" >&2
+                        exit 1
+                fi
+                sleep 0.05
+        done
+}
+
+
+# One session from $SRC to $DST: session "<receiver options>" "<sender
+# options>" items...  False if either end fails.
+session ()
+{
+        ropts=$1
+        sopts=$2
+        shift 2
+        ( cd "$DST" && exec "$CANUTE" getserv:$CHECK_PORT $ropts ) \
+                >> "$LOG" 2>&1 &
+        rpid=$!
+        wait_listen
+        ( cd "$SRC" && "$CANUTE" sendto:$CHECK_PORT $sopts 127.0.0.1 "$@" ) \
+                >> "$LOG" 2>&1
+        s=$?
+        wait $rpid
+        r=$?
+        [ $s -eq 0 ] && [ $r -eq 0 ]
+}
+
+
+# A file rewritten with the same size between two incremental sessions
+check_index_same_size ()
+{
+        printf 'first version\n' > "$SRC/f"
+        touch -d '2020-01-01 00:00:00' "$SRC/f"
+        session "-I $CHECK_DIR/index" "-i" f || return 1
+        printf 'other version\n' > "$SRC/f"
+        touch -d '2021-01-01 00:00:00' "$SRC/f"
+        session "-I $CHECK_DIR/index" "-i" f || return 1
+        cmp -s "$SRC/f" "$DST/f" || return 1
+
+        # The index must know the new version, and skip it from now on
+        session "-I $CHECK_DIR/index" "-i" f || return 1
+        cmp -s "$SRC/f" "$DST/f"
+}
+
+
+# An interrupted transfer is resumed with an index too, not started again
+check_index_resume ()
+{
+        head -c 1000000 /dev/urandom > "$SRC/f"
+        head -c 300000 "$SRC/f" > "$DST/f"
+        session "-I $CHECK_DIR/index" "-i" f || return 1
+        cmp -s "$SRC/f" "$DST/f" && grep -q "Completed 700,000 bytes" "$LOG"
+}
+
+
+# Deduplicated files repeating chunks within a batch, with and without store
+check_dedup_repeats ()
+{
+        head -c 262144 /dev/urandom > "$CHECK_DIR/p"
+        head -c 262144 /dev/urandom > "$CHECK_DIR/q"
+        head -c 1048576 /dev/urandom > "$SRC/a"
+        head -c 262144 "$SRC/a" > "$CHECK_DIR/old"
+        ( cd "$CHECK_DIR" && cat old p old p q old q ) > "$SRC/b"
+        session "-S $CHECK_DIR/store" "-d" a || return 1
+        session "-S $CHECK_DIR/store" "-d" b || return 1
+        cmp -s "$SRC/b" "$DST/b" || return 1
+        rm "$DST/b"
+        session "" "-d" b || return 1
+        cmp -s "$SRC/b" "$DST/b"
+}
+
+
+# A rule ending in '/' leaves out directories only, on either end
+check_filter_dir_slash ()
+{
+        mkdir -p "$SRC/t/c" "$SRC/t/d"
+        echo inside > "$SRC/t/c/f"
+        echo file > "$SRC/t/d/c"
+        echo '- c/' > "$CHECK_DIR/rules"
+        session "" "-X $CHECK_DIR/rules" t || return 1
+        [ ! -e "$DST/t/c" ] && cmp -s "$SRC/t/d/c" "$DST/t/d/c" || return 1
+        rm -r "$DST/t"
+        session "-X $CHECK_DIR/rules" "" t || return 1
+        [ ! -e "$DST/t/c" ] && cmp -s "$SRC/t/d/c" "$DST/t/d/c"
+}
+
+
+# A tape replays into the state it was recorded from, and stops cleanly
+# anywhere else
+check_replay_state ()
+{
+        mkdir -p "$SRC/t" "$CHECK_DIR/again"
+        head -c 300000 /dev/urandom > "$SRC/t/a"
+        echo small > "$SRC/t/b"
+        session "-T $CHECK_DIR/tape" "" t || return 1
+        ( cd "$CHECK_DIR/again" && "$CANUTE" replay "$CHECK_DIR/tape" ) \
+                >> "$LOG" 2>&1 || return 1
+        cmp -s "$SRC/t/a" "$CHECK_DIR/again/t/a" || return 1
+
+        # The files are there now, the receiver answers otherwise
+        ( cd "$DST" && "$CANUTE" replay "$CHECK_DIR/tape" ) >> "$LOG" 2>&1 \
+                && return 1
+        grep -q "receiver state differs from the recording" "$LOG"
+}
+
+
+# Files passed as descriptors on a Unix socket are on the tape too
+check_replay_local ()
+{
+        mkdir -p "$SRC/t" "$CHECK_DIR/again"
+        head -c 300000 /dev/urandom > "$SRC/t/a"
+        sock=unix:$CHECK_DIR/sock
+        ( cd "$DST" && exec "$CANUTE" getserv:$sock -T "$CHECK_DIR/tape" ) \
+                >> "$LOG" 2>&1 &
+        rpid=$!
+        i=0
+        while [ ! -S "$CHECK_DIR/sock" ] && [ $i -lt 100 ]
+        do
+                i=`expr $i + 1`
+                sleep 0.05
+        done
+        ( cd "$SRC" && "$CANUTE" sendto:$sock $sock t ) >> "$LOG" 2>&1 \
+                || return 1
+        wait $rpid || return 1
+        ( cd "$CHECK_DIR/again" && "$CANUTE" replay "$CHECK_DIR/tape" ) \
+                >> "$LOG" 2>&1 || return 1
+        cmp -s "$SRC/t/a" "$CHECK_DIR/again/t/a"
+}
+
+
+# An append session that died leaves the previous index usable
+check_pack_unfinished ()
+{
+        echo one > "$SRC/a"
+        echo two > "$SRC/b"
+        session "-P $CHECK_DIR/p.pack" "" a || return 1
+        head -c 100000 /dev/urandom >> "$CHECK_DIR/p.pack"
+        session "-P $CHECK_DIR/p.pack" "" b || return 1
+        "$CANUTE" unpack "$CHECK_DIR/p.pack" "$CHECK_DIR/out" >> "$LOG" 2>&1 \
+                || return 1
+        cmp -s "$SRC/a" "$CHECK_DIR/out/a" && cmp -s "$SRC/b" "$CHECK_DIR/out/b"
+}
+
+
+failed=0
+for c in $CHECK_ONLY
+do
+        rm -rf "$CHECK_DIR"
+        mkdir -p "$SRC" "$DST"
+        if check_$c
+        then
+                echo "ok    $c"
+        else
+                cp "$LOG" "$CHECK_DIR-$c.log"
+                echo "FAIL  $c (see $CHECK_DIR-$c.log)"
+                failed=`expr $failed + 1`
+        fi
+done
+
+if [ $failed -gt 0 ]
+then
+        echo "$failed checks failed"
+        exit 1
+fi
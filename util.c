@@ -45,20 +45,102 @@ char *safename (char *path)
 }
 
 
+/*
+ * safepath
+ *
+ * Path the receiver knows the entry at sub inside item by, from the session
+ * start: the safename() of item followed by that of every component of sub
+ * (which may be empty).  Return false if it does not fit in PATH_MAX.
+ */
+int safepath (char *out, const char *item, const char *sub)
+{
+        char        name[PATH_MAX];
+        const char *c;
+        size_t      len, n;
+
+        snprintf(name, PATH_MAX, "%s", item);
+        len = snprintf(out, PATH_MAX, "%s", safename(name));
+        for (c = sub;  *c != '\0' && len < PATH_MAX;  c += n)
+        {
+                while (*c == '/')
+                        c++;
+                n = strcspn(c, "/");
+                if (n == 0)
+                        break;
+                memcpy(name, c, n);
+                name[n] = '\0';
+                len += snprintf(out + len, PATH_MAX - len, "/%s",
+                                safename(name));
+        }
+        return len < PATH_MAX;
+}
+
+
+/* Armed while a library call runs, see fail() */
+static THREAD_LOCAL struct failure *trap = NULL;
+
+
+/*
+ * vfail
+ *
+ * The body of fatal() and fail().
+ */
+static void vfail (int code, char *msg, va_list pars)
+{
+        int  err = errno;
+        char s[128];
+
+        vsnprintf(s, 128, msg, pars);
+        if (trap == NULL)
+        {
+                fputs("\nFATAL ERROR: ", stderr);
+                if (err != 0)
+                        fprintf(stderr, "%s: %s\n", s, strerror(err));
+                else
+                        fprintf(stderr, "%s\n", s);
+                exit(EXIT_FAILURE);
+        }
+
+        /* Failing while cleaning up after a failure, keep the first reason */
+        if (trap->code == 0)
+        {
+                trap->code      = code;
+                trap->sys_errno = err;
+                if (err != 0)
+                        snprintf(trap->message, sizeof(trap->message),
+                                 "%s: %s", s, strerror(err));
+                else
+                        snprintf(trap->message, sizeof(trap->message), "%s",
+                                 s);
+        }
+        longjmp(trap->env, 1);
+}
+
+
 /*
  * error
  *
- * Error message a la printf(). Custom message + system error string.
+ * Error message a la printf(). Custom message + system error string.  Only
+ * counted while a library call runs.
  */
 void error (char *msg, ...)
 {
         va_list pars;
+        int     err = errno;
         char    s[128];
 
-        fputs("ERROR: ", stderr);
         va_start(pars, msg);
         vsnprintf(s, 128, msg, pars);
         va_end(pars);
+        if (trap != NULL)
+        {
+                trap->warnings++;
+                snprintf(trap->warning, sizeof(trap->warning), "%s: %s", s,
+                         strerror(err));
+                return;
+        }
+        fputs("ERROR: ", stderr);
+        errno = err;
         perror(s);
 }
 
@@ -66,19 +148,52 @@ void error (char *msg, ...)
 /*
  * fatal
  *
- * Fatal error. Same as error() but also exit failing (aborting).
+ * Fatal error. Same as error() but also exit failing (aborting).  A local
+ * problem, see fail() for the rest.
  */
 void fatal (char *msg, ...)
 {
         va_list pars;
-        char    s[128];
 
-        fputs("\nFATAL ERROR: ", stderr);
         va_start(pars, msg);
-        vsnprintf(s, 128, msg, pars);
+        vfail(CANUTE_EFILE, msg, pars);
         va_end(pars);
-        perror(s);
-        exit(EXIT_FAILURE);
+}
+
+
+/*
+ * fail
+ *
+ * Same as fatal(), telling what kind of error (CANUTE_E*) it is.  Exit, or
+ * return to the library call that armed the trap, see fail_trap().
+ */
+void fail (int code, char *msg, ...)
+{
+        va_list pars;
+
+        va_start(pars, msg);
+        vfail(code, msg, pars);
+        va_end(pars);
+}
+
+
+/*
+ * fail_trap
+ *
+ * Make fail() and fatal() of this thread longjmp() to f->env instead of
+ * exiting (and error() keep quiet), or stop doing so if f is NULL.
+ */
+void fail_trap (struct failure *f)
+{
+        trap = f;
+        if (f != NULL)
+        {
+                f->code       = 0;
+                f->sys_errno  = 0;
+                f->warnings   = 0;
+                f->message[0] = '\0';
+                f->warning[0] = '\0';
+        }
 }
 
 
@@ -117,10 +232,52 @@ void help (char *argv0)
 {
         printf("Canute " CANUTE_VERSION_STR "\n\n"
                "Syntax:\n"
-               "\t%s send[:port]   <file/directory> [<file/directory> ...]\n"
-               "\t%s get[:port]    <host/IP>\n"
-               "\t%s sendto[:port] <host/IP> <file/directory> [<file/directory> ...]\n"
-               "\t%s getserv[:port]\n", argv0, argv0, argv0, argv0);
+               "\t%s send[:port]   [options] <file/directory> [<file/directory> ...]\n"
+               "\t%s get[:port]    [options] <host/IP>\n"
+               "\t%s sendto[:port] [options] <host/IP> <file/directory> [<file/directory> ...]\n"
+               "\t%s getserv[:port] [options]\n"
+               "\t%s verify[:port]   [options] <file/directory>\n"
+               "\t%s verifyto[:port] [options] <host/IP> <file/directory>\n"
+               "\t%s sendstream[:port] [<host/IP>]   (standard input)\n"
+               "\t%s getstream[:port]  [<host/IP>]   (standard output)\n"
+               "\t%s lspack <pack>\n"
+               "\t%s unpack <pack> [<directory>]\n"
+               "\t%s replay [options] <tape>   (as the receiver, see -T)\n"
+               "\n\tA port may be unix:<path>, and a host unix:<path>, for peers on the\n"
+               "\tsame host meeting on a Unix socket (file contents are not copied\n"
+               "\tthrough it)\n"
+               "\nSender options:\n"
+               "\t-a        Fail unless the receiver confirms the end (see -y)\n"
+               "\t-C <file> Cache content hashes between sessions (also verify)\n"
+               "\t-d        Deduplicate contents against the receiver chunk store\n"
+               "\t-f        Keep sending what the files given grow, until interrupted\n"
+               "\t-i        Skip files the receiver index says are unchanged\n"
+               "\t-l        Send hard linked files once, linked on the receiver\n"
+               "\t-p <file> Send from a pack (items are paths inside it, optional)\n"
+               "\t-r        Leave out what the receiver filter rules exclude\n"
+               "\t-s        Send big files along with the rest, not ahead of it\n"
+               "\t-w        Keep sending what changes, until interrupted (Linux)\n"
+               "\t-z        Do not send holes and zero blocks (sparse files)\n"
+               "\nReceiver options:\n"
+               "\t-H        Record content hashes in the file index\n"
+               "\t-I <file> Keep an index of received files (for -i)\n"
+               "\t-P <file> Store everything in a pack instead of the filesystem\n"
+               "\t-S <dir>  Chunk store for deduplicated transfers\n"
+               "\t-T <file> Record the session to this tape, for replay\n"
+               "\t-t <file> Same, leaving file contents out (made up on replay)\n"
+               "\t-y <when> Sync received data: none, file, dir or session\n"
+               "\nConnection options (both ends):\n"
+               "\t-m <addr> Also transfer through paths from/to this address or\n"
+               "\t          interface (repeat it for more, needs -m on the peer)\n"
+               "\t-R        Reconnect and resume the session if the connection is\n"
+               "\t          lost (needs -R on the peer, not with -m)\n"
+               "\t-k <file> Encrypt the connection with the key in this file\n"
+               "\t          (needs the same key on the peer)\n"
+               "\nFilter options (sender, or receiver refusing):\n"
+               "\t-x <rule> Filter rule, like '- *.o' (a bare glob excludes)\n"
+               "\t-X <file> Read filter rules from a file, one per line\n",
+               argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0, argv0,
+               argv0, argv0);
         exit(EXIT_FAILURE);
 }
 
@@ -0,0 +1,640 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                      MERKLE TREE DIRECTORY VERIFICATION                    */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * In verify mode both peers hash their copy of a tree and compare the results
+ * without moving the contents.  Every node of the tree gets a SHA-256:
+ *
+ *      file         the SHA-256 of its contents
+ *      directory    the SHA-256 of its children, sorted by safe name, each one
+ *                   as its type ('f' or 'd'), its safe name with the
+ *                   terminator and its hash
+ *
+ * Files are hashed in parallel, biggest first so the long ones do not end up
+ * running alone at the end.  With a hash cache (-C) files that did not change
+ * are not read at all.  Anything other than files and directories is ignored,
+ * as the sender would do.
+ *
+ * Then the client (verifyto) walks the tree top-down.  For every directory it
+ * sends a REQUEST_TREE with the node number of the peer directory and the hash
+ * of its own.  The peer replies REPLY_SKIP if the hashes match, or REPLY_ACCEPT
+ * with the node type in the mtime field and the listing of the children:
+ *
+ *      type (1 byte), hash, node number (4 bytes), name length (2 bytes), name
+ *
+ * numbers in network byte order.  Only directories that differ are descended
+ * into, so the traffic depends on the differences and not on the tree size.
+ * REQUEST_END finishes the session.
+ *
+ * A file that cannot be read gets a hash that depends on a per process salt,
+ * so it never matches anything on the other side.
+ */
+#include "canute.h"
+
+#ifndef HASEFROCH
+#include <pthread.h>
+#endif
+
+#define NODE_FILE      'f'
+#define NODE_DIR       'd'
+#define LISTING_ENTRY  (1 + HASH_SIZE + 4 + 2)  /* Without the name */
+#define HASH_BUFFER    (16 * CANUTE_BLOCK_SIZE)
+#define MAX_THREADS    16
+
+struct node
+{
+        char            *name;         /* As found on disk */
+        char            *safe;         /* As compared and reported */
+        int              type;
+        int              parent;
+        int              first_child;  /* Children are consecutive */
+        int              child_count;
+        struct stat_info st;
+        unsigned char    hash[HASH_SIZE];
+};
+
+struct child
+{
+        char *name;
+        char *safe;
+};
+
+
+/*********************  PRIVATE DATA (Tree and hashing)  *********************/
+
+static struct node   *nodes      = NULL;
+static int            node_count = 0;
+static int            node_alloc = 0;
+static char          *root_path;
+static unsigned char  salt[HASH_SIZE];
+static int           *jobs       = NULL;  /* Files to hash, node numbers */
+static int            job_count  = 0;
+static int            next_job   = 0;
+#ifndef HASEFROCH
+static pthread_mutex_t job_lock  = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * node_path
+ *
+ * Local path of a node, for opening it.  Use safe names instead with safe set,
+ * relative to the root, for messages.
+ */
+static void node_path (int n, char *buf, int safe)
+{
+        size_t len;
+
+        if (n == 0)
+        {
+                strcpy(buf, (safe ? "." : root_path));
+                return;
+        }
+        if (nodes[n].parent == 0 && safe)
+        {
+                snprintf(buf, PATH_MAX, "%s", nodes[n].safe);
+                return;
+        }
+        node_path(nodes[n].parent, buf, safe);
+        len = strlen(buf);
+        snprintf(buf + len, PATH_MAX - len, "/%s",
+                 (safe ? nodes[n].safe : nodes[n].name));
+}
+
+
+/*
+ * new_node
+ *
+ * Append an empty node and return its number.
+ */
+static int new_node (void)
+{
+        if (node_count == node_alloc)
+        {
+                node_alloc = (node_alloc == 0 ? 1024 : node_alloc * 2);
+                nodes      = realloc(nodes, node_alloc * sizeof(struct node));
+                if (nodes == NULL)
+                        fatal("Allocating tree");
+        }
+        memset(&nodes[node_count], 0, sizeof(struct node));
+        return node_count++;
+}
+
+
+static int compare_children (const void *a, const void *b)
+{
+        return strcmp(((const struct child *) a)->safe,
+                      ((const struct child *) b)->safe);
+}
+
+
+/*
+ * scan
+ *
+ * Add the children of directory node n to the tree, sorted by safe name, and
+ * then scan the subdirectories among them.
+ */
+static void scan (int n)
+{
+        char             path[PATH_MAX];
+        struct child    *list = NULL;
+        size_t           count = 0, alloc = 0, i, len;
+        struct dirent   *dentry;
+        struct stat_info st;
+        DIR             *dir;
+        int              c, first;
+
+        node_path(n, path, 0);
+        dir = opendir(path);
+        if (dir == NULL)
+        {
+                error("Cannot open dir '%s'", path);
+                return;
+        }
+
+        for (dentry = readdir(dir);  dentry != NULL;  dentry = readdir(dir))
+        {
+                if (!NOT_SELF_OR_PARENT(dentry->d_name))
+                        continue;
+                if (count == alloc)
+                {
+                        alloc = (alloc == 0 ? 64 : alloc * 2);
+                        list  = realloc(list, alloc * sizeof(struct child));
+                        if (list == NULL)
+                                fatal("Allocating tree");
+                }
+                list[count].name = strdup(dentry->d_name);
+                list[count].safe = strdup(dentry->d_name);
+                if (list[count].name == NULL || list[count].safe == NULL)
+                        fatal("Allocating tree");
+                safename(list[count].safe);
+                count++;
+        }
+        closedir(dir);
+        qsort(list, count, sizeof(struct child), compare_children);
+
+        first = node_count;
+        len   = strlen(path);
+        for (i = 0;  i < count;  i++)
+        {
+                snprintf(path + len, PATH_MAX - len, "/%s", list[i].name);
+                if (stat(path, &st) == -1)
+                {
+                        error("Cannot stat item '%s'", path);
+                        st.st_mode = 0;
+                }
+                if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+                {
+                        free(list[i].name);
+                        free(list[i].safe);
+                        continue;
+                }
+
+                c = new_node();
+                nodes[c].name   = list[i].name;
+                nodes[c].safe   = list[i].safe;
+                nodes[c].type   = (S_ISDIR(st.st_mode) ? NODE_DIR : NODE_FILE);
+                nodes[c].parent = n;
+                nodes[c].st     = st;
+        }
+        free(list);
+
+        nodes[n].first_child = first;
+        nodes[n].child_count = node_count - first;
+        for (c = first;  c < first + nodes[n].child_count;  c++)
+                if (nodes[c].type == NODE_DIR)
+                        scan(c);
+}
+
+
+/*
+ * hash_file
+ *
+ * Hash the contents of file node n using buf.  Runs in the worker threads, so
+ * it must not touch anything shared but the node itself.
+ */
+static void hash_file (int n, char *buf)
+{
+        char          path[PATH_MAX];
+        struct sha256 ctx;
+        size_t        r;
+        FILE         *file;
+
+        node_path(n, path, 0);
+        sha256_init(&ctx);
+        file = fopen(path, "rb");
+        if (file != NULL)
+        {
+                setvbuf(file, NULL, _IONBF, 0);
+                while ((r = fread(buf, 1, HASH_BUFFER, file)) > 0)
+                        sha256_update(&ctx, buf, r);
+        }
+        if (file == NULL || ferror(file))
+        {
+                error("Cannot read file '%s'", path);
+                sha256_update(&ctx, salt, HASH_SIZE);
+        }
+        if (file != NULL)
+                fclose(file);
+        sha256_final(&ctx, nodes[n].hash);
+}
+
+
+/*
+ * hash_worker
+ *
+ * Take files from the job list until it is empty.
+ */
+static void *hash_worker (void *unused)
+{
+        char *buf;
+        int   j;
+
+        buf = malloc(HASH_BUFFER);
+        if (buf == NULL)
+                fatal("Allocating hash buffer");
+
+        for (;;)
+        {
+#ifndef HASEFROCH
+                pthread_mutex_lock(&job_lock);
+#endif
+                j = next_job++;
+#ifndef HASEFROCH
+                pthread_mutex_unlock(&job_lock);
+#endif
+                if (j >= job_count)
+                        break;
+                hash_file(jobs[j], buf);
+        }
+
+        free(buf);
+        return unused;
+}
+
+
+static int compare_jobs (const void *a, const void *b)
+{
+        long long x = nodes[*(const int *) a].st.st_size;
+        long long y = nodes[*(const int *) b].st.st_size;
+
+        return (x > y ? -1 : (x < y ? 1 : 0));
+}
+
+
+/*
+ * hash_files
+ *
+ * Hash every file not found in the hash cache, spread over as many threads as
+ * processors (up to MAX_THREADS).
+ */
+static void hash_files (void)
+{
+        long long  bytes = 0;
+        int        i, threads = 1;
+#ifndef HASEFROCH
+        pthread_t  tid[MAX_THREADS];
+        long       cpus;
+#endif
+
+        jobs = malloc((node_count + 1) * sizeof(int));
+        if (jobs == NULL)
+                fatal("Allocating tree");
+        for (i = 0;  i < node_count;  i++)
+                if (nodes[i].type == NODE_FILE
+                    && !hashcache_file_hash(&nodes[i].st, nodes[i].hash))
+                {
+                        jobs[job_count++] = i;
+                        bytes += nodes[i].st.st_size;
+                }
+        qsort(jobs, job_count, sizeof(int), compare_jobs);
+
+#ifndef HASEFROCH
+        cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus < 1 ? 1 : (cpus > MAX_THREADS ? MAX_THREADS
+                                                      : (int) cpus));
+        if (threads > job_count)
+                threads = (job_count > 0 ? job_count : 1);
+#endif
+        printf("--- Hashing %d files (%lld bytes) with %d thread%s\n",
+               job_count, bytes, threads, (threads > 1 ? "s" : ""));
+
+#ifndef HASEFROCH
+        for (i = 1;  i < threads;  i++)
+                if (pthread_create(&tid[i], NULL, hash_worker, NULL) != 0)
+                        fatal("Creating hashing thread");
+        hash_worker(NULL);
+        for (i = 1;  i < threads;  i++)
+                pthread_join(tid[i], NULL);
+#else
+        hash_worker(NULL);
+#endif
+
+        for (i = 0;  i < job_count;  i++)
+                hashcache_set_file_hash(&nodes[jobs[i]].st,
+                                        nodes[jobs[i]].hash);
+        free(jobs);
+}
+
+
+/*
+ * hash_dirs
+ *
+ * Children always come after their parent, so going backwards every directory
+ * is hashed after all its descendants.
+ */
+static void hash_dirs (void)
+{
+        struct sha256 ctx;
+        unsigned char type;
+        int           i, c;
+
+        for (i = node_count - 1;  i >= 0;  i--)
+        {
+                if (nodes[i].type != NODE_DIR)
+                        continue;
+                sha256_init(&ctx);
+                for (c = nodes[i].first_child;
+                     c < nodes[i].first_child + nodes[i].child_count;  c++)
+                {
+                        type = (unsigned char) nodes[c].type;
+                        sha256_update(&ctx, &type, 1);
+                        sha256_update(&ctx, nodes[c].safe,
+                                      strlen(nodes[c].safe) + 1);
+                        sha256_update(&ctx, nodes[c].hash, HASH_SIZE);
+                }
+                sha256_final(&ctx, nodes[i].hash);
+        }
+}
+
+
+/*
+ * build_tree
+ *
+ * Scan and hash everything under dir.
+ */
+static void build_tree (char *dir)
+{
+        struct stat_info st;
+        long             noise[4];
+        int              n;
+
+        noise[0] = (long) time(NULL);
+        noise[1] = (long) getpid();
+        noise[2] = (long) clock();
+        noise[3] = (long) &st;
+        sha256(noise, sizeof(noise), salt);
+
+        if (stat(dir, &st) == -1)
+                fatal("Cannot stat item '%s'", dir);
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+                fatal("Cannot verify '%s', not a file or directory", dir);
+
+        root_path = dir;
+        n = new_node();
+        nodes[n].name = nodes[n].safe = dir;
+        nodes[n].type = (S_ISDIR(st.st_mode) ? NODE_DIR : NODE_FILE);
+        nodes[n].st   = st;
+        if (nodes[n].type == NODE_DIR)
+                scan(n);
+
+        hash_files();
+        hash_dirs();
+}
+
+
+/*
+ * listing
+ *
+ * Encode the children of node n in *buf (allocated) and return its length.
+ */
+static size_t listing (int n, unsigned char **buf)
+{
+        unsigned char *p;
+        size_t         size = 0, len;
+        int            c, last;
+
+        last = nodes[n].first_child + nodes[n].child_count;
+        for (c = nodes[n].first_child;  c < last;  c++)
+                size += LISTING_ENTRY + strlen(nodes[c].safe);
+
+        *buf = malloc(size + 1);
+        if (*buf == NULL)
+                fatal("Allocating listing");
+
+        p = *buf;
+        for (c = nodes[n].first_child;  c < last;  c++)
+        {
+                len  = strlen(nodes[c].safe);
+                *p++ = (unsigned char) nodes[c].type;
+                memcpy(p, nodes[c].hash, HASH_SIZE);
+                p   += HASH_SIZE;
+                *p++ = (unsigned char) (c >> 24);
+                *p++ = (unsigned char) (c >> 16);
+                *p++ = (unsigned char) (c >> 8);
+                *p++ = (unsigned char) c;
+                *p++ = (unsigned char) (len >> 8);
+                *p++ = (unsigned char) len;
+                memcpy(p, nodes[c].safe, len);
+                p   += len;
+        }
+        return size;
+}
+
+
+/*
+ * report
+ *
+ * Tell about a difference.  Paths are relative to the verified directory.
+ */
+static void report (const char *what, int parent, const char *name)
+{
+        char path[PATH_MAX];
+
+        node_path(parent, path, 1);
+        if (name != NULL)
+        {
+                if (parent == 0)
+                        path[0] = '\0';
+                else
+                        strcat(path, "/");
+                strncat(path, name, PATH_MAX - strlen(path) - 1);
+        }
+        printf("*** %s '%s'\n", what, path);
+}
+
+
+/*
+ * compare_node
+ *
+ * Compare local node n with peer node remote and descend into the directories
+ * that differ.  Return the number of differences found.
+ */
+static int compare_node (struct connection *cn, int n, int remote)
+{
+        unsigned char *buf, *p, *end, *hash;
+        char           name[PATH_MAX];
+        long long      size;
+        int            reply, type, id, len, c, last, diff = 0, cmp;
+
+        send_message(cn, REQUEST_TREE, 0, 0, remote, NULL);
+        send_data(cn, (char *) nodes[n].hash, HASH_SIZE);
+        reply = receive_message(cn, NULL, &type, &size, NULL);
+        if (reply == REPLY_SKIP)
+                return 0;
+        if (reply != REPLY_ACCEPT)
+                fatal("Unexpected reply from peer");
+
+        buf = malloc((size_t) size + 1);
+        if (buf == NULL)
+                fatal("Allocating listing");
+        receive_data(cn, (char *) buf, (size_t) size);
+
+        if (type != nodes[n].type || type != NODE_DIR)
+        {
+                report("Different", n, NULL);
+                free(buf);
+                return 1;
+        }
+
+        /* Merge both sorted lists */
+        p    = buf;
+        end  = buf + size;
+        c    = nodes[n].first_child;
+        last = c + nodes[n].child_count;
+        while (p < end || c < last)
+        {
+                if (p < end)
+                {
+                        if (end - p < LISTING_ENTRY)
+                                fatal("Malformed listing from peer");
+                        type = p[0];
+                        hash = p + 1;
+                        id   = (p[HASH_SIZE + 1] << 24) | (p[HASH_SIZE + 2] << 16)
+                             | (p[HASH_SIZE + 3] << 8)  |  p[HASH_SIZE + 4];
+                        len  = (p[HASH_SIZE + 5] << 8)  |  p[HASH_SIZE + 6];
+                        if (len >= PATH_MAX || end - p < LISTING_ENTRY + len)
+                                fatal("Malformed listing from peer");
+                        memcpy(name, p + LISTING_ENTRY, len);
+                        name[len] = '\0';
+                }
+                cmp = (p >= end ? -1 : (c >= last ? 1
+                                        : strcmp(nodes[c].safe, name)));
+
+                if (cmp < 0)
+                {
+                        report("Missing on peer", n, nodes[c].safe);
+                        diff++;
+                        c++;
+                        continue;
+                }
+                p += LISTING_ENTRY + len;
+                if (cmp > 0)
+                {
+                        report("Missing here", n, name);
+                        diff++;
+                        continue;
+                }
+
+                if (type != nodes[c].type)
+                {
+                        report("Different", c, NULL);
+                        diff++;
+                }
+                else if (memcmp(hash, nodes[c].hash, HASH_SIZE) != 0)
+                {
+                        if (type == NODE_DIR)
+                                diff += compare_node(cn, c, id);
+                        else
+                        {
+                                report("Different", c, NULL);
+                                diff++;
+                        }
+                }
+                c++;
+        }
+
+        free(buf);
+        return diff;
+}
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * verify_compare
+ *
+ * Client side: hash the local tree under dir, compare it with the peer one and
+ * report the differences.  Return how many were found.
+ */
+int verify_compare (struct connection *cn, char *dir)
+{
+        int diff;
+
+        build_tree(dir);
+        diff = compare_node(cn, 0, 0);
+        send_message(cn, REQUEST_END, 0, 0, 0, NULL);
+
+        if (diff == 0)
+                printf("--- Trees match\n");
+        else
+                printf("--- %d difference%s found\n", diff,
+                       (diff > 1 ? "s" : ""));
+        return diff;
+}
+
+
+/*
+ * verify_answer
+ *
+ * Server side: hash the local tree under dir and answer the questions of the
+ * peer about it.
+ */
+void verify_answer (struct connection *cn, char *dir)
+{
+        unsigned char  hash[HASH_SIZE], *buf;
+        long long      n;
+        size_t         size;
+        int            request, asked = 0;
+
+        build_tree(dir);
+
+        for (;;)
+        {
+                request = receive_message(cn, NULL, NULL, &n, NULL);
+                if (request == REQUEST_END)
+                        break;
+                if (request != REQUEST_TREE)
+                        fatal("Unexpected request from peer");
+                receive_data(cn, (char *) hash, HASH_SIZE);
+                if (n < 0 || n >= node_count)
+                        fatal("Peer asked for an unknown node");
+
+                asked++;
+                if (memcmp(hash, nodes[n].hash, HASH_SIZE) == 0)
+                {
+                        send_message(cn, REPLY_SKIP, 0, 0, 0, NULL);
+                        continue;
+                }
+                size = listing((int) n, &buf);
+                send_message(cn, REPLY_ACCEPT, 0, nodes[n].type,
+                             (long long) size, NULL);
+                send_data(cn, (char *) buf, size);
+                free(buf);
+        }
+
+        printf("--- Answered %d director%s\n", asked,
+               (asked == 1 ? "y" : "ies"));
+}
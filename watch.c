@@ -0,0 +1,444 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                           SENDER WATCH MODE                                */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * With -w the sender does not end the session once its items are sent: it
+ * keeps watching them and sends again whatever is created or changed, so the
+ * receiver holds a replica a fraction of a second behind.
+ *
+ * Every directory of the trees sent is watched with inotify, from before the
+ * items are first sent so nothing changed meanwhile is missed.  A file counts
+ * as changed when it is closed after writing or moved into place, not when it
+ * is created (it would be sent half written), unless it is born complete (a
+ * hard or symbolic link).  A directory created or moved in is watched and sent
+ * whole.  Items that are files are watched through their directory.
+ *
+ * Events are gathered in batches: a batch ends after WATCH_QUIET ms without
+ * events, or WATCH_LATENCY ms after its first one whatever happens, so a burst
+ * of writes becomes a single batch and a constant trickle still goes out.  Its
+ * changes are sorted, duplicates dropped, and sent (see send_changed() in
+ * protocol.c).  If the kernel drops events, every item is sent again, which
+ * only costs a negotiation per unchanged file.
+ *
+ * Deletions are not sent.  Directories left out by the filter rules are not
+ * watched.  SIGINT and SIGTERM end the session cleanly, after the batch being
+ * sent.  Only Linux has inotify.
+ */
+#include "canute.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#define WATCH_INOTIFY
+#endif
+
+#define WATCH_QUIET   100  /* ms without events that end a batch */
+#define WATCH_LATENCY 500  /* ms a batch waits at most */
+#define WATCH_MASK    (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+struct watched_item
+{
+        char *path;     /* As given, without trailing separators */
+        int   is_file;
+        int   wd;       /* Files: watch of the directory holding them */
+        char *name;     /* Files: name in that directory */
+};
+
+struct watched_dir
+{
+        int   item;     /* -1 if the slot is free */
+        char *sub;      /* Path inside the item, "" for the item itself */
+};
+
+struct change
+{
+        int   item;
+        char *sub;
+};
+
+
+/*************************  PRIVATE DATA (Sender)  ***************************/
+
+#ifdef WATCH_INOTIFY
+static int                  ifd        = -1;
+static struct watched_item *items      = NULL;
+static int                  item_count = 0;
+static struct watched_dir  *dirs       = NULL;  /* By watch descriptor */
+static int                  dir_alloc  = 0;
+static struct change       *changes    = NULL;
+static size_t               change_count = 0;
+static size_t               change_alloc = 0;
+static volatile sig_atomic_t stop      = 0;
+
+
+/****************************  PRIVATE FUNCTIONS  ****************************/
+
+/*
+ * join
+ *
+ * Path of name inside sub (either may be empty), in a malloc()ed string.
+ */
+static char *join (const char *sub, const char *name)
+{
+        char *s = malloc(strlen(sub) + strlen(name) + 2);
+
+        if (s == NULL)
+                fatal("Allocating watch");
+        sprintf(s, "%s%s%s", sub,
+                (sub[0] != '\0' && name[0] != '\0' ? "/" : ""), name);
+        return s;
+}
+
+
+/*
+ * add_change
+ *
+ * Queue the entry at sub (taken over) inside the item for the next batch.
+ */
+static void add_change (int item, char *sub)
+{
+        if (change_count == change_alloc)
+        {
+                change_alloc = (change_alloc == 0 ? 64 : change_alloc * 2);
+                changes      = realloc(changes,
+                                       change_alloc * sizeof(struct change));
+                if (changes == NULL)
+                        fatal("Allocating watch");
+        }
+        changes[change_count].item = item;
+        changes[change_count].sub  = sub;
+        change_count++;
+}
+
+
+/*
+ * compare_changes
+ *
+ * qsort() order: by item, then by path.
+ */
+static int compare_changes (const void *a, const void *b)
+{
+        const struct change *x = a, *y = b;
+
+        if (x->item != y->item)
+                return x->item - y->item;
+        return strcmp(x->sub, y->sub);
+}
+
+
+/*
+ * watch_dir
+ *
+ * Start watching the directory at sub inside the item, and everything inside
+ * it that the filter rules do not leave out.
+ */
+static void watch_dir (int item, const char *sub)
+{
+        char           *path, *inner, rel[PATH_MAX];
+        DIR            *dir;
+        struct dirent  *dentry;
+        struct stat_info st;
+        int             wd;
+
+        path = join(items[item].path, sub);
+        wd = inotify_add_watch(ifd, path, WATCH_MASK | IN_ONLYDIR);
+        if (wd == -1)
+        {
+                error("Cannot watch directory '%s'", path);
+                free(path);
+                return;
+        }
+        if (wd >= dir_alloc)
+        {
+                dirs = realloc(dirs, (wd + 64) * sizeof(struct watched_dir));
+                if (dirs == NULL)
+                        fatal("Allocating watch");
+                for (;  dir_alloc < wd + 64;  dir_alloc++)
+                        dirs[dir_alloc].item = -1;
+        }
+        if (dirs[wd].item != -1)
+                free(dirs[wd].sub);  /* Seen again, moved perhaps */
+        dirs[wd].item = item;
+        dirs[wd].sub  = strdup(sub);
+        if (dirs[wd].sub == NULL)
+                fatal("Allocating watch");
+
+        dir = opendir(path);
+        if (dir == NULL)
+        {
+                free(path);
+                return;
+        }
+        while ((dentry = readdir(dir)) != NULL)
+        {
+                if (!NOT_SELF_OR_PARENT(dentry->d_name))
+                        continue;
+                inner = join(path, dentry->d_name);
+                if (lstat(inner, &st) == 0 && S_ISDIR(st.st_mode))
+                {
+                        free(inner);
+                        inner = join(sub, dentry->d_name);
+                        if (!filter_enabled()
+                            || (safepath(rel, items[item].path, inner)
+                                && !filter_excluded(rel, 1)))
+                                watch_dir(item, inner);
+                }
+                free(inner);
+        }
+        closedir(dir);
+        free(path);
+}
+
+
+/*
+ * take_event
+ *
+ * Turn an inotify event into watches and changes.
+ */
+static void take_event (const struct inotify_event *ev)
+{
+        struct stat_info st;
+        char            *sub, *path;
+        int              i, item;
+
+        if (ev->mask & IN_Q_OVERFLOW)
+        {
+                inform("--- Watch events lost, sending everything again\n");
+                for (i = 0;  i < item_count;  i++)
+                        add_change(i, join("", ""));
+                return;
+        }
+
+        /* Files given as items */
+        for (i = 0;  i < item_count;  i++)
+                if (items[i].is_file && items[i].wd == ev->wd && ev->len > 0
+                    && strcmp(items[i].name, ev->name) == 0
+                    && (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+                        add_change(i, join("", ""));
+
+        if (ev->wd < 0 || ev->wd >= dir_alloc || dirs[ev->wd].item == -1)
+                return;
+        if (ev->mask & IN_IGNORED)
+        {
+                free(dirs[ev->wd].sub);
+                dirs[ev->wd].item = -1;
+                return;
+        }
+        if (ev->len == 0)
+                return;
+
+        item = dirs[ev->wd].item;
+        sub  = join(dirs[ev->wd].sub, ev->name);
+        if (ev->mask & IN_ISDIR)
+        {
+                watch_dir(item, sub);
+                add_change(item, sub);
+        }
+        else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                add_change(item, sub);
+        else
+        {
+                /* Created: only links are complete already */
+                path = join(items[item].path, sub);
+                if (lstat(path, &st) == 0
+                    && (S_ISLNK(st.st_mode) || st.st_nlink > 1))
+                        add_change(item, sub);
+                else
+                        free(sub);
+                free(path);
+        }
+}
+
+
+/*
+ * read_events
+ *
+ * Wait up to timeout ms (-1 for ever) for events and take them.  Return false
+ * if none came.
+ */
+static int read_events (int timeout)
+{
+        struct pollfd pfd;
+        ssize_t       r, i;
+        union
+        {
+                struct inotify_event ev;
+                char                 buf[65536];
+        } u;
+        struct inotify_event *ev;
+
+        pfd.fd     = ifd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, timeout) <= 0)
+                return 0;
+        r = read(ifd, u.buf, sizeof(u.buf));
+        if (r <= 0)
+                return 0;
+        for (i = 0;  i < r;  i += sizeof(struct inotify_event) + ev->len)
+        {
+                ev = (struct inotify_event *) (u.buf + i);
+                take_event(ev);
+        }
+        return 1;
+}
+
+
+/*
+ * stop_watching
+ *
+ * Signal handler, the session ends after the current batch.
+ */
+static void stop_watching (int sig)
+{
+        stop = 1;
+}
+
+
+static long long now_ms (void)
+{
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec * 1000LL + tv.tv_usec / 1000;
+}
+#endif /* WATCH_INOTIFY */
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * watch_start
+ *
+ * Start watching the items to be sent, before they are.
+ */
+void watch_start (char **paths, int count)
+{
+#ifdef WATCH_INOTIFY
+        struct stat_info st;
+        char            *c;
+        size_t           len;
+        int              i;
+
+        ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (ifd == -1)
+                fail(CANUTE_EFILE, "Starting to watch");
+        items = calloc(count, sizeof(struct watched_item));
+        if (items == NULL)
+                fatal("Allocating watch");
+        item_count = count;
+
+        for (i = 0;  i < count;  i++)
+        {
+                items[i].path = strdup(paths[i]);
+                if (items[i].path == NULL)
+                        fatal("Allocating watch");
+                len = strlen(items[i].path);
+                while (len > 1 && IS_PATH_SEPARATOR(items[i].path[len - 1]))
+                        items[i].path[--len] = '\0';
+                items[i].wd = -1;
+
+                if (stat(items[i].path, &st) == -1)
+                        error("Cannot stat item '%s'", items[i].path);
+                else if (S_ISDIR(st.st_mode))
+                        watch_dir(i, "");
+                else
+                {
+                        /* Watch the directory, the file may be replaced */
+                        items[i].is_file = 1;
+                        c = strrchr(items[i].path, '/');
+                        items[i].name = (c != NULL ? c + 1 : items[i].path);
+                        if (c == NULL)
+                                items[i].wd = inotify_add_watch(ifd, ".",
+                                                                WATCH_MASK);
+                        else
+                        {
+                                *c = '\0';
+                                items[i].wd = inotify_add_watch(ifd,
+                                        (c == items[i].path ? "/"
+                                                            : items[i].path),
+                                        WATCH_MASK);
+                                *c = '/';
+                        }
+                        if (items[i].wd == -1)
+                                error("Cannot watch '%s'", items[i].path);
+                }
+        }
+#else
+        errno = 0;
+        fail(CANUTE_EINVAL, "Watch mode not supported");
+#endif
+}
+
+
+/*
+ * watch_run
+ *
+ * Send the changes to the items, batch after batch, until interrupted.
+ */
+void watch_run (struct connection *cn)
+{
+#ifdef WATCH_INOTIFY
+        struct sigaction sa, old_int, old_term;
+        long long        first;
+        size_t           i, sent;
+        int              left;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = stop_watching;  /* No SA_RESTART, poll() must end */
+        sigaction(SIGINT, &sa, &old_int);
+        sigaction(SIGTERM, &sa, &old_term);
+
+        inform("--- Watching for changes\n");
+        while (!stop)
+        {
+                if (!read_events(-1) || change_count == 0)
+                        continue;
+
+                /* Gather the burst */
+                first = now_ms();
+                while (!stop)
+                {
+                        left = (int) (first + WATCH_LATENCY - now_ms());
+                        if (left <= 0
+                            || !read_events(left < WATCH_QUIET ? left
+                                                               : WATCH_QUIET))
+                                break;
+                }
+
+                qsort(changes, change_count, sizeof(struct change),
+                      compare_changes);
+                for (i = sent = 0;  i < change_count;  i++)
+                {
+                        if (i == 0 || compare_changes(&changes[i],
+                                                      &changes[i - 1]) != 0)
+                        {
+                                send_changed(cn, items[changes[i].item].path,
+                                             changes[i].sub);
+                                sent++;
+                        }
+                }
+                end_changes(cn);
+                inform("--- Sent %lu changes\n", (unsigned long) sent);
+
+                for (i = 0;  i < change_count;  i++)
+                        free(changes[i].sub);
+                change_count = 0;
+        }
+
+        sigaction(SIGINT, &old_int, NULL);
+        sigaction(SIGTERM, &old_term, NULL);
+        close(ifd);
+        ifd = -1;
+#endif
+}
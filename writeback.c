@@ -0,0 +1,134 @@
+/******************************************************************************/
+/*                ____      _      _   _   _   _   _____   _____              */
+/*               / ___|    / \    | \ | | | | | | |_   _| | ____|             */
+/*              | |       / _ \   |  \| | | | | |   | |   |  _|               */
+/*              | |___   / ___ \  | |\  | | |_| |   | |   | |___              */
+/*               \____| /_/   \_\ |_| \_|  \___/    |_|   |_____|             */
+/*                                                                            */
+/*                    RECEIVER PREALLOCATION AND WRITE-BEHIND                 */
+/*                                                                            */
+/******************************************************************************/
+
+/*
+ * EXPLANATION
+ *
+ * Files grown by small appends get fragmented when several of them are being
+ * written at once, and a huge transfer fills memory with dirty pages that the
+ * kernel then flushes all at once, stalling everything.  So the receiver:
+ *
+ *   - Preallocates the whole file as soon as the header says how long it is,
+ *     with FALLOC_FL_KEEP_SIZE: the size still tells how much was received,
+ *     which resuming relies on.  Not for sparse transfers, that would fill the
+ *     holes.
+ *
+ *   - Writes through a WRITE_BUFFER sized stdio buffer, so the filesystem sees
+ *     large writes, aligned to the buffer size for files received from the
+ *     start.
+ *
+ *   - Every WRITEBACK_WINDOW bytes, starts writeback of the window just
+ *     completed and waits for the one before, so dirty memory stays around two
+ *     windows per transfer whatever the file size.
+ *
+ * Only one file is written at a time (per thread), the state is static.
+ * Preallocation and write-behind are Linux only, elsewhere only the buffer
+ * applies.
+ */
+#include "canute.h"
+
+#ifndef HASEFROCH
+#include <fcntl.h>
+#endif
+
+#define WRITE_BUFFER     (16 * CANUTE_BLOCK_SIZE)
+#define WRITEBACK_WINDOW (8 * WRITE_BUFFER)
+
+static THREAD_LOCAL FILE     *wb_file   = NULL;
+static THREAD_LOCAL long long wb_start  = 0;   /* Window being filled */
+static THREAD_LOCAL long long wb_prev   = -1;  /* Window under writeback, if any */
+static THREAD_LOCAL long long wb_filled = 0;   /* Bytes written since wb_start */
+
+
+/*****************************  PUBLIC FUNCTIONS  *****************************/
+
+/*
+ * writeback_setup
+ *
+ * Give a freshly opened file the large write buffer.  Must come before any
+ * other operation on it.
+ */
+void writeback_setup (FILE *file)
+{
+        setvbuf(file, NULL, _IOFBF, WRITE_BUFFER);
+}
+
+
+/*
+ * writeback_begin
+ *
+ * The contents of file from offset to end are about to be written, in order
+ * except for seeks over holes.  Preallocate them if requested.
+ */
+void writeback_begin (FILE *file, long long offset, long long end,
+                      int prealloc)
+{
+        wb_file   = file;
+        wb_start  = offset;
+        wb_prev   = -1;
+        wb_filled = 0;
+
+#ifdef FALLOC_FL_KEEP_SIZE
+        /* Just a hint, filesystems without support simply refuse */
+        if (prealloc && end > offset)
+                fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, (off_t) offset,
+                          (off_t) (end - offset));
+#endif
+}
+
+
+/*
+ * writeback_written
+ *
+ * count more bytes went to the file.
+ */
+void writeback_written (size_t count)
+{
+#ifdef SYNC_FILE_RANGE_WRITE
+        long long pos;
+        int       fd;
+
+        if (wb_file == NULL)
+                return;
+        wb_filled += count;
+        if (wb_filled < WRITEBACK_WINDOW)
+                return;
+
+        /* What is still in the stdio buffer is not in the file yet, waiting
+         * for this window next time covers it */
+        pos = (long long) ftello(wb_file);
+        fd  = fileno(wb_file);
+        if (pos <= wb_start)
+                return;
+        sync_file_range(fd, (off_t) wb_start, (off_t) (pos - wb_start),
+                        SYNC_FILE_RANGE_WRITE);
+        if (wb_prev >= 0)
+                sync_file_range(fd, (off_t) wb_prev,
+                                (off_t) (wb_start - wb_prev),
+                                SYNC_FILE_RANGE_WAIT_BEFORE
+                                | SYNC_FILE_RANGE_WRITE
+                                | SYNC_FILE_RANGE_WAIT_AFTER);
+        wb_prev   = wb_start;
+        wb_start  = pos;
+        wb_filled = 0;
+#endif
+}
+
+
+/*
+ * writeback_end
+ *
+ * The file is complete (or abandoned), stop tracking it.
+ */
+void writeback_end (void)
+{
+        wb_file = NULL;
+}